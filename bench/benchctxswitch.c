@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -18,6 +18,7 @@
  */
 
 #include <err.h>
+#include <psctl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,6 +52,11 @@ int main(void)
 	while ( !uptime(&now) && now < end ) { usleep(0); count += 2; /* back and forth */ }
 	printf("Made %zu context switches in 1 second\n", count);
 
+	struct psctl_stat psst;
+	if ( psctl(getpid(), PSCTL_STAT, &psst) == 0 )
+		printf("Loaded the floating point registers %zu times\n",
+		       psst.fpu_switches);
+
 	kill(slavepid, SIGKILL);
 
 	return 0;
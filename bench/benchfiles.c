@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * benchfiles.c
+ * Benchmarks creating, inspecting and deleting many files in a directory.
+ */
+
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int uptime(uintmax_t* usecs)
+{
+	struct timespec uptime;
+	if ( clock_gettime(CLOCK_BOOT, &uptime) < 0 )
+		return -1;
+	*usecs = uptime.tv_sec * 1000000ULL + uptime.tv_nsec / 1000ULL;
+	return 0;
+}
+
+static void report(const char* what, size_t count, uintmax_t start)
+{
+	uintmax_t now;
+	if ( uptime(&now) )
+		err(1, "uptime");
+	uintmax_t elapsed = now - start;
+	printf("%s %zu files in %ju ms (%ju ns per file)\n", what, count,
+	       elapsed / 1000, count ? elapsed * 1000 / count : 0);
+}
+
+int main(int argc, char* argv[])
+{
+	// The directory is made inside /tmp by default, which is on kramfs.
+	size_t count = 100000;
+	if ( 2 <= argc )
+		count = strtoul(argv[1], NULL, 0);
+	const char* tmpdir = getenv("TMPDIR");
+	if ( 3 <= argc )
+		tmpdir = argv[2];
+	else if ( !tmpdir )
+		tmpdir = "/tmp";
+
+	char* dir;
+	if ( asprintf(&dir, "%s/benchfiles.XXXXXX", tmpdir) < 0 )
+		err(1, "malloc");
+	if ( !mkdtemp(dir) )
+		err(1, "mkdtemp: %s", dir);
+	int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+	if ( dirfd < 0 )
+		err(1, "%s", dir);
+
+	char name[sizeof(size_t) * 3 + 2];
+	uintmax_t start;
+
+	if ( uptime(&start) )
+		err(1, "uptime");
+	for ( size_t i = 0; i < count; i++ )
+	{
+		snprintf(name, sizeof(name), "f%zu", i);
+		int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if ( fd < 0 )
+			err(1, "%s/%s", dir, name);
+		close(fd);
+	}
+	report("Created", count, start);
+
+	if ( uptime(&start) )
+		err(1, "uptime");
+	for ( size_t i = 0; i < count; i++ )
+	{
+		snprintf(name, sizeof(name), "f%zu", i);
+		struct stat st;
+		if ( fstatat(dirfd, name, &st, 0) < 0 )
+			err(1, "stat: %s/%s", dir, name);
+	}
+	report("Inspected", count, start);
+
+	if ( uptime(&start) )
+		err(1, "uptime");
+	for ( size_t i = 0; i < count; i++ )
+	{
+		snprintf(name, sizeof(name), "f%zu", i);
+		if ( unlinkat(dirfd, name, 0) < 0 )
+			err(1, "unlink: %s/%s", dir, name);
+	}
+	report("Deleted", count, start);
+
+	close(dirfd);
+	if ( rmdir(dir) < 0 )
+		err(1, "rmdir: %s", dir);
+	free(dir);
+
+	return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * benchforkexec.c
+ * Benchmarks the speed of spawning processes with fork and exec.
+ */
+
+#include <sys/wait.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int uptime(uintmax_t* usecs)
+{
+	struct timespec uptime;
+	if ( clock_gettime(CLOCK_BOOT, &uptime) < 0 )
+		return -1;
+	*usecs = uptime.tv_sec * 1000000ULL + uptime.tv_nsec / 1000ULL;
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	// Use some memory like a shell would, which fork has to deal with.
+	size_t heap_size = 16 * 1024 * 1024;
+	if ( 2 <= argc )
+		heap_size = strtoul(argv[1], NULL, 0) * 1024 * 1024;
+	void* heap = malloc(heap_size);
+	if ( heap_size && !heap )
+		err(1, "malloc");
+	memset(heap, 0xAA, heap_size);
+
+	uintmax_t start;
+	if ( uptime(&start) )
+		err(1, "uptime");
+	uintmax_t end = start + 1ULL * 1000ULL * 1000ULL; // 1 second
+	size_t count = 0;
+	uintmax_t now;
+	while ( !uptime(&now) && now < end )
+	{
+		pid_t child_pid = fork();
+		if ( child_pid < 0 )
+			err(1, "fork");
+		if ( child_pid == 0 )
+		{
+			execlp("true", "true", (const char*) NULL);
+			_exit(127);
+		}
+		int status;
+		if ( waitpid(child_pid, &status, 0) < 0 )
+			err(1, "waitpid");
+		if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+			errx(1, "true failed");
+		count++;
+	}
+
+	uintmax_t elapsed = now - start;
+	printf("Spawned %zu processes in 1 second with %zu MiB of heap "
+	       "(%ju us per process)\n", count, heap_size / (1024 * 1024),
+	       count ? elapsed / count : 0);
+
+	free(heap);
+
+	return 0;
+}
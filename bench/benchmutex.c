@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * benchmutex.c
+ * Benchmarks the speed of contended mutexes.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool done = false;
+
+static int uptime(uintmax_t* usecs)
+{
+	struct timespec uptime;
+	if ( clock_gettime(CLOCK_BOOT, &uptime) < 0 )
+		return -1;
+	*usecs = uptime.tv_sec * 1000000ULL + uptime.tv_nsec / 1000ULL;
+	return 0;
+}
+
+static void* thread_routine(void* cookie)
+{
+	size_t* count = (size_t*) cookie;
+	while ( !done )
+	{
+		pthread_mutex_lock(&mutex);
+		(*count)++;
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t num_threads = 4;
+	if ( 2 <= argc )
+		num_threads = strtoul(argv[1], NULL, 10);
+	if ( num_threads == 0 )
+		errx(1, "invalid number of threads");
+
+	pthread_t* threads = calloc(num_threads, sizeof(pthread_t));
+	size_t* counts = calloc(num_threads, sizeof(size_t));
+	if ( !threads || !counts )
+		err(1, "malloc");
+
+	uintmax_t start;
+	if ( uptime(&start) )
+		err(1, "uptime");
+	for ( size_t i = 0; i < num_threads; i++ )
+	{
+		int errnum = pthread_create(&threads[i], NULL, thread_routine, &counts[i]);
+		if ( errnum )
+			errx(1, "pthread_create: %s", strerror(errnum));
+	}
+	uintmax_t end = start + 1ULL * 1000ULL * 1000ULL; // 1 second
+	uintmax_t now;
+	while ( !uptime(&now) && now < end )
+		usleep(1000);
+	done = true;
+
+	size_t count = 0;
+	for ( size_t i = 0; i < num_threads; i++ )
+	{
+		pthread_join(threads[i], NULL);
+		count += counts[i];
+	}
+	printf("Made %zu mutex acquisitions in 1 second with %zu threads\n",
+	       count, num_threads);
+
+	return 0;
+}
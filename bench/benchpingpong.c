@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * benchpingpong.c
+ * Benchmarks the round trip latency of pipes and unix sockets.
+ */
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static int uptime(uintmax_t* usecs)
+{
+	struct timespec uptime;
+	if ( clock_gettime(CLOCK_BOOT, &uptime) < 0 )
+		return -1;
+	*usecs = uptime.tv_sec * 1000000ULL + uptime.tv_nsec / 1000ULL;
+	return 0;
+}
+
+static void pingpong(const char* name, int ping[2], int pong[2])
+{
+	pid_t child_pid = fork();
+	if ( child_pid < 0 )
+		err(1, "fork");
+	if ( child_pid == 0 )
+	{
+		close(ping[1]);
+		close(pong[0]);
+		char c;
+		while ( read(ping[0], &c, 1) == 1 )
+			if ( write(pong[1], &c, 1) != 1 )
+				err(1, "write");
+		exit(0);
+	}
+	close(ping[0]);
+	close(pong[1]);
+
+	uintmax_t start;
+	if ( uptime(&start) )
+		err(1, "uptime");
+	uintmax_t end = start + 1ULL * 1000ULL * 1000ULL; // 1 second
+	size_t count = 0;
+	uintmax_t now;
+	while ( !uptime(&now) && now < end )
+	{
+		char c = 'x';
+		if ( write(ping[1], &c, 1) != 1 )
+			err(1, "write");
+		if ( read(pong[0], &c, 1) != 1 )
+			err(1, "read");
+		count++;
+	}
+	close(ping[1]);
+	close(pong[0]);
+	waitpid(child_pid, NULL, 0);
+
+	uintmax_t elapsed = now - start;
+	printf("%s: %zu round trips in 1 second (%ju ns per round trip)\n",
+	       name, count, count ? elapsed * 1000 / count : 0);
+}
+
+int main(void)
+{
+	int ping[2];
+	int pong[2];
+
+	if ( pipe(ping) < 0 || pipe(pong) < 0 )
+		err(1, "pipe");
+	pingpong("pipe", ping, pong);
+
+	// Each socket is used in one direction only, so it works like the pipes.
+	int first[2];
+	int second[2];
+	if ( socketpair(AF_UNIX, SOCK_STREAM, 0, first) < 0 ||
+	     socketpair(AF_UNIX, SOCK_STREAM, 0, second) < 0 )
+		err(1, "socketpair");
+	ping[0] = first[0];
+	ping[1] = first[1];
+	pong[0] = second[0];
+	pong[1] = second[1];
+	pingpong("unix socket", ping, pong);
+
+	return 0;
+}
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -53,12 +53,13 @@ void Block::Construct(Device* device, uint32_t block_id)
 	this->block_id = block_id;
 	this->dirty = false;
 	this->is_in_transit = false;
+	this->is_loading = false;
 }
 
 Block::~Block()
 {
 	Destruct();
-	delete[] block_data;
+	device->FreeBlockData(block_data);
 }
 
 void Block::Destruct()
@@ -69,11 +70,14 @@ void Block::Destruct()
 
 void Block::Refer()
 {
+	pthread_mutex_lock(&device->cache_lock);
 	reference_count++;
+	pthread_mutex_unlock(&device->cache_lock);
 }
 
 void Block::Unref()
 {
+	pthread_mutex_lock(&device->cache_lock);
 	if ( !--reference_count )
 	{
 #if 0
@@ -81,6 +85,7 @@ void Block::Unref()
 		delete this;
 #endif
 	}
+	pthread_mutex_unlock(&device->cache_lock);
 }
 
 void Block::Sync()
@@ -94,15 +99,19 @@ void Block::Sync()
 		return;
 	}
 
-	if ( !dirty )
-		return;
-	dirty = false;
-	(prev_dirty ? prev_dirty->next_dirty : device->dirty_block) = next_dirty;
-	if ( next_dirty )
-		next_dirty->prev_dirty = prev_dirty;
-	prev_dirty = NULL;
-	next_dirty = NULL;
-	if ( !device->write )
+	pthread_mutex_lock(&device->sync_thread_lock);
+	bool was_dirty = dirty;
+	if ( dirty )
+	{
+		dirty = false;
+		(prev_dirty ? prev_dirty->next_dirty : device->dirty_block) = next_dirty;
+		if ( next_dirty )
+			next_dirty->prev_dirty = prev_dirty;
+		prev_dirty = NULL;
+		next_dirty = NULL;
+	}
+	pthread_mutex_unlock(&device->sync_thread_lock);
+	if ( !was_dirty || !device->write )
 		return;
 	off_t file_offset = (off_t) device->block_size * (off_t) block_id;
 	pwriteall(device->fd, block_data, device->block_size, file_offset);
@@ -134,8 +143,10 @@ void Block::FinishWrite()
 
 void Block::Use()
 {
+	pthread_mutex_lock(&device->cache_lock);
 	Unlink();
 	Prelink();
+	pthread_mutex_unlock(&device->cache_lock);
 }
 
 void Block::Unlink()
@@ -163,3 +174,17 @@ void Block::Prelink()
 	if ( next_hashed )
 		next_hashed->prev_hashed = this;
 }
+
+// Blocks waiting for the sync thread aren't evicted, as waiting for it could
+// deadlock with a worker that holds the block's modify lock.
+bool Block::IsEvictable()
+{
+	if ( reference_count )
+		return false;
+	if ( !device->has_sync_thread )
+		return true;
+	pthread_mutex_lock(&device->sync_thread_lock);
+	bool result = !dirty && !is_in_transit;
+	pthread_mutex_unlock(&device->sync_thread_lock);
+	return result;
+}
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -45,6 +45,7 @@ public:
 	uint32_t block_id;
 	bool dirty;
 	bool is_in_transit;
+	bool is_loading;
 	uint8_t* block_data;
 
 public:
@@ -56,6 +57,7 @@ public:
 	void Use();
 	void Unlink();
 	void Prelink();
+	bool IsEvictable();
 
 };
 
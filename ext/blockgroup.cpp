@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -21,6 +21,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -35,6 +36,7 @@
 
 BlockGroup::BlockGroup(Filesystem* filesystem, uint32_t group_id)
 {
+	this->alloc_lock = PTHREAD_MUTEX_INITIALIZER;
 	this->data_block = NULL;
 	this->data = NULL;
 	this->filesystem = filesystem;
@@ -78,8 +80,9 @@ uint32_t BlockGroup::AllocateBlock()
 {
 	if ( !filesystem->device->write )
 		return errno = EROFS, 0;
+	pthread_mutex_lock(&alloc_lock);
 	if ( !data->bg_free_blocks_count )
-		return errno = ENOSPC, 0;
+		return pthread_mutex_unlock(&alloc_lock), errno = ENOSPC, 0;
 	size_t num_chunk_bits = filesystem->block_size * 8UL;
 	uint32_t begun_chunk = block_alloc_chunk;
 	for ( uint32_t i = 0; i < num_block_bitmap_chunks; i++ )
@@ -91,7 +94,7 @@ uint32_t BlockGroup::AllocateBlock()
 			uint32_t block_id = data->bg_block_bitmap + block_alloc_chunk;
 			block_bitmap_chunk = filesystem->device->GetBlock(block_id);
 			if ( !block_bitmap_chunk )
-				return 0;
+				return pthread_mutex_unlock(&alloc_lock), 0;
 			block_bitmap_chunk_i = 0;
 		}
 		uint32_t chunk_offset = block_alloc_chunk * num_chunk_bits;
@@ -113,6 +116,7 @@ uint32_t BlockGroup::AllocateBlock()
 				filesystem->FinishWrite();
 				uint32_t group_block_id = chunk_offset + block_bitmap_chunk_i++;
 				uint32_t block_id = first_block_id + group_block_id;
+				pthread_mutex_unlock(&alloc_lock);
 				return block_id;
 			}
 		}
@@ -122,6 +126,7 @@ uint32_t BlockGroup::AllocateBlock()
 	BeginWrite();
 	data->bg_free_blocks_count = 0;
 	FinishWrite();
+	pthread_mutex_unlock(&alloc_lock);
 	return errno = ENOSPC, 0;
 }
 
@@ -129,8 +134,9 @@ uint32_t BlockGroup::AllocateInode()
 {
 	if ( !filesystem->device->write )
 		return errno = EROFS, 0;
+	pthread_mutex_lock(&alloc_lock);
 	if ( !data->bg_free_inodes_count )
-		return errno = ENOSPC, 0;
+		return pthread_mutex_unlock(&alloc_lock), errno = ENOSPC, 0;
 	size_t num_chunk_bits = filesystem->block_size * 8UL;
 	uint32_t begun_chunk = inode_alloc_chunk;
 	for ( uint32_t i = 0; i < num_inode_bitmap_chunks; i++ )
@@ -142,7 +148,7 @@ uint32_t BlockGroup::AllocateInode()
 			uint32_t block_id = data->bg_inode_bitmap + inode_alloc_chunk;
 			inode_bitmap_chunk = filesystem->device->GetBlock(block_id);
 			if ( !inode_bitmap_chunk )
-				return 0;
+				return pthread_mutex_unlock(&alloc_lock), 0;
 			inode_bitmap_chunk_i = 0;
 		}
 		uint32_t chunk_offset = inode_alloc_chunk * num_chunk_bits;
@@ -164,6 +170,7 @@ uint32_t BlockGroup::AllocateInode()
 				filesystem->FinishWrite();
 				uint32_t group_inode_id = chunk_offset + inode_bitmap_chunk_i++;
 				uint32_t inode_id = first_inode_id + group_inode_id;
+				pthread_mutex_unlock(&alloc_lock);
 				return inode_id;
 			}
 		}
@@ -173,6 +180,7 @@ uint32_t BlockGroup::AllocateInode()
 	BeginWrite();
 	data->bg_free_inodes_count = 0;
 	FinishWrite();
+	pthread_mutex_unlock(&alloc_lock);
 	return errno = ENOSPC, 0;
 }
 
@@ -183,6 +191,7 @@ void BlockGroup::FreeBlock(uint32_t block_id)
 	size_t num_chunk_bits = filesystem->block_size * 8UL;
 	uint32_t chunk_id = block_id / num_chunk_bits;
 	uint32_t chunk_bit = block_id % num_chunk_bits;
+	pthread_mutex_lock(&alloc_lock);
 	if ( !block_bitmap_chunk || chunk_id != block_alloc_chunk )
 	{
 		if ( block_bitmap_chunk )
@@ -205,6 +214,7 @@ void BlockGroup::FreeBlock(uint32_t block_id)
 	filesystem->BeginWrite();
 	filesystem->sb->s_free_blocks_count++;
 	filesystem->FinishWrite();
+	pthread_mutex_unlock(&alloc_lock);
 }
 
 void BlockGroup::FreeInode(uint32_t inode_id)
@@ -214,6 +224,7 @@ void BlockGroup::FreeInode(uint32_t inode_id)
 	size_t num_chunk_bits = filesystem->block_size * 8UL;
 	uint32_t chunk_id = inode_id / num_chunk_bits;
 	uint32_t chunk_bit = inode_id % num_chunk_bits;
+	pthread_mutex_lock(&alloc_lock);
 	if ( !inode_bitmap_chunk || chunk_id != inode_alloc_chunk )
 	{
 		if ( inode_bitmap_chunk )
@@ -236,6 +247,7 @@ void BlockGroup::FreeInode(uint32_t inode_id)
 	filesystem->BeginWrite();
 	filesystem->sb->s_free_inodes_count++;
 	filesystem->FinishWrite();
+	pthread_mutex_unlock(&alloc_lock);
 }
 
 void BlockGroup::Refer()
@@ -250,6 +262,7 @@ void BlockGroup::Unref()
 
 void BlockGroup::Sync()
 {
+	pthread_mutex_lock(&alloc_lock);
 	if ( block_bitmap_chunk )
 		block_bitmap_chunk->Sync();
 	if ( inode_bitmap_chunk )
@@ -257,6 +270,7 @@ void BlockGroup::Sync()
 	if ( dirty )
 		data_block->Sync();
 	dirty = false;
+	pthread_mutex_unlock(&alloc_lock);
 }
 
 void BlockGroup::BeginWrite()
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -30,6 +30,7 @@ public:
 	~BlockGroup();
 
 public:
+	pthread_mutex_t alloc_lock;
 	Block* data_block;
 	struct ext_blockgrpdesc* data;
 	Filesystem* filesystem;
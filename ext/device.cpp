@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,6 +17,7 @@
  * Block device.
  */
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -43,6 +44,8 @@ Device::Device(int fd, const char* path, uint32_t block_size, bool write)
 	this->sync_thread_cond = PTHREAD_COND_INITIALIZER;
 	this->sync_thread_idle_cond = PTHREAD_COND_INITIALIZER;
 	this->sync_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+	this->cache_lock = PTHREAD_MUTEX_INITIALIZER;
+	this->load_cond = PTHREAD_COND_INITIALIZER;
 	this->mru_block = NULL;
 	this->lru_block = NULL;
 	this->dirty_block = NULL;
@@ -60,10 +63,11 @@ Device::Device(int fd, const char* path, uint32_t block_size, bool write)
 	this->sync_in_transit = false;
 	this->block_count = 0;
 #ifdef __sortix__
-	// TODO: This isn't scaleable if there's multiple filesystems mounted.
+	// The cache grows until the system runs low on memory, and is then trimmed
+	// so multiple filesystems share the memory.
 	size_t memory;
 	memstat(NULL, &memory);
-	this->block_limit = (memory / 10) / block_size;
+	this->block_limit = memory / block_size;
 #else
 	this->block_limit = 32768;
 #endif
@@ -94,48 +98,111 @@ void Device::SpawnSyncThread()
 		pthread_create(&this->sync_thread, NULL, Device__SyncThread, this) == 0;
 }
 
+// The cache lock must be held.
 Block* Device::AllocateBlock()
 {
-	if ( block_limit <= block_count )
+	uint8_t* data = NULL;
+	Block* block = NULL;
+	if ( block_count < block_limit &&
+	     (data = AllocateBlockData()) &&
+	     (block = new Block()) ) // TODO: Use operator new nothrow!
 	{
-		for ( Block* block = lru_block; block; block = block->prev_block )
+		block->block_data = data;
+		block_count++;
+		return block;
+	}
+	if ( data )
+		FreeBlockData(data);
+	// Reuse the least recently used block if out of memory.
+	for ( block = lru_block; block; block = block->prev_block )
+	{
+		if ( !block->IsEvictable() )
+			continue;
+		block->Destruct(); // Syncs.
+		return block;
+	}
+	return NULL;
+}
+
+// Blocks that are whole pages are mapped directly, so their memory is given
+// back to the system when the cache is trimmed.
+uint8_t* Device::AllocateBlockData()
+{
+#ifdef __sortix__
+	if ( block_size % getpagesize() == 0 )
+	{
+		void* data = mmap(NULL, block_size, PROT_READ | PROT_WRITE,
+		                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return data == MAP_FAILED ? NULL : (uint8_t*) data;
+	}
+#endif
+	return new uint8_t[block_size]; // TODO: Use operator new nothrow!
+}
+
+void Device::FreeBlockData(uint8_t* data)
+{
+#ifdef __sortix__
+	if ( block_size % getpagesize() == 0 )
+	{
+		munmap(data, block_size);
+		return;
+	}
+#endif
+	delete[] data;
+}
+
+// Deletes the least recently used blocks that aren't in use until the amount of
+// bytes have been given back.
+size_t Device::Trim(size_t bytes)
+{
+	pthread_mutex_lock(&cache_lock);
+	size_t freed = 0;
+	Block* block = lru_block;
+	while ( block && freed < bytes )
+	{
+		Block* prev = block->prev_block;
+		if ( block->IsEvictable() )
 		{
-			if ( block->reference_count )
-				continue;
-			block->Destruct(); // Syncs.
-			return block;
+			delete block; // Syncs.
+			block_count--;
+			freed += block_size;
 		}
+		block = prev;
 	}
-	uint8_t* data = new uint8_t[block_size];
-	if ( !data ) // TODO: Use operator new nothrow!
-		return NULL;
-	Block* block = new Block();
-	if ( !block ) // TODO: Use operator new nothrow!
-		return delete[] data, (Block*) NULL;
-	block->block_data = data;
-	block_count++;
-	return block;
+	pthread_mutex_unlock(&cache_lock);
+	return freed;
 }
 
+// The block is read without the cache lock, so other workers aren't stalled
+// by the disk, and anyone else wanting the block waits for the read to finish.
 Block* Device::GetBlock(uint32_t block_id)
 {
-	if ( Block* block = GetCachedBlock(block_id) )
-		return block;
+	pthread_mutex_lock(&cache_lock);
+	if ( Block* block = LookupBlock(block_id) )
+		return pthread_mutex_unlock(&cache_lock), block;
 	Block* block = AllocateBlock();
 	if ( !block )
-		return NULL;
+		return pthread_mutex_unlock(&cache_lock), (Block*) NULL;
 	block->Construct(this, block_id);
+	block->is_loading = true;
+	block->Prelink();
+	pthread_mutex_unlock(&cache_lock);
 	off_t file_offset = (off_t) block_size * (off_t) block_id;
 	preadall(fd, block->block_data, block_size, file_offset);
-	block->Prelink();
+	pthread_mutex_lock(&cache_lock);
+	block->is_loading = false;
+	pthread_cond_broadcast(&load_cond);
+	pthread_mutex_unlock(&cache_lock);
 	return block;
 }
 
 Block* Device::GetBlockZeroed(uint32_t block_id)
 {
 	assert(write);
-	if ( Block* block = GetCachedBlock(block_id) )
+	pthread_mutex_lock(&cache_lock);
+	if ( Block* block = LookupBlock(block_id) )
 	{
+		pthread_mutex_unlock(&cache_lock);
 		block->BeginWrite();
 		memset(block->block_data, 0, block_size);
 		block->FinishWrite();
@@ -143,21 +210,37 @@ Block* Device::GetBlockZeroed(uint32_t block_id)
 	}
 	Block* block = AllocateBlock();
 	if ( !block )
-		return NULL;
+		return pthread_mutex_unlock(&cache_lock), (Block*) NULL;
 	block->Construct(this, block_id);
 	memset(block->block_data, 0, block_size);
 	block->Prelink();
+	pthread_mutex_unlock(&cache_lock);
 	block->BeginWrite();
 	block->FinishWrite();
 	return block;
 }
 
 Block* Device::GetCachedBlock(uint32_t block_id)
+{
+	pthread_mutex_lock(&cache_lock);
+	Block* block = LookupBlock(block_id);
+	pthread_mutex_unlock(&cache_lock);
+	return block;
+}
+
+// The cache lock must be held.
+Block* Device::LookupBlock(uint32_t block_id)
 {
 	size_t bin = block_id % DEVICE_HASH_LENGTH;
 	for ( Block* iter = hash_blocks[bin]; iter; iter = iter->next_hashed )
-		if ( iter->block_id == block_id )
-			return iter->Refer(), iter;
+	{
+		if ( iter->block_id != block_id )
+			continue;
+		iter->reference_count++;
+		while ( iter->is_loading )
+			pthread_cond_wait(&load_cond, &cache_lock);
+		return iter;
+	}
 	return NULL;
 }
 
@@ -173,8 +256,10 @@ void Device::Sync()
 		return;
 	}
 
+	pthread_mutex_lock(&cache_lock);
 	while ( dirty_block )
 		dirty_block->Sync();
+	pthread_mutex_unlock(&cache_lock);
 	fsync(fd);
 }
 
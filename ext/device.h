@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -35,6 +35,8 @@ public:
 	pthread_cond_t sync_thread_cond;
 	pthread_cond_t sync_thread_idle_cond;
 	pthread_mutex_t sync_thread_lock;
+	pthread_mutex_t cache_lock;
+	pthread_cond_t load_cond;
 	Block* mru_block;
 	Block* lru_block;
 	Block* dirty_block;
@@ -53,11 +55,15 @@ public:
 public:
 	void SpawnSyncThread();
 	Block* AllocateBlock();
+	uint8_t* AllocateBlockData();
+	void FreeBlockData(uint8_t* data);
 	Block* GetBlock(uint32_t block_id);
 	Block* GetBlockZeroed(uint32_t block_id);
 	Block* GetCachedBlock(uint32_t block_id);
+	Block* LookupBlock(uint32_t block_id);
 	void Sync();
 	void SyncThread();
+	size_t Trim(size_t bytes);
 
 };
 
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <error.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -55,8 +56,8 @@ static const uint32_t EXT2_FEATURE_INCOMPAT_SUPPORTED = \
 static const uint32_t EXT2_FEATURE_RO_COMPAT_SUPPORTED = \
                       EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
 
-uid_t request_uid;
-uid_t request_gid;
+__thread uid_t request_uid;
+__thread uid_t request_gid;
 
 mode_t HostModeFromExtMode(uint32_t extmode)
 {
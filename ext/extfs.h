@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -20,8 +20,8 @@
 #ifndef EXTFS_H
 #define EXTFS_H
 
-extern uid_t request_uid;
-extern gid_t request_gid;
+extern __thread uid_t request_uid;
+extern __thread gid_t request_gid;
 
 class Inode;
 
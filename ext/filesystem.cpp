@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -21,6 +21,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -40,6 +41,8 @@ Filesystem::Filesystem(Device* device, const char* mount_path)
 {
 	uint64_t sb_offset = 1024;
 	uint32_t sb_block_id = sb_offset / device->block_size;
+	this->cache_lock = PTHREAD_MUTEX_INITIALIZER;
+	this->tree_lock = PTHREAD_RWLOCK_INITIALIZER;
 	this->sb_block = device->GetBlock(sb_block_id);
 	assert(sb_block); // TODO: This can fail.
 	this->sb = (struct ext_superblock*)
@@ -143,8 +146,11 @@ void Filesystem::Sync()
 BlockGroup* Filesystem::GetBlockGroup(uint32_t group_id)
 {
 	assert(group_id < num_groups);
-	if ( block_groups[group_id] )
-		return block_groups[group_id]->Refer(), block_groups[group_id];
+	pthread_mutex_lock(&cache_lock);
+	BlockGroup* group = block_groups[group_id];
+	pthread_mutex_unlock(&cache_lock);
+	if ( group )
+		return group->Refer(), group;
 
 	size_t group_size = sizeof(ext_blockgrpdesc);
 	uint32_t first_block_id = sb->s_first_data_block + 1 /* superblock */;
@@ -154,13 +160,26 @@ BlockGroup* Filesystem::GetBlockGroup(uint32_t group_id)
 	Block* block = device->GetBlock(block_id);
 	if ( !block )
 		return (BlockGroup*) NULL;
-	BlockGroup* group = new BlockGroup(this, group_id);
+	pthread_mutex_lock(&cache_lock);
+	// Another worker might have loaded the block group in the meanwhile.
+	if ( (group = block_groups[group_id]) )
+	{
+		pthread_mutex_unlock(&cache_lock);
+		block->Unref();
+		return group->Refer(), group;
+	}
+	group = new BlockGroup(this, group_id);
 	if ( !group ) // TODO: Use operator new nothrow!
+	{
+		pthread_mutex_unlock(&cache_lock);
 		return block->Unref(), (BlockGroup*) NULL;
+	}
 	group->data_block = block;
 	uint8_t* buf = group->data_block->block_data + offset;
 	group->data = (struct ext_blockgrpdesc*) buf;
-	return block_groups[group_id] = group;
+	block_groups[group_id] = group;
+	pthread_mutex_unlock(&cache_lock);
+	return group;
 }
 
 Inode* Filesystem::GetInode(uint32_t inode_id)
@@ -170,10 +189,11 @@ Inode* Filesystem::GetInode(uint32_t inode_id)
 	if ( !inode_id )
 		return errno = EBADF, (Inode*) NULL;
 
-	size_t bin = inode_id % INODE_HASH_LENGTH;
-	for ( Inode* iter = hash_inodes[bin]; iter; iter = iter->next_hashed )
-		if ( iter->inode_id == inode_id )
-			return iter->Refer(), iter;
+	pthread_mutex_lock(&cache_lock);
+	Inode* inode = LookupInode(inode_id);
+	pthread_mutex_unlock(&cache_lock);
+	if ( inode )
+		return inode;
 
 	uint32_t group_id = (inode_id-1) / sb->s_inodes_per_group;
 	uint32_t tabel_index = (inode_id-1) % sb->s_inodes_per_group;
@@ -189,17 +209,39 @@ Inode* Filesystem::GetInode(uint32_t inode_id)
 	Block* block = device->GetBlock(block_id);
 	if ( !block )
 		return (Inode*) NULL;
-	Inode* inode = new Inode(this, inode_id);
+	pthread_mutex_lock(&cache_lock);
+	// Another worker might have loaded the inode while the block was read.
+	if ( (inode = LookupInode(inode_id)) )
+	{
+		pthread_mutex_unlock(&cache_lock);
+		block->Unref();
+		return inode;
+	}
+	inode = new Inode(this, inode_id);
 	if ( !inode )
+	{
+		pthread_mutex_unlock(&cache_lock);
 		return block->Unref(), (Inode*) NULL;
+	}
 	inode->data_block = block;
 	uint8_t* buf = inode->data_block->block_data + offset;
 	inode->data = (struct ext_inode*) buf;
 	inode->Prelink();
+	pthread_mutex_unlock(&cache_lock);
 
 	return inode;
 }
 
+// The cache lock must be held.
+Inode* Filesystem::LookupInode(uint32_t inode_id)
+{
+	size_t bin = inode_id % INODE_HASH_LENGTH;
+	for ( Inode* iter = hash_inodes[bin]; iter; iter = iter->next_hashed )
+		if ( iter->inode_id == inode_id )
+			return iter->reference_count++, iter;
+	return NULL;
+}
+
 uint32_t Filesystem::AllocateBlock(BlockGroup* preferred)
 {
 	if ( !device->write )
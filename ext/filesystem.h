@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -33,6 +33,8 @@ public:
 	~Filesystem();
 
 public:
+	pthread_mutex_t cache_lock;
+	pthread_rwlock_t tree_lock;
 	Block* sb_block;
 	struct ext_superblock* sb;
 	Device* device;
@@ -54,6 +56,7 @@ public:
 public:
 	BlockGroup* GetBlockGroup(uint32_t group_id);
 	Inode* GetInode(uint32_t inode_id);
+	Inode* LookupInode(uint32_t inode_id);
 	uint32_t AllocateBlock(BlockGroup* preferred = NULL);
 	uint32_t AllocateInode(BlockGroup* preferred = NULL);
 	void FreeBlock(uint32_t block_id);
@@ -19,7 +19,6 @@
 
 #if defined(__sortix__)
 
-#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -29,6 +28,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <ioleast.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -39,6 +39,7 @@
 #include <unistd.h>
 
 #include <sortix/dirent.h>
+#include <sortix/mempressure.h>
 
 #include <fsmarshall.h>
 
@@ -54,9 +55,84 @@
 #include "fuse.h"
 #include "inode.h"
 
+// The response is built in a buffer after room for the frame header, so the
+// whole frame is written to the kernel at once. Each worker has its own.
+static __thread uint8_t* response_data = NULL;
+static __thread size_t response_length = 0;
+static __thread size_t response_used = 0;
+static __thread bool response_failed = false;
+
+// Workers take turns reading and writing whole frames, as the channel is a
+// single stream of bytes.
+static pthread_mutex_t channel_read_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t channel_write_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool channel_closed = false;
+
+void BeginResponse()
+{
+	response_used = sizeof(struct fsm_tagged_header);
+	response_failed = false;
+}
+
+bool FinishResponse(int chl, size_t tag)
+{
+	if ( response_failed )
+	{
+		// Tell the kernel the request failed rather than leave it waiting.
+		struct
+		{
+			struct fsm_tagged_header frame;
+			struct fsm_msg_header hdr;
+			struct fsm_resp_error body;
+		} error;
+		size_t error_size = sizeof(error.frame) + sizeof(error.hdr) +
+		                    sizeof(error.body);
+		error.frame.tag = tag;
+		error.frame.size = sizeof(error.hdr) + sizeof(error.body);
+		error.hdr.msgtype = FSM_RESP_ERROR;
+		error.hdr.msgsize = sizeof(error.body);
+		error.body.errnum = ENOMEM;
+		pthread_mutex_lock(&channel_write_lock);
+		bool success = writeall(chl, &error, error_size) == error_size;
+		pthread_mutex_unlock(&channel_write_lock);
+		return success;
+	}
+	struct fsm_tagged_header frame;
+	frame.tag = tag;
+	frame.size = response_used - sizeof(frame);
+	const void* data = &frame;
+	size_t size = sizeof(frame);
+	if ( frame.size )
+	{
+		memcpy(response_data, &frame, sizeof(frame));
+		data = response_data;
+		size = response_used;
+	}
+	pthread_mutex_lock(&channel_write_lock);
+	bool success = writeall(chl, data, size) == size;
+	pthread_mutex_unlock(&channel_write_lock);
+	return success;
+}
+
 bool RespondData(int chl, const void* ptr, size_t count)
 {
-	return writeall(chl, ptr, count) == count;
+	(void) chl;
+	if ( response_failed )
+		return false;
+	if ( response_length - response_used < count )
+	{
+		size_t new_length = response_length ? response_length : 4096;
+		while ( new_length - response_used < count )
+			new_length *= 2;
+		uint8_t* new_data = (uint8_t*) realloc(response_data, new_length);
+		if ( !new_data )
+			return response_failed = true, false;
+		response_data = new_data;
+		response_length = new_length;
+	}
+	memcpy(response_data + response_used, ptr, count);
+	response_used += count;
+	return true;
 }
 
 bool RespondHeader(int chl, size_t type, size_t size)
@@ -146,14 +222,15 @@ bool RespondMakeDir(int chl, ino_t ino)
 	return RespondMessage(chl, FSM_RESP_MKDIR, &body, sizeof(body));
 }
 
-bool RespondReadDir(int chl, struct dirent* dirent)
+bool RespondReadDir(int chl, off_t cookie, const void* entries, size_t size,
+                    size_t needed)
 {
 	struct fsm_resp_readdirents body;
-	body.ino = dirent->d_ino;
-	body.type = dirent->d_type;
-	body.namelen = dirent->d_namlen;
+	body.cookie = cookie;
+	body.size = size;
+	body.needed = needed;
 	return RespondMessage(chl, FSM_RESP_READDIRENTS, &body, sizeof(body)) &&
-	       RespondData(chl, dirent->d_name, dirent->d_namlen);
+	       RespondData(chl, entries, size);
 }
 
 bool RespondTCGetBlob(int chl, const void* data, size_t data_size)
@@ -196,7 +273,9 @@ void HandleSync(int chl, struct fsm_req_sync* msg, Filesystem* fs)
 {
 	Inode* inode = SafeGetInode(fs, msg->ino);
 	if ( !inode ) { RespondError(chl, errno); return; }
+	pthread_rwlock_rdlock(&inode->lock);
 	inode->Sync();
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 	RespondSuccess(chl);
 }
@@ -206,7 +285,9 @@ void HandleStat(int chl, struct fsm_req_stat* msg, Filesystem* fs)
 	Inode* inode = SafeGetInode(fs, msg->ino);
 	if ( !inode ) { RespondError(chl, errno); return; }
 	struct stat st;
+	pthread_rwlock_rdlock(&inode->lock);
 	StatInode(inode, &st);
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 	RespondStat(chl, &st);
 }
@@ -217,9 +298,11 @@ void HandleChangeMode(int chl, struct fsm_req_chmod* msg, Filesystem* fs)
 	Inode* inode = SafeGetInode(fs, msg->ino);
 	if ( !inode ) { RespondError(chl, errno); return; }
 	uint32_t req_mode = ExtModeFromHostMode(msg->mode);
+	pthread_rwlock_wrlock(&inode->lock);
 	uint32_t old_mode = inode->Mode();
 	uint32_t new_mode = (old_mode & ~S_SETABLE) | (req_mode & S_SETABLE);
 	inode->SetMode(new_mode);
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 	RespondSuccess(chl);
 }
@@ -229,8 +312,10 @@ void HandleChangeOwner(int chl, struct fsm_req_chown* msg, Filesystem* fs)
 	if ( !fs->device->write ) { RespondError(chl, EROFS); return; }
 	Inode* inode = SafeGetInode(fs, msg->ino);
 	if ( !inode ) { RespondError(chl, errno); return; }
+	pthread_rwlock_wrlock(&inode->lock);
 	inode->SetUserId((uint32_t) msg->uid);
 	inode->SetGroupId((uint32_t) msg->gid);
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 	RespondSuccess(chl);
 }
@@ -244,6 +329,7 @@ void HandleUTimens(int chl, struct fsm_req_utimens* msg, Filesystem* fs)
 	     msg->times[1].tv_nsec != UTIME_OMIT )
 	{
 		time_t now = time(NULL);
+		pthread_rwlock_wrlock(&inode->lock);
 		inode->BeginWrite();
 		if ( msg->times[0].tv_nsec == UTIME_NOW )
 			inode->data->i_atime = now;
@@ -254,6 +340,7 @@ void HandleUTimens(int chl, struct fsm_req_utimens* msg, Filesystem* fs)
 		else if ( msg->times[1].tv_nsec != UTIME_OMIT )
 			inode->data->i_mtime = msg->times[1].tv_sec;
 		inode->FinishWrite();
+		pthread_rwlock_unlock(&inode->lock);
 	}
 	inode->Unref();
 	RespondSuccess(chl);
@@ -265,7 +352,9 @@ void HandleTruncate(int chl, struct fsm_req_truncate* msg, Filesystem* fs)
 	if ( msg->size < 0 ) { RespondError(chl, EINVAL); return; }
 	Inode* inode = SafeGetInode(fs, msg->ino);
 	if ( !inode ) { RespondError(chl, errno); return; }
+	pthread_rwlock_wrlock(&inode->lock);
 	inode->Truncate((uint64_t) msg->size);
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 	RespondSuccess(chl);
 }
@@ -278,7 +367,9 @@ void HandleSeek(int chl, struct fsm_req_lseek* msg, Filesystem* fs)
 		RespondSeek(chl, msg->offset);
 	else if ( msg->whence == SEEK_END )
 	{
+		pthread_rwlock_rdlock(&inode->lock);
 		off_t inode_size = inode->Size();
+		pthread_rwlock_unlock(&inode->lock);
 		if ( (msg->offset < 0 && inode_size + msg->offset < 0) ||
 		     (0 <= msg->offset && OFF_MAX - inode_size < msg->offset) )
 			RespondError(chl, EOVERFLOW);
@@ -296,7 +387,9 @@ void HandleReadAt(int chl, struct fsm_req_pread* msg, Filesystem* fs)
 	if ( !inode ) { RespondError(chl, errno); return; }
 	uint8_t* buf = (uint8_t*) malloc(msg->count);
 	if ( !buf ) { inode->Unref(); RespondError(chl, errno); return; }
+	pthread_rwlock_rdlock(&inode->lock);
 	ssize_t amount = inode->ReadAt(buf, msg->count, msg->offset);
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 	if ( amount < 0 ) { free(buf); RespondError(chl, errno); return; }
 	RespondRead(chl, buf, amount);
@@ -308,7 +401,9 @@ void HandleWriteAt(int chl, struct fsm_req_pwrite* msg, Filesystem* fs)
 	Inode* inode = SafeGetInode(fs, msg->ino);
 	if ( !inode ) { RespondError(chl, errno); return; }
 	const uint8_t* buf = (const uint8_t*) &msg[1];
+	pthread_rwlock_wrlock(&inode->lock);
 	ssize_t amount = inode->WriteAt(buf, msg->count, msg->offset);
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 	if ( amount < 0 ) { RespondError(chl, errno); return; }
 	RespondWrite(chl, amount);
@@ -330,7 +425,9 @@ void HandleOpen(int chl, struct fsm_req_open* msg, Filesystem* fs)
 	memcpy(path, pathraw, msg->namelen);
 	path[msg->namelen] = '\0';
 
+	pthread_rwlock_rdlock(&inode->lock);
 	Inode* result = inode->Open(path, msg->flags, ExtModeFromHostMode(msg->mode));
+	pthread_rwlock_unlock(&inode->lock);
 
 	free(path);
 	inode->Unref();
@@ -372,21 +469,38 @@ void HandleReadDir(int chl, struct fsm_req_readdirents* msg, Filesystem* fs)
 {
 	Inode* inode = SafeGetInode(fs, msg->ino);
 	if ( !inode ) { RespondError(chl, errno); return; }
+	pthread_rwlock_rdlock(&inode->lock);
 	if ( !S_ISDIR(inode->Mode()) )
 	{
+		pthread_rwlock_unlock(&inode->lock);
 		inode->Unref();
 		RespondError(chl, ENOTDIR);
 		return;
 	}
-	union
+	// The cookie is the offset of the next entry in the directory, so the
+	// listing resumes there without visiting the earlier entries again. Entries
+	// are aligned to four bytes, and the cookie is otherwise not trusted.
+	if ( msg->cookie < 0 || msg->cookie % 4 )
+	{
+		pthread_rwlock_unlock(&inode->lock);
+		inode->Unref();
+		RespondError(chl, EINVAL);
+		return;
+	}
+	size_t size = msg->size < 65536 ? msg->size : 65536;
+	uint8_t* entries = (uint8_t*) malloc(size ? size : 1);
+	if ( !entries )
 	{
-		struct dirent kernel_entry;
-		uint8_t padding[sizeof(struct dirent) + 256];
-	};
-	memset(&kernel_entry, 0, sizeof(kernel_entry));
+		pthread_rwlock_unlock(&inode->lock);
+		inode->Unref();
+		RespondError(chl, errno);
+		return;
+	}
+	size_t used = 0;
+	size_t needed = 0;
 
 	uint64_t file_size = inode->Size();
-	uint64_t offset = 0;
+	uint64_t offset = msg->cookie;
 	Block* block = NULL;
 	uint64_t block_id = 0;
 	while ( offset < file_size )
@@ -398,38 +512,58 @@ void HandleReadDir(int chl, struct fsm_req_readdirents* msg, Filesystem* fs)
 			block = NULL;
 		if ( !block && !(block = inode->GetBlock(block_id = entry_block_id)) )
 		{
+			pthread_rwlock_unlock(&inode->lock);
 			inode->Unref();
+			free(entries);
 			RespondError(chl, errno);
 			return;
 		}
 		const uint8_t* block_data = block->block_data + entry_block_offset;
 		const struct ext_dirent* entry = (const struct ext_dirent*) block_data;
-		if ( entry->inode && entry->name_len && !(msg->rec_num--) )
+		// The entry must be within the block and hold its name.
+		if ( fs->block_size - entry_block_offset < sizeof(struct ext_dirent) ||
+		     entry->reclen % 4 ||
+		     entry->reclen < sizeof(struct ext_dirent) + entry->name_len ||
+		     fs->block_size - entry_block_offset < entry->reclen )
 		{
-			uint8_t file_type = EXT2_FT_UNKNOWN;
-			if ( fs->sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE )
-				file_type = entry->file_type;
-			kernel_entry.d_reclen = sizeof(kernel_entry) + entry->name_len;
-			kernel_entry.d_ino = entry->inode;
-			kernel_entry.d_dev = 0;
-			kernel_entry.d_type = HostDTFromExtDT(file_type);
-			kernel_entry.d_namlen = entry->name_len;
-			memcpy(kernel_entry.d_name, entry->name, entry->name_len);
-			size_t dname_offset = offsetof(struct dirent, d_name);
-			padding[dname_offset + kernel_entry.d_namlen] = '\0';
 			block->Unref();
+			pthread_rwlock_unlock(&inode->lock);
 			inode->Unref();
-			RespondReadDir(chl, &kernel_entry);
+			free(entries);
+			RespondError(chl, EIO);
 			return;
 		}
+		if ( entry->inode && entry->name_len )
+		{
+			size_t reclen = DIRENT_RECLEN(entry->name_len);
+			if ( size - used < reclen )
+			{
+				if ( !used )
+					needed = reclen;
+				break;
+			}
+			uint8_t file_type = EXT2_FT_UNKNOWN;
+			if ( fs->sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE )
+				file_type = entry->file_type;
+			struct dirent* kernel_entry = (struct dirent*) (entries + used);
+			memset(kernel_entry, 0, reclen);
+			kernel_entry->d_reclen = reclen;
+			kernel_entry->d_ino = entry->inode;
+			kernel_entry->d_dev = 0;
+			kernel_entry->d_type = HostDTFromExtDT(file_type);
+			kernel_entry->d_namlen = entry->name_len;
+			memcpy(kernel_entry->d_name, entry->name, entry->name_len);
+			used += reclen;
+		}
 		offset += entry->reclen;
 	}
 	if ( block )
 		block->Unref();
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 
-	kernel_entry.d_reclen = sizeof(kernel_entry);
-	RespondReadDir(chl, &kernel_entry);
+	RespondReadDir(chl, (off_t) offset, entries, used, needed);
+	free(entries);
 }
 
 void HandleIsATTY(int chl, struct fsm_req_isatty* msg, Filesystem* fs)
@@ -562,11 +696,25 @@ void HandleReadlink(int chl, struct fsm_req_readlink* msg, Filesystem* fs)
 {
 	Inode* inode = SafeGetInode(fs, msg->ino);
 	if ( !inode ) { RespondError(chl, errno); return; }
-	if ( !EXT2_S_ISLNK(inode->Mode()) ) { inode->Unref(); RespondError(chl, EINVAL); return; }
+	pthread_rwlock_rdlock(&inode->lock);
+	if ( !EXT2_S_ISLNK(inode->Mode()) )
+	{
+		pthread_rwlock_unlock(&inode->lock);
+		inode->Unref();
+		RespondError(chl, EINVAL);
+		return;
+	}
 	size_t count = inode->Size();
 	uint8_t* buf = (uint8_t*) malloc(count);
-	if ( !buf ) { inode->Unref(); RespondError(chl, errno); return; }
+	if ( !buf )
+	{
+		pthread_rwlock_unlock(&inode->lock);
+		inode->Unref();
+		RespondError(chl, errno);
+		return;
+	}
 	ssize_t amount = inode->ReadAt(buf, count, 0);
+	pthread_rwlock_unlock(&inode->lock);
 	inode->Unref();
 	if ( amount < 0 )  { RespondError(chl, errno); return; }
 	RespondReadlink(chl, buf, amount);
@@ -649,7 +797,8 @@ void HandleTCGetBlob(int chl, struct fsm_req_tcgetblob* msg, Filesystem* fs)
 	free(name);
 }
 
-void HandleIncomingMessage(int chl, struct fsm_msg_header* hdr, Filesystem* fs)
+void HandleIncomingMessage(int chl, struct fsm_msg_header* hdr, uint8_t* body,
+                           Filesystem* fs)
 {
 	request_uid = hdr->uid;
 	request_gid = hdr->gid;
@@ -692,25 +841,25 @@ void HandleIncomingMessage(int chl, struct fsm_msg_header* hdr, Filesystem* fs)
 		RespondError(chl, ENOTSUP);
 		return;
 	}
-	uint8_t body_buffer[65536];
-	uint8_t* body = body_buffer;
-	if ( sizeof(body_buffer) < hdr->msgsize )
-	{
-		body = (uint8_t*) mmap(NULL, hdr->msgsize, PROT_READ | PROT_WRITE,
-		                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if ( (void*) body == MAP_FAILED )
-		{
-			RespondError(chl, errno);
-			return;
-		}
-	}
-	if ( readall(chl, body, hdr->msgsize) == hdr->msgsize )
-		handlers[hdr->msgtype](chl, body, fs);
+	// Requests that change the directory tree are handled alone, while the
+	// others are handled concurrently and lock the inodes they use.
+	bool changes_tree = hdr->msgtype == FSM_REQ_MKDIR ||
+	                    hdr->msgtype == FSM_REQ_RMDIR ||
+	                    hdr->msgtype == FSM_REQ_UNLINK ||
+	                    hdr->msgtype == FSM_REQ_LINK ||
+	                    hdr->msgtype == FSM_REQ_SYMLINK ||
+	                    hdr->msgtype == FSM_REQ_RENAME ||
+	                    (hdr->msgtype == FSM_REQ_OPEN &&
+	                     ((struct fsm_req_open*) body)->flags &
+	                     (O_CREAT | O_TRUNC));
+	if ( changes_tree )
+		pthread_rwlock_wrlock(&fs->tree_lock);
 	else
-		RespondError(chl, errno);
-	if ( sizeof(body_buffer) < hdr->msgsize )
-		munmap(body, hdr->msgsize);
+		pthread_rwlock_rdlock(&fs->tree_lock);
+	handlers[hdr->msgtype](chl, body, fs);
+	pthread_rwlock_unlock(&fs->tree_lock);
 }
+
 static volatile bool should_terminate = false;
 
 void TerminationHandler(int)
@@ -718,6 +867,106 @@ void TerminationHandler(int)
 	should_terminate = true;
 }
 
+// Taken for good when shutting down, as the caches may no longer be trimmed.
+static pthread_mutex_t trim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* PressureThread(void* ctx)
+{
+	Device* dev = (Device*) ctx;
+	int fd = open("/dev/mempressure", O_RDONLY | O_CLOEXEC);
+	if ( fd < 0 )
+		return NULL;
+	struct mempressure event;
+	while ( true )
+	{
+		ssize_t amount = read(fd, &event, sizeof(event));
+		if ( amount < 0 && errno == EINTR )
+			continue;
+		if ( amount != (ssize_t) sizeof(event) )
+			break;
+		if ( event.target <= event.free )
+			continue;
+		pthread_mutex_lock(&trim_lock);
+		dev->Trim(event.target - event.free);
+		pthread_mutex_unlock(&trim_lock);
+	}
+	close(fd);
+	return NULL;
+}
+
+// Workers serve requests concurrently, so a request waiting for the disk
+// doesn't stall the other processes using the filesystem.
+static const size_t WORKER_COUNT = 8;
+
+struct worker_ctx
+{
+	int serverfd;
+	Filesystem* fs;
+	Device* dev;
+};
+
+static struct timespec last_sync_at;
+
+static void* Worker(void* ctx_ptr)
+{
+	struct worker_ctx* ctx = (struct worker_ctx*) ctx_ptr;
+	int serverfd = ctx->serverfd;
+	Filesystem* fs = ctx->fs;
+	Device* dev = ctx->dev;
+	uint8_t* request = NULL;
+	size_t request_length = 0;
+	while ( true )
+	{
+		pthread_mutex_lock(&channel_read_lock);
+		struct fsm_tagged_header frame;
+		bool received = !channel_closed &&
+		                readall(serverfd, &frame, sizeof(frame)) == sizeof(frame) &&
+		                !should_terminate;
+		if ( received && request_length < frame.size )
+		{
+			uint8_t* new_request = (uint8_t*) realloc(request, frame.size);
+			if ( !new_request )
+				error(1, errno, "malloc");
+			request = new_request;
+			request_length = frame.size;
+		}
+		if ( received )
+			received = readall(serverfd, request, frame.size) == frame.size;
+		if ( !received )
+			channel_closed = true;
+		pthread_mutex_unlock(&channel_read_lock);
+		if ( !received )
+			break;
+
+		BeginResponse();
+		struct fsm_msg_header* hdr = (struct fsm_msg_header*) request;
+		if ( frame.size < sizeof(*hdr) ||
+		     frame.size - sizeof(*hdr) != hdr->msgsize )
+		{
+			RespondError(serverfd, EINVAL);
+			FinishResponse(serverfd, frame.tag);
+			continue;
+		}
+		HandleIncomingMessage(serverfd, hdr, request + sizeof(*hdr), fs);
+		FinishResponse(serverfd, frame.tag);
+
+		// There is only a single worker if there is no sync thread.
+		if ( dev->write && !dev->has_sync_thread )
+		{
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			if ( 5 <= timespec_sub(now, last_sync_at).tv_sec )
+			{
+				fs->Sync();
+				last_sync_at = now;
+			}
+		}
+	}
+	free(request);
+	return NULL;
+}
+
 int fsmarshall_main(const char* argv0,
                     const char* mount_path,
                     bool foreground,
@@ -735,7 +984,8 @@ int fsmarshall_main(const char* argv0,
 	root_inode->Unref();
 
 	// Create a filesystem server connected to the kernel that we'll listen on.
-	int serverfd = fsm_mountat(AT_FDCWD, mount_path, &root_inode_st, 0);
+	int serverfd = fsm_mountat(AT_FDCWD, mount_path, &root_inode_st,
+	                           FSM_MOUNT_TAGGED);
 	if ( serverfd < 0 )
 		error(1, errno, "%s", mount_path);
 
@@ -757,37 +1007,31 @@ int fsmarshall_main(const char* argv0,
 
 	dev->SpawnSyncThread();
 
+	// Give back cached blocks when the system runs low on memory.
+	pthread_t pressure_thread;
+	if ( pthread_create(&pressure_thread, NULL, PressureThread, dev) == 0 )
+		pthread_detach(pressure_thread);
+
 	// Listen for filesystem messages and sync the filesystem every few seconds.
-	struct timespec last_sync_at;
+	// Blocks are written back by whoever syncs them if there is no sync thread,
+	// which is only safe with a single worker.
 	clock_gettime(CLOCK_MONOTONIC, &last_sync_at);
-	int channel;
-	while ( 0 <= (channel = accept(serverfd, NULL, NULL)) )
-	{
-		if ( should_terminate )
-			break;
-		struct fsm_msg_header hdr;
-		size_t amount;
-		if ( (amount = readall(channel, &hdr, sizeof(hdr))) != sizeof(hdr) )
-		{
-			//error(0, errno, "incomplete header: got %zi of %zu bytes", amount, sizeof(hdr));
-			errno = 0;
-			continue;
-		}
-		HandleIncomingMessage(channel, &hdr, fs);
-		close(channel);
-
-		if ( dev->write && !dev->has_sync_thread )
-		{
-			struct timespec now;
-			clock_gettime(CLOCK_MONOTONIC, &now);
-
-			if ( 5 <= timespec_sub(now, last_sync_at).tv_sec )
-			{
-				fs->Sync();
-				last_sync_at = now;
-			}
-		}
-	}
+	struct worker_ctx ctx;
+	ctx.serverfd = serverfd;
+	ctx.fs = fs;
+	ctx.dev = dev;
+	size_t worker_count = dev->write && !dev->has_sync_thread ? 1 : WORKER_COUNT;
+	pthread_t workers[WORKER_COUNT];
+	size_t workers_started = 0;
+	while ( workers_started + 1 < worker_count &&
+	        pthread_create(&workers[workers_started], NULL, Worker, &ctx) == 0 )
+		workers_started++;
+	Worker(&ctx);
+	for ( size_t i = 0; i < workers_started; i++ )
+		pthread_join(workers[i], NULL);
+
+	// The caches are no longer trimmed while shutting down.
+	pthread_mutex_lock(&trim_lock);
 
 	// Garbage collect all open inode references.
 	while ( fs->mru_inode )
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -52,6 +53,7 @@
 
 Inode::Inode(Filesystem* filesystem, uint32_t inode_id)
 {
+	this->lock = PTHREAD_RWLOCK_INITIALIZER;
 	this->prev_inode = NULL;
 	this->next_inode = NULL;
 	this->prev_hashed = NULL;
@@ -72,7 +74,11 @@ Inode::~Inode()
 	Sync();
 	if ( data_block )
 		data_block->Unref();
-	Unlink();
+	// Inodes are only in the cache while they are referenced.
+	pthread_mutex_lock(&filesystem->cache_lock);
+	if ( reference_count || remote_reference_count )
+		Unlink();
+	pthread_mutex_unlock(&filesystem->cache_lock);
 }
 
 uint32_t Inode::Mode()
@@ -168,13 +174,21 @@ void Inode::SetSize(uint64_t new_size)
 	Modified();
 }
 
-Block* Inode::GetBlockFromTable(Block* table, uint32_t index)
+// Holes are only filled when writing, as that changes the block tables and
+// must only be done with the inode locked exclusively.
+Block* Inode::GetBlockFromTable(Block* table, uint32_t index, bool fill,
+                                bool* hole)
 {
 	if ( uint32_t block_id = ((uint32_t*) table->block_data)[index] )
 		return filesystem->device->GetBlock(block_id);
-	// TODO: If in read only mode, then perhaps return a zero block here.
+	if ( !fill )
+	{
+		if ( hole )
+			*hole = true;
+		return errno = EIO, (Block*) NULL;
+	}
 	if ( !filesystem->device->write )
-		return NULL;
+		return errno = EROFS, (Block*) NULL;
 	uint32_t group_id = (inode_id - 1) / filesystem->sb->s_inodes_per_group;
 	assert(group_id < filesystem->num_groups);
 	BlockGroup* block_group = filesystem->GetBlockGroup(group_id);
@@ -183,6 +197,8 @@ Block* Inode::GetBlockFromTable(Block* table, uint32_t index)
 	if ( block_id )
 	{
 		Block* block = filesystem->device->GetBlockZeroed(block_id);
+		if ( !block )
+			return filesystem->FreeBlock(block_id), (Block*) NULL;
 		table->BeginWrite();
 		((uint32_t*) table->block_data)[index] = block_id;
 		table->FinishWrite();
@@ -191,7 +207,23 @@ Block* Inode::GetBlockFromTable(Block* table, uint32_t index)
 	return NULL;
 }
 
-Block* Inode::GetBlock(uint64_t offset)
+// Returns the block at the offset in the file, or NULL with hole set if given
+// when the block doesn't exist, which reads as zeroes.
+Block* Inode::GetBlock(uint64_t offset, bool* hole)
+{
+	if ( hole )
+		*hole = false;
+	return WalkBlockTables(offset, false, hole);
+}
+
+// Returns the block at the offset in the file, allocating it if it's a hole.
+// The inode must be locked exclusively.
+Block* Inode::GetBlockForWrite(uint64_t offset)
+{
+	return WalkBlockTables(offset, true, NULL);
+}
+
+Block* Inode::WalkBlockTables(uint64_t offset, bool fill, bool* hole)
 {
 	const uint64_t ENTRIES = filesystem->block_size / sizeof(uint32_t);
 	uint64_t block_direct = sizeof(data->i_block) / sizeof(uint32_t) - 3;
@@ -219,7 +251,7 @@ Block* Inode::GetBlock(uint64_t offset)
 	read_direct:
 		index = offset;
 		offset %= 1;
-		block = GetBlockFromTable(table, index);
+		block = GetBlockFromTable(table, index, fill, hole);
 		table->Unref();
 		if ( !block )
 			return NULL;
@@ -232,7 +264,7 @@ Block* Inode::GetBlock(uint64_t offset)
 	read_singly:
 		index = offset / ENTRIES;
 		offset = offset % ENTRIES;
-		block = GetBlockFromTable(table, index);
+		block = GetBlockFromTable(table, index, fill, hole);
 		table->Unref();
 		if ( !block )
 			return NULL;
@@ -246,7 +278,7 @@ Block* Inode::GetBlock(uint64_t offset)
 	read_doubly:
 		index = offset / (ENTRIES * ENTRIES);
 		offset = offset % (ENTRIES * ENTRIES);
-		block = GetBlockFromTable(table, index);
+		block = GetBlockFromTable(table, index, fill, hole);
 		table->Unref();
 		if ( !block )
 			return NULL;
@@ -260,7 +292,7 @@ Block* Inode::GetBlock(uint64_t offset)
 	/*read_triply:*/
 		index = offset / (ENTRIES * ENTRIES * ENTRIES);
 		offset = offset % (ENTRIES * ENTRIES * ENTRIES);
-		block = GetBlockFromTable(table, index);
+		block = GetBlockFromTable(table, index, fill, hole);
 		table->Unref();
 		if ( !block )
 			return NULL;
@@ -349,11 +381,15 @@ void Inode::Truncate(uint64_t new_size)
 	uint32_t partial = new_size % filesystem->block_size;
 	if ( partial )
 	{
-		Block* partial_block = GetBlock(new_num_blocks-1);
-		uint8_t* data = partial_block->block_data;
-		partial_block->BeginWrite();
-		memset(data + partial, 0, filesystem->block_size - partial);
-		partial_block->FinishWrite();
+		// Holes already read as zeroes.
+		if ( Block* partial_block = GetBlock(new_num_blocks-1) )
+		{
+			uint8_t* data = partial_block->block_data;
+			partial_block->BeginWrite();
+			memset(data + partial, 0, filesystem->block_size - partial);
+			partial_block->FinishWrite();
+			partial_block->Unref();
+		}
 	}
 
 	const uint64_t ENTRIES = filesystem->block_size / sizeof(uint32_t);
@@ -575,7 +611,7 @@ bool Inode::Link(const char* elem, Inode* dest, bool directories)
 	if ( block && block_id != hole_block_id )
 		block->Unref(),
 		block = NULL;
-	if ( !block && !(block = GetBlock(block_id = hole_block_id)) )
+	if ( !block && !(block = GetBlockForWrite(block_id = hole_block_id)) )
 		return NULL;
 
 	Modified();
@@ -700,8 +736,14 @@ Inode* Inode::UnlinkKeep(const char* elem, bool directories, bool force)
 			strncpy(entry->name + entry->name_len, "",
 			        entry->reclen - sizeof(struct ext_dirent) - entry->name_len);
 
-			// If the entire block is empty, we'll need to remove it.
-			if ( !entry->name[0] && entry->reclen == block_size )
+			bool block_empty = !entry->name[0] && entry->reclen == block_size;
+
+			block->FinishWrite();
+
+			// If the entire block is empty, we'll need to remove it. This is
+			// done after finishing the write, as truncating takes the cache
+			// locks that must not be waited for with the block held.
+			if ( block_empty )
 			{
 				// If this is not the last block, we'll make it. This is faster
 				// than shifting the entire directory a single block. We don't
@@ -712,7 +754,9 @@ Inode* Inode::UnlinkKeep(const char* elem, bool directories, bool force)
 					Block* last_block = GetBlock(num_blocks-1);
 					if ( last_block )
 					{
+						block->BeginWrite();
 						memcpy(block->block_data, last_block->block_data, block_size);
+						block->FinishWrite();
 						last_block->Unref();
 						Truncate(filesize - block_size);
 					}
@@ -723,8 +767,6 @@ Inode* Inode::UnlinkKeep(const char* elem, bool directories, bool force)
 				}
 			}
 
-			block->FinishWrite();
-
 			block->Unref();
 
 			return inode;
@@ -776,14 +818,19 @@ ssize_t Inode::ReadAt(uint8_t* buf, size_t s_count, off_t o_offset)
 		uint64_t block_id = offset / filesystem->block_size;
 		uint32_t block_offset = offset % filesystem->block_size;
 		uint32_t block_left = filesystem->block_size - block_offset;
-		Block* block = GetBlock(block_id);
-		if ( !block )
+		bool hole;
+		Block* block = GetBlock(block_id, &hole);
+		if ( !block && !hole )
 			return sofar ? sofar : -1;
 		size_t amount = count - sofar < block_left ? count - sofar : block_left;
-		memcpy(buf + sofar, block->block_data + block_offset, amount);
+		if ( block )
+			memcpy(buf + sofar, block->block_data + block_offset, amount);
+		else
+			memset(buf + sofar, 0, amount);
 		sofar += amount;
 		offset += amount;
-		block->Unref();
+		if ( block )
+			block->Unref();
 	}
 	return (ssize_t) sofar;
 }
@@ -823,7 +870,7 @@ ssize_t Inode::WriteAt(const uint8_t* buf, size_t s_count, off_t o_offset)
 		uint64_t block_id = offset / filesystem->block_size;
 		uint32_t block_offset = offset % filesystem->block_size;
 		uint32_t block_left = filesystem->block_size - block_offset;
-		Block* block = GetBlock(block_id);
+		Block* block = GetBlockForWrite(block_id);
 		if ( !block )
 			return sofar ? (ssize_t) sofar : -1;
 		size_t amount = count - sofar < block_left ? count - sofar : block_left;
@@ -1080,14 +1127,23 @@ void Inode::Delete()
 
 void Inode::Refer()
 {
+	pthread_mutex_lock(&filesystem->cache_lock);
 	reference_count++;
+	pthread_mutex_unlock(&filesystem->cache_lock);
 }
 
 void Inode::Unref()
 {
+	pthread_mutex_lock(&filesystem->cache_lock);
 	assert(0 < reference_count);
 	reference_count--;
-	if ( !reference_count && !remote_reference_count )
+	bool dropped = !reference_count && !remote_reference_count;
+	// Leave the cache right away so no other worker can find the inode while
+	// it's being deleted.
+	if ( dropped )
+		Unlink();
+	pthread_mutex_unlock(&filesystem->cache_lock);
+	if ( dropped )
 	{
 		if ( !data->i_links_count )
 			Delete();
@@ -1097,14 +1153,21 @@ void Inode::Unref()
 
 void Inode::RemoteRefer()
 {
+	pthread_mutex_lock(&filesystem->cache_lock);
 	remote_reference_count++;
+	pthread_mutex_unlock(&filesystem->cache_lock);
 }
 
 void Inode::RemoteUnref()
 {
+	pthread_mutex_lock(&filesystem->cache_lock);
 	assert(0 < remote_reference_count);
 	remote_reference_count--;
-	if ( !reference_count && !remote_reference_count )
+	bool dropped = !reference_count && !remote_reference_count;
+	if ( dropped )
+		Unlink();
+	pthread_mutex_unlock(&filesystem->cache_lock);
+	if ( dropped )
 	{
 		if ( !data->i_links_count )
 			Delete();
@@ -1131,6 +1194,8 @@ void Inode::FinishWrite()
 	struct timespec now;
 	clock_gettime(CLOCK_REALTIME, &now);
 	data->i_ctime = now.tv_sec;
+	data_block->FinishWrite();
+	pthread_mutex_lock(&filesystem->cache_lock);
 	if ( !dirty )
 	{
 		dirty = true;
@@ -1140,29 +1205,41 @@ void Inode::FinishWrite()
 			next_dirty->prev_dirty = this;
 		filesystem->dirty_inode = this;
 	}
-	data_block->FinishWrite();
+	pthread_mutex_unlock(&filesystem->cache_lock);
 	Use();
 }
 
 void Inode::Sync()
 {
-	if ( !dirty )
+	pthread_mutex_lock(&filesystem->cache_lock);
+	bool was_dirty = dirty;
+	if ( dirty )
+	{
+		(prev_dirty ? prev_dirty->next_dirty : filesystem->dirty_inode) = next_dirty;
+		if ( next_dirty )
+			next_dirty->prev_dirty = prev_dirty;
+		prev_dirty = NULL;
+		next_dirty = NULL;
+		dirty = false;
+	}
+	pthread_mutex_unlock(&filesystem->cache_lock);
+	if ( !was_dirty )
 		return;
 	data_block->Sync();
 	// TODO: The inode contents needs to be sync'd as well!
-	(prev_dirty ? prev_dirty->next_dirty : filesystem->dirty_inode) = next_dirty;
-	if ( next_dirty )
-		next_dirty->prev_dirty = prev_dirty;
-	prev_dirty = NULL;
-	next_dirty = NULL;
-	dirty = false;
 }
 
 void Inode::Use()
 {
 	data_block->Use();
-	Unlink();
-	Prelink();
+	pthread_mutex_lock(&filesystem->cache_lock);
+	// Inodes are only in the cache while they are referenced.
+	if ( reference_count || remote_reference_count )
+	{
+		Unlink();
+		Prelink();
+	}
+	pthread_mutex_unlock(&filesystem->cache_lock);
 }
 
 void Inode::Unlink()
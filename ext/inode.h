@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -30,6 +30,7 @@ public:
 	~Inode();
 
 public:
+	pthread_rwlock_t lock;
 	Inode* prev_inode;
 	Inode* next_inode;
 	Inode* prev_hashed;
@@ -56,8 +57,10 @@ public:
 	void Truncate(uint64_t new_size);
 	bool FreeIndirect(uint64_t from, uint64_t offset, uint32_t block_id,
 	                  int indirection, uint64_t entry_span);
-	Block* GetBlock(uint64_t offset);
-	Block* GetBlockFromTable(Block* table, uint32_t index);
+	Block* GetBlock(uint64_t offset, bool* hole = NULL);
+	Block* GetBlockForWrite(uint64_t offset);
+	Block* WalkBlockTables(uint64_t offset, bool fill, bool* hole);
+	Block* GetBlockFromTable(Block* table, uint32_t index, bool fill, bool* hole);
 	Inode* Open(const char* elem, int flags, mode_t mode);
 	bool Link(const char* elem, Inode* dest, bool directories);
 	bool Symlink(const char* elem, const char* dest);
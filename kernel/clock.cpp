@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -24,7 +24,6 @@
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/kthread.h>
-#include <sortix/kernel/signal.h>
 #include <sortix/kernel/timer.h>
 #include <sortix/kernel/worker.h>
 
@@ -40,6 +39,8 @@ Clock::Clock()
 	clock_mutex = KTHREAD_MUTEX_INITIALIZER;
 	clock_callable_from_interrupt = false;
 	we_disabled_interrupts = false;
+	interpolate = NULL;
+	timers_changed = NULL;
 }
 
 Clock::~Clock()
@@ -100,12 +101,16 @@ void Clock::Set(struct timespec* now, struct timespec* res)
 	UnlockClock();
 }
 
+// The clock is advanced in steps by the timer interrupt, but a finer clock
+// source may tell how much time has passed since it was last advanced, which is
+// then added when reading the clock.
 void Clock::Get(struct timespec* now, struct timespec* res)
 {
 	LockClock();
 
 	if ( now )
-		*now = current_time;
+		*now = interpolate ? timespec_add(current_time, interpolate()) :
+		                     current_time;
 	if ( res )
 		*res = resolution;
 
@@ -153,6 +158,11 @@ void Clock::RegisterDelay(Timer* timer) // Lock acquired.
 	assert(!(timer->flags & TIMER_ACTIVE));
 	timer->flags |= TIMER_ACTIVE;
 
+	// Measure the delay from the current time rather than from when the clock
+	// was last advanced.
+	if ( interpolate )
+		timer->value.it_value = timespec_add(timer->value.it_value, interpolate());
+
 	Timer* before = NULL;
 	struct timespec before_time = timespec_nul();
 	for ( Timer* iter = delay_timer; iter; iter = before->next_timer )
@@ -230,58 +240,85 @@ void Clock::Cancel(Timer* timer)
 	UnlockClock();
 }
 
-// TODO: We need some method for threads to sleep for real but still be
-//       interrupted by signals.
-struct timespec Clock::SleepDelay(struct timespec duration)
+struct clock_sleep
 {
-	struct timespec start_advancement;
-	struct timespec elapsed = timespec_nul();
-	bool start_advancement_set = false;
+	kthread_cond_t cond;
+	volatile bool expired;
+};
 
-	while ( timespec_lt(elapsed, duration) )
-	{
-		if ( start_advancement_set )
-		{
-			if ( Signal::IsPending() )
-				return duration;
+static void Clock__SleepTimeout(Clock* /*clock*/, Timer* /*timer*/, void* ctx)
+{
+	struct clock_sleep* sleep = (struct clock_sleep*) ctx;
+	sleep->expired = true;
+	kthread_cond_signal(&sleep->cond);
+}
 
-			kthread_yield();
-		}
+// Sleeps until a timer on the clock fires, such that the processor can go idle
+// instead of polling the clock. The timer may fire from the timer interrupt
+// handler, so the condition is checked with interrupts disabled. Returns false
+// if interrupted by a signal.
+static bool Clock__SleepOnTimer(Clock* clock, struct timespec value, int flags)
+{
+	struct clock_sleep sleep;
+	sleep.cond = KTHREAD_COND_INITIALIZER;
+	sleep.expired = false;
+	struct itimerspec its;
+	its.it_interval = timespec_nul();
+	its.it_value = value;
+	Timer timer;
+	timer.Attach(clock);
+	flags |= TIMER_FUNC_INTERRUPT_HANDLER | TIMER_FUNC_ADVANCE_THREAD;
+	timer.Set(&its, NULL, flags, Clock__SleepTimeout, &sleep);
+	bool was_enabled = Interrupt::SetEnabled(false);
+	bool interrupted = false;
+	while ( !sleep.expired && !interrupted )
+		interrupted = !kthread_cond_wait_signal(&sleep.cond, NULL);
+	Interrupt::SetEnabled(was_enabled);
+	timer.Cancel();
+	timer.Detach();
+	return sleep.expired;
+}
 
-		LockClock();
+struct timespec Clock::SleepDelay(struct timespec duration)
+{
+	if ( timespec_le(duration, timespec_nul()) )
+		return timespec_nul();
 
-		if ( !start_advancement_set )
-			start_advancement = current_advancement,
-			start_advancement_set = true;
+	LockClock();
+	struct timespec start_advancement = current_advancement;
+	UnlockClock();
 
-		elapsed = timespec_sub(current_advancement, start_advancement);
+	if ( Clock__SleepOnTimer(this, duration, 0) )
+		return timespec_nul();
 
-		UnlockClock();
-	}
+	LockClock();
+	struct timespec elapsed = timespec_sub(current_advancement, start_advancement);
+	UnlockClock();
 
-	return timespec_nul();
+	if ( timespec_le(duration, elapsed) )
+		return timespec_nul();
+	return timespec_sub(duration, elapsed);
 }
 
-// TODO: We need some method for threads to sleep for real but still be
-//       interrupted by signals.
 struct timespec Clock::SleepUntil(struct timespec expiration)
 {
-	while ( true )
-	{
-		LockClock();
-		struct timespec now = current_time;
-		UnlockClock();
+	LockClock();
+	struct timespec now = current_time;
+	UnlockClock();
 
-		if ( timespec_le(expiration, now) )
-			break;
+	if ( timespec_le(expiration, now) )
+		return timespec_nul();
 
-		if ( Signal::IsPending() )
-			return timespec_sub(expiration, now);
+	if ( Clock__SleepOnTimer(this, expiration, TIMER_ABSOLUTE) )
+		return timespec_nul();
 
-		kthread_yield();
-	}
+	LockClock();
+	now = current_time;
+	UnlockClock();
 
-	return timespec_nul();
+	if ( timespec_le(expiration, now) )
+		return timespec_nul();
+	return timespec_sub(expiration, now);
 }
 
 void Clock::Advance(struct timespec duration)
@@ -296,6 +333,35 @@ void Clock::Advance(struct timespec duration)
 	UnlockClock();
 }
 
+// Determines how long until the next timer on this clock expires, such that
+// the timer hardware need not interrupt before then. Returns false if no timers
+// are pending.
+bool Clock::GetNextTimerDelay(struct timespec* delay)
+{
+	LockClock();
+
+	bool any = false;
+	if ( delay_timer )
+	{
+		*delay = delay_timer->value.it_value;
+		any = true;
+	}
+	if ( absolute_timer )
+	{
+		struct timespec left =
+			timespec_sub(absolute_timer->value.it_value, current_time);
+		if ( timespec_lt(left, timespec_nul()) )
+			left = timespec_nul();
+		if ( !any || timespec_lt(left, *delay) )
+			*delay = left;
+		any = true;
+	}
+
+	UnlockClock();
+
+	return any;
+}
+
 // Fire timers that wait for a certain amount of time.
 void Clock::TriggerDelay(struct timespec unaccounted) // Lock acquired.
 {
@@ -353,7 +419,8 @@ static void Clock__FireTimer(void* timer_ptr)
 	// do other important stuff.
 	timer->clock->LockClock();
 	if ( timer->num_firings_scheduled )
-		Worker::Schedule(Clock__FireTimer, timer_ptr);
+		Worker::Schedule(Clock__FireTimer, timer_ptr,
+		                 Worker::PRIORITY_HIGH);
 	// If this was the last event, we'll clear the firing bit and the advance
 	// thread now has the responsibility of creating worker thread jobs.
 	else
@@ -399,7 +466,8 @@ void Clock::FireTimer(Timer* timer)
 		else
 		{
 			timer->flags |= TIMER_FIRING;
-			Worker::Schedule(Clock__FireTimer, timer);
+			Worker::Schedule(Clock__FireTimer, timer,
+			                 Worker::PRIORITY_HIGH);
 		}
 	}
 
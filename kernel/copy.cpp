@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -27,6 +27,7 @@
 #include <sortix/kernel/copy.h>
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/kthread.h>
+#include <sortix/kernel/memorymanagement.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/segment.h>
 #include <sortix/kernel/string.h>
@@ -43,30 +44,15 @@ namespace Sortix {
 
 static bool IsInProcessAddressSpace(Process* process)
 {
-	addr_t current_address_space;
-#if defined(__i386__)
-	asm ( "mov %%cr3, %0" : "=r"(current_address_space) );
-#elif defined(__x86_64__)
-	asm ( "mov %%cr3, %0" : "=r"(current_address_space) );
-#else
-	#warning "You should set current_address_space for safety"
-	current_address_space = process->addrspace;
-#endif
-	return current_address_space == process->addrspace;
+	return Memory::GetAddressSpace() == process->addrspace;
 }
 
 static struct segment* FindSegment(Process* process, uintptr_t addr)
 {
-	for ( size_t i = 0; i < process->segments_used; i++ )
-	{
-		struct segment* segment = &process->segments[i];
-		if ( addr < segment->addr )
-			continue;
-		if ( segment->addr + segment->size <= addr )
-			continue;
-		return segment;
-	}
-	return NULL;
+	struct segment region;
+	region.addr = addr;
+	region.size = 1;
+	return FindOverlappingSegment(process, &region);
 }
 
 bool CopyToUser(void* userdst_ptr, const void* ksrc_ptr, size_t count)
@@ -385,11 +385,11 @@ ssize_t Descriptor::readdirents(ioctx_t* ctx,
 		size = SSIZE_MAX;
 	if ( size < sizeof(*dirent) )
 		return errno = EINVAL, -1;
+	// The offset is a cookie chosen by the filesystem that says where to resume
+	// listing the directory, which is only meaningful if it is zero or
+	// returned by the filesystem.
 	ScopedLock lock(&current_offset_lock);
-	ssize_t ret = vnode->readdirents(ctx, dirent, size, current_offset);
-	if ( 0 < ret )
-		current_offset++;
-	return ret;
+	return vnode->readdirents(ctx, dirent, size, &current_offset);
 }
 
 static bool IsSaneFlagModeCombination(int flags, mode_t /*mode*/)
@@ -790,7 +790,7 @@ Ref<Descriptor> Descriptor::fsm_mount(ioctx_t* ctx,
                                       const struct stat* rootst,
                                       int flags)
 {
-	if ( flags & ~(FSM_MOUNT_NOFOLLOW | FSM_MOUNT_NONBLOCK) )
+	if ( flags & ~(FSM_MOUNT_NOFOLLOW | FSM_MOUNT_NONBLOCK | FSM_MOUNT_TAGGED) )
 		return errno = EINVAL, Ref<Descriptor>(NULL);
 	int result_dflags = O_READ | O_WRITE;
 	if ( flags & FSM_MOUNT_NOFOLLOW ) result_dflags |= O_NONBLOCK;
@@ -851,4 +851,14 @@ int Descriptor::tcsetattr(ioctx_t* ctx, int actions, const struct termios* tio)
 	return vnode->tcsetattr(ctx, actions, tio);
 }
 
+addr_t Descriptor::mmap(ioctx_t* ctx, off_t off)
+{
+	return vnode->mmap(ctx, off);
+}
+
+int Descriptor::msync(ioctx_t* ctx, off_t off, size_t size)
+{
+	return vnode->msync(ctx, off, size);
+}
+
 } // namespace Sortix
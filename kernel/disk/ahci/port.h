@@ -67,6 +67,7 @@ public:
 	bool Initialize();
 	bool FinishInitialize();
 	void OnInterrupt();
+	void OnInterruptTimeout();
 
 private:
 	__attribute__((format(printf, 2, 3)))
@@ -104,7 +105,9 @@ private:
 	uint16_t cylinder_count;
 	uint16_t head_count;
 	uint16_t sector_count;
+	kthread_cond_t interrupt_cond;
 	volatile bool interrupt_signaled;
+	volatile bool interrupt_timed_out;
 	bool transfer_in_progress;
 	size_t transfer_size;
 	bool transfer_is_write;
@@ -29,12 +29,14 @@
 
 #include <sortix/kernel/addralloc.h>
 #include <sortix/kernel/clock.h>
+#include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/ioport.h>
 #include <sortix/kernel/kthread.h>
 #include <sortix/kernel/log.h>
 #include <sortix/kernel/memorymanagement.h>
 #include <sortix/kernel/signal.h>
 #include <sortix/kernel/time.h>
+#include <sortix/kernel/timer.h>
 
 #include "hba.h"
 #include "port.h"
@@ -72,6 +74,8 @@ Port::Port(Channel* channel, unsigned int port_index)
 	is_control_page_mapped = false;
 	is_dma_page_mapped = false;
 	interrupt_signaled = false;
+	interrupt_timed_out = false;
+	interrupt_cond = KTHREAD_COND_INITIALIZER;
 	transfer_in_progress = false;
 	control_physical_frame = 0;
 	dma_physical_frame = 0;
@@ -734,27 +738,42 @@ void Port::PrepareAwaitInterrupt()
 	interrupt_signaled = false;
 }
 
+static void Port__OnInterruptTimeout(Clock* /*clock*/, Timer* /*timer*/,
+                                     void* user)
+{
+	((Port*) user)->OnInterruptTimeout();
+}
+
+void Port::OnInterruptTimeout()
+{
+	interrupt_timed_out = true;
+	kthread_cond_broadcast(&interrupt_cond);
+}
+
 bool Port::AwaitInterrupt(unsigned int msecs)
 {
-	struct timespec timeout = timespec_make(msecs / 1000, (msecs % 1000) * 1000000L);
-	Clock* clock = Time::GetClock(CLOCK_BOOT);
-	struct timespec begun;
-	clock->Get(&begun, NULL);
-	while ( true )
-	{
-		struct timespec now;
-		clock->Get(&now, NULL);
-		if ( interrupt_signaled )
-			return true;
-		struct timespec elapsed = timespec_sub(now, begun);
-		if ( timespec_le(timeout, elapsed) )
-			return errno = ETIMEDOUT, false;
-		// TODO: Can't safely back out here unless the pending operation is
-		//       is properly cancelled.
-		//if ( Signal::IsPending() )
-		//	return errno = EINTR, false;
-		kthread_yield();
-	}
+	struct itimerspec timeout;
+	timeout.it_interval = timespec_nul();
+	timeout.it_value = timespec_make(msecs / 1000, (msecs % 1000) * 1000000L);
+	Timer timer;
+	timer.Attach(Time::GetClock(CLOCK_BOOT));
+	interrupt_timed_out = false;
+	int timer_flags = TIMER_FUNC_INTERRUPT_HANDLER | TIMER_FUNC_ADVANCE_THREAD;
+	timer.Set(&timeout, NULL, timer_flags, Port__OnInterruptTimeout, this);
+	// Sleep with interrupts disabled such that the interrupt can't arrive
+	// between checking for it and going to sleep.
+	bool was_enabled = Interrupt::SetEnabled(false);
+	// TODO: Can't safely back out here unless the pending operation is
+	//       is properly cancelled.
+	while ( !interrupt_signaled && !interrupt_timed_out )
+		kthread_cond_wait(&interrupt_cond, NULL);
+	bool signaled = interrupt_signaled;
+	Interrupt::SetEnabled(was_enabled);
+	timer.Cancel();
+	timer.Detach();
+	if ( !signaled )
+		return errno = ETIMEDOUT, false;
+	return true;
 }
 
 void Port::OnInterrupt()
@@ -771,7 +790,7 @@ void Port::OnInterrupt()
 	if ( !interrupt_signaled )
 	{
 		interrupt_signaled = true;
-		// TODO: Priority schedule the blocking thread now.
+		kthread_cond_broadcast(&interrupt_cond);
 	}
 }
 
@@ -25,17 +25,31 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <sortix/mman.h>
 #include <sortix/stat.h>
 
+#include <sortix/kernel/addralloc.h>
 #include <sortix/kernel/harddisk.h>
 #include <sortix/kernel/inode.h>
+#include <sortix/kernel/ioctx.h>
 #include <sortix/kernel/kthread.h>
 #include <sortix/kernel/log.h>
+#include <sortix/kernel/memorymanagement.h>
 
 #include "node.h"
 
 namespace Sortix {
 
+static size_t PortNode__Shrink(void* ctx, size_t pages)
+{
+	return ((PortNode*) ctx)->Shrink(pages);
+}
+
+static size_t PortNode__WriteBack(void* ctx, size_t pages)
+{
+	return ((PortNode*) ctx)->WriteBack(pages);
+}
+
 PortNode::PortNode(Harddisk* harddisk, uid_t owner, gid_t group, mode_t mode,
                    dev_t dev, ino_t /*ino*/)
 {
@@ -50,15 +64,152 @@ PortNode::PortNode(Harddisk* harddisk, uid_t owner, gid_t group, mode_t mode,
 	this->stat_mode = (mode & S_SETABLE) | this->type;
 	this->stat_blksize = harddisk->GetBlockSize();
 	this->stat_blocks = harddisk->GetBlockCount();
+	this->page_lock = KTHREAD_MUTEX_INITIALIZER;
+	for ( size_t i = 0; i < PAGE_BUCKETS; i++ )
+		this->pages[i] = NULL;
+	this->pages_count = 0;
+	this->shrinker.shrink = PortNode__Shrink;
+	this->shrinker.writeback = PortNode__WriteBack;
+	this->shrinker.context = this;
+	Pressure::RegisterShrinker(&this->shrinker);
 }
 
 PortNode::~PortNode()
 {
+	Pressure::UnregisterShrinker(&shrinker);
 	// TODO: Ownership of `port'.
+	for ( size_t i = 0; i < PAGE_BUCKETS; i++ )
+	{
+		while ( PortPage* page = pages[i] )
+		{
+			pages[i] = page->next;
+			DeletePage(page);
+		}
+	}
+}
+
+void PortNode::DeletePage(PortPage* page)
+{
+	Memory::Unmap(page->addralloc.from);
+	Memory::InvalidatePage(page->addralloc.from);
+	FreeKernelAddress(&page->addralloc);
+	Page::Put(page->frame, PAGE_USAGE_FILESYSTEM_CACHE);
+	delete page;
+}
+
+// Clean pages no longer mapped by any process are dropped, as they are read
+// again from the disk if mapped again. The dirty pages are left for the
+// background reclaim to write back, as writing to the disk takes its locks.
+size_t PortNode::Shrink(size_t count)
+{
+	if ( !kthread_mutex_trylock(&page_lock) )
+		return 0;
+	size_t freed = 0;
+	for ( size_t i = 0; freed < count && i < PAGE_BUCKETS; i++ )
+	{
+		for ( PortPage** link = &pages[i]; freed < count && *link; )
+		{
+			PortPage* page = *link;
+			if ( page->dirty || Page::IsShared(page->frame) )
+			{
+				link = &page->next;
+				continue;
+			}
+			*link = page->next;
+			DeletePage(page);
+			pages_count--;
+			freed++;
+		}
+	}
+	kthread_mutex_unlock(&page_lock);
+	return freed;
+}
+
+// Writes back the dirty pages no longer mapped by any process, such that they
+// can be dropped when shrinking.
+size_t PortNode::WriteBack(size_t count)
+{
+	ScopedLock lock(&page_lock);
+	size_t written = 0;
+	for ( size_t i = 0; written < count && i < PAGE_BUCKETS; i++ )
+	{
+		for ( PortPage* page = pages[i]; written < count && page; page = page->next )
+		{
+			if ( !page->dirty || Page::IsShared(page->frame) )
+				continue;
+			if ( !CleanPage(page) )
+				return written;
+			written++;
+		}
+	}
+	return written;
+}
+
+PortPage* PortNode::FindPage(off_t off)
+{
+	// page_lock is held at this point.
+	size_t bucket = (size_t) (off / Page::Size()) % PAGE_BUCKETS;
+	for ( PortPage* page = pages[bucket]; page; page = page->next )
+		if ( page->offset == off )
+			return page;
+	return NULL;
+}
+
+bool PortNode::ReadPage(PortPage* page)
+{
+	ioctx_t ctx; SetupKernelIOCtx(&ctx);
+	unsigned char* data = (unsigned char*) page->addralloc.from;
+	off_t left = harddisk->GetSize() - page->offset;
+	size_t amount = left < (off_t) Page::Size() ? (size_t) left : Page::Size();
+	memset(data + amount, 0, Page::Size() - amount);
+	for ( size_t sofar = 0; sofar < amount; )
+	{
+		off_t at = page->offset + (off_t) sofar;
+		ssize_t done = harddisk->pread(&ctx, data + sofar, amount - sofar, at);
+		if ( done < 0 )
+			return false;
+		if ( done == 0 )
+			return errno = EIO, false;
+		sofar += done;
+	}
+	return true;
+}
+
+bool PortNode::WritePage(PortPage* page)
+{
+	ioctx_t ctx; SetupKernelIOCtx(&ctx);
+	const unsigned char* data = (const unsigned char*) page->addralloc.from;
+	off_t left = harddisk->GetSize() - page->offset;
+	size_t amount = left < (off_t) Page::Size() ? (size_t) left : Page::Size();
+	for ( size_t sofar = 0; sofar < amount; )
+	{
+		off_t at = page->offset + (off_t) sofar;
+		ssize_t done = harddisk->pwrite(&ctx, data + sofar, amount - sofar, at);
+		if ( done < 0 )
+			return false;
+		if ( done == 0 )
+			return errno = EIO, false;
+		sofar += done;
+	}
+	return true;
+}
+
+// The page stays dirty while it is mapped, as it may be modified again.
+bool PortNode::CleanPage(PortPage* page)
+{
+	if ( !WritePage(page) )
+		return false;
+	page->dirty = Page::IsShared(page->frame);
+	return true;
 }
 
 int PortNode::sync(ioctx_t* ctx)
 {
+	ScopedLock lock(&page_lock);
+	for ( size_t i = 0; i < PAGE_BUCKETS; i++ )
+		for ( PortPage* page = pages[i]; page; page = page->next )
+			if ( page->dirty && !CleanPage(page) )
+				return -1;
 	return harddisk->sync(ctx);
 }
 
@@ -83,15 +234,176 @@ off_t PortNode::lseek(ioctx_t* /*ctx*/, off_t offset, int whence)
 	return errno = EINVAL, -1;
 }
 
+// The pages aren't locked while copying to or from the caller, as the caller's
+// buffer might be a memory mapping of this disk, whose page faults would lock
+// the pages again. The disk is likewise accessed through a bounce buffer, as
+// the driver copies to the caller while holding its own locks.
 ssize_t PortNode::pread(ioctx_t* ctx, uint8_t* buf, size_t count, off_t off)
 {
-	return harddisk->pread(ctx, (unsigned char*) buf, count, off);
+	off_t size = harddisk->GetSize();
+	if ( off < 0 )
+		return errno = EINVAL, -1;
+	if ( (size_t) SSIZE_MAX < count )
+		count = (size_t) SSIZE_MAX;
+	uint8_t* bounce = new uint8_t[Page::Size()];
+	if ( !bounce )
+		return -1;
+	ioctx_t kctx; SetupKernelIOCtx(&kctx);
+	size_t sofar = 0;
+	while ( sofar < count )
+	{
+		off_t at = off + (off_t) sofar;
+		if ( size <= at )
+			break;
+		size_t page_off = (size_t) (at % Page::Size());
+		size_t amount = Page::Size() - page_off;
+		if ( count - sofar < amount )
+			amount = count - sofar;
+		if ( (uintmax_t) (size - at) < (uintmax_t) amount )
+			amount = (size_t) (size - at);
+		ssize_t done = (ssize_t) amount;
+		kthread_mutex_lock(&page_lock);
+		// The memory mapped pages may have been modified, so they're read
+		// instead of the disk.
+		if ( PortPage* page = FindPage(at - (off_t) page_off) )
+		{
+			const uint8_t* data = (const uint8_t*) page->addralloc.from;
+			memcpy(bounce, data + page_off, amount);
+		}
+		else
+			done = harddisk->pread(&kctx, bounce, amount, at);
+		kthread_mutex_unlock(&page_lock);
+		if ( 0 < done && !ctx->copy_to_dest(buf + sofar, bounce, done) )
+			done = -1;
+		if ( done < 0 )
+			return delete[] bounce, sofar ? (ssize_t) sofar : -1;
+		if ( done == 0 )
+			break;
+		sofar += done;
+	}
+	delete[] bounce;
+	return (ssize_t) sofar;
 }
 
 ssize_t PortNode::pwrite(ioctx_t* ctx, const uint8_t* buf, size_t count,
                         off_t off)
 {
-	return harddisk->pwrite(ctx, (const unsigned char*) buf, count, off);
+	off_t size = harddisk->GetSize();
+	if ( off < 0 )
+		return errno = EINVAL, -1;
+	if ( (size_t) SSIZE_MAX < count )
+		count = (size_t) SSIZE_MAX;
+	uint8_t* bounce = new uint8_t[Page::Size()];
+	if ( !bounce )
+		return -1;
+	ioctx_t kctx; SetupKernelIOCtx(&kctx);
+	size_t sofar = 0;
+	while ( sofar < count )
+	{
+		off_t at = off + (off_t) sofar;
+		if ( size <= at )
+			break;
+		size_t page_off = (size_t) (at % Page::Size());
+		size_t amount = Page::Size() - page_off;
+		if ( count - sofar < amount )
+			amount = count - sofar;
+		if ( (uintmax_t) (size - at) < (uintmax_t) amount )
+			amount = (size_t) (size - at);
+		if ( !ctx->copy_from_src(bounce, buf + sofar, amount) )
+			return delete[] bounce, sofar ? (ssize_t) sofar : -1;
+		ssize_t done = (ssize_t) amount;
+		kthread_mutex_lock(&page_lock);
+		// The memory mapped pages are updated and then written to the disk.
+		if ( PortPage* page = FindPage(at - (off_t) page_off) )
+		{
+			uint8_t* data = (uint8_t*) page->addralloc.from;
+			memcpy(data + page_off, bounce, amount);
+			if ( !CleanPage(page) )
+				done = -1;
+		}
+		else
+			done = harddisk->pwrite(&kctx, bounce, amount, at);
+		kthread_mutex_unlock(&page_lock);
+		if ( done < 0 )
+			return delete[] bounce, sofar ? (ssize_t) sofar : -1;
+		if ( done == 0 )
+			break;
+		sofar += done;
+	}
+	delete[] bounce;
+	return (ssize_t) sofar;
+}
+
+addr_t PortNode::mmap(ioctx_t* /*ctx*/, off_t off)
+{
+	ScopedLock lock(&page_lock);
+	if ( off < 0 || off % Page::Size() )
+		return errno = EINVAL, 0;
+	if ( harddisk->GetSize() <= off )
+		return errno = ENXIO, 0;
+	PortPage* page = FindPage(off);
+	if ( !page )
+	{
+		if ( !(page = new PortPage) )
+			return 0;
+		page->offset = off;
+		page->dirty = false;
+		if ( !(page->frame = Page::Get(PAGE_USAGE_FILESYSTEM_CACHE)) )
+			return delete page, 0;
+		if ( !AllocateKernelAddress(&page->addralloc, Page::Size()) )
+		{
+			Page::Put(page->frame, PAGE_USAGE_FILESYSTEM_CACHE);
+			return delete page, 0;
+		}
+		int prot = PROT_KREAD | PROT_KWRITE;
+		if ( !Memory::Map(page->frame, page->addralloc.from, prot) )
+		{
+			FreeKernelAddress(&page->addralloc);
+			Page::Put(page->frame, PAGE_USAGE_FILESYSTEM_CACHE);
+			return delete page, 0;
+		}
+		Memory::InvalidatePage(page->addralloc.from);
+		if ( !ReadPage(page) )
+		{
+			Memory::Unmap(page->addralloc.from);
+			Memory::InvalidatePage(page->addralloc.from);
+			FreeKernelAddress(&page->addralloc);
+			Page::Put(page->frame, PAGE_USAGE_FILESYSTEM_CACHE);
+			return delete page, 0;
+		}
+		size_t bucket = (size_t) (off / Page::Size()) % PAGE_BUCKETS;
+		page->next = pages[bucket];
+		pages[bucket] = page;
+		pages_count++;
+	}
+	// Whether the mapping is shared and writable isn't known here, so the page
+	// is assumed to be modified through it.
+	page->dirty = true;
+	Page::Lock();
+	Page::ShareUnlocked(page->frame);
+	Page::Unlock();
+	return page->frame;
+}
+
+int PortNode::msync(ioctx_t* ctx, off_t off, size_t size)
+{
+	ScopedLock lock(&page_lock);
+	if ( off < 0 )
+		return errno = EINVAL, -1;
+	off_t end = off + (off_t) size;
+	if ( (uintmax_t) (OFF_MAX - off) < (uintmax_t) size )
+		end = OFF_MAX;
+	for ( size_t i = 0; i < PAGE_BUCKETS; i++ )
+	{
+		for ( PortPage* page = pages[i]; page; page = page->next )
+		{
+			if ( page->offset + (off_t) Page::Size() <= off || end <= page->offset )
+				continue;
+			if ( page->dirty && !CleanPage(page) )
+				return -1;
+		}
+	}
+	return harddisk->sync(ctx);
 }
 
 ssize_t PortNode::tcgetblob(ioctx_t* ctx, const char* name, void* buffer,
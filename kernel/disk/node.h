@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -24,13 +24,27 @@
 
 #include <stdint.h>
 
+#include <sortix/kernel/addralloc.h>
 #include <sortix/kernel/inode.h>
 #include <sortix/kernel/kthread.h>
+#include <sortix/kernel/pressure.h>
 
 namespace Sortix {
 
 class Harddisk;
 
+// A page of the disk that is memory mapped, which reads and writes go through
+// so they see the same contents as the memory mappings. The page is dirty if it
+// may have been modified through a memory mapping since it was written back.
+struct PortPage
+{
+	PortPage* next;
+	off_t offset;
+	addr_t frame;
+	addralloc_t addralloc;
+	bool dirty;
+};
+
 class PortNode : public AbstractInode
 {
 public:
@@ -42,9 +56,25 @@ public:
 	virtual ssize_t pread(ioctx_t* ctx, uint8_t* buf, size_t count, off_t off);
 	virtual ssize_t pwrite(ioctx_t* ctx, const uint8_t* buf, size_t count, off_t off);
 	virtual ssize_t tcgetblob(ioctx_t* ctx, const char* name, void* buffer, size_t count);
+	virtual addr_t mmap(ioctx_t* ctx, off_t off);
+	virtual int msync(ioctx_t* ctx, off_t off, size_t size);
+	size_t Shrink(size_t pages);
+	size_t WriteBack(size_t pages);
+
+private:
+	PortPage* FindPage(off_t off);
+	void DeletePage(PortPage* page);
+	bool ReadPage(PortPage* page);
+	bool WritePage(PortPage* page);
+	bool CleanPage(PortPage* page);
 
 private:
+	static const size_t PAGE_BUCKETS = 64;
+	kthread_mutex_t page_lock;
+	PortPage* pages[PAGE_BUCKETS];
+	size_t pages_count;
 	Harddisk* harddisk;
+	struct shrinker shrinker;
 
 };
 
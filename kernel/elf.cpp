@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -32,11 +32,15 @@
 #include <__/wordsize.h>
 
 #include <sortix/mman.h>
+#include <sortix/stat.h>
 
+#include <sortix/kernel/descriptor.h>
 #include <sortix/kernel/elf.h>
+#include <sortix/kernel/ioctx.h>
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/memorymanagement.h>
 #include <sortix/kernel/process.h>
+#include <sortix/kernel/refcount.h>
 #include <sortix/kernel/segment.h>
 
 namespace Sortix {
@@ -50,7 +54,36 @@ static bool is_power_of_two(uintptr_t value)
 	return false;
 }
 
-uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
+static ssize_t ReadAll(Ref<Descriptor> desc, ioctx_t* ctx, void* buf_ptr,
+                       size_t count, off_t offset)
+{
+	unsigned char* buf = (unsigned char*) buf_ptr;
+	size_t sofar = 0;
+	while ( sofar < count )
+	{
+		ssize_t amount = desc->pread(ctx, buf + sofar, count - sofar,
+		                             offset + (off_t) sofar);
+		if ( amount < 0 )
+			return -1;
+		if ( amount == 0 )
+			break;
+		sofar += amount;
+	}
+	return (ssize_t) sofar;
+}
+
+static bool ReadExactly(Ref<Descriptor> desc, ioctx_t* ctx, void* buf,
+                        size_t count, off_t offset)
+{
+	ssize_t amount = ReadAll(desc, ctx, buf, count, offset);
+	if ( amount < 0 )
+		return false;
+	if ( (size_t) amount != count )
+		return errno = EINVAL, false;
+	return true;
+}
+
+uintptr_t Load(Ref<Descriptor> desc, Auxiliary* aux)
 {
 	memset(aux, 0, sizeof(*aux));
 
@@ -61,9 +94,26 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 	Memory::GetUserVirtualArea(&userspace_addr, &userspace_size);
 	uintptr_t userspace_end = userspace_addr + userspace_size;
 
-	const unsigned char* file = (const unsigned char*) file_ptr;
+	ioctx_t ctx; SetupKernelIOCtx(&ctx);
 
-	if ( file_size < EI_NIDENT )
+	struct stat st;
+	if ( desc->stat(&ctx, &st) < 0 )
+		return 0;
+	if ( st.st_size < 0 )
+		return errno = EINVAL, 0;
+	if ( (uintmax_t) SIZE_MAX < (uintmax_t) st.st_size )
+		return errno = EFBIG, 0;
+	size_t file_size = (size_t) st.st_size;
+
+	Elf_Ehdr header_storage;
+	const unsigned char* file = (const unsigned char*) &header_storage;
+	ssize_t header_amount = ReadAll(desc, &ctx, &header_storage,
+	                                sizeof(header_storage), 0);
+	if ( header_amount < 0 )
+		return 0;
+	size_t header_size = (size_t) header_amount;
+
+	if ( header_size < EI_NIDENT )
 		return errno = ENOEXEC, 0;
 
 	if ( memcmp(file, ELFMAG, SELFMAG) != 0 )
@@ -98,11 +148,9 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 	if ( file[EI_ABIVERSION] != 0 )
 		return errno = EINVAL, 0;
 
-	if ( file_size < sizeof(Elf_Ehdr) )
+	if ( header_size < sizeof(Elf_Ehdr) )
 		return errno = EINVAL, 0;
-	if ( (uintptr_t) file & (alignof(Elf_Ehdr) - 1) )
-		return errno = EINVAL, 0;
-	const Elf_Ehdr* header = (const Elf_Ehdr*) file;
+	const Elf_Ehdr* header = &header_storage;
 
 	if ( header->e_ehsize < sizeof(Elf_Ehdr) )
 		return errno = EINVAL, 0;
@@ -138,6 +186,17 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 	if ( header->e_shentsize < sizeof(Elf_Shdr) )
 		return errno = EINVAL, 0;
 
+	// Map the program segments directly from the file if it provides its pages,
+	// such that the text is shared with the other processes running the program
+	// and the pages are only read when first used. Otherwise the contents are
+	// copied into anonymous memory.
+	addr_t probe = desc->mmap(&ctx, 0);
+	if ( probe )
+		Page::Put(probe, PAGE_USAGE_USER_SPACE);
+	else if ( errno != ENODEV )
+		return 0;
+	bool file_mappable = probe;
+
 	process->ResetForExecute();
 
 	if ( header->e_phnum == (Elf_Half) -1 )
@@ -151,9 +210,11 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 		if ( max_phs <= i )
 			return errno = EINVAL, 0;
 		size_t pheader_offset = header->e_phoff + i * header->e_phentsize;
-		if ( (uintptr_t) (file + pheader_offset) & (alignof(Elf_Phdr) - 1) )
-			return errno = EINVAL, 0;
-		Elf_Phdr* pheader = (Elf_Phdr*) (file + pheader_offset);
+		Elf_Phdr pheader_storage;
+		if ( !ReadExactly(desc, &ctx, &pheader_storage, sizeof(pheader_storage),
+		                  (off_t) pheader_offset) )
+			return 0;
+		Elf_Phdr* pheader = &pheader_storage;
 
 		switch ( pheader->p_type )
 		{
@@ -184,19 +245,26 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 
 		if ( pheader->p_type == PT_NOTE )
 		{
+			if ( pheader->p_offset & (alignof(uint32_t) - 1) )
+				return errno = EINVAL, 0;
+			unsigned char* notes = new unsigned char[pheader->p_filesz];
+			if ( !notes )
+				return 0;
+			if ( !ReadExactly(desc, &ctx, notes, pheader->p_filesz,
+			                  (off_t) pheader->p_offset) )
+				return delete[] notes, 0;
 			size_t notes_offset = 0;
 			while ( notes_offset < pheader->p_filesz )
 			{
 				size_t available = pheader->p_filesz - notes_offset;
 				size_t note_header_size = 3 * sizeof(uint32_t);
 				if ( available < note_header_size )
-					return errno = EINVAL, 0;
+					return delete[] notes, errno = EINVAL, 0;
 				available -= note_header_size;
-				size_t file_offset = pheader->p_offset + notes_offset;
-				if ( ((uintptr_t) file + file_offset) & (alignof(uint32_t) - 1) )
-					return errno = EINVAL, 0;
+				if ( notes_offset & (alignof(uint32_t) - 1) )
+					return delete[] notes, errno = EINVAL, 0;
 
-				const unsigned char* note = file + file_offset;
+				const unsigned char* note = notes + notes_offset;
 				uint32_t* note_header = (uint32_t*) note;
 				uint32_t namesz = note_header[0];
 				uint32_t descsz = note_header[1];
@@ -204,26 +272,26 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 				uint32_t namesz_aligned = -(-namesz & ~(sizeof(uint32_t) - 1));
 				uint32_t descsz_aligned = -(-descsz & ~(sizeof(uint32_t) - 1));
 				if ( available < namesz_aligned )
-					return errno = EINVAL, 0;
+					return delete[] notes, errno = EINVAL, 0;
 				available -= namesz_aligned;
 				if ( available < descsz_aligned )
-					return errno = EINVAL, 0;
+					return delete[] notes, errno = EINVAL, 0;
 				available -= descsz_aligned;
 				(void) available;
 				notes_offset += note_header_size + namesz_aligned + descsz_aligned;
 
 				const char* name = (const char*) (note + note_header_size);
 				if ( strnlen(name, namesz_aligned) == namesz_aligned )
-					return errno = EINVAL, 0;
-				const unsigned char* desc = note + note_header_size + namesz_aligned;
-				const uint32_t* desc_32bits = (const uint32_t*) desc;
+					return delete[] notes, errno = EINVAL, 0;
+				const unsigned char* note_desc = note + note_header_size + namesz_aligned;
+				const uint32_t* desc_32bits = (const uint32_t*) note_desc;
 
 				if ( strcmp(name, ELF_NOTE_SORTIX) == 0 )
 				{
 					if ( type == ELF_NOTE_SORTIX_UTHREAD_SIZE )
 					{
 						if ( descsz_aligned != 2 * sizeof(size_t) )
-							return errno = EINVAL, 0;
+							return delete[] notes, errno = EINVAL, 0;
 #if __WORDSIZE == 32
 						aux->uthread_size = desc_32bits[0];
 						aux->uthread_align = desc_32bits[1];
@@ -241,10 +309,11 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 #error "You need to correctly read the uthread note"
 #endif
 						if ( !is_power_of_two(aux->uthread_align) )
-							return errno = EINVAL, 0;
+							return delete[] notes, errno = EINVAL, 0;
 					}
 				}
 			}
+			delete[] notes;
 			continue;
 		}
 
@@ -276,6 +345,25 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 			uintptr_t map_end = Page::AlignUp(pheader->p_vaddr + pheader->p_memsz);
 			size_t map_size = map_end - map_start;
 
+			// The whole pages of file data are mapped from the file, while the
+			// page containing the end of the file data and the pages beyond it
+			// are anonymous memory, as the rest of that page must be zero.
+			uintptr_t file_end = pheader->p_vaddr + pheader->p_filesz;
+			uintptr_t file_map_end = map_start;
+			if ( file_mappable && pheader->p_filesz &&
+			     Page::Size() <= pheader->p_align )
+			{
+				if ( pheader->p_filesz < pheader->p_memsz )
+					file_map_end = Page::AlignDown(file_end);
+				else
+					file_map_end = Page::AlignUp(file_end);
+				if ( file_map_end < map_start )
+					file_map_end = map_start;
+			}
+			size_t file_map_size = file_map_end - map_start;
+			off_t file_map_offset = (off_t) pheader->p_offset -
+			                        (off_t) (pheader->p_vaddr - map_start);
+
 			struct segment segment;
 			segment.addr =  map_start;
 			segment.size = map_size;
@@ -293,25 +381,53 @@ uintptr_t Load(const void* file_ptr, size_t file_size, Auxiliary* aux)
 				return errno = EINVAL, 0;
 			}
 
-			if ( !Memory::MapRange(segment.addr, segment.size, kprot, PAGE_USAGE_USER_SPACE) )
+			if ( file_map_size &&
+			     !Memory::MapFileMemory(process, map_start, file_map_size, prot,
+			                            0, desc, file_map_offset) )
 			{
 				kthread_mutex_unlock(&process->segment_lock);
 				kthread_mutex_unlock(&process->segment_write_lock);
 				return errno = EINVAL, 0;
 			}
 
-			if ( !AddSegment(process, &segment) )
+			if ( file_map_end == map_end )
+			{
+				kthread_mutex_unlock(&process->segment_lock);
+				kthread_mutex_unlock(&process->segment_write_lock);
+				continue;
+			}
+
+			if ( !Memory::MapMemory(process, file_map_end,
+			                        map_end - file_map_end, kprot, false) )
 			{
-				Memory::UnmapRange(segment.addr, segment.size, PAGE_USAGE_USER_SPACE);
 				kthread_mutex_unlock(&process->segment_lock);
 				kthread_mutex_unlock(&process->segment_write_lock);
 				return errno = EINVAL, 0;
 			}
 
-			memset((void*) segment.addr, 0, segment.size);
-			memcpy((void*) pheader->p_vaddr, file + pheader->p_offset, pheader->p_filesz);
-			Memory::ProtectMemory(CurrentProcess(), segment.addr, segment.size, prot);
+			// Reading the file may copy to user-space which requires the
+			// segment lock to be free.
+			kthread_mutex_unlock(&process->segment_lock);
 
+			uintptr_t copy_start = file_map_end;
+			if ( copy_start < pheader->p_vaddr )
+				copy_start = pheader->p_vaddr;
+			if ( copy_start < file_end )
+			{
+				size_t copy_size = file_end - copy_start;
+				off_t copy_offset = (off_t) pheader->p_offset +
+				                    (off_t) (copy_start - pheader->p_vaddr);
+				if ( !ReadExactly(desc, &ctx, (void*) copy_start, copy_size,
+				                  copy_offset) )
+				{
+					kthread_mutex_unlock(&process->segment_write_lock);
+					return 0;
+				}
+			}
+
+			kthread_mutex_lock(&process->segment_lock);
+			Memory::ProtectMemory(CurrentProcess(), file_map_end,
+			                      map_end - file_map_end, prot);
 			kthread_mutex_unlock(&process->segment_lock);
 			kthread_mutex_unlock(&process->segment_write_lock);
 		}
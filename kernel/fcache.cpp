@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -34,6 +34,7 @@
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/kthread.h>
 #include <sortix/kernel/memorymanagement.h>
+#include <sortix/kernel/pressure.h>
 
 namespace Sortix {
 
@@ -73,6 +74,11 @@ static size_t AreaOfBlockId(uintptr_t blockid, size_t blocks_per_area)
 	return (size_t) (blockid / blocks_per_area);
 }
 
+static size_t BlockCache__Shrink(void* ctx, size_t pages)
+{
+	return ((BlockCache*) ctx)->Shrink(pages);
+}
+
 BlockCache::BlockCache()
 {
 	areas = NULL;
@@ -85,19 +91,30 @@ BlockCache::BlockCache()
 	mru_block = NULL;
 	lru_block = NULL;
 	unused_block = NULL;
+	nonpresent_block = NULL;
 	bcache_mutex = KTHREAD_MUTEX_INITIALIZER;
+	shrinker.shrink = BlockCache__Shrink;
+	shrinker.writeback = NULL;
+	shrinker.context = this;
+	Pressure::RegisterShrinker(&shrinker);
 }
 
 BlockCache::~BlockCache()
 {
+	Pressure::UnregisterShrinker(&shrinker);
 	// TODO: Clean up everything here!
 }
 
 BlockCacheBlock* BlockCache::AcquireBlock()
 {
 	ScopedLock lock(&bcache_mutex);
-	if ( !unused_block && !AddArea() )
-		return NULL;
+	if ( !unused_block )
+	{
+		if ( !nonpresent_block && !AddArea() )
+			return NULL;
+		if ( !PopulateBlock(nonpresent_block) )
+			return NULL;
+	}
 	BlockCacheBlock* ret = unused_block;
 	assert(ret);
 	unused_block_count--;
@@ -117,29 +134,91 @@ void BlockCache::ReleaseBlock(BlockCacheBlock* block)
 	assert(block->information & BCACHE_PRESENT);
 	assert(block->information & BCACHE_USED);
 	blocks_used--;
-	if ( blocks_per_area < unused_block_count )
+	UnlinkBlock(block);
+	block->information &= ~BCACHE_USED;
+	// Memory mappings of the block keep using its frame, so the block needs a
+	// new frame before it is reused for another file.
+	uint8_t* block_data = BlockDataUnlocked(block);
+	addr_t block_frame;
+	if ( (Memory::LookUp((addr_t) block_data, &block_frame, NULL) &&
+	      Page::IsShared(block_frame)) ||
+	     blocks_per_area < unused_block_count )
 	{
-		blocks_allocated--;
-		uint8_t* block_data = BlockDataUnlocked(block);
-		addr_t block_data_addr = Memory::Unmap((addr_t) block_data);
-		Page::Put(block_data_addr, PAGE_USAGE_FILESYSTEM_CACHE);
-		// TODO: We leak this block's meta information here. Rather, we should
-		// put this block into a list of non-present blocks so we can reuse it
-		// later and reallocate a physical frame for it - then we will just
-		// reuse the block's meta information.
-		block->information &= ~(BCACHE_USED | BCACHE_PRESENT);
+		DepopulateBlock(block);
 		return;
 	}
-	UnlinkBlock(block);
 	unused_block_count++;
 	if ( unused_block )
 		unused_block->prev_block = block;
 	block->next_block = unused_block;
 	block->prev_block = NULL;
-	block->information &= ~BCACHE_USED;
 	unused_block = block;
 }
 
+// Gives the first block without a frame a new frame and makes it unused.
+bool BlockCache::PopulateBlock(BlockCacheBlock* block)
+{
+	assert(block == nonpresent_block);
+	assert(!(block->information & BCACHE_PRESENT));
+	addr_t frame = Page::Get(PAGE_USAGE_FILESYSTEM_CACHE);
+	if ( !frame )
+		return false;
+	uint8_t* block_data = BlockDataUnlocked(block);
+	if ( !Memory::Map(frame, (addr_t) block_data, PROT_KREAD | PROT_KWRITE) )
+	{
+		Page::Put(frame, PAGE_USAGE_FILESYSTEM_CACHE);
+		return false;
+	}
+	Memory::InvalidatePage((addr_t) block_data);
+	nonpresent_block = block->next_block;
+	blocks_allocated++;
+	block->information |= BCACHE_PRESENT;
+	unused_block_count++;
+	if ( unused_block )
+		unused_block->prev_block = block;
+	block->next_block = unused_block;
+	block->prev_block = NULL;
+	unused_block = block;
+	return true;
+}
+
+// Gives back the frame of the block that isn't in any list, and keeps the block
+// for reuse once it gets a new frame.
+void BlockCache::DepopulateBlock(BlockCacheBlock* block)
+{
+	assert(block->information & BCACHE_PRESENT);
+	assert(!(block->information & BCACHE_USED));
+	uint8_t* block_data = BlockDataUnlocked(block);
+	addr_t block_frame = Memory::Unmap((addr_t) block_data);
+	Memory::InvalidatePage((addr_t) block_data);
+	Page::Put(block_frame, PAGE_USAGE_FILESYSTEM_CACHE);
+	blocks_allocated--;
+	block->information &= ~(BCACHE_PRESENT | BCACHE_MODIFIED);
+	block->prev_block = NULL;
+	block->next_block = nonpresent_block;
+	nonpresent_block = block;
+}
+
+// The blocks in use are the only copy of the files in the kernel filesystem, so
+// only the frames of the unused blocks can be given back.
+size_t BlockCache::Shrink(size_t pages)
+{
+	if ( !kthread_mutex_trylock(&bcache_mutex) )
+		return 0;
+	size_t freed = 0;
+	while ( freed < pages && unused_block )
+	{
+		BlockCacheBlock* block = unused_block;
+		if ( (unused_block = block->next_block) )
+			unused_block->prev_block = NULL;
+		unused_block_count--;
+		DepopulateBlock(block);
+		freed++;
+	}
+	kthread_mutex_unlock(&bcache_mutex);
+	return freed;
+}
+
 uint8_t* BlockCache::BlockData(BlockCacheBlock* block)
 {
 	ScopedLock lock(&bcache_mutex);
@@ -154,6 +233,22 @@ uint8_t* BlockCache::BlockDataUnlocked(BlockCacheBlock* block)
 	return areas[area_num].data + area_off * Page::Size();
 }
 
+// Returns the physical frame of the block with a reference to it held on behalf
+// of a memory mapping, which is released with Page::Put.
+addr_t BlockCache::ShareBlockFrame(BlockCacheBlock* block)
+{
+	ScopedLock lock(&bcache_mutex);
+	addr_t frame;
+	if ( !Memory::LookUp((addr_t) BlockDataUnlocked(block), &frame, NULL) )
+		return errno = EFAULT, 0;
+	Page::Lock();
+	Page::ShareUnlocked(frame);
+	Page::Unlock();
+	UnlinkBlock(block);
+	LinkBlock(block);
+	return frame;
+}
+
 void BlockCache::MarkUsed(BlockCacheBlock* block)
 {
 	ScopedLock lock(&bcache_mutex);
@@ -189,6 +284,7 @@ void BlockCache::LinkBlock(BlockCacheBlock* block)
 		lru_block = block;
 }
 
+// The blocks of new areas don't have frames until they're used.
 bool BlockCache::AddArea()
 {
 	if ( areas_used == areas_length )
@@ -203,41 +299,29 @@ bool BlockCache::AddArea()
 	}
 
 	size_t area_memory_size = Page::Size() * blocks_per_area;
-	int prot = PROT_KREAD | PROT_KWRITE;
 
 	BlockCacheArea* area = &areas[areas_used];
 	if ( !AllocateKernelAddress(&area->addralloc, area_memory_size) )
 		goto cleanup_done;
 	if ( !(area->blocks = new BlockCacheBlock[blocks_per_area]) )
 		goto cleanup_addralloc;
-	if ( !Memory::MapRange(area->addralloc.from, area->addralloc.size, prot, PAGE_USAGE_FILESYSTEM_CACHE) )
-		goto cleanup_blocks;
-	Memory::Flush();
-	blocks_allocated += blocks_per_area;
 
-	// Add all our new blocks into the unused block linked list.
+	// Add all our new blocks into the non-present block linked list.
 	for ( size_t i = blocks_per_area; i != 0; i-- )
 	{
 		size_t index = i - 1;
 		BlockCacheBlock* block = &area->blocks[index];
 		uintptr_t blockid = MakeBlockId(areas_used, blocks_per_area, index);
-		block->information = MakeBlockInformation(blockid, BCACHE_PRESENT);
+		block->information = MakeBlockInformation(blockid, 0);
 		block->fcache = NULL;
-		block->next_block = unused_block;
+		block->next_block = nonpresent_block;
 		block->prev_block = NULL;
-		if ( unused_block )
-			unused_block->prev_block = block;
-		unused_block = block;
-		unused_block_count++;
+		nonpresent_block = block;
 	}
 
 	area->data = (uint8_t*) area->addralloc.from;
-	for ( size_t i = 0; i < area_memory_size; i++ )
-		area->data[i] = 0xCC;
 	return areas_used++, true;
 
-cleanup_blocks:
-	delete[] area->blocks;
 cleanup_addralloc:
 	FreeKernelAddress(&area->addralloc);
 cleanup_done:
@@ -309,46 +393,55 @@ void FileCache::InitializeFileData(off_t to_where)
 	}
 }
 
+// The file isn't locked while copying to or from the caller, as the caller's
+// buffer might be a memory mapping of this file, whose page faults would lock
+// the file again. The data is instead passed through a small bounce buffer.
 ssize_t FileCache::pread(ioctx_t* ctx, uint8_t* buf, size_t count, off_t off)
 {
-	ScopedLock lock(&fcache_mutex);
 	if ( off < 0 )
 		return errno = EINVAL, -1;
-	if ( file_size <= off )
-		return 0;
-	off_t available_bytes = file_size - off;
-	if ( (uintmax_t) available_bytes < (uintmax_t) count )
-		count = available_bytes;
 	if ( (size_t) SSIZE_MAX < count )
 		count = (size_t) SSIZE_MAX;
 	size_t sofar = 0;
 	while ( sofar < count )
 	{
+		unsigned char buffer[512];
 		off_t current_off = off + (off_t) sofar;
+		kthread_mutex_lock(&fcache_mutex);
+		if ( file_size <= current_off )
+		{
+			kthread_mutex_unlock(&fcache_mutex);
+			break;
+		}
+		off_t available_bytes = file_size - current_off;
 		size_t left = count - sofar;
+		if ( (uintmax_t) available_bytes < (uintmax_t) left )
+			left = (size_t) available_bytes;
 		size_t block_off = (size_t) (current_off % Page::Size());
 		size_t block_num = (size_t) (current_off / Page::Size());
 		size_t block_left = Page::Size() - block_off;
 		size_t amount_to_copy = left < block_left ? left : block_left;
+		if ( sizeof(buffer) < amount_to_copy )
+			amount_to_copy = sizeof(buffer);
 		assert(block_num < blocks_used);
 		BlockCacheBlock* block = blocks[block_num];
 		const uint8_t* block_data = kernel_block_cache->BlockData(block);
 		const uint8_t* src_data = block_data + block_off;
-		uint8_t* dest_buf = buf + sofar;
 		off_t end_at = current_off + (off_t) amount_to_copy;
 		if ( file_written < end_at )
 			InitializeFileData(end_at);
-		if ( !ctx->copy_to_dest(dest_buf, src_data, amount_to_copy) )
+		memcpy(buffer, src_data, amount_to_copy);
+		kernel_block_cache->MarkUsed(block);
+		kthread_mutex_unlock(&fcache_mutex);
+		if ( !ctx->copy_to_dest(buf + sofar, buffer, amount_to_copy) )
 			return sofar ? (ssize_t) sofar : -1;
 		sofar += amount_to_copy;
-		kernel_block_cache->MarkUsed(block);
 	}
 	return (ssize_t) sofar;
 }
 
 ssize_t FileCache::pwrite(ioctx_t* ctx, const uint8_t* buf, size_t count, off_t off)
 {
-	ScopedLock lock(&fcache_mutex);
 	if ( off < 0 )
 		return errno = EINVAL, -1;
 	off_t available_growth = OFF_MAX - off;
@@ -359,39 +452,47 @@ ssize_t FileCache::pwrite(ioctx_t* ctx, const uint8_t* buf, size_t count, off_t
 	if ( (size_t) SSIZE_MAX < count )
 		count = (size_t) SSIZE_MAX;
 	off_t write_end = off + (off_t) count;
-	if ( file_size < write_end && !ChangeSize(write_end, false) )
-	{
-		if ( file_size < off )
-			return -1;
-		count = (size_t) (file_size - off);
-		write_end = off + (off_t) count;
-	}
-	assert(write_end <= file_size);
 	size_t sofar = 0;
 	while ( sofar < count )
 	{
+		unsigned char buffer[512];
 		off_t current_off = off + (off_t) sofar;
 		size_t left = count - sofar;
 		size_t block_off = (size_t) (current_off % Page::Size());
 		size_t block_num = (size_t) (current_off / Page::Size());
 		size_t block_left = Page::Size() - block_off;
 		size_t amount_to_copy = left < block_left ? left : block_left;
+		if ( sizeof(buffer) < amount_to_copy )
+			amount_to_copy = sizeof(buffer);
+		if ( !ctx->copy_from_src(buffer, buf + sofar, amount_to_copy) )
+			return sofar ? (ssize_t) sofar : -1;
+		off_t end_at = current_off + (off_t) amount_to_copy;
+		kthread_mutex_lock(&fcache_mutex);
+		// The file may have been truncated while it wasn't locked.
+		if ( file_size < end_at && !ChangeSize(write_end, false) )
+		{
+			if ( file_size <= current_off )
+			{
+				kthread_mutex_unlock(&fcache_mutex);
+				return sofar ? (ssize_t) sofar : -1;
+			}
+			amount_to_copy = (size_t) (file_size - current_off);
+			end_at = file_size;
+			count = sofar + amount_to_copy;
+		}
 		assert(block_num < blocks_used);
 		BlockCacheBlock* block = blocks[block_num];
 		uint8_t* block_data = kernel_block_cache->BlockData(block);
 		uint8_t* data = block_data + block_off;
-		const uint8_t* src_buf = buf + sofar;
-		off_t begin_at = off + (off_t) sofar;
-		off_t end_at = current_off + (off_t) amount_to_copy;
-		if ( file_written < begin_at )
-			InitializeFileData(begin_at);
-		modified = true; /* Unconditionally - copy_from_src can fail midway. */
-		if ( !ctx->copy_from_src(data, src_buf, amount_to_copy) )
-			return sofar ? (ssize_t) sofar : -1;
+		if ( file_written < current_off )
+			InitializeFileData(current_off);
+		memcpy(data, buffer, amount_to_copy);
+		modified = true;
 		if ( file_written < end_at )
 			file_written = end_at;
-		sofar += amount_to_copy;
 		kernel_block_cache->MarkModified(block);
+		kthread_mutex_unlock(&fcache_mutex);
+		sofar += amount_to_copy;
 	}
 	return (ssize_t) sofar;
 }
@@ -418,6 +519,48 @@ off_t FileCache::lseek(ioctx_t* /*ctx*/, off_t offset, int whence)
 	return errno = EINVAL, -1;
 }
 
+addr_t FileCache::mmap(ioctx_t* /*ctx*/, off_t off)
+{
+	ScopedLock lock(&fcache_mutex);
+	if ( off < 0 || off % Page::Size() )
+		return errno = EINVAL, 0;
+	if ( file_size <= off )
+		return errno = ENXIO, 0;
+	size_t block_num = (size_t) (off / Page::Size());
+	assert(block_num < blocks_used);
+	BlockCacheBlock* block = blocks[block_num];
+	off_t block_end = off + (off_t) Page::Size();
+	if ( file_size < block_end )
+		block_end = file_size;
+	if ( file_written < block_end )
+		InitializeFileData(block_end);
+	// The part of the last block after the end of the file is mapped as zeroes.
+	size_t block_used = (size_t) (block_end - off);
+	uint8_t* block_data = kernel_block_cache->BlockData(block);
+	memset(block_data + block_used, 0, Page::Size() - block_used);
+	return kernel_block_cache->ShareBlockFrame(block);
+}
+
+// Shared memory mappings write directly into the blocks, so they're only known
+// to have been modified once synchronized.
+int FileCache::msync(ioctx_t* /*ctx*/, off_t off, size_t size)
+{
+	ScopedLock lock(&fcache_mutex);
+	if ( off < 0 )
+		return errno = EINVAL, -1;
+	off_t end = off + (off_t) size;
+	if ( (uintmax_t) (OFF_MAX - off) < (uintmax_t) size )
+		end = OFF_MAX;
+	if ( file_size < end )
+		end = file_size;
+	for ( off_t at = off - off % Page::Size(); at < end; at += Page::Size() )
+	{
+		kernel_block_cache->MarkModified(blocks[at / Page::Size()]);
+		modified = true;
+	}
+	return Synchronize() ? 0 : -1;
+}
+
 //bool FileCache::ChangeBackend(FileCacheBackend* backend, bool sync_old)
 //{
 //}
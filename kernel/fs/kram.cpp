@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -164,6 +164,22 @@ ssize_t File::pwrite(ioctx_t* ctx, const uint8_t* src, size_t count, off_t off)
 	return ret;
 }
 
+addr_t File::mmap(ioctx_t* ctx, off_t off)
+{
+	return fcache.mmap(ctx, off);
+}
+
+int File::msync(ioctx_t* ctx, off_t off, size_t size)
+{
+	int ret = fcache.msync(ctx, off, size);
+	if ( ret == 0 )
+	{
+		ScopedLock lock(&metalock);
+		stat_mtim = Time::Get(CLOCK_REALTIME);
+	}
+	return ret;
+}
+
 ssize_t File::readlink(ioctx_t* ctx, char* buf, size_t bufsize)
 {
 	if ( !S_ISLNK(type) )
@@ -200,6 +216,7 @@ Dir::Dir(dev_t dev, ino_t ino, uid_t owner, gid_t group, mode_t mode)
 	children_used = 0;
 	children_length = 0;
 	children = NULL;
+	buckets = NULL;
 	shut_down = false;
 }
 
@@ -210,37 +227,67 @@ Dir::~Dir()
 	// simply forget about us.
 	assert(!children_used);
 	delete[] children;
+	delete[] buckets;
 }
 
 ssize_t Dir::readdirents(ioctx_t* ctx, struct dirent* dirent, size_t size,
-                         off_t start)
+                         off_t* cookie)
 {
 	ScopedLock lock(&dir_lock);
-	if ( children_used <= (uintmax_t) start )
-		return 0;
-	struct dirent retdirent;
-	memset(&retdirent, 0, sizeof(retdirent));
-	const char* name = children[start].name;
-	size_t namelen = strlen(name);
-	Ref<Inode> inode = children[start].inode;
-	retdirent.d_reclen = sizeof(*dirent) + namelen + 1;
-	retdirent.d_namlen = namelen;
-	retdirent.d_ino = inode->ino;
-	retdirent.d_dev = inode->dev;
-	retdirent.d_type = ModeToDT(inode->type);
-	if ( !ctx->copy_to_dest(dirent, &retdirent, sizeof(retdirent)) )
-		return -1;
-	if ( size < retdirent.d_reclen )
-		return errno = ERANGE, -1;
-	if ( !ctx->copy_to_dest(dirent->d_name, name, namelen+1) )
-		return -1;
-	return (ssize_t) retdirent.d_reclen;
+	if ( *cookie < 0 )
+		return errno = EINVAL, -1;
+	size_t used = 0;
+	size_t index = (uintmax_t) *cookie;
+	for ( ; index < children_used; index++ )
+	{
+		struct dirent retdirent;
+		memset(&retdirent, 0, sizeof(retdirent));
+		const char* name = children[index].name;
+		size_t namelen = strlen(name);
+		Ref<Inode> inode = children[index].inode;
+		retdirent.d_reclen = DIRENT_RECLEN(namelen);
+		retdirent.d_namlen = namelen;
+		retdirent.d_ino = inode->ino;
+		retdirent.d_dev = inode->dev;
+		retdirent.d_type = ModeToDT(inode->type);
+		struct dirent* dest = (struct dirent*) ((uint8_t*) dirent + used);
+		if ( size - used < retdirent.d_reclen )
+		{
+			if ( used )
+				break;
+			if ( !ctx->copy_to_dest(dirent, &retdirent, sizeof(retdirent)) )
+				return -1;
+			return errno = ERANGE, -1;
+		}
+		if ( !ctx->copy_to_dest(dest, &retdirent, sizeof(retdirent)) ||
+		     !ctx->copy_to_dest(dest->d_name, name, namelen+1) )
+			return -1;
+		used += retdirent.d_reclen;
+	}
+	*cookie = (off_t) index;
+	return (ssize_t) used;
+}
+
+static size_t HashName(const char* name)
+{
+	size_t hash = 5381;
+	for ( size_t i = 0; name[i]; i++ )
+		hash = hash * 33 + (unsigned char) name[i];
+	return hash;
 }
 
+// The children are kept in an array in the order they were added, which is
+// the order they are listed in, and are indexed by hash chains of indexes into
+// that array, so names are found in constant time on average.
 size_t Dir::FindChild(const char* filename)
 {
-	for ( size_t i = 0; i < children_used; i++ )
-		if ( !strcmp(filename, children[i].name) )
+	if ( !children_length )
+		return SIZE_MAX;
+	size_t hash = HashName(filename);
+	for ( size_t i = buckets[hash % children_length];
+	      i != SIZE_MAX;
+	      i = children[i].next )
+		if ( children[i].hash == hash && !strcmp(filename, children[i].name) )
 			return i;
 	return SIZE_MAX;
 }
@@ -253,37 +300,66 @@ bool Dir::AddChild(const char* filename, Ref<Inode> inode)
 		DirEntry* new_children = new DirEntry[new_children_length];
 		if ( !new_children )
 			return false;
+		size_t* new_buckets = new size_t[new_children_length];
+		if ( !new_buckets )
+			return delete[] new_children, false;
+		for ( size_t i = 0; i < new_children_length; i++ )
+			new_buckets[i] = SIZE_MAX;
 		for ( size_t i = 0; i < children_used; i++ )
 		{
+			size_t* bucket = &new_buckets[children[i].hash % new_children_length];
 			new_children[i].inode = children[i].inode;
 			new_children[i].name = children[i].name;
+			new_children[i].hash = children[i].hash;
+			new_children[i].next = *bucket;
+			*bucket = i;
 			children[i].inode.Reset();
 		}
 		delete[] children; children = new_children;
+		delete[] buckets; buckets = new_buckets;
 		children_length = new_children_length;
 	}
 	char* filename_copy = String::Clone(filename);
 	if ( !filename_copy )
 		return false;
 	inode->linked();
-	DirEntry* dirent = &children[children_used++];
+	size_t index = children_used++;
+	DirEntry* dirent = &children[index];
 	dirent->inode = inode;
 	dirent->name = filename_copy;
+	dirent->hash = HashName(filename);
+	size_t* bucket = &buckets[dirent->hash % children_length];
+	dirent->next = *bucket;
+	*bucket = index;
 	return true;
 }
 
+size_t* Dir::ChainLink(size_t index)
+{
+	size_t* link = &buckets[children[index].hash % children_length];
+	while ( *link != index )
+		link = &children[*link].next;
+	return link;
+}
+
+// The last child takes the place of the removed child, so the array stays
+// dense, at the cost of moving that child earlier in the listing.
 void Dir::RemoveChild(size_t index)
 {
 	assert(index < children_used);
-	if ( index != children_used-1 )
-	{
-		DirEntry tmp = children[index];
-		children[index] = children[children_used-1];
-		children[children_used-1] = tmp;
-		index = children_used-1;
-	}
+	size_t last = children_used - 1;
+	*ChainLink(index) = children[index].next;
 	children[index].inode.Reset();
 	delete[] children[index].name;
+	if ( index != last )
+	{
+		*ChainLink(last) = index;
+		children[index].inode = children[last].inode;
+		children[index].name = children[last].name;
+		children[index].hash = children[last].hash;
+		children[index].next = children[last].next;
+		children[last].inode.Reset();
+	}
 	children_used--;
 }
 
@@ -371,6 +447,7 @@ int Dir::rmdir_me(ioctx_t* /*ctx*/)
 		delete[] children[i].name;
 	}
 	delete[] children; children = NULL;
+	delete[] buckets; buckets = NULL;
 	children_used = children_length = 0;
 	return 0;
 }
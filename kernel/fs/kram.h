@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -31,6 +31,8 @@ struct DirEntry
 {
 	Ref<Inode> inode;
 	char* name;
+	size_t hash;
+	size_t next; // The next entry in the same hash chain or SIZE_MAX.
 };
 
 class File : public AbstractInode
@@ -45,6 +47,8 @@ public:
 	                      off_t off);
 	virtual ssize_t pwrite(ioctx_t* ctx, const uint8_t* buf, size_t count,
 	                       off_t off);
+	virtual addr_t mmap(ioctx_t* ctx, off_t off);
+	virtual int msync(ioctx_t* ctx, off_t off, size_t size);
 	virtual ssize_t readlink(ioctx_t* ctx, char* buf, size_t bufsiz);
 	virtual ssize_t tcgetblob(ioctx_t* ctx, const char* name, void* buffer,
 	                          size_t count);
@@ -61,7 +65,7 @@ public:
 	Dir(dev_t dev, ino_t ino, uid_t owner, gid_t group, mode_t mode);
 	virtual ~Dir();
 	virtual ssize_t readdirents(ioctx_t* ctx, struct dirent* dirent,
-	                            size_t size, off_t start);
+	                            size_t size, off_t* cookie);
 	virtual Ref<Inode> open(ioctx_t* ctx, const char* filename, int flags,
 	                        mode_t mode);
 	virtual int mkdir(ioctx_t* ctx, const char* filename, mode_t mode);
@@ -83,12 +87,14 @@ private:
 	size_t FindChild(const char* filename);
 	bool AddChild(const char* filename, Ref<Inode> inode);
 	void RemoveChild(size_t index);
+	size_t* ChainLink(size_t index);
 
 private:
 	kthread_mutex_t dir_lock;
 	size_t children_used;
 	size_t children_length;
 	DirEntry* children;
+	size_t* buckets; // As many as children_length.
 	bool shut_down;
 
 };
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * fs/mempressure.cpp
+ * Device that notifies when the system is low on memory.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <sortix/mempressure.h>
+#include <sortix/stat.h>
+
+#include <sortix/kernel/inode.h>
+#include <sortix/kernel/ioctx.h>
+#include <sortix/kernel/pressure.h>
+
+#include "mempressure.h"
+
+namespace Sortix {
+
+MemoryPressure::MemoryPressure(dev_t dev, ino_t ino, uid_t owner, gid_t group,
+                               mode_t mode)
+{
+	inode_type = INODE_TYPE_STREAM;
+	if ( !dev )
+		dev = (dev_t) this;
+	if ( !ino )
+		ino = (ino_t) this;
+	this->type = S_IFCHR;
+	this->stat_uid = owner;
+	this->stat_gid = group;
+	this->stat_mode = (mode & S_SETABLE) | this->type;
+	this->stat_size = 0;
+	this->stat_blksize = sizeof(struct mempressure);
+	this->dev = dev;
+	this->ino = ino;
+}
+
+MemoryPressure::~MemoryPressure()
+{
+}
+
+// Each read waits for the next time the system runs low on memory.
+ssize_t MemoryPressure::read(ioctx_t* ctx, uint8_t* buf, size_t count)
+{
+	if ( count < sizeof(struct mempressure) )
+		return errno = EINVAL, -1;
+	struct mempressure event;
+	if ( !Pressure::Wait(&event) )
+		return -1;
+	if ( !ctx->copy_to_dest(buf, &event, sizeof(event)) )
+		return -1;
+	return (ssize_t) sizeof(event);
+}
+
+ssize_t MemoryPressure::pread(ioctx_t* /*ctx*/, uint8_t* /*buf*/,
+                              size_t /*count*/, off_t /*off*/)
+{
+	return errno = ESPIPE, -1;
+}
+
+} // namespace Sortix
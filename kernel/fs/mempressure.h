@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * fs/mempressure.h
+ * Device that notifies when the system is low on memory.
+ */
+
+#ifndef SORTIX_FS_MEMPRESSURE_H
+#define SORTIX_FS_MEMPRESSURE_H
+
+#include <sortix/kernel/inode.h>
+
+namespace Sortix {
+
+class MemoryPressure : public AbstractInode
+{
+public:
+	MemoryPressure(dev_t dev, ino_t ino, uid_t owner, gid_t group, mode_t mode);
+	virtual ~MemoryPressure();
+	virtual ssize_t read(ioctx_t* ctx, uint8_t* buf, size_t count);
+	virtual ssize_t pread(ioctx_t* ctx, uint8_t* buf, size_t count, off_t off);
+
+};
+
+} // namespace Sortix
+
+#endif
@@ -42,6 +42,7 @@
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/kthread.h>
 #include <sortix/kernel/mtable.h>
+#include <sortix/kernel/namecache.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/refcount.h>
 #include <sortix/kernel/scheduler.h>
@@ -81,32 +82,55 @@ private:
 	bool still_writing;
 
 public:
-	uintptr_t sender_system_tid;
-	uintptr_t receiver_system_tid;
+	Thread* sender_thread;
+	Thread* receiver_thread;
 
 };
 
+// The kernel side of a request to the server and its response.
 class Channel
 {
 public:
-	Channel(ioctx_t* ioctx);
-	~Channel();
-
-public:
-	void InformSystemTids(uintptr_t client_tid, uintptr_t server_tid);
+	Channel(ioctx_t* ctx);
+	virtual ~Channel();
 
 public:
 	bool KernelSend(ioctx_t* ctx, const void* ptr, size_t count)
 	{
 		return KernelSend(ctx, ptr, count, count) == count;
 	}
-	size_t KernelSend(ioctx_t* ctx, const void* ptr, size_t least, size_t max);
+	virtual size_t KernelSend(ioctx_t* ctx, const void* ptr, size_t least,
+	                          size_t max) = 0;
 	bool KernelRecv(ioctx_t* ctx, void* ptr, size_t count)
 	{
 		return KernelRecv(ctx, ptr, count, count) == count;
 	}
-	size_t KernelRecv(ioctx_t* ctx, void* ptr, size_t least, size_t max);
-	void KernelClose();
+	virtual size_t KernelRecv(ioctx_t* ctx, void* ptr, size_t least,
+	                          size_t max) = 0;
+	virtual void KernelClose() = 0;
+
+public:
+	uid_t uid;
+	gid_t gid;
+
+};
+
+// A connection accepted by the server that carries a single request.
+class StreamChannel : public Channel
+{
+public:
+	StreamChannel(ioctx_t* ctx);
+	virtual ~StreamChannel();
+
+public:
+	void InformThreads(Thread* client, Thread* server);
+
+public:
+	virtual size_t KernelSend(ioctx_t* ctx, const void* ptr, size_t least,
+	                          size_t max);
+	virtual size_t KernelRecv(ioctx_t* ctx, void* ptr, size_t least,
+	                          size_t max);
+	virtual void KernelClose();
 
 public:
 	bool UserSend(ioctx_t* ctx, const void* ptr, size_t count)
@@ -130,9 +154,51 @@ private:
 	bool kernel_closed;
 	bool user_closed;
 
+};
+
+enum TaggedState
+{
+	TAGGED_STATE_BUILDING,
+	TAGGED_STATE_QUEUED,
+	TAGGED_STATE_SENT,
+	TAGGED_STATE_ANSWERED,
+	TAGGED_STATE_FAILED,
+};
+
+// A request that is sent in a tagged frame over the server file descriptor,
+// whose response is routed back by its tag. The request is built in a buffer
+// and sent once the response is first waited for, or when the channel is
+// closed if no response is wanted. The channels and their buffers are reused.
+class TaggedChannel : public Channel
+{
 public:
-	uid_t uid;
-	gid_t gid;
+	TaggedChannel(Server* server, ioctx_t* ctx);
+	virtual ~TaggedChannel();
+
+public:
+	virtual size_t KernelSend(ioctx_t* ctx, const void* ptr, size_t least,
+	                          size_t max);
+	virtual size_t KernelRecv(ioctx_t* ctx, void* ptr, size_t least,
+	                          size_t max);
+	virtual void KernelClose();
+
+public:
+	TaggedChannel* prev_channel;
+	TaggedChannel* next_channel;
+	Server* server;
+	Thread* client_thread;
+	kthread_cond_t answered_cond;
+	uint8_t* request;
+	size_t request_length;
+	size_t request_used;
+	uint8_t* response;
+	size_t response_length;
+	size_t response_used;
+	size_t response_offset;
+	size_t tag;
+	enum TaggedState state;
+	bool send_failed;
+	bool abandoned;
 
 };
 
@@ -140,38 +206,69 @@ class ChannelNode : public AbstractInode
 {
 public:
 	ChannelNode();
-	ChannelNode(Channel* channel);
+	ChannelNode(StreamChannel* channel);
 	virtual ~ChannelNode();
-	void Construct(Channel* channel);
+	void Construct(StreamChannel* channel);
 	virtual ssize_t read(ioctx_t* ctx, uint8_t* buf, size_t count);
 	virtual ssize_t write(ioctx_t* ctx, const uint8_t* buf, size_t count);
 
 private:
-	Channel* channel;
+	StreamChannel* channel;
 
 };
 
 class Server : public Refcountable
 {
+	friend class TaggedChannel;
+
 public:
-	Server();
+	Server(bool tagged);
 	virtual ~Server();
 	void Disconnect();
 	void Unmount();
 	Channel* Connect(ioctx_t* ctx);
-	Channel* Accept();
+	StreamChannel* Accept();
+	ssize_t Read(ioctx_t* ctx, uint8_t* buf, size_t count);
+	ssize_t Write(ioctx_t* ctx, const uint8_t* buf, size_t count);
 	Ref<Inode> BootstrapNode(ino_t ino, mode_t type);
 	Ref<Inode> OpenNode(ino_t ino, mode_t type);
 
+private:
+	Channel* ConnectTagged(ioctx_t* ctx);
+	void Submit(TaggedChannel* channel);
+	void Recycle(TaggedChannel* channel);
+	void LinkSent(TaggedChannel* channel);
+	void UnlinkSent(TaggedChannel* channel);
+	TaggedChannel* FindSent(size_t tag);
+	void FinishResponse();
+
 private:
 	kthread_mutex_t connect_lock;
 	kthread_cond_t connecting_cond;
 	kthread_cond_t connectable_cond;
-	uintptr_t listener_system_tid;
-	uintptr_t connecter_system_tid;
-	Channel* connecting;
+	Thread* listener_thread;
+	Thread* connecter_thread;
+	StreamChannel* connecting;
 	bool disconnected;
 	bool unmounted;
+	bool tagged;
+
+private: // Protected by connect_lock if tagged.
+	kthread_cond_t request_cond;
+	TaggedChannel* first_queued;
+	TaggedChannel* last_queued;
+	TaggedChannel* first_sent;
+	TaggedChannel* first_free;
+	size_t free_count;
+	size_t next_tag;
+	TaggedChannel* reading;
+	size_t reading_offset;
+	struct fsm_tagged_header reading_header;
+	struct fsm_tagged_header writing_header;
+	size_t writing_header_used;
+	TaggedChannel* writing;
+	size_t writing_left;
+	bool writing_failed;
 
 };
 
@@ -182,6 +279,8 @@ public:
 	virtual ~ServerNode();
 	virtual Ref<Inode> accept(ioctx_t* ctx, uint8_t* addr, size_t* addrlen,
 	                          int flags);
+	virtual ssize_t read(ioctx_t* ctx, uint8_t* buf, size_t count);
+	virtual ssize_t write(ioctx_t* ctx, const uint8_t* buf, size_t count);
 
 private:
 	Ref<Server> server;
@@ -211,7 +310,7 @@ public:
 	virtual int utimens(ioctx_t* ctx, const struct timespec* times);
 	virtual int isatty(ioctx_t* ctx);
 	virtual ssize_t readdirents(ioctx_t* ctx, struct dirent* dirent,
-	                            size_t size, off_t start);
+	                            size_t size, off_t* cookie);
 	virtual Ref<Inode> open(ioctx_t* ctx, const char* filename, int flags,
 	                        mode_t mode);
 	virtual int mkdir(ioctx_t* ctx, const char* filename, mode_t mode);
@@ -255,6 +354,9 @@ public:
 	virtual pid_t tcgetsid(ioctx_t* ctx);
 	virtual int tcsendbreak(ioctx_t* ctx, int duration);
 	virtual int tcsetattr(ioctx_t* ctx, int actions, const struct termios* tio);
+	virtual addr_t mmap(ioctx_t* ctx, off_t off);
+	virtual int msync(ioctx_t* ctx, off_t off, size_t size);
+	virtual bool names_cacheable();
 
 private:
 	bool SendMessage(Channel* channel, size_t type, void* ptr, size_t size,
@@ -283,8 +385,8 @@ ChannelDirection::ChannelDirection()
 	not_full = KTHREAD_COND_INITIALIZER;
 	still_reading = true;
 	still_writing = true;
-	sender_system_tid = 0;
-	receiver_system_tid = 0;
+	sender_thread = NULL;
+	receiver_thread = NULL;
 }
 
 ChannelDirection::~ChannelDirection()
@@ -295,9 +397,9 @@ size_t ChannelDirection::Send(ioctx_t* ctx, const void* ptr, size_t least, size_
 {
 	const uint8_t* src = (const uint8_t*) ptr;
 	size_t sofar = 0;
-	CurrentThread()->yield_to_tid = receiver_system_tid;
+	CurrentThread()->yield_to = receiver_thread;
 	ScopedLock inner_lock(&transfer_lock);
-	sender_system_tid = CurrentThread()->system_tid;
+	sender_thread = CurrentThread();
 	while ( true )
 	{
 		while ( true )
@@ -335,9 +437,9 @@ size_t ChannelDirection::Recv(ioctx_t* ctx, void* ptr, size_t least, size_t max)
 {
 	uint8_t* dst = (uint8_t*) ptr;
 	size_t sofar = 0;
-	CurrentThread()->yield_to_tid = sender_system_tid;
+	CurrentThread()->yield_to = sender_thread;
 	ScopedLock inner_lock(&transfer_lock);
-	receiver_system_tid = CurrentThread()->system_tid;
+	receiver_thread = CurrentThread();
 	while ( true )
 	{
 		while ( true )
@@ -391,51 +493,64 @@ void ChannelDirection::RecvClose()
 //
 
 Channel::Channel(ioctx_t* ctx)
+{
+	uid = ctx ? ctx->uid : 0;
+	gid = ctx ? ctx->gid : 0;
+}
+
+Channel::~Channel()
+{
+}
+
+//
+// Implementation of StreamChannel.
+//
+
+StreamChannel::StreamChannel(ioctx_t* ctx) : Channel(ctx)
 {
 	kernel_lock = KTHREAD_MUTEX_INITIALIZER;
 	user_lock = KTHREAD_MUTEX_INITIALIZER;
 	destruction_lock = KTHREAD_MUTEX_INITIALIZER;
 	user_closed = false;
 	kernel_closed = false;
-	uid = ctx ? ctx->uid : 0;
-	gid = ctx ? ctx->gid : 0;
 }
 
-Channel::~Channel()
+StreamChannel::~StreamChannel()
 {
 }
 
-void Channel::InformSystemTids(uintptr_t client_tid, uintptr_t server_tid)
+void StreamChannel::InformThreads(Thread* client, Thread* server)
 {
-	from_kernel.sender_system_tid = client_tid;
-	from_kernel.receiver_system_tid = server_tid;
-	from_user.sender_system_tid = server_tid;
-	from_user.receiver_system_tid = client_tid;
+	from_kernel.sender_thread = client;
+	from_kernel.receiver_thread = server;
+	from_user.sender_thread = server;
+	from_user.receiver_thread = client;
 }
 
-size_t Channel::KernelSend(ioctx_t* ctx, const void* ptr, size_t least,
-                            size_t max)
+size_t StreamChannel::KernelSend(ioctx_t* ctx, const void* ptr, size_t least,
+                                 size_t max)
 {
 	ScopedLockSignal outer_lock(&kernel_lock);
 	if ( !outer_lock.IsAcquired() )
 		return errno = EINTR, 0;
 	size_t ret = from_kernel.Send(ctx, ptr, least, max);
-	CurrentThread()->yield_to_tid = 0;
+	CurrentThread()->yield_to = NULL;
 	Scheduler::ScheduleTrueThread();
 	return ret;
 }
 
-size_t Channel::KernelRecv(ioctx_t* ctx, void* ptr, size_t least, size_t max)
+size_t StreamChannel::KernelRecv(ioctx_t* ctx, void* ptr, size_t least,
+                                 size_t max)
 {
 	ScopedLockSignal outer_lock(&kernel_lock);
 	if ( !outer_lock.IsAcquired() )
 		return errno = EINTR, 0;
-	CurrentThread()->yield_to_tid = 0;
+	CurrentThread()->yield_to = NULL;
 	Scheduler::ScheduleTrueThread();
 	return from_user.Recv(ctx, ptr, least, max);
 }
 
-void Channel::KernelClose()
+void StreamChannel::KernelClose()
 {
 	// No lock needed, this thread is the last to use this object as kernel.
 	from_kernel.SendClose();
@@ -448,30 +563,31 @@ void Channel::KernelClose()
 		delete this;
 }
 
-size_t Channel::UserSend(ioctx_t* ctx, const void* ptr, size_t least,
-                         size_t max)
+size_t StreamChannel::UserSend(ioctx_t* ctx, const void* ptr, size_t least,
+                               size_t max)
 {
 	ScopedLockSignal outer_lock(&user_lock);
 	if ( !outer_lock.IsAcquired() )
 		return errno = EINTR, 0;
 	size_t ret = from_user.Send(ctx, ptr, least, max);
-	CurrentThread()->yield_to_tid = 0;
+	CurrentThread()->yield_to = NULL;
 	Scheduler::ScheduleTrueThread();
 	return ret;
 }
 
-size_t Channel::UserRecv(ioctx_t* ctx, void* ptr, size_t least, size_t max)
+size_t StreamChannel::UserRecv(ioctx_t* ctx, void* ptr, size_t least,
+                               size_t max)
 {
 	ScopedLockSignal outer_lock(&user_lock);
 	if ( !outer_lock.IsAcquired() )
 		return errno = EINTR, 0;
 	size_t ret = from_kernel.Recv(ctx, ptr, least, max);
-	CurrentThread()->yield_to_tid = 0;
+	CurrentThread()->yield_to = NULL;
 	Scheduler::ScheduleTrueThread();
 	return ret;
 }
 
-void Channel::UserClose()
+void StreamChannel::UserClose()
 {
 	// No lock needed, this thread is the last to use this object as user.
 	from_kernel.RecvClose();
@@ -484,6 +600,123 @@ void Channel::UserClose()
 		delete this;
 }
 
+//
+// Implementation of TaggedChannel.
+//
+
+// The largest request and response carried in a tagged frame. Transfers of
+// file data are limited to TRANSFER_MAX so they fit with their headers.
+static const size_t TRANSFER_MAX = 1024 * 1024;
+static const size_t TAGGED_REQUEST_MAX = TRANSFER_MAX + 64 * 1024;
+static const size_t TAGGED_RESPONSE_MAX = TRANSFER_MAX + 64 * 1024;
+
+// How many channels are kept for reuse and how large buffers they keep.
+static const size_t TAGGED_FREE_MAX = 16;
+static const size_t TAGGED_KEEP_LENGTH = 64 * 1024;
+
+TaggedChannel::TaggedChannel(Server* server, ioctx_t* ctx) : Channel(ctx)
+{
+	prev_channel = NULL;
+	next_channel = NULL;
+	this->server = server;
+	client_thread = NULL;
+	answered_cond = KTHREAD_COND_INITIALIZER;
+	request = NULL;
+	request_length = 0;
+	request_used = 0;
+	response = NULL;
+	response_length = 0;
+	response_used = 0;
+	response_offset = 0;
+	tag = 0;
+	state = TAGGED_STATE_BUILDING;
+	send_failed = false;
+	abandoned = false;
+}
+
+TaggedChannel::~TaggedChannel()
+{
+	delete[] request;
+	delete[] response;
+}
+
+size_t TaggedChannel::KernelSend(ioctx_t* ctx, const void* ptr, size_t least,
+                                 size_t max)
+{
+	(void) least;
+	if ( state != TAGGED_STATE_BUILDING || send_failed )
+		return errno = EINVAL, 0;
+	if ( TAGGED_REQUEST_MAX - request_used < max )
+		return send_failed = true, errno = EMSGSIZE, 0;
+	if ( request_length - request_used < max )
+	{
+		size_t new_length = request_length ? 2 * request_length : 256;
+		while ( new_length - request_used < max )
+			new_length *= 2;
+		uint8_t* new_request = new uint8_t[new_length];
+		if ( !new_request )
+			return send_failed = true, 0;
+		memcpy(new_request, request, request_used);
+		delete[] request;
+		request = new_request;
+		request_length = new_length;
+	}
+	if ( !ctx->copy_from_src(request + request_used, ptr, max) )
+		return send_failed = true, 0;
+	request_used += max;
+	return max;
+}
+
+size_t TaggedChannel::KernelRecv(ioctx_t* ctx, void* ptr, size_t least,
+                                 size_t max)
+{
+	ScopedLock lock(&server->connect_lock);
+	if ( state == TAGGED_STATE_BUILDING )
+	{
+		if ( send_failed )
+			return errno = EIO, 0;
+		server->Submit(this);
+	}
+	while ( state == TAGGED_STATE_QUEUED || state == TAGGED_STATE_SENT )
+	{
+		CurrentThread()->yield_to = server->listener_thread;
+		bool interrupted =
+			!kthread_cond_wait_signal(&answered_cond, &server->connect_lock);
+		CurrentThread()->yield_to = NULL;
+		if ( interrupted )
+			return errno = EINTR, 0;
+	}
+	if ( state == TAGGED_STATE_FAILED )
+		return errno = ECONNRESET, 0;
+	lock.Reset();
+	// The response belongs to this thread once it has been answered.
+	size_t count = response_used - response_offset;
+	if ( max < count )
+		count = max;
+	if ( !ctx->copy_to_dest(ptr, response + response_offset, count) )
+		return 0;
+	response_offset += count;
+	if ( count < least )
+		errno = ECONNRESET;
+	return count;
+}
+
+void TaggedChannel::KernelClose()
+{
+	ScopedLock lock(&server->connect_lock);
+	if ( state == TAGGED_STATE_BUILDING && !send_failed && request_used &&
+	     !server->disconnected )
+	{
+		// Requests that aren't answered are sent when the channel is closed.
+		abandoned = true;
+		server->Submit(this);
+	}
+	else if ( state == TAGGED_STATE_QUEUED || state == TAGGED_STATE_SENT )
+		abandoned = true;
+	else
+		server->Recycle(this);
+}
+
 //
 // Implementation of ChannelNode.
 //
@@ -493,7 +726,7 @@ ChannelNode::ChannelNode()
 	channel = NULL;
 }
 
-ChannelNode::ChannelNode(Channel* channel)
+ChannelNode::ChannelNode(StreamChannel* channel)
 {
 	Construct(channel);
 }
@@ -504,7 +737,7 @@ ChannelNode::~ChannelNode()
 		channel->UserClose();
 }
 
-void ChannelNode::Construct(Channel* channel)
+void ChannelNode::Construct(StreamChannel* channel)
 {
 	inode_type = INODE_TYPE_STREAM;
 	this->channel = channel;
@@ -528,26 +761,78 @@ ssize_t ChannelNode::write(ioctx_t* ctx, const uint8_t* buf, size_t count)
 // Implementation of Server.
 //
 
-Server::Server()
+Server::Server(bool tagged)
 {
 	connect_lock = KTHREAD_MUTEX_INITIALIZER;
 	connecting_cond = KTHREAD_COND_INITIALIZER;
 	connectable_cond = KTHREAD_COND_INITIALIZER;
-	listener_system_tid = 0;
+	listener_thread = NULL;
 	connecting = NULL;
 	disconnected = false;
 	unmounted = false;
+	this->tagged = tagged;
+	request_cond = KTHREAD_COND_INITIALIZER;
+	first_queued = NULL;
+	last_queued = NULL;
+	first_sent = NULL;
+	first_free = NULL;
+	free_count = 0;
+	next_tag = 0;
+	reading = NULL;
+	reading_offset = 0;
+	writing_header_used = 0;
+	writing = NULL;
+	writing_left = 0;
+	writing_failed = false;
 }
 
 Server::~Server()
 {
+	while ( TaggedChannel* channel = first_free )
+	{
+		first_free = channel->next_channel;
+		delete channel;
+	}
 }
 
 void Server::Disconnect()
 {
-	ScopedLock lock(&connect_lock);
+	kthread_mutex_lock(&connect_lock);
 	disconnected = true;
 	kthread_cond_signal(&connectable_cond);
+	// Fail the tagged requests that will never be answered.
+	if ( reading )
+	{
+		reading->next_channel = first_queued;
+		first_queued = reading;
+		reading = NULL;
+	}
+	if ( writing )
+	{
+		writing->next_channel = first_queued;
+		first_queued = writing;
+		writing = NULL;
+	}
+	while ( TaggedChannel* channel = first_sent )
+	{
+		UnlinkSent(channel);
+		channel->next_channel = first_queued;
+		first_queued = channel;
+	}
+	while ( TaggedChannel* channel = first_queued )
+	{
+		first_queued = channel->next_channel;
+		channel->state = TAGGED_STATE_FAILED;
+		if ( channel->abandoned )
+			Recycle(channel);
+		else
+			kthread_cond_signal(&channel->answered_cond);
+	}
+	last_queued = NULL;
+	kthread_cond_broadcast(&request_cond);
+	kthread_mutex_unlock(&connect_lock);
+	// The cached names refer to inodes of this server and keep it alive.
+	NameCache::InvalidateDevice((dev_t) this);
 }
 
 void Server::Unmount()
@@ -555,43 +840,308 @@ void Server::Unmount()
 	ScopedLock lock(&connect_lock);
 	unmounted = true;
 	kthread_cond_signal(&connecting_cond);
+	kthread_cond_broadcast(&request_cond);
 }
 
 Channel* Server::Connect(ioctx_t* ctx)
 {
-	Channel* channel = new Channel(ctx);
+	if ( tagged )
+		return ConnectTagged(ctx);
+	StreamChannel* channel = new StreamChannel(ctx);
 	if ( !channel )
 		return NULL;
-	CurrentThread()->yield_to_tid = listener_system_tid;
+	CurrentThread()->yield_to = listener_thread;
 	ScopedLock lock(&connect_lock);
 	while ( !disconnected && connecting )
 	{
 		if ( !kthread_cond_wait_signal(&connectable_cond, &connect_lock) )
 		{
-			CurrentThread()->yield_to_tid = 0;
+			CurrentThread()->yield_to = NULL;
 			delete channel;
 			return errno = EINTR, (Channel*) NULL;
 		}
 	}
-	CurrentThread()->yield_to_tid = 0;
+	CurrentThread()->yield_to = NULL;
 	if ( disconnected )
 		return delete channel, errno = ECONNREFUSED, (Channel*) NULL;
-	channel->InformSystemTids(CurrentThread()->system_tid, listener_system_tid);
+	channel->InformThreads(CurrentThread(), listener_thread);
 	connecting = channel;
 	kthread_cond_signal(&connecting_cond);
 	return channel;
 }
 
-Channel* Server::Accept()
+Channel* Server::ConnectTagged(ioctx_t* ctx)
 {
 	ScopedLock lock(&connect_lock);
-	listener_system_tid = CurrentThread()->system_tid;
+	if ( disconnected )
+		return errno = ECONNREFUSED, (Channel*) NULL;
+	TaggedChannel* channel = first_free;
+	if ( channel )
+	{
+		first_free = channel->next_channel;
+		free_count--;
+		channel->uid = ctx ? ctx->uid : 0;
+		channel->gid = ctx ? ctx->gid : 0;
+	}
+	else if ( !(channel = new TaggedChannel(this, ctx)) )
+		return NULL;
+	channel->prev_channel = NULL;
+	channel->next_channel = NULL;
+	channel->client_thread = CurrentThread();
+	channel->request_used = 0;
+	channel->response_used = 0;
+	channel->response_offset = 0;
+	channel->state = TAGGED_STATE_BUILDING;
+	channel->send_failed = false;
+	channel->abandoned = false;
+	return channel;
+}
+
+void Server::Submit(TaggedChannel* channel)
+{
+	if ( disconnected )
+	{
+		channel->state = TAGGED_STATE_FAILED;
+		if ( channel->abandoned )
+			Recycle(channel);
+		return;
+	}
+	channel->tag = next_tag++;
+	channel->state = TAGGED_STATE_QUEUED;
+	channel->next_channel = NULL;
+	if ( last_queued )
+		last_queued->next_channel = channel;
+	else
+		first_queued = channel;
+	last_queued = channel;
+	kthread_cond_signal(&request_cond);
+}
+
+void Server::Recycle(TaggedChannel* channel)
+{
+	if ( TAGGED_FREE_MAX <= free_count )
+	{
+		delete channel;
+		return;
+	}
+	if ( TAGGED_KEEP_LENGTH < channel->request_length )
+	{
+		delete[] channel->request;
+		channel->request = NULL;
+		channel->request_length = 0;
+	}
+	if ( TAGGED_KEEP_LENGTH < channel->response_length )
+	{
+		delete[] channel->response;
+		channel->response = NULL;
+		channel->response_length = 0;
+	}
+	channel->client_thread = NULL;
+	channel->next_channel = first_free;
+	first_free = channel;
+	free_count++;
+}
+
+void Server::LinkSent(TaggedChannel* channel)
+{
+	channel->prev_channel = NULL;
+	channel->next_channel = first_sent;
+	if ( first_sent )
+		first_sent->prev_channel = channel;
+	first_sent = channel;
+}
+
+void Server::UnlinkSent(TaggedChannel* channel)
+{
+	if ( channel->prev_channel )
+		channel->prev_channel->next_channel = channel->next_channel;
+	else
+		first_sent = channel->next_channel;
+	if ( channel->next_channel )
+		channel->next_channel->prev_channel = channel->prev_channel;
+	channel->prev_channel = NULL;
+	channel->next_channel = NULL;
+}
+
+TaggedChannel* Server::FindSent(size_t tag)
+{
+	for ( TaggedChannel* channel = first_sent;
+	      channel;
+	      channel = channel->next_channel )
+		if ( channel->tag == tag )
+			return channel;
+	return NULL;
+}
+
+// Hands out the queued requests as a stream of frames, where each read only
+// returns data from a single frame.
+ssize_t Server::Read(ioctx_t* ctx, uint8_t* buf, size_t count)
+{
+	if ( !tagged )
+		return errno = EBADF, -1;
+	ScopedLock lock(&connect_lock);
+	listener_thread = CurrentThread();
+	while ( !reading )
+	{
+		if ( first_queued )
+		{
+			reading = first_queued;
+			if ( !(first_queued = reading->next_channel) )
+				last_queued = NULL;
+			reading->next_channel = NULL;
+			reading_offset = 0;
+			reading_header.tag = reading->tag;
+			reading_header.size = reading->request_used;
+			break;
+		}
+		if ( disconnected || unmounted )
+			return 0;
+		if ( !kthread_cond_wait_signal(&request_cond, &connect_lock) )
+			return CurrentThread()->yield_to = NULL, errno = EINTR, -1;
+	}
+	CurrentThread()->yield_to = NULL;
+	size_t sofar = 0;
+	if ( reading_offset < sizeof(reading_header) )
+	{
+		size_t amount = sizeof(reading_header) - reading_offset;
+		if ( count < amount )
+			amount = count;
+		const uint8_t* src = (const uint8_t*) &reading_header + reading_offset;
+		if ( !ctx->copy_to_dest(buf, src, amount) )
+			return -1;
+		reading_offset += amount;
+		sofar += amount;
+	}
+	size_t frame_size = sizeof(reading_header) + reading->request_used;
+	if ( sizeof(reading_header) <= reading_offset && sofar < count )
+	{
+		size_t amount = frame_size - reading_offset;
+		if ( count - sofar < amount )
+			amount = count - sofar;
+		const uint8_t* src =
+			reading->request + (reading_offset - sizeof(reading_header));
+		if ( !ctx->copy_to_dest(buf + sofar, src, amount) )
+			return sofar ? (ssize_t) sofar : -1;
+		reading_offset += amount;
+		sofar += amount;
+	}
+	if ( reading_offset == frame_size )
+	{
+		if ( reading->abandoned )
+			Recycle(reading);
+		else
+		{
+			reading->state = TAGGED_STATE_SENT;
+			LinkSent(reading);
+		}
+		reading = NULL;
+		if ( first_queued )
+			kthread_cond_signal(&request_cond);
+	}
+	return (ssize_t) sofar;
+}
+
+void Server::FinishResponse()
+{
+	if ( writing )
+	{
+		if ( writing->abandoned )
+			Recycle(writing);
+		else
+		{
+			writing->state = writing_failed ? TAGGED_STATE_FAILED :
+			                                  TAGGED_STATE_ANSWERED;
+			kthread_cond_signal(&writing->answered_cond);
+			if ( writing->client_thread )
+				CurrentThread()->yield_to = writing->client_thread;
+		}
+	}
+	writing = NULL;
+	writing_header_used = 0;
+	writing_left = 0;
+	writing_failed = false;
+}
+
+// Routes the stream of response frames to the requests they answer. Responses
+// to requests that aren't waiting for them are discarded. Frames written in a
+// single write are delivered atomically.
+ssize_t Server::Write(ioctx_t* ctx, const uint8_t* buf, size_t count)
+{
+	if ( !tagged )
+		return errno = EBADF, -1;
+	ScopedLock lock(&connect_lock);
+	size_t sofar = 0;
+	while ( sofar < count )
+	{
+		if ( writing_header_used < sizeof(writing_header) )
+		{
+			size_t amount = sizeof(writing_header) - writing_header_used;
+			if ( count - sofar < amount )
+				amount = count - sofar;
+			uint8_t* dst = (uint8_t*) &writing_header + writing_header_used;
+			if ( !ctx->copy_from_src(dst, buf + sofar, amount) )
+				return sofar ? (ssize_t) sofar : -1;
+			writing_header_used += amount;
+			sofar += amount;
+			if ( writing_header_used < sizeof(writing_header) )
+				break;
+			writing_left = writing_header.size;
+			writing_failed = false;
+			if ( (writing = FindSent(writing_header.tag)) )
+			{
+				UnlinkSent(writing);
+				writing->response_used = 0;
+				writing->response_offset = 0;
+				if ( TAGGED_RESPONSE_MAX < writing_left )
+					writing_failed = true;
+				else if ( writing->response_length < writing_left )
+				{
+					delete[] writing->response;
+					writing->response_length = 0;
+					writing->response = new uint8_t[writing_left];
+					if ( writing->response )
+						writing->response_length = writing_left;
+					else
+						writing_failed = true;
+				}
+			}
+			if ( !writing_left )
+				FinishResponse();
+			continue;
+		}
+		size_t amount = writing_left;
+		if ( count - sofar < amount )
+			amount = count - sofar;
+		if ( writing && !writing_failed )
+		{
+			uint8_t* dst = writing->response + writing->response_used;
+			if ( !ctx->copy_from_src(dst, buf + sofar, amount) )
+			{
+				writing_failed = true;
+				return sofar ? (ssize_t) sofar : -1;
+			}
+			writing->response_used += amount;
+		}
+		writing_left -= amount;
+		sofar += amount;
+		if ( !writing_left )
+			FinishResponse();
+	}
+	return (ssize_t) sofar;
+}
+
+StreamChannel* Server::Accept()
+{
+	if ( tagged )
+		return errno = EINVAL, (StreamChannel*) NULL;
+	ScopedLock lock(&connect_lock);
+	listener_thread = CurrentThread();
 	while ( !connecting && !unmounted )
 		if ( !kthread_cond_wait_signal(&connecting_cond, &connect_lock) )
-			return errno = EINTR, (Channel*) NULL;
+			return errno = EINTR, (StreamChannel*) NULL;
 	if ( unmounted )
-		return errno = ECONNRESET, (Channel*) NULL;
-	Channel* result = connecting;
+		return errno = ECONNRESET, (StreamChannel*) NULL;
+	StreamChannel* result = connecting;
 	connecting = NULL;
 	kthread_cond_signal(&connectable_cond);
 	return result;
@@ -637,13 +1187,23 @@ Ref<Inode> ServerNode::accept(ioctx_t* ctx, uint8_t* addr, size_t* addrlen,
 	Ref<ChannelNode> node(new ChannelNode);
 	if ( !node )
 		return Ref<Inode>(NULL);
-	Channel* channel = server->Accept();
+	StreamChannel* channel = server->Accept();
 	if ( !channel )
 		return Ref<Inode>(NULL);
 	node->Construct(channel);
 	return node;
 }
 
+ssize_t ServerNode::read(ioctx_t* ctx, uint8_t* buf, size_t count)
+{
+	return server->Read(ctx, buf, count);
+}
+
+ssize_t ServerNode::write(ioctx_t* ctx, const uint8_t* buf, size_t count)
+{
+	return server->Write(ctx, buf, count);
+}
+
 //
 // Implementation of Unode.
 //
@@ -875,6 +1435,8 @@ off_t Unode::lseek(ioctx_t* ctx, off_t offset, int whence)
 
 ssize_t Unode::read(ioctx_t* ctx, uint8_t* buf, size_t count)
 {
+	if ( TRANSFER_MAX < count )
+		count = TRANSFER_MAX;
 	Channel* channel = server->Connect(ctx);
 	if ( !channel )
 		return -1;
@@ -897,6 +1459,8 @@ ssize_t Unode::read(ioctx_t* ctx, uint8_t* buf, size_t count)
 
 ssize_t Unode::pread(ioctx_t* ctx, uint8_t* buf, size_t count, off_t off)
 {
+	if ( TRANSFER_MAX < count )
+		count = TRANSFER_MAX;
 	Channel* channel = server->Connect(ctx);
 	if ( !channel )
 		return -1;
@@ -920,6 +1484,8 @@ ssize_t Unode::pread(ioctx_t* ctx, uint8_t* buf, size_t count, off_t off)
 
 ssize_t Unode::write(ioctx_t* ctx, const uint8_t* buf, size_t count)
 {
+	if ( TRANSFER_MAX < count )
+		count = TRANSFER_MAX;
 	Channel* channel = server->Connect(ctx);
 	if ( !channel )
 		return -1;
@@ -944,6 +1510,8 @@ ssize_t Unode::write(ioctx_t* ctx, const uint8_t* buf, size_t count)
 
 ssize_t Unode::pwrite(ioctx_t* ctx, const uint8_t* buf, size_t count, off_t off)
 {
+	if ( TRANSFER_MAX < count )
+		count = TRANSFER_MAX;
 	Channel* channel = server->Connect(ctx);
 	if ( !channel )
 		return -1;
@@ -999,47 +1567,78 @@ int Unode::isatty(ioctx_t* ctx)
 	return ret;
 }
 
+// The entries from the server are checked and given the device number of the
+// server in a kernel buffer before they are handed out, which limits how many
+// entries are listed at once.
+static const size_t READDIRENTS_MAX = 64 * 1024;
+
+static bool FixupDirents(uint8_t* buffer, size_t size, dev_t dev)
+{
+	size_t offset = 0;
+	while ( offset < size )
+	{
+		if ( size - offset < sizeof(struct dirent) )
+			return false;
+		struct dirent* entry = (struct dirent*) (buffer + offset);
+		if ( entry->d_reclen < sizeof(struct dirent) ||
+		     entry->d_reclen % alignof(struct dirent) ||
+		     size - offset < entry->d_reclen ||
+		     entry->d_reclen - sizeof(struct dirent) <= entry->d_namlen )
+			return false;
+		entry->d_name[entry->d_namlen] = '\0';
+		entry->d_dev = dev;
+		offset += entry->d_reclen;
+	}
+	return true;
+}
+
 ssize_t Unode::readdirents(ioctx_t* ctx, struct dirent* dirent, size_t size,
-                           off_t start)
+                           off_t* cookie)
 {
+	if ( READDIRENTS_MAX < size )
+		size = READDIRENTS_MAX;
 	Channel* channel = server->Connect(ctx);
 	if ( !channel )
 		return -1;
 	ssize_t ret = -1;
+	uint8_t* buffer = NULL;
 	struct fsm_req_readdirents msg;
 	struct fsm_resp_readdirents resp;
 	msg.ino = ino;
-	msg.rec_num = start;
-	errno = 0;
+	msg.cookie = *cookie;
+	msg.size = size;
 	if ( SendMessage(channel, FSM_REQ_READDIRENTS, &msg, sizeof(msg)) &&
 	     RecvMessage(channel, FSM_RESP_READDIRENTS, &resp, sizeof(resp)) )
 	{
-		if ( !resp.namelen )
+		if ( !resp.size && resp.needed )
+		{
+			struct dirent entry;
+			memset(&entry, 0, sizeof(entry));
+			entry.d_reclen = resp.needed;
+			if ( ctx->copy_to_dest(dirent, &entry, sizeof(entry)) )
+				errno = ERANGE;
+		}
+		else if ( !resp.size )
 		{
+			*cookie = resp.cookie;
 			ret = 0;
-			goto break_if;
 		}
-
-		struct dirent entry;
-		memset(&entry, 0, sizeof(entry));
-		entry.d_reclen = sizeof(entry) + resp.namelen + 1;
-		entry.d_namlen = resp.namelen;
-		entry.d_dev = (dev_t) server.Get();
-		entry.d_ino = resp.ino;
-		entry.d_type = resp.type;
-
-		if ( !ctx->copy_to_dest(dirent, &entry, sizeof(entry)) )
-			goto break_if;
-
-		if ( size < entry.d_reclen && (errno = ERANGE) )
-			goto break_if;
-
-		char nul = '\0';
-		if ( channel->KernelRecv(ctx, dirent->d_name, resp.namelen) &&
-		     ctx->copy_to_dest(&dirent->d_name[resp.namelen], &nul, 1) )
-			ret = (ssize_t) entry.d_reclen;
-	} break_if:
+		else if ( size < resp.size )
+			errno = EIO;
+		else if ( (buffer = new uint8_t[resp.size]) &&
+		          channel->KernelRecv(&kctx, buffer, resp.size) )
+		{
+			if ( !FixupDirents(buffer, resp.size, (dev_t) server.Get()) )
+				errno = EIO;
+			else if ( ctx->copy_to_dest(dirent, buffer, resp.size) )
+			{
+				*cookie = resp.cookie;
+				ret = (ssize_t) resp.size;
+			}
+		}
+	}
 	channel->KernelClose();
+	delete[] buffer;
 	return ret;
 }
 
@@ -1582,11 +2181,33 @@ int Unode::tcsetattr(ioctx_t* ctx, int actions, const struct termios* user_tio)
 	return ret;
 }
 
+// The file contents are owned by the server, which has no pages to share with
+// the kernel. Shared mappings are therefore not supported, while private
+// mappings are made by copying the file when it is mapped, which is a snapshot
+// that later changes to the file are not reflected in.
+addr_t Unode::mmap(ioctx_t* /*ctx*/, off_t /*off*/)
+{
+	return errno = ENODEV, 0;
+}
+
+int Unode::msync(ioctx_t* /*ctx*/, off_t /*off*/, size_t /*size*/)
+{
+	return errno = ENODEV, -1;
+}
+
+// The file system is only changed through the kernel, which invalidates the
+// names it changes, so lookups can skip the round trip to the server.
+bool Unode::names_cacheable()
+{
+	return true;
+}
+
 bool Bootstrap(Ref<Inode>* out_root,
                Ref<Inode>* out_server,
-               const struct stat* rootst)
+               const struct stat* rootst,
+               int flags)
 {
-	Ref<Server> server(new Server());
+	Ref<Server> server(new Server(flags & FSM_MOUNT_TAGGED));
 	if ( !server )
 		return false;
 
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -28,7 +28,8 @@
 namespace Sortix {
 namespace UserFS {
 
-bool Bootstrap(Ref<Inode>* out_root, Ref<Inode>* out_server, const struct stat* rootst);
+bool Bootstrap(Ref<Inode>* out_root, Ref<Inode>* out_server,
+               const struct stat* rootst, int flags);
 
 } // namespace UserFS
 } // namespace Sortix
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * futex.cpp
+ * Fast userspace mutual exclusion.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <timespec.h>
+
+#include <sortix/clock.h>
+#include <sortix/futex.h>
+#include <sortix/itimerspec.h>
+#include <sortix/timespec.h>
+
+#include <sortix/kernel/clock.h>
+#include <sortix/kernel/copy.h>
+#include <sortix/kernel/kernel.h>
+#include <sortix/kernel/kthread.h>
+#include <sortix/kernel/process.h>
+#include <sortix/kernel/syscall.h>
+#include <sortix/kernel/time.h>
+#include <sortix/kernel/timer.h>
+
+namespace Sortix {
+
+// Threads waiting on a futex word are kept in a hash table keyed by the
+// process and the address of the word. The futex word is only ever inspected
+// with the bucket lock held, which makes checking its value and going to sleep
+// atomic with respect to wakeups.
+struct futex_waiter
+{
+	struct futex_waiter* prev;
+	struct futex_waiter* next;
+	struct futex_bucket* bucket;
+	Process* process;
+	uintptr_t address;
+	kthread_cond_t cond;
+	bool woken;
+	bool timed_out;
+};
+
+struct futex_bucket
+{
+	kthread_mutex_t lock;
+	struct futex_waiter* first;
+	struct futex_waiter* last;
+};
+
+static const size_t FUTEX_BUCKETS = 256;
+static struct futex_bucket futex_buckets[FUTEX_BUCKETS];
+
+static struct futex_bucket* GetBucket(Process* process, uintptr_t address)
+{
+	uintptr_t hash = address / sizeof(int) ^ (uintptr_t) process / 64;
+	hash ^= hash / FUTEX_BUCKETS;
+	return &futex_buckets[hash % FUTEX_BUCKETS];
+}
+
+static void LinkWaiter(struct futex_bucket* bucket, struct futex_waiter* waiter)
+{
+	waiter->prev = bucket->last;
+	waiter->next = NULL;
+	if ( bucket->last )
+		bucket->last->next = waiter;
+	else
+		bucket->first = waiter;
+	bucket->last = waiter;
+}
+
+static void UnlinkWaiter(struct futex_bucket* bucket,
+                         struct futex_waiter* waiter)
+{
+	if ( waiter->prev )
+		waiter->prev->next = waiter->next;
+	else
+		bucket->first = waiter->next;
+	if ( waiter->next )
+		waiter->next->prev = waiter->prev;
+	else
+		bucket->last = waiter->prev;
+	waiter->prev = NULL;
+	waiter->next = NULL;
+}
+
+static void futex_timeout(Clock* /*clock*/, Timer* /*timer*/, void* ctx)
+{
+	struct futex_waiter* waiter = (struct futex_waiter*) ctx;
+	ScopedLock lock(&waiter->bucket->lock);
+	waiter->timed_out = true;
+	kthread_cond_signal(&waiter->cond);
+}
+
+static int futex_wait(int* user_address, int value,
+                      const struct timespec* user_timeout, int op)
+{
+	struct timespec timeout;
+	Clock* clock = NULL;
+	if ( user_timeout )
+	{
+		if ( !CopyFromUser(&timeout, user_timeout, sizeof(timeout)) )
+			return -1;
+		if ( timeout.tv_nsec < 0 || 1000000000 <= timeout.tv_nsec )
+			return errno = EINVAL, -1;
+		if ( !(clock = Time::GetClock(FUTEX_GET_CLOCK(op))) )
+			return -1;
+		struct timespec now;
+		clock->Get(&now, NULL);
+		if ( op & FUTEX_ABSOLUTE ? timespec_le(timeout, now) :
+		                           timespec_le(timeout, timespec_nul()) )
+			return errno = ETIMEDOUT, -1;
+	}
+
+	Process* process = CurrentProcess();
+	uintptr_t address = (uintptr_t) user_address;
+	struct futex_bucket* bucket = GetBucket(process, address);
+	struct futex_waiter waiter;
+	waiter.prev = NULL;
+	waiter.next = NULL;
+	waiter.bucket = bucket;
+	waiter.process = process;
+	waiter.address = address;
+	waiter.cond = KTHREAD_COND_INITIALIZER;
+	waiter.woken = false;
+	waiter.timed_out = false;
+
+	ScopedLock lock(&bucket->lock);
+	int current;
+	if ( !CopyFromUser(&current, user_address, sizeof(current)) )
+		return -1;
+	if ( current != value )
+		return errno = EAGAIN, -1;
+	LinkWaiter(bucket, &waiter);
+
+	Timer timer;
+	if ( clock )
+	{
+		struct itimerspec its;
+		its.it_interval = timespec_nul();
+		its.it_value = timeout;
+		int flags = op & FUTEX_ABSOLUTE ? TIMER_ABSOLUTE : 0;
+		timer.Attach(clock);
+		timer.Set(&its, NULL, flags, futex_timeout, &waiter);
+	}
+
+	bool interrupted = false;
+	while ( !waiter.woken && !waiter.timed_out && !interrupted )
+		interrupted = !kthread_cond_wait_signal(&waiter.cond, &bucket->lock);
+	if ( !waiter.woken )
+		UnlinkWaiter(bucket, &waiter);
+
+	if ( clock )
+	{
+		// The timeout callback takes the bucket lock.
+		lock.Reset();
+		timer.Cancel();
+		timer.Detach();
+	}
+
+	if ( waiter.woken )
+		return 0;
+	if ( waiter.timed_out )
+		return errno = ETIMEDOUT, -1;
+	return errno = EINTR, -1;
+}
+
+static int futex_wake(int* user_address, int count)
+{
+	Process* process = CurrentProcess();
+	uintptr_t address = (uintptr_t) user_address;
+	struct futex_bucket* bucket = GetBucket(process, address);
+	ScopedLock lock(&bucket->lock);
+	int woken = 0;
+	struct futex_waiter* waiter = bucket->first;
+	while ( waiter && woken < count )
+	{
+		struct futex_waiter* next = waiter->next;
+		if ( waiter->process == process && waiter->address == address )
+		{
+			UnlinkWaiter(bucket, waiter);
+			waiter->woken = true;
+			kthread_cond_signal(&waiter->cond);
+			woken++;
+		}
+		waiter = next;
+	}
+	return woken;
+}
+
+int sys_futex(int* user_address, int op, int value,
+              const struct timespec* user_timeout)
+{
+	if ( (uintptr_t) user_address % sizeof(int) )
+		return errno = EINVAL, -1;
+	switch ( FUTEX_GET_OP(op) )
+	{
+	case FUTEX_WAIT: return futex_wait(user_address, value, user_timeout, op);
+	case FUTEX_WAKE: return futex_wake(user_address, value);
+	default: return errno = EINVAL, -1;
+	}
+}
+
+} // namespace Sortix
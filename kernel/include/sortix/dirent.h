@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -75,6 +75,14 @@ struct dirent
 	__extension__ char d_name[];
 };
 
+#if __USE_SORTIX
+/* The record length of an entry whose name has the given length, such that the
+   next entry packed after it in a buffer is suitably aligned. */
+#define DIRENT_RECLEN(namelen) \
+	((sizeof(struct dirent) + (namelen) + 1 + __alignof__(struct dirent) - 1) & \
+	 ~(__alignof__(struct dirent) - 1))
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * sortix/futex.h
+ * Fast userspace mutual exclusion.
+ */
+
+#ifndef INCLUDE_SORTIX_FUTEX_H
+#define INCLUDE_SORTIX_FUTEX_H
+
+#include <sys/cdefs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sleep while the futex word has the given value, optionally until a timeout
+   on the clock given with FUTEX_CLOCK expires. The timeout is relative unless
+   FUTEX_ABSOLUTE is set. */
+#define FUTEX_WAIT 1
+
+/* Wake at most the given number of threads sleeping on the futex word. */
+#define FUTEX_WAKE 2
+
+#define FUTEX_ABSOLUTE (1 << 8)
+#define FUTEX_CLOCK(clock) ((clock) << 16)
+
+#define FUTEX_GET_OP(op) ((op) & 0xFF)
+#define FUTEX_GET_CLOCK(op) ((op) >> 16)
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -46,12 +46,17 @@ public:
 	kthread_mutex_t clock_mutex;
 	bool clock_callable_from_interrupt;
 	bool we_disabled_interrupts;
+	struct timespec (*interpolate)();
+	// Lets the timer interrupt be reprogrammed if a timer was armed that expires
+	// before the next timer interrupt.
+	void (*timers_changed)();
 
 public:
 	void SetCallableFromInterrupts(bool callable_from_interrupts);
 	void Set(struct timespec* now, struct timespec* res);
 	void Get(struct timespec* now, struct timespec* res);
 	void Advance(struct timespec duration);
+	bool GetNextTimerDelay(struct timespec* delay);
 	void Register(Timer* timer);
 	void Unlink(Timer* timer);
 	void Cancel(Timer* timer);
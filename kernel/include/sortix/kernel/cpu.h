@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -27,6 +27,53 @@
 
 namespace Sortix {
 
+namespace CPU {
+
+// The maximum number of processors that can be brought online.
+const size_t MAX_CPUS = 32;
+
+// The number of processors that have been brought online.
+size_t GetCount();
+
+// The index of the processor running this kernel code. This is the processor
+// that currently holds the kernel lock, which all kernel code runs with.
+size_t GetIndex();
+
+// Interrupts another processor such that it runs the scheduler.
+void Reschedule(size_t cpu);
+
+// Sets whether a signal is pending for the thread running on another processor
+// and interrupts it such that the signal is delivered.
+void SetSignalPending(size_t cpu, unsigned long pending);
+
+// Makes all other processors forget their cached virtual memory translations,
+// including those of the global kernel pages if requested.
+void FlushRemoteTLBs(bool global);
+
+// Makes all other processors forget their cached translations of the pages.
+void InvalidateRemotePages(const addr_t* pages, size_t count);
+
+// Stops all other processors, used when the kernel panics.
+void StopOthers();
+
+// Brings the application processors online.
+void InitSMP();
+
+// Releases the kernel lock and waits for interrupts forever, used by the idle
+// thread of each processor.
+__attribute__((noreturn))
+void Idle();
+
+// Stops the periodic timer interrupt of this processor when it goes idle and
+// instead programs the timer to interrupt at the next pending timer deadline.
+void EnterIdle();
+
+// Restores the periodic timer interrupt when this processor leaves its idle
+// thread, as running threads may need to be preempted.
+void LeaveIdle();
+
+} // namespace CPU
+
 // Functions for 32-bit and 64-bit x86.
 #if defined(__i386__) || defined(__x86_64__)
 namespace CPU {
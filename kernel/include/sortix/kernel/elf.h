@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -23,7 +23,12 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <sortix/kernel/refcount.h>
+
 namespace Sortix {
+
+class Descriptor;
+
 namespace ELF {
 
 struct Auxiliary
@@ -36,9 +41,9 @@ struct Auxiliary
 	size_t uthread_align;
 };
 
-// Reads the elf file into the current address space and returns the entry
+// Maps the elf file into the current address space and returns the entry
 // address of the program, or 0 upon failure.
-uintptr_t Load(const void* file, size_t filelen, Auxiliary* aux);
+uintptr_t Load(Ref<Descriptor> desc, Auxiliary* aux);
 
 } // namespace ELF
 } // namespace Sortix
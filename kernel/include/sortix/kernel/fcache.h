@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -28,6 +28,7 @@
 #include <sortix/kernel/addralloc.h>
 #include <sortix/kernel/kthread.h>
 #include <sortix/kernel/memorymanagement.h>
+#include <sortix/kernel/pressure.h>
 
 namespace Sortix {
 
@@ -54,9 +55,13 @@ public:
 	void MarkUsed(BlockCacheBlock* block);
 	void MarkModified(BlockCacheBlock* block);
 	uint8_t* BlockData(BlockCacheBlock* block);
+	addr_t ShareBlockFrame(BlockCacheBlock* block);
 
 public:
 	bool AddArea();
+	bool PopulateBlock(BlockCacheBlock* block);
+	void DepopulateBlock(BlockCacheBlock* block);
+	size_t Shrink(size_t pages);
 	void UnlinkBlock(BlockCacheBlock* block);
 	void LinkBlock(BlockCacheBlock* block);
 	uint8_t* BlockDataUnlocked(BlockCacheBlock* block);
@@ -72,7 +77,9 @@ private:
 	BlockCacheBlock* mru_block;
 	BlockCacheBlock* lru_block;
 	BlockCacheBlock* unused_block;
+	BlockCacheBlock* nonpresent_block;
 	kthread_mutex_t bcache_mutex;
+	struct shrinker shrinker;
 
 };
 
@@ -106,6 +113,8 @@ public:
 	ssize_t pwrite(ioctx_t* ctx, const uint8_t* buf, size_t count, off_t off);
 	int truncate(ioctx_t* ctx, off_t length);
 	off_t lseek(ioctx_t* ctx, off_t offset, int whence);
+	addr_t mmap(ioctx_t* ctx, off_t off);
+	int msync(ioctx_t* ctx, off_t off, size_t size);
 	//bool ChangeBackend(FileCacheBackend* backend, bool sync_old);
 	off_t GetFileSize();
 
@@ -27,6 +27,7 @@
 
 #include <sortix/timespec.h>
 
+#include <sortix/kernel/decl.h>
 #include <sortix/kernel/refcount.h>
 
 struct dirent;
@@ -70,7 +71,7 @@ public:
 	virtual int utimens(ioctx_t* ctx, const struct timespec* times) = 0;
 	virtual int isatty(ioctx_t* ctx) = 0;
 	virtual ssize_t readdirents(ioctx_t* ctx, struct dirent* dirent,
-	                            size_t size, off_t start) = 0;
+	                            size_t size, off_t* cookie) = 0;
 	virtual Ref<Inode> open(ioctx_t* ctx, const char* filename, int flags,
 	                        mode_t mode) = 0;
 	virtual int mkdir(ioctx_t* ctx, const char* filename, mode_t mode) = 0;
@@ -114,6 +115,9 @@ public:
 	virtual pid_t tcgetsid(ioctx_t* ctx) = 0;
 	virtual int tcsendbreak(ioctx_t* ctx, int duration) = 0;
 	virtual int tcsetattr(ioctx_t* ctx, int actions, const struct termios* tio) = 0;
+	virtual addr_t mmap(ioctx_t* ctx, off_t off) = 0;
+	virtual int msync(ioctx_t* ctx, off_t off, size_t size) = 0;
+	virtual bool names_cacheable() = 0;
 
 };
 
@@ -163,7 +167,7 @@ public:
 	virtual int utimens(ioctx_t* ctx, const struct timespec* times);
 	virtual int isatty(ioctx_t* ctx);
 	virtual ssize_t readdirents(ioctx_t* ctx, struct dirent* dirent,
-	                            size_t size, off_t start);
+	                            size_t size, off_t* cookie);
 	virtual Ref<Inode> open(ioctx_t* ctx, const char* filename, int flags,
 	                        mode_t mode);
 	virtual int mkdir(ioctx_t* ctx, const char* filename, mode_t mode);
@@ -207,6 +211,9 @@ public:
 	virtual pid_t tcgetsid(ioctx_t* ctx);
 	virtual int tcsendbreak(ioctx_t* ctx, int duration);
 	virtual int tcsetattr(ioctx_t* ctx, int actions, const struct termios* tio);
+	virtual addr_t mmap(ioctx_t* ctx, off_t off);
+	virtual int msync(ioctx_t* ctx, off_t off, size_t size);
+	virtual bool names_cacheable();
 
 };
 
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -114,6 +114,7 @@ void RegisterHandler(unsigned int index, struct interrupt_handler* handler);
 void UnregisterHandler(unsigned int index, struct interrupt_handler* handler);
 
 void Init();
+void InitCPU();
 void InitWorker();
 void WorkerThread(void* user);
 
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -20,15 +20,19 @@
 #ifndef INCLUDE_SORTIX_KERNEL_MEMORYMANAGEMENT_H
 #define INCLUDE_SORTIX_KERNEL_MEMORYMANAGEMENT_H
 
+#include <sys/types.h>
+
 #include <stddef.h>
 #include <stdint.h>
 
 #include <sortix/kernel/decl.h>
+#include <sortix/kernel/refcount.h>
 
 typedef struct multiboot_info multiboot_info_t;
 
 namespace Sortix {
 
+class Descriptor;
 class Process;
 
 enum page_usage
@@ -60,8 +64,13 @@ addr_t Get(enum page_usage usage);
 addr_t GetUnlocked(enum page_usage usage);
 addr_t Get32Bit(enum page_usage usage);
 addr_t Get32BitUnlocked(enum page_usage usage);
+addr_t GetContiguous(size_t count, enum page_usage usage);
+addr_t GetContiguous32Bit(size_t count, enum page_usage usage);
 void Put(addr_t page, enum page_usage usage);
 void PutUnlocked(addr_t page, enum page_usage usage);
+void PutContiguous(addr_t page, size_t count, enum page_usage usage);
+void ShareUnlocked(addr_t page);
+bool IsShared(addr_t page);
 void Lock();
 void Unlock();
 
@@ -79,12 +88,33 @@ inline bool IsAligned(addr_t page) { return AlignDown(page) == page; }
 } // namespace Page
 } // namespace Sortix
 
+namespace Sortix {
+
+// Collects the virtual pages whose translations were changed, such that the
+// processors forget them one by one, or forget everything if too many pages
+// were changed.
+static const size_t TLB_GATHER_PAGES = 32;
+
+struct tlb_gather
+{
+	addr_t pages[TLB_GATHER_PAGES];
+	size_t count;
+	bool flush;
+	bool global;
+};
+
+} // namespace Sortix
+
 namespace Sortix {
 namespace Memory {
 
 void Init(multiboot_info_t* bootinfo);
 void InvalidatePage(addr_t addr);
 void Flush();
+void TLBGatherInit(struct tlb_gather* gather);
+void TLBGatherPage(struct tlb_gather* gather, addr_t addr);
+void TLBGatherRange(struct tlb_gather* gather, addr_t addr, size_t size);
+void TLBGatherFinish(struct tlb_gather* gather);
 addr_t Fork();
 addr_t GetAddressSpace();
 addr_t SwitchAddressSpace(addr_t addrspace);
@@ -95,19 +125,30 @@ addr_t Physical(addr_t mapto);
 int PageProtection(addr_t mapto);
 bool LookUp(addr_t mapto, addr_t* physical, int* prot);
 int ProvidedProtection(int prot);
-void PageProtect(addr_t mapto, int protection);
-void PageProtectAdd(addr_t mapto, int protection);
-void PageProtectSub(addr_t mapto, int protection);
+bool PageProtect(addr_t mapto, int protection);
+bool PageProtectAdd(addr_t mapto, int protection);
+bool PageProtectSub(addr_t mapto, int protection);
+bool PageProtectRange(addr_t where, size_t bytes, int protection);
+bool SplitLargePages(addr_t where, size_t bytes);
 bool MapRange(addr_t where, size_t bytes, int protection, enum page_usage usage);
 bool UnmapRange(addr_t where, size_t bytes, enum page_usage usage);
+bool MapLazyRange(addr_t where, size_t bytes, int protection,
+                  bool file = false);
+bool MapFilePage(addr_t mapto, addr_t physical, bool shared);
 void Statistics(size_t* amountused, size_t* totalmem);
+void UsageStatistics(size_t usage[PAGE_USAGE_NUM_KINDS]);
 addr_t GetKernelStack();
 size_t GetKernelStackSize();
 void GetKernelVirtualArea(addr_t* from, size_t* size);
 void GetUserVirtualArea(uintptr_t* from, size_t* size);
-void UnmapMemory(Process* process, uintptr_t addr, size_t size);
+bool UnmapMemory(Process* process, uintptr_t addr, size_t size);
 bool ProtectMemory(Process* process, uintptr_t addr, size_t size, int prot);
-bool MapMemory(Process* process, uintptr_t addr, size_t size, int prot);
+bool MapMemory(Process* process, uintptr_t addr, size_t size, int prot,
+               bool populate = false);
+bool MapFileMemory(Process* process, uintptr_t addr, size_t size, int prot,
+                   int flags, Ref<Descriptor> desc, off_t offset);
+bool HandlePageFault(addr_t address, bool write, bool user);
+bool HandleFilePageFault(addr_t page, bool locked);
 
 } // namespace Memory
 } // namespace Sortix
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * sortix/kernel/namecache.h
+ * Cache of the names looked up in directories.
+ */
+
+#ifndef INCLUDE_SORTIX_KERNEL_NAMECACHE_H
+#define INCLUDE_SORTIX_KERNEL_NAMECACHE_H
+
+#include <stddef.h>
+
+#include <sortix/kernel/refcount.h>
+
+namespace Sortix {
+
+class Inode;
+
+// Remembers which inode a name in a directory refers to, or that the name
+// doesn't exist, for the filesystems whose inodes allow their names to be
+// cached. The directories are identified by their device and inode number, as
+// some filesystems make new inode objects each time an inode is opened. The
+// entries are invalidated whenever a name is changed in a directory, and the
+// generation lets lookups detect the cache changed while they were looking.
+namespace NameCache {
+
+bool Lookup(Ref<Inode> dir, const char* name, Ref<Inode>* result);
+size_t Generation();
+void Insert(Ref<Inode> dir, const char* name, Ref<Inode> child,
+            size_t generation);
+void Invalidate(Ref<Inode> dir, const char* name);
+void InvalidateDevice(dev_t dev);
+
+} // namespace NameCache
+} // namespace Sortix
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * sortix/kernel/pressure.h
+ * Memory pressure and reclaiming memory from caches.
+ */
+
+#ifndef INCLUDE_SORTIX_KERNEL_PRESSURE_H
+#define INCLUDE_SORTIX_KERNEL_PRESSURE_H
+
+#include <stddef.h>
+
+#include <sortix/mempressure.h>
+
+namespace Sortix {
+
+// Caches register a shrinker that gives back memory they can do without when
+// the system runs low on memory. The shrink function frees up to the requested
+// amount of pages and returns how many pages it freed. It may be called while
+// the allocating thread holds arbitrary locks, so it must only try to lock its
+// own locks and give up if they're taken. Caches with modified pages that must
+// be written back before they can be freed also have a writeback function,
+// which is only called by the background reclaim and may block. It writes back
+// up to the requested amount of pages and returns how many it wrote, which the
+// shrink function can then free the next time.
+struct shrinker
+{
+	size_t (*shrink)(void* context, size_t pages);
+	size_t (*writeback)(void* context, size_t pages);
+	void* context;
+	struct shrinker* prev;
+	struct shrinker* next;
+};
+
+} // namespace Sortix
+
+namespace Sortix {
+namespace Pressure {
+
+void Init();
+void RegisterShrinker(struct shrinker* shrinker);
+void UnregisterShrinker(struct shrinker* shrinker);
+void Check();
+size_t Reclaim(size_t pages);
+bool Wait(struct mempressure* event);
+
+} // namespace Pressure
+} // namespace Sortix
+
+#endif
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -51,6 +51,7 @@ struct ProcessTimer;
 struct ioctx_struct;
 typedef struct ioctx_struct ioctx_t;
 struct segment;
+struct segment_node;
 
 class Process
 {
@@ -69,6 +70,9 @@ public:
 	kthread_mutex_t nicelock;
 	int nice;
 
+public:
+	size_t fpu_switches;
+
 public:
 	kthread_mutex_t idlock;
 	uid_t uid, euid;
@@ -139,11 +143,11 @@ public:
 	bool threads_exiting;
 
 public:
-	struct segment* segments;
-	size_t segments_used;
-	size_t segments_length;
+	struct segment_node* segment_tree;
 	kthread_mutex_t segment_write_lock;
 	kthread_mutex_t segment_lock;
+	size_t resident_pages;
+	size_t page_table_pages;
 
 public:
 	kthread_mutex_t user_timers_lock;
@@ -155,8 +159,8 @@ public:
 	Clock child_system_clock;
 
 public:
-	int Execute(const char* programname, const uint8_t* program,
-	            size_t programsize, int argc, const char* const* argv,
+	int Execute(const char* programname, Ref<Descriptor> program,
+	            int argc, const char* const* argv,
 	            int envc, const char* const* envp,
 	            struct thread_registers* regs);
 	void ResetAddressSpace();
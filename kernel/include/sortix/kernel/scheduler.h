@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -49,12 +49,18 @@ static inline void ExitThread()
 #endif
 
 void Switch(struct interrupt_context* intctx);
+void Tick(struct interrupt_context* intctx);
+void PreemptIfNeeded(struct interrupt_context* intctx);
 void SetThreadState(Thread* thread, ThreadState state);
 ThreadState GetThreadState(Thread* thread);
 void SetIdleThread(Thread* thread);
+bool HasPreviousThread(size_t cpu);
+void ReleasePreviousThread(size_t cpu);
+void WaitForExit(Thread* thread);
 void SetInitProcess(Process* init);
 Process* GetInitProcess();
 Process* GetKernelProcess();
+size_t GetRunningCPU(Thread* thread);
 void InterruptYieldCPU(struct interrupt_context* intctx, void* user);
 void ThreadExitCPU(struct interrupt_context* intctx, void* user);
 void SaveInterruptedContext(const struct interrupt_context* intctx,
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -20,18 +20,50 @@
 #ifndef INCLUDE_SORTIX_KERNEL_SEGMENT_H
 #define INCLUDE_SORTIX_KERNEL_SEGMENT_H
 
+#include <sys/types.h>
+
 #include <stddef.h>
 #include <stdint.h>
 
+#include <sortix/kernel/descriptor.h>
+#include <sortix/kernel/refcount.h>
+
 namespace Sortix {
 
 class Process;
 
+// Shared mappings of files not opened for writing can't be made writable.
+const int SEGMENT_READ_ONLY = 1 << 16;
+
+// Segments backed by a file have its pages at offset in the file, which are
+// shared with the file if flags contains MAP_SHARED.
 struct segment
 {
+	segment() : addr(0), size(0), prot(0), flags(0), offset(0) { }
 	uintptr_t addr;
 	size_t size;
 	int prot;
+	int flags;
+	Ref<Descriptor> desc;
+	off_t offset;
+};
+
+// The segments of a process are kept in a balanced tree ordered by address,
+// where each node summarizes its subtree such that the gaps between segments
+// can be searched in logarithmic time.
+struct segment_node : public segment
+{
+	segment_node() : parent(NULL), left(NULL), right(NULL), height(1),
+	                 subtree_addr(0), subtree_end(0), subtree_gap(0),
+	                 subtree_size(0) { }
+	struct segment_node* parent;
+	struct segment_node* left;
+	struct segment_node* right;
+	size_t height;
+	uintptr_t subtree_addr; // Where the first segment in the subtree begins.
+	uintptr_t subtree_end; // Where the last segment in the subtree ends.
+	size_t subtree_gap; // The largest gap between segments in the subtree.
+	size_t subtree_size; // The total size of the segments in the subtree.
 };
 
 static inline int segmentcmp(const void* a_ptr, const void* b_ptr)
@@ -45,11 +77,18 @@ static inline int segmentcmp(const void* a_ptr, const void* b_ptr)
 	                            0 ;
 }
 
+void SplitSegment(struct segment* left, struct segment* right, uintptr_t at);
 bool AreSegmentsOverlapping(const struct segment* a, const struct segment* b);
 bool IsUserspaceSegment(const struct segment* segment);
 struct segment* FindOverlappingSegment(Process* process, const struct segment* new_segment);
 bool IsSegmentOverlapping(Process* process, const struct segment* new_segment);
 bool AddSegment(Process* process, const struct segment* new_segment);
+void RemoveSegment(Process* process, struct segment* segment);
+void UpdateSegment(struct segment* segment);
+struct segment* FirstSegment(Process* process);
+struct segment* NextSegment(struct segment* segment);
+struct segment_node* CloneSegmentTree(const struct segment_node* tree);
+void DeleteSegmentTree(struct segment_node* tree);
 bool PlaceSegment(struct segment* solution, Process* process, void* addr_ptr,
                   size_t size, int flags);
 
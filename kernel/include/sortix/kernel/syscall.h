@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -30,6 +30,7 @@
 #include <sortix/exit.h>
 #include <sortix/fork.h>
 #include <sortix/itimerspec.h>
+#include <sortix/memusage.h>
 #include <sortix/poll.h>
 #include <sortix/resource.h>
 #include <sortix/sigaction.h>
@@ -82,6 +83,7 @@ int sys_fstatvfs(int, struct statvfs*);
 int sys_fstatvfsat(int, const char*, struct statvfs*, int);
 int sys_fsync(int);
 int sys_ftruncate(int, off_t);
+int sys_futex(int*, int, int, const struct timespec*);
 int sys_futimens(int, const struct timespec*);
 gid_t sys_getegid(void);
 int sys_getentropy(void*, size_t);
@@ -107,10 +109,12 @@ int sys_linkat(int, const char*, int, const char*, int);
 int sys_listen(int, int);
 off_t sys_lseek(int, off_t, int);
 int sys_memstat(size_t*, size_t*);
+int sys_memusage(struct memusage*);
 int sys_mkdirat(int, const char*, mode_t);
 int sys_mkpartition(int, off_t, off_t, int);
 void* sys_mmap_wrapper(struct mmap_request*);
 int sys_mprotect(const void*, size_t, int);
+int sys_msync(void*, size_t, int);
 int sys_munmap(void*, size_t);
 int sys_openat(int, const char*, int, mode_t);
 int sys_pipe2(int*, int);
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -60,8 +60,8 @@ public:
 	~Thread();
 
 public:
-	uintptr_t system_tid;
-	uintptr_t yield_to_tid;
+	Thread* yield_to;
+	Thread* hash_next;
 	struct thread_registers registers;
 	uint8_t* self_allocation;
 	size_t id;
@@ -70,7 +70,13 @@ public:
 	Thread* nextsibling;
 	Thread* scheduler_list_prev;
 	Thread* scheduler_list_next;
+	size_t scheduler_array;
+	int scheduler_priority;
+	int scheduler_bonus;
+	unsigned int scheduler_timeslice;
 	volatile ThreadState state;
+	size_t cpu;
+	volatile bool on_cpu;
 	sigset_t signal_pending;
 	sigset_t signal_mask;
 	stack_t signal_stack;
@@ -93,6 +99,7 @@ public:
 
 Thread* AllocateThread();
 void FreeThread(Thread* thread);
+bool IsThreadAlive(Thread* thread);
 
 Thread* CurrentThread();
 
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -29,6 +29,7 @@ namespace Sortix {
 class Clock;
 class Process;
 class Thread;
+struct interrupt_context;
 } // namespace Sortix
 
 namespace Sortix {
@@ -37,6 +38,13 @@ namespace Time {
 void Init();
 void Start();
 void OnTick(struct timespec tick_period, bool system_mode);
+void AccountTick(struct timespec tick_period, bool system_mode);
+void EnterIdle();
+void LeaveIdle();
+void InitClockSource();
+void InitLocalTimer();
+void OnLocalTimer(struct interrupt_context* intctx);
+void OnTimersChanged();
 void InitializeProcessClocks(Process* process);
 void InitializeThreadClocks(Thread* thread);
 struct timespec Get(clockid_t clock);
@@ -26,6 +26,7 @@
 
 #include <sortix/timespec.h>
 
+#include <sortix/kernel/decl.h>
 #include <sortix/kernel/refcount.h>
 
 struct dirent;
@@ -67,7 +68,7 @@ public:
 	int utimens(ioctx_t* ctx, const struct timespec* times);
 	int isatty(ioctx_t* ctx);
 	ssize_t readdirents(ioctx_t* ctx, struct dirent* dirent, size_t size,
-	                    off_t start);
+	                    off_t* cookie);
 	Ref<Vnode> open(ioctx_t* ctx, const char* filename, int flags, mode_t mode);
 	int mkdir(ioctx_t* ctx, const char* filename, mode_t mode);
 	int unlink(ioctx_t* ctx, const char* filename);
@@ -107,6 +108,12 @@ public:
 	pid_t tcgetsid(ioctx_t* ctx);
 	int tcsendbreak(ioctx_t* ctx, int duration);
 	int tcsetattr(ioctx_t* ctx, int actions, const struct termios* tio);
+	addr_t mmap(ioctx_t* ctx, off_t off);
+	int msync(ioctx_t* ctx, off_t off, size_t size);
+
+private:
+	Ref<Inode> OpenCached(ioctx_t* ctx, const char* filename, int flags,
+	                      mode_t mode);
 
 public /*TODO: private*/:
 	Ref<Inode> inode;
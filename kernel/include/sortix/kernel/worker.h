@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -14,7 +14,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  *
  * sortix/kernel/worker.h
- * Kernel worker thread.
+ * Kernel worker threads.
  */
 
 #ifndef SORTIX_WORKER_H
@@ -25,9 +25,20 @@
 namespace Sortix {
 namespace Worker {
 
+// Jobs are run by a pool of worker threads in order of priority, where one
+// worker is always kept available for high priority jobs.
+const size_t NUM_THREADS = 4;
+
+const int PRIORITY_HIGH = 0;
+const int PRIORITY_NORMAL = 1;
+const int PRIORITY_LOW = 2;
+const int NUM_PRIORITIES = 3;
+
 void Init();
-void Schedule(void (*func)(void*), void* user = NULL);
-bool TrySchedule(void (*func)(void*), void* user = NULL);
+void Schedule(void (*func)(void*), void* user = NULL,
+              int priority = PRIORITY_NORMAL);
+bool TrySchedule(void (*func)(void*), void* user = NULL,
+                 int priority = PRIORITY_NORMAL);
 void Thread(void* user = NULL);
 
 } // namespace Worker
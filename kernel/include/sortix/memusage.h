@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * sortix/memusage.h
+ * Declarations for memory usage statistics.
+ */
+
+#ifndef INCLUDE_SORTIX_MEMUSAGE_H
+#define INCLUDE_SORTIX_MEMUSAGE_H
+
+#include <sys/cdefs.h>
+
+#ifndef __size_t_defined
+#define __size_t_defined
+#define __need_size_t
+#include <stddef.h>
+#endif
+
+#define MEMUSAGE_OTHER 0
+#define MEMUSAGE_PHYSICAL 1
+#define MEMUSAGE_PAGING_OVERHEAD 2
+#define MEMUSAGE_KERNEL_HEAP 3
+#define MEMUSAGE_FILESYSTEM_CACHE 4
+#define MEMUSAGE_USER_SPACE 5
+#define MEMUSAGE_EXECUTE 6
+#define MEMUSAGE_DRIVER 7
+#define MEMUSAGE_NUM 8
+
+struct memusage
+{
+	size_t used;
+	size_t total;
+	size_t usage[MEMUSAGE_NUM];
+};
+
+#endif
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -44,7 +44,12 @@
 
 #define MAP_ANONYMOUS (1<<2)
 #define MAP_FIXED (1<<3)
+#define MAP_POPULATE (1<<4)
 
 #define MAP_FAILED ((void*) -1)
 
+#define MS_ASYNC (1<<0)
+#define MS_SYNC (1<<1)
+#define MS_INVALIDATE (1<<2)
+
 #endif
@@ -318,13 +318,22 @@ static void ExtractInitrd(Ref<Descriptor> desc, struct initrd_context* ctx)
 		uint8_t dirent_data[sizeof(struct dirent) + sizeof(uintmax_t) * 3];
 	};
 
-	while ( 0 < ctx->links->readdirents(&ctx->ioctx, &dirent, sizeof(dirent_data)) &&
-	        ((const char*) dirent.d_name)[0] )
+	ssize_t amount;
+	while ( 0 < (amount = ctx->links->readdirents(&ctx->ioctx, &dirent,
+	                                              sizeof(dirent_data))) )
 	{
-		if ( ((const char*) dirent.d_name)[0] == '.' )
-			continue;
-		ctx->links->unlinkat(&ctx->ioctx, dirent.d_name, AT_REMOVEFILE);
-		ctx->links->lseek(&ctx->ioctx, 0, SEEK_SET);
+		bool unlinked = false;
+		for ( size_t offset = 0; offset < (size_t) amount; )
+		{
+			struct dirent* entry = (struct dirent*) (dirent_data + offset);
+			offset += entry->d_reclen;
+			if ( entry->d_name[0] == '.' )
+				continue;
+			ctx->links->unlinkat(&ctx->ioctx, entry->d_name, AT_REMOVEFILE);
+			unlinked = true;
+		}
+		if ( unlinked )
+			ctx->links->lseek(&ctx->ioctx, 0, SEEK_SET);
 	}
 
 	ctx->links.Reset();
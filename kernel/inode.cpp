@@ -202,7 +202,7 @@ int AbstractInode::isatty(ioctx_t* /*ctx*/)
 ssize_t AbstractInode::readdirents(ioctx_t* /*ctx*/,
                                    struct dirent* /*dirent*/,
                                    size_t /*size*/,
-                                   off_t /*start*/)
+                                   off_t* /*cookie*/)
 {
 	if ( inode_type == INODE_TYPE_DIR )
 		return errno = EBADF, -1;
@@ -445,4 +445,19 @@ int AbstractInode::tcsetattr(ioctx_t* /*ctx*/, int /*actions*/, const struct ter
 	return errno = ENOTTY, -1;
 }
 
+addr_t AbstractInode::mmap(ioctx_t* /*ctx*/, off_t /*off*/)
+{
+	return errno = ENODEV, 0;
+}
+
+int AbstractInode::msync(ioctx_t* /*ctx*/, off_t /*off*/, size_t /*size*/)
+{
+	return errno = ENODEV, -1;
+}
+
+bool AbstractInode::names_cacheable()
+{
+	return false;
+}
+
 } // namespace Sortix
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -24,6 +24,7 @@
 #include <sortix/kernel/cpu.h>
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/kernel.h>
+#include <sortix/kernel/kthread.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/scheduler.h>
 #include <sortix/kernel/signal.h>
@@ -35,10 +36,14 @@
 namespace Sortix {
 namespace Interrupt {
 
+// Interrupt handlers queue work here for the interrupt worker thread, which
+// sleeps while the queue is empty. The queue is only accessed with interrupts
+// disabled.
 unsigned char* queue;
-volatile size_t queue_offset;
-volatile size_t queue_used;
+size_t queue_offset;
+size_t queue_used;
 const size_t QUEUE_SIZE = 4096;
+static kthread_cond_t queue_cond = KTHREAD_COND_INITIALIZER;
 
 struct worker_package
 {
@@ -60,10 +65,14 @@ static void WriteToQueue(const void* src, size_t size)
 {
 	assert(size <= QUEUE_SIZE - queue_used);
 	const unsigned char* input = (const unsigned char*) src;
-	for ( size_t i = 0; i < size; i++ )
+	size_t index = (queue_offset + queue_used) % QUEUE_SIZE;
+	size_t linear = QUEUE_SIZE - index;
+	if ( size <= linear )
+		memcpy(queue + index, input, size);
+	else
 	{
-		size_t index = (queue_offset + queue_used + i) % QUEUE_SIZE;
-		queue[index] = input[i];
+		memcpy(queue + index, input, linear);
+		memcpy(queue, input + linear, size - linear);
 	}
 	queue_used += size;
 }
@@ -72,39 +81,27 @@ static void ReadFromQueue(void* dst, size_t size)
 {
 	assert(size <= queue_used);
 	unsigned char* output = (unsigned char*) dst;
-	for ( size_t i = 0; i < size; i++ )
+	size_t linear = QUEUE_SIZE - queue_offset;
+	if ( size <= linear )
+		memcpy(output, queue + queue_offset, size);
+	else
 	{
-		size_t index = (queue_offset + i) % QUEUE_SIZE;
-		output[i] = queue[index];
+		memcpy(output, queue + queue_offset, linear);
+		memcpy(output + linear, queue, size - linear);
 	}
 	queue_offset = (queue_offset + size) % QUEUE_SIZE;
 	queue_used -= size;
 }
 
-static bool PopPackage(struct worker_package* package,
-                       unsigned char* payload,
-                       size_t payload_size)
+// The payload must have room for QUEUE_SIZE bytes.
+static void PopPackage(struct worker_package* package, unsigned char* payload)
 {
 	bool interrupts_was_enabled = Interrupt::SetEnabled(false);
-	if ( !queue_used )
-	{
-		Interrupt::SetEnabled(interrupts_was_enabled);
-		return false;
-	}
-
+	while ( !queue_used )
+		kthread_cond_wait(&queue_cond, NULL);
 	ReadFromQueue(package, sizeof(*package));
-	if ( !(package->payload_size <= payload_size) )
-	{
-		Interrupt::SetEnabled(interrupts_was_enabled);
-		assert(package->payload_size <= payload_size);
-		queue_offset = (queue_offset + package->payload_size) % QUEUE_SIZE;
-		return false;
-	}
-
 	ReadFromQueue(payload, package->payload_size);
-
 	Interrupt::SetEnabled(interrupts_was_enabled);
-	return true;
 }
 
 void WorkerThread(void* /*user*/)
@@ -112,17 +109,12 @@ void WorkerThread(void* /*user*/)
 	assert(Interrupt::IsEnabled());
 
 	struct worker_package package;
-	size_t storage_size = QUEUE_SIZE;
-	unsigned char* storage = new unsigned char[storage_size];
+	unsigned char* storage = new unsigned char[QUEUE_SIZE];
 	if ( !storage )
 		Panic("Can't allocate interrupt worker storage");
 	while ( true )
 	{
-		if ( !PopPackage(&package, storage, storage_size) )
-		{
-			Scheduler::Yield();
-			continue;
-		}
+		PopPackage(&package, storage);
 		unsigned char* payload = storage;
 		size_t payload_size = package.payload_size;
 		assert(package.handler);
@@ -149,8 +141,11 @@ bool ScheduleWork(void (*handler)(void*, void*, size_t),
 	if ( QUEUE_SIZE - queue_used < sizeof(package) + payload_size )
 		return false;
 
+	bool was_empty = !queue_used;
 	WriteToQueue(&package, sizeof(package));
 	WriteToQueue(payload, payload_size);
+	if ( was_empty )
+		kthread_cond_signal(&queue_cond);
 
 	return true;
 }
@@ -1112,7 +1112,8 @@ int sys_fsm_fsbind(int rootfd, int mpointfd, int flags)
 int sys_fsm_mountat(int dirfd, const char* path, const struct stat* rootst, int flags)
 {
 	if ( flags & ~(FSM_MOUNT_CLOEXEC | FSM_MOUNT_CLOFORK |
-	               FSM_MOUNT_NOFOLLOW | FSM_MOUNT_NONBLOCK) )
+	               FSM_MOUNT_NOFOLLOW | FSM_MOUNT_NONBLOCK |
+	               FSM_MOUNT_TAGGED) )
 		return -1;
 	int fdflags = 0;
 	if ( flags & FSM_MOUNT_CLOEXEC ) fdflags |= FD_CLOEXEC;
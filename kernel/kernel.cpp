@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -38,6 +38,7 @@
 #include <sortix/wait.h>
 
 #include <sortix/kernel/copy.h>
+#include <sortix/kernel/cpu.h>
 #include <sortix/kernel/decl.h>
 #include <sortix/kernel/descriptor.h>
 #include <sortix/kernel/dtable.h>
@@ -52,6 +53,7 @@
 #include <sortix/kernel/mtable.h>
 #include <sortix/kernel/panic.h>
 #include <sortix/kernel/pci.h>
+#include <sortix/kernel/pressure.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/ptable.h>
 #include <sortix/kernel/refcount.h>
@@ -71,6 +73,7 @@
 #include "disk/ata/ata.h"
 #include "fs/full.h"
 #include "fs/kram.h"
+#include "fs/mempressure.h"
 #include "fs/null.h"
 #include "fs/random.h"
 #include "fs/zero.h"
@@ -167,6 +170,12 @@ extern "C" void KernelInit(unsigned long magic, multiboot_info_t* bootinfo_p)
 	// Detect available physical memory.
 	Memory::Init(bootinfo);
 
+#if defined(__x86_64__)
+	// Access the segment bases with the faster instructions if supported.
+	if ( GDT::IsFSGSBaseSupported() )
+		GDT::InitializeFSGSBase();
+#endif
+
 	// Initialize the kernel log.
 	Log::Init(bootinfo);
 
@@ -346,7 +355,7 @@ static void SystemIdleThread(void* /*user*/)
 	// Alright, we are now the system idle thread. If there is nothing to do,
 	// then we are run. Note that we must never do any real work here as the
 	// idle thread must always be runnable.
-	while(true);
+	CPU::Idle();
 }
 
 static void BootThread(void* /*user*/)
@@ -376,10 +385,16 @@ static void BootThread(void* /*user*/)
 	// Initialize the worker thread data structures.
 	Worker::Init();
 
-	// Create a general purpose worker thread.
-	Thread* workerthread = RunKernelThread(Worker::Thread, NULL);
-	if ( !workerthread )
-		Panic("Unable to create general purpose worker thread");
+	// Create the general purpose worker threads.
+	for ( size_t i = 0; i < Worker::NUM_THREADS; i++ )
+	{
+		Thread* workerthread = RunKernelThread(Worker::Thread, NULL);
+		if ( !workerthread )
+			Panic("Unable to create general purpose worker thread");
+	}
+
+	// Reclaim memory from the caches when the system runs low on memory.
+	Pressure::Init();
 
 	//
 	// Stage 4. Initialize the Filesystem
@@ -425,6 +440,12 @@ static void BootThread(void* /*user*/)
 	// Stage 5. Loading and Initializing Core Drivers.
 	//
 
+	// Use the finest available clock source for timekeeping.
+	Time::InitClockSource();
+
+	// Bring the other processors online.
+	CPU::InitSMP();
+
 	// Initialize the real-time clock.
 	CMOS::Init();
 
@@ -501,6 +522,15 @@ static void BootThread(void* /*user*/)
 	if ( LinkInodeInDir(&ctx, slashdev, "urandom", random_device) != 0 )
 		Panic("Unable to link /dev/urandom to the random device.");
 
+	// Register the memory pressure device as /dev/mempressure.
+	Ref<Inode> mempressure_device(new MemoryPressure(slashdev->dev, (ino_t) 0,
+	                                                 (uid_t) 0, (gid_t) 0,
+	                                                 (mode_t) 0444));
+	if ( !mempressure_device )
+		Panic("Could not allocate a memory pressure device");
+	if ( LinkInodeInDir(&ctx, slashdev, "mempressure", mempressure_device) != 0 )
+		Panic("Unable to link /dev/mempressure to the memory pressure device.");
+
 	// Initialize the COM ports.
 	COM::Init("/dev", slashdev);
 
@@ -635,28 +665,6 @@ static void InitThread(void* /*user*/)
 	if ( !init )
 		PanicF("Could not open %s in early kernel RAM filesystem:\n%s",
 		       initpath, strerror(errno));
-	struct stat st;
-	if ( init->stat(&ctx, &st) )
-		PanicF("Could not stat '%s' in initrd.", initpath);
-	assert(0 <= st.st_size);
-	if ( (uintmax_t) SIZE_MAX < (uintmax_t) st.st_size )
-		PanicF("%s is bigger than SIZE_MAX.", initpath);
-	size_t programsize = st.st_size;
-	uint8_t* program = new uint8_t[programsize];
-	if ( !program )
-		PanicF("Unable to allocate 0x%zx bytes needed for %s.", programsize, initpath);
-	size_t sofar = 0;
-	while ( sofar < programsize )
-	{
-		ssize_t numbytes = init->read(&ctx, program+sofar, programsize-sofar);
-		if ( !numbytes )
-			PanicF("Premature EOF when reading %s.", initpath);
-		if ( numbytes < 0 )
-			PanicF("IO error when reading %s.", initpath);
-		sofar += numbytes;
-	}
-
-	init.Reset();
 
 	Log::PrintF("\r\e[m\e[J");
 
@@ -665,11 +673,10 @@ static void InitThread(void* /*user*/)
 	struct thread_registers regs;
 	assert((((uintptr_t) &regs) & (alignof(regs)-1)) == 0);
 
-	if ( process->Execute(initpath, program, programsize, argc, argv, envc,
-	                       envp, &regs) )
+	if ( process->Execute(initpath, init, argc, argv, envc, envp, &regs) )
 		PanicF("Unable to execute %s.", initpath);
 
-	delete[] program;
+	init.Reset();
 	delete[] argv;
 
 	// Now become the init process and the operation system shall run.
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,8 +17,11 @@
  * Utility and synchronization mechanisms for kernel threads.
  */
 
+#include <stdint.h>
+
 #include <sortix/signal.h>
 
+#include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/kthread.h>
 #include <sortix/kernel/scheduler.h>
@@ -32,38 +35,189 @@ namespace Sortix {
 static void kthread_do_kill_thread(void* user)
 {
 	Thread* thread = (Thread*) user;
-	while ( thread->state != ThreadState::DEAD )
-		kthread_yield();
+	// The processor that ran the thread may still be using its stack.
+	Scheduler::WaitForExit(thread);
 	FreeThread(thread);
 }
 
 extern "C" void kthread_exit()
 {
-	Worker::Schedule(kthread_do_kill_thread, CurrentThread());
+	Worker::Schedule(kthread_do_kill_thread, CurrentThread(),
+	                 Worker::PRIORITY_LOW);
 	Scheduler::ExitThread();
 	__builtin_unreachable();
 }
 
+// Threads waiting for an event are kept on a wait queue and taken off the run
+// queue until the event happens. The wait queues are only modified with
+// interrupts disabled, which makes the operations atomic with respect to other
+// threads (including those on other processors, as the kernel lock is held) and
+// allows waking threads from interrupt handlers.
 struct kthread_cond_elem
 {
 	kthread_cond_elem_t* next;
+	kthread_cond_elem_t* prev;
+	Thread* thread;
+	void* key;
 	volatile unsigned long woken;
 };
 
+static void kthread_wait_init(kthread_cond_elem_t* elem, void* key)
+{
+	elem->next = NULL;
+	elem->prev = NULL;
+	elem->thread = CurrentThread();
+	elem->key = key;
+	elem->woken = 0;
+}
+
+static void kthread_wait_insert(kthread_cond_t* queue, kthread_cond_elem_t* elem)
+{
+	elem->prev = queue->last;
+	elem->next = NULL;
+	if ( queue->last )
+		queue->last->next = elem;
+	else
+		queue->first = elem;
+	queue->last = elem;
+}
+
+static void kthread_wait_remove(kthread_cond_t* queue, kthread_cond_elem_t* elem)
+{
+	if ( elem->prev )
+		elem->prev->next = elem->next;
+	else
+		queue->first = elem->next;
+	if ( elem->next )
+		elem->next->prev = elem->prev;
+	else
+		queue->last = elem->prev;
+	elem->next = NULL;
+	elem->prev = NULL;
+}
+
+static void kthread_wait_wake(kthread_cond_t* queue, kthread_cond_elem_t* elem)
+{
+	kthread_wait_remove(queue, elem);
+	Thread* thread = elem->thread;
+	elem->woken = 1;
+	// The element lives on the stack of the woken thread and may be gone as
+	// soon as the thread runs again, so it must not be touched after this.
+	if ( thread->state == ThreadState::BLOCKING )
+		Scheduler::SetThreadState(thread, ThreadState::RUNNABLE);
+}
+
+// Sleeps until the element is woken, or until a signal is pending if the wait
+// is interruptible, in which case false is returned and the element is still
+// on the wait queue. Interrupts must be disabled.
+static bool kthread_wait_sleep(kthread_cond_elem_t* elem, bool interruptible)
+{
+	Thread* thread = elem->thread;
+	while ( !elem->woken )
+	{
+		if ( interruptible && Signal::IsPending() )
+			return false;
+		// The idle threads must always be runnable, so they merely yield.
+		if ( thread->state == ThreadState::RUNNABLE )
+			Scheduler::SetThreadState(thread, ThreadState::BLOCKING);
+		kthread_yield();
+	}
+	return true;
+}
+
+// Threads waiting for a mutex sleep on a wait queue shared by all the mutexes
+// whose address hash to it. A mutex is 0 if unlocked, 1 if locked, and 2 if
+// locked and threads may be waiting for it.
+static const size_t MUTEX_WAIT_QUEUES = 64;
+static kthread_cond_t mutex_wait_queues[MUTEX_WAIT_QUEUES];
+
+static kthread_cond_t* kthread_mutex_queue(kthread_mutex_t* mutex)
+{
+	uintptr_t hash = (uintptr_t) mutex / sizeof(kthread_mutex_t);
+	hash ^= hash / MUTEX_WAIT_QUEUES;
+	return &mutex_wait_queues[hash % MUTEX_WAIT_QUEUES];
+}
+
+static void kthread_mutex_wake(kthread_mutex_t* mutex)
+{
+	bool was_enabled = Interrupt::SetEnabled(false);
+	kthread_cond_t* queue = kthread_mutex_queue(mutex);
+	for ( kthread_cond_elem_t* elem = queue->first; elem; elem = elem->next )
+	{
+		if ( elem->key != mutex )
+			continue;
+		kthread_wait_wake(queue, elem);
+		break;
+	}
+	Interrupt::SetEnabled(was_enabled);
+}
+
+static bool kthread_mutex_sleep(kthread_mutex_t* mutex, bool interruptible)
+{
+	bool was_enabled = Interrupt::SetEnabled(false);
+	kthread_cond_t* queue = kthread_mutex_queue(mutex);
+	bool acquired = true;
+	// Mark the mutex as contended such that the owner wakes a waiter when it
+	// unlocks the mutex.
+	while ( __atomic_exchange_n(mutex, 2, __ATOMIC_ACQUIRE) != 0 )
+	{
+		kthread_cond_elem_t elem;
+		kthread_wait_init(&elem, mutex);
+		kthread_wait_insert(queue, &elem);
+		if ( !kthread_wait_sleep(&elem, interruptible) )
+		{
+			kthread_wait_remove(queue, &elem);
+			acquired = false;
+			break;
+		}
+	}
+	Interrupt::SetEnabled(was_enabled);
+	return acquired;
+}
+
+extern "C" unsigned kthread_mutex_trylock(kthread_mutex_t* mutex)
+{
+	unsigned expected = 0;
+	return __atomic_compare_exchange_n(mutex, &expected, 1, false,
+	                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+extern "C" void kthread_mutex_lock(kthread_mutex_t* mutex)
+{
+	if ( kthread_mutex_trylock(mutex) )
+		return;
+	kthread_mutex_sleep(mutex, false);
+}
+
+extern "C" unsigned long kthread_mutex_lock_signal(kthread_mutex_t* mutex)
+{
+	if ( Signal::IsPending() )
+		return 0;
+	if ( kthread_mutex_trylock(mutex) )
+		return 1;
+	return kthread_mutex_sleep(mutex, true) ? 1 : 0;
+}
+
+extern "C" void kthread_mutex_unlock(kthread_mutex_t* mutex)
+{
+	if ( __atomic_exchange_n(mutex, 0, __ATOMIC_RELEASE) == 2 )
+		kthread_mutex_wake(mutex);
+}
+
+// The mutex may be NULL if the condition is instead protected by the caller
+// having disabled interrupts, which is useful when waiting for interrupts.
 extern "C" void kthread_cond_wait(kthread_cond_t* cond, kthread_mutex_t* mutex)
 {
+	bool was_enabled = Interrupt::SetEnabled(false);
 	kthread_cond_elem_t elem;
-	elem.next = NULL;
-	elem.woken = 0;
-	if ( cond->last ) { cond->last->next = &elem; }
-	if ( !cond->last ) { cond->first = &elem; }
-	cond->last = &elem;
-	while ( !elem.woken )
-	{
+	kthread_wait_init(&elem, cond);
+	kthread_wait_insert(cond, &elem);
+	if ( mutex )
 		kthread_mutex_unlock(mutex);
-		Scheduler::Yield();
+	kthread_wait_sleep(&elem, false);
+	Interrupt::SetEnabled(was_enabled);
+	if ( mutex )
 		kthread_mutex_lock(mutex);
-	}
 }
 
 extern "C" unsigned long kthread_cond_wait_signal(kthread_cond_t* cond,
@@ -71,53 +225,36 @@ extern "C" unsigned long kthread_cond_wait_signal(kthread_cond_t* cond,
 {
 	if ( Signal::IsPending() )
 		return 0;
+	bool was_enabled = Interrupt::SetEnabled(false);
 	kthread_cond_elem_t elem;
-	elem.next = NULL;
-	elem.woken = 0;
-	if ( cond->last ) { cond->last->next = &elem; }
-	if ( !cond->last ) { cond->first = &elem; }
-	cond->last = &elem;
-	while ( !elem.woken )
-	{
-		if ( Signal::IsPending() )
-		{
-			if ( cond->first == &elem )
-			{
-				cond->first = elem.next;
-				if ( cond->last == &elem )
-					cond->last = NULL;
-			}
-			else
-			{
-				kthread_cond_elem_t* prev = cond->first;
-				while ( prev->next != &elem )
-					prev = prev->next;
-				prev->next = elem.next;
-				if ( cond->last == &elem )
-					cond->last = prev;
-			}
-			// Note that the thread still owns the mutex.
-			return 0;
-		}
+	kthread_wait_init(&elem, cond);
+	kthread_wait_insert(cond, &elem);
+	if ( mutex )
 		kthread_mutex_unlock(mutex);
-		Scheduler::Yield();
+	bool woken = kthread_wait_sleep(&elem, true);
+	if ( !woken )
+		kthread_wait_remove(cond, &elem);
+	Interrupt::SetEnabled(was_enabled);
+	// Note that the thread owns the mutex again even if interrupted.
+	if ( mutex )
 		kthread_mutex_lock(mutex);
-	}
-	return 1;
+	return woken ? 1 : 0;
 }
 
 extern "C" void kthread_cond_signal(kthread_cond_t* cond)
 {
-	kthread_cond_elem_t* elem = cond->first;
-	if ( !elem ) { return; }
-	if ( !(cond->first = elem->next) ) { cond->last = NULL; }
-	elem->next = NULL;
-	elem->woken = 1;
+	bool was_enabled = Interrupt::SetEnabled(false);
+	if ( cond->first )
+		kthread_wait_wake(cond, cond->first);
+	Interrupt::SetEnabled(was_enabled);
 }
 
 extern "C" void kthread_cond_broadcast(kthread_cond_t* cond)
 {
-	while ( cond->first ) { kthread_cond_signal(cond); }
+	bool was_enabled = Interrupt::SetEnabled(false);
+	while ( cond->first )
+		kthread_wait_wake(cond, cond->first);
+	Interrupt::SetEnabled(was_enabled);
 }
 
 } // namespace Sortix
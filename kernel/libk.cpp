@@ -67,7 +67,6 @@ void* libk_heap_expand(size_t* num_bytes)
 	enum Sortix::page_usage page_usage = Sortix::PAGE_USAGE_KERNEL_HEAP;
 	if ( !Sortix::Memory::MapRange(mapto, *num_bytes, prot, page_usage) )
 		return NULL;
-	Sortix::Memory::Flush();
 
 	return mapping;
 }
@@ -144,17 +143,17 @@ void* libk_mmap(size_t size, int prot)
 		FreeKernelAddress(&addralloc);
 		return NULL;
 	}
-	Memory::Flush();
 	return (void*) addralloc.from;
 }
 
 extern "C"
 void libk_mprotect(void* ptr, size_t size, int prot)
 {
-	addr_t mapto = (addr_t) ptr;
-	for ( size_t i = 0; i < size; i += Page::Size() )
-		Memory::PageProtect(mapto + i, prot);
-	Memory::Flush();
+	Memory::PageProtectRange((addr_t) ptr, size, prot);
+	struct tlb_gather gather;
+	Memory::TLBGatherInit(&gather);
+	Memory::TLBGatherRange(&gather, (addr_t) ptr, size);
+	Memory::TLBGatherFinish(&gather);
 }
 
 extern "C"
@@ -165,7 +164,10 @@ void libk_munmap(void* ptr, size_t size)
 	addralloc.from = (addr_t) ptr;
 	addralloc.size = size;
 	Memory::UnmapRange(addralloc.from, size, PAGE_USAGE_KERNEL_HEAP);
-	Memory::Flush();
+	struct tlb_gather gather;
+	Memory::TLBGatherInit(&gather);
+	Memory::TLBGatherRange(&gather, addralloc.from, size);
+	Memory::TLBGatherFinish(&gather);
 	FreeKernelAddress(&addralloc);
 }
 
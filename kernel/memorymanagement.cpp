@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <sortix/memusage.h>
 #include <sortix/mman.h>
 #include <sortix/seek.h>
 
@@ -51,12 +52,24 @@ int sys_memstat(size_t* memused, size_t* memtotal)
 	return 0;
 }
 
+static_assert(MEMUSAGE_NUM == PAGE_USAGE_NUM_KINDS,
+              "The memory usage kinds must match the page usage kinds");
+
+int sys_memusage(struct memusage* user_mu)
+{
+	struct memusage mu;
+	memset(&mu, 0, sizeof(mu));
+	Memory::Statistics(&mu.used, &mu.total);
+	Memory::UsageStatistics(mu.usage);
+	return CopyToUser(user_mu, &mu, sizeof(mu)) ? 0 : -1;
+}
+
 } // namespace Sortix
 
 namespace Sortix {
 namespace Memory {
 
-void UnmapMemory(Process* process, uintptr_t addr, size_t size)
+bool UnmapMemory(Process* process, uintptr_t addr, size_t size)
 {
 	// process->segment_write_lock is held.
 	// process->segment_lock is held.
@@ -67,8 +80,15 @@ void UnmapMemory(Process* process, uintptr_t addr, size_t size)
 	if ( UINTPTR_MAX - addr < size )
 		size = Page::AlignDown(UINTPTR_MAX - addr);
 	if ( !size )
-		return;
+		return true;
 
+	// Large pages never cross segments, so only the large pages at the ends of
+	// the range may need to be split, which is done before anything changes.
+	if ( !Memory::SplitLargePages(addr, size) )
+		return false;
+
+	struct tlb_gather gather;
+	Memory::TLBGatherInit(&gather);
 	struct segment unmap_segment;
 	unmap_segment.addr = addr;
 	unmap_segment.size = size;
@@ -79,18 +99,10 @@ void UnmapMemory(Process* process, uintptr_t addr, size_t size)
 		// Delete the segment if covered entirely by our request.
 		if ( addr <= conflict->addr && conflict->addr + conflict->size <= addr + size )
 		{
-			uintptr_t conflict_offset = (uintptr_t) conflict - (uintptr_t) process->segments;
-			size_t conflict_index = conflict_offset / sizeof(struct segment);
 			Memory::UnmapRange(conflict->addr, conflict->size, PAGE_USAGE_USER_SPACE);
-			Memory::Flush();
-			if ( conflict_index + 1 == process->segments_used )
-			{
-				process->segments_used--;
-				continue;
-			}
-			process->segments[conflict_index] = process->segments[--process->segments_used];
-			qsort(process->segments, process->segments_used,
-			      sizeof(struct segment), segmentcmp);
+			Memory::TLBGatherRange(&gather, conflict->addr, conflict->size);
+			Memory::TLBGatherFinish(&gather);
+			RemoveSegment(process, conflict);
 			continue;
 		}
 
@@ -98,16 +110,16 @@ void UnmapMemory(Process* process, uintptr_t addr, size_t size)
 		if ( conflict->addr < addr && addr + size - conflict->addr <= conflict->size )
 		{
 			Memory::UnmapRange(addr, size, PAGE_USAGE_USER_SPACE);
-			Memory::Flush();
+			Memory::TLBGatherRange(&gather, addr, size);
+			Memory::TLBGatherFinish(&gather);
 			struct segment right_segment;
-			right_segment.addr = addr + size;
-			right_segment.size = conflict->addr + conflict->size - (addr + size);
-			right_segment.prot = conflict->prot;
+			SplitSegment(conflict, &right_segment, addr + size);
 			conflict->size = addr - conflict->addr;
 			// TODO: This shouldn't really fail as we free memory above, but
 			//       this code isn't really provably reliable.
 			if ( !AddSegment(process, &right_segment) )
 				PanicF("Unexpectedly unable to split memory mapped segment");
+			UpdateSegment(conflict);
 			continue;
 		}
 
@@ -115,9 +127,12 @@ void UnmapMemory(Process* process, uintptr_t addr, size_t size)
 		if ( addr <= conflict->addr )
 		{
 			Memory::UnmapRange(conflict->addr, addr + size - conflict->addr, PAGE_USAGE_USER_SPACE);
-			Memory::Flush();
+			Memory::TLBGatherRange(&gather, conflict->addr, addr + size - conflict->addr);
+			Memory::TLBGatherFinish(&gather);
+			conflict->offset += (off_t) (addr + size - conflict->addr);
 			conflict->size = conflict->addr + conflict->size - (addr + size);
 			conflict->addr = addr + size;
+			UpdateSegment(conflict);
 			continue;
 		}
 
@@ -125,11 +140,15 @@ void UnmapMemory(Process* process, uintptr_t addr, size_t size)
 		if ( conflict->addr <= addr + size )
 		{
 			Memory::UnmapRange(addr, conflict->addr + conflict->size - addr, PAGE_USAGE_USER_SPACE);
-			Memory::Flush();
+			Memory::TLBGatherRange(&gather, addr, conflict->addr + conflict->size - addr);
+			Memory::TLBGatherFinish(&gather);
 			conflict->size -= conflict->addr + conflict->size - addr;
+			UpdateSegment(conflict);
 			continue;
 		}
 	}
+
+	return true;
 }
 
 bool ProtectMemory(Process* process, uintptr_t addr, size_t size, int prot)
@@ -144,7 +163,10 @@ bool ProtectMemory(Process* process, uintptr_t addr, size_t size, int prot)
 	// smaller segments that doesn't cross addr and addr+size, while verifying
 	// there are no gaps in that region. This is where the operation can fail as
 	// the AddSegment call can run out of memory. There is no harm in splitting
-	// the segments into smaller chunks.
+	// the segments into smaller chunks. The large pages at the ends of the
+	// range are likewise split first, as splitting them can fail as well.
+	if ( !Memory::SplitLargePages(addr, size) )
+		return false;
 	for ( size_t offset = 0; offset < size; )
 	{
 		struct segment search_region;
@@ -160,16 +182,14 @@ bool ProtectMemory(Process* process, uintptr_t addr, size_t size, int prot)
 		if ( segment->addr < search_region.addr )
 		{
 			struct segment new_segment;
-			new_segment.addr = search_region.addr;
-			new_segment.size = segment->addr + segment->size - new_segment.addr;
-			new_segment.prot = segment->prot;
-			segment->size = search_region.addr - segment->addr;
+			SplitSegment(segment, &new_segment, search_region.addr);
 
 			if ( !AddSegment(process, &new_segment) )
 			{
 				segment->size += new_segment.size;
 				return false;
 			}
+			UpdateSegment(segment);
 
 			continue;
 		}
@@ -178,16 +198,14 @@ bool ProtectMemory(Process* process, uintptr_t addr, size_t size, int prot)
 		if ( size < segment->addr + segment->size - addr )
 		{
 			struct segment new_segment;
-			new_segment.addr = addr + size;
-			new_segment.size = segment->addr + segment->size - new_segment.addr;
-			new_segment.prot = segment->prot;
-			segment->size = addr + size - segment->addr;
+			SplitSegment(segment, &new_segment, addr + size);
 
 			if ( !AddSegment(process, &new_segment) )
 			{
 				segment->size += new_segment.size;
 				return false;
 			}
+			UpdateSegment(segment);
 
 			continue;
 		}
@@ -197,6 +215,8 @@ bool ProtectMemory(Process* process, uintptr_t addr, size_t size, int prot)
 
 	// Run through all the segments in the region [addr, addr+size) and change
 	// the permissions and update the permissions of the virtual memory itself.
+	struct tlb_gather gather;
+	Memory::TLBGatherInit(&gather);
 	for ( size_t offset = 0; offset < size; )
 	{
 		struct segment search_region;
@@ -213,18 +233,20 @@ bool ProtectMemory(Process* process, uintptr_t addr, size_t size, int prot)
 			//       what applies to the actual pages.
 			// TODO: SECURTIY: Does this have security implications?
 			segment->prot = prot;
-			for ( size_t i = 0; i < segment->size; i += Page::Size() )
-				Memory::PageProtect(segment->addr + i, prot);
-			Memory::Flush();
+			Memory::PageProtectRange(segment->addr, segment->size, prot);
+			Memory::TLBGatherRange(&gather, segment->addr, segment->size);
 		}
 
 		offset += segment->size;
 	}
+	Memory::TLBGatherFinish(&gather);
 
 	return true;
 }
 
-bool MapMemory(Process* process, uintptr_t addr, size_t size, int prot)
+// The memory is allocated and zeroed on first use unless it is populated now.
+bool MapMemory(Process* process, uintptr_t addr, size_t size, int prot,
+               bool populate)
 {
 	// process->segment_write_lock is held.
 	// process->segment_lock is held.
@@ -232,21 +254,30 @@ bool MapMemory(Process* process, uintptr_t addr, size_t size, int prot)
 	assert(Page::IsAligned(size));
 	assert(process == CurrentProcess());
 
-	UnmapMemory(process, addr, size);
+	if ( !UnmapMemory(process, addr, size) )
+		return false;
 
 	struct segment new_segment;
 	new_segment.addr = addr;
 	new_segment.size = size;
 	new_segment.prot = prot;
 
-	if ( !MapRange(new_segment.addr, new_segment.size, new_segment.prot, PAGE_USAGE_USER_SPACE) )
+	if ( !populate )
+	{
+		if ( !MapLazyRange(new_segment.addr, new_segment.size, new_segment.prot) )
+			return false;
+	}
+	else if ( !MapRange(new_segment.addr, new_segment.size, new_segment.prot, PAGE_USAGE_USER_SPACE) )
 		return false;
-	Memory::Flush();
+	// The translations of the range were already invalidated when unmapped.
 
 	if ( !AddSegment(process, &new_segment) )
 	{
 		UnmapRange(new_segment.addr, new_segment.size, PAGE_USAGE_USER_SPACE);
-		Memory::Flush();
+		struct tlb_gather gather;
+		TLBGatherInit(&gather);
+		TLBGatherRange(&gather, new_segment.addr, new_segment.size);
+		TLBGatherFinish(&gather);
 		return false;
 	}
 
@@ -255,11 +286,91 @@ bool MapMemory(Process* process, uintptr_t addr, size_t size, int prot)
 	// TODO: Another thread is able to see the old contents of the memory before
 	//       we zero it causing potential information leaks.
 	// TODO: SECURITY: Information leak.
-	memset((void*) new_segment.addr, 0, new_segment.size);
+	if ( populate )
+		memset((void*) new_segment.addr, 0, new_segment.size);
+
+	return true;
+}
+
+// The pages are read from the file when first used.
+bool MapFileMemory(Process* process, uintptr_t addr, size_t size, int prot,
+                   int flags, Ref<Descriptor> desc, off_t offset)
+{
+	// process->segment_write_lock is held.
+	// process->segment_lock is held.
+	assert(Page::IsAligned(addr));
+	assert(Page::IsAligned(size));
+	assert(process == CurrentProcess());
+
+	if ( !UnmapMemory(process, addr, size) )
+		return false;
+
+	struct segment new_segment;
+	new_segment.addr = addr;
+	new_segment.size = size;
+	new_segment.prot = prot;
+	new_segment.flags = flags;
+	new_segment.desc = desc;
+	new_segment.offset = offset;
+
+	if ( !MapLazyRange(new_segment.addr, new_segment.size, new_segment.prot, true) )
+		return false;
+	// The translations of the range were already invalidated when unmapped.
+
+	if ( !AddSegment(process, &new_segment) )
+	{
+		UnmapRange(new_segment.addr, new_segment.size, PAGE_USAGE_USER_SPACE);
+		return false;
+	}
 
 	return true;
 }
 
+// The kernel only accesses user-space memory with the segment lock held, which
+// then is locked already. Otherwise the lock isn't held while reading the file,
+// as reading files may copy to user-space.
+bool HandleFilePageFault(addr_t page, bool locked)
+{
+	Process* process = CurrentProcess();
+	int errno_saved = errno;
+	struct segment search_region;
+	search_region.addr = page;
+	search_region.size = Page::Size();
+	if ( !locked )
+		kthread_mutex_lock(&process->segment_lock);
+	struct segment* segment = FindOverlappingSegment(process, &search_region);
+	Ref<Descriptor> desc;
+	off_t offset = 0;
+	bool shared = false;
+	if ( segment && segment->desc )
+	{
+		desc = segment->desc;
+		offset = segment->offset + (off_t) (page - segment->addr);
+		shared = segment->flags & MAP_SHARED;
+	}
+	if ( !locked )
+		kthread_mutex_unlock(&process->segment_lock);
+	if ( !desc )
+		return false;
+	// Files don't stay locked while copying to or from user-space, so reading a
+	// file into a memory mapping of itself doesn't deadlock here.
+	ioctx_t ctx; SetupKernelIOCtx(&ctx);
+	addr_t physical = desc->mmap(&ctx, offset);
+	if ( !physical && errno != ENXIO )
+		return errno = errno_saved, false;
+	if ( !locked )
+		kthread_mutex_lock(&process->segment_lock);
+	// Check the segment wasn't changed while the file was read.
+	segment = FindOverlappingSegment(process, &search_region);
+	bool unchanged = segment && segment->desc == desc &&
+	                 segment->offset + (off_t) (page - segment->addr) == offset;
+	if ( !(unchanged && MapFilePage(page, physical, shared)) && physical )
+		Page::Put(physical, PAGE_USAGE_USER_SPACE);
+	if ( !locked )
+		kthread_mutex_unlock(&process->segment_lock);
+	return errno = errno_saved, true;
+}
+
 } // namespace Memory
 } // namespace Sortix
 
@@ -269,7 +380,8 @@ const int USER_SETTABLE_PROT = PROT_USER;
 const int UNDERSTOOD_MMAP_FLAGS = MAP_SHARED |
                                   MAP_PRIVATE |
                                   MAP_ANONYMOUS |
-                                  MAP_FIXED;
+                                  MAP_FIXED |
+                                  MAP_POPULATE;
 
 static
 void* sys_mmap(void* addr_ptr, size_t size, int prot, int flags, int fd,
@@ -291,8 +403,8 @@ void* sys_mmap(void* addr_ptr, size_t size, int prot, int flags, int fd,
 	// Verify that MAP_PRIVATE and MAP_SHARED are not both set.
 	if ( bool(flags & MAP_PRIVATE) == bool(flags & MAP_SHARED) )
 		return errno = EINVAL, MAP_FAILED;
-	// TODO: MAP_SHARED is not currently supported.
-	if ( flags & MAP_SHARED )
+	// TODO: Shared anonymous memory is not currently supported.
+	if ( (flags & MAP_SHARED) && (flags & MAP_ANONYMOUS) )
 		return errno = EINVAL, MAP_FAILED;
 	// Verify the fíle descriptor and the offset is suitable set if needed.
 	if ( !(flags & MAP_ANONYMOUS) &&
@@ -322,6 +434,8 @@ void* sys_mmap(void* addr_ptr, size_t size, int prot, int flags, int fd,
 	// Verify whether the backing file is usable for memory mapping.
 	ioctx_t ctx; SetupUserIOCtx(&ctx);
 	Ref<Descriptor> desc;
+	bool file_backed = false;
+	int segment_flags = flags & MAP_SHARED;
 	if ( !(flags & MAP_ANONYMOUS) )
 	{
 		if ( !(desc = process->GetDescriptor(fd)) )
@@ -333,9 +447,23 @@ void* sys_mmap(void* addr_ptr, size_t size, int prot, int flags, int fd,
 		if ( desc->read(&ctx, NULL, 0) != 0 )
 			return errno = EACCES, MAP_FAILED;
 		// Verify that we have write access to the file if needed.
-		if ( (prot & PROT_WRITE) && !(flags & MAP_PRIVATE) &&
-		     desc->write(&ctx, NULL, 0) != 0 )
-			return errno = EACCES, MAP_FAILED;
+		if ( (flags & MAP_SHARED) && desc->write(&ctx, NULL, 0) != 0 )
+		{
+			if ( prot & PROT_WRITE )
+				return errno = EACCES, MAP_FAILED;
+			segment_flags |= SEGMENT_READ_ONLY;
+		}
+		// Map the pages of the file directly if it provides them, as probed by
+		// asking for the first page, or otherwise copy the file contents.
+		ioctx_t kctx; SetupKernelIOCtx(&kctx);
+		addr_t probe = desc->mmap(&kctx, offset);
+		if ( probe )
+			Page::Put(probe, PAGE_USAGE_USER_SPACE);
+		else if ( errno == ENODEV && (flags & MAP_SHARED) )
+			return MAP_FAILED;
+		else if ( errno != ENODEV && errno != ENXIO )
+			return MAP_FAILED;
+		file_backed = probe || errno == ENXIO;
 	}
 
 	ScopedLock lock1(&process->segment_write_lock);
@@ -348,10 +476,32 @@ void* sys_mmap(void* addr_ptr, size_t size, int prot, int flags, int fd,
 		new_segment.size = aligned_size;
 	else if ( !PlaceSegment(&new_segment, process, (void*) addr, aligned_size, flags) )
 		return errno = ENOMEM, MAP_FAILED;
+
+	if ( prot & PROT_READ )
+		prot |= PROT_KREAD;
+	if ( prot & PROT_WRITE )
+		prot |= PROT_KWRITE;
+	prot |= PROT_FORK;
+
+	// Map the file such that its pages are used when first accessed.
+	if ( file_backed )
+	{
+		if ( !Memory::MapFileMemory(process, new_segment.addr, new_segment.size,
+		                            prot, segment_flags, desc, offset) )
+			return MAP_FAILED;
+		lock2.Reset();
+		if ( flags & MAP_POPULATE )
+			for ( size_t i = 0; i < new_segment.size; i += Page::Size() )
+				Memory::HandleFilePageFault(new_segment.addr + i, false);
+		return (void*) new_segment.addr;
+	}
+
 	new_segment.prot = PROT_KWRITE | PROT_FORK;
 
 	// Allocate a memory segment with the desired properties.
-	if ( !Memory::MapMemory(process, new_segment.addr, new_segment.size, new_segment.prot) )
+	bool populate = flags & MAP_POPULATE;
+	if ( !Memory::MapMemory(process, new_segment.addr, new_segment.size,
+	                        new_segment.prot, populate) )
 		return MAP_FAILED;
 
 	// The pread will copy to user-space right requires this lock to be free.
@@ -377,8 +527,8 @@ void* sys_mmap(void* addr_ptr, size_t size, int prot, int flags, int fd,
 			if ( !num_bytes )
 			{
 				// We got an unexpected early end-of-file condition, but that's
-				// alright as the MapMemory call zero'd the new memory and we
-				// are expected to zero the remainder.
+				// alright as the new memory is zeroed and we are expected to
+				// zero the remainder.
 				break;
 			}
 			so_far += num_bytes;
@@ -387,11 +537,6 @@ void* sys_mmap(void* addr_ptr, size_t size, int prot, int flags, int fd,
 
 	// Finally switch to the desired page protections.
 	kthread_mutex_lock(&process->segment_lock);
-	if ( prot & PROT_READ )
-		prot |= PROT_KREAD;
-	if ( prot & PROT_WRITE )
-		prot |= PROT_KWRITE;
-	prot |= PROT_FORK;
 	Memory::ProtectMemory(CurrentProcess(), new_segment.addr, new_segment.size, prot);
 	kthread_mutex_unlock(&process->segment_lock);
 
@@ -417,12 +562,75 @@ int sys_mprotect(const void* addr_ptr, size_t size, int prot)
 	ScopedLock lock1(&process->segment_write_lock);
 	ScopedLock lock2(&process->segment_lock);
 
+	// Shared mappings of files not opened for writing can't become writable.
+	if ( prot & PROT_WRITE )
+	{
+		struct segment region;
+		region.addr = addr;
+		region.size = size;
+		for ( struct segment* segment = FindOverlappingSegment(process, &region);
+		      segment && AreSegmentsOverlapping(segment, &region);
+		      segment = NextSegment(segment) )
+		{
+			if ( segment->flags & SEGMENT_READ_ONLY )
+				return errno = EACCES, -1;
+		}
+	}
+
 	if ( !Memory::ProtectMemory(process, addr, size, prot) )
 		return -1;
 
 	return 0;
 }
 
+int sys_msync(void* addr_ptr, size_t size, int flags)
+{
+	// Verify that that the address is suitable aligned.
+	uintptr_t addr = (uintptr_t) addr_ptr;
+	if ( !Page::IsAligned(addr) )
+		return errno = EINVAL, -1;
+	// Verify that we understand all the flags and that they're consistent.
+	if ( flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE) )
+		return errno = EINVAL, -1;
+	if ( (flags & MS_ASYNC) && (flags & MS_SYNC) )
+		return errno = EINVAL, -1;
+
+	size = Page::AlignUp(size);
+	if ( UINTPTR_MAX - addr < size )
+		return errno = ENOMEM, -1;
+
+	// The segments can't change while the write lock is held, and the segment
+	// lock isn't held as synchronizing the files may copy to user-space. The
+	// shared mappings are always coherent with the files, so the modified pages
+	// are written back now even if asynchronously was requested.
+	Process* process = CurrentProcess();
+	ScopedLock lock(&process->segment_write_lock);
+
+	ioctx_t ctx; SetupKernelIOCtx(&ctx);
+	for ( size_t offset = 0; offset < size; )
+	{
+		struct segment search_region;
+		search_region.addr = addr + offset;
+		search_region.size = Page::Size();
+		struct segment* segment = FindOverlappingSegment(process, &search_region);
+		if ( !segment )
+			return errno = ENOMEM, -1;
+		size_t amount = segment->addr + segment->size - search_region.addr;
+		if ( size - offset < amount )
+			amount = size - offset;
+		if ( segment->desc && (segment->flags & MAP_SHARED) )
+		{
+			off_t file_offset = segment->offset +
+			                    (off_t) (search_region.addr - segment->addr);
+			if ( segment->desc->msync(&ctx, file_offset, amount) < 0 )
+				return -1;
+		}
+		offset += amount;
+	}
+
+	return 0;
+}
+
 int sys_munmap(void* addr_ptr, size_t size)
 {
 	// Verify that that the address is suitable aligned.
@@ -439,7 +647,8 @@ int sys_munmap(void* addr_ptr, size_t size)
 	ScopedLock lock1(&process->segment_write_lock);
 	ScopedLock lock2(&process->segment_lock);
 
-	Memory::UnmapMemory(process, addr, size);
+	if ( !Memory::UnmapMemory(process, addr, size) )
+		return -1;
 
 	return 0;
 }
@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * namecache.cpp
+ * Cache of the names looked up in directories.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sortix/kernel/inode.h>
+#include <sortix/kernel/kernel.h>
+#include <sortix/kernel/kthread.h>
+#include <sortix/kernel/namecache.h>
+#include <sortix/kernel/refcount.h>
+#include <sortix/kernel/string.h>
+
+namespace Sortix {
+namespace NameCache {
+
+struct name_entry
+{
+	name_entry* hash_prev;
+	name_entry* hash_next;
+	name_entry* lru_prev;
+	name_entry* lru_next;
+	Ref<Inode> child; // NULL if the name doesn't exist.
+	dev_t dev;
+	ino_t dirino;
+	size_t hash;
+	char* name;
+};
+
+static const size_t HASH_BUCKETS = 1024;
+static const size_t MAX_ENTRIES = 4096;
+
+static kthread_mutex_t cache_lock = KTHREAD_MUTEX_INITIALIZER;
+static name_entry* buckets[HASH_BUCKETS];
+static name_entry* mru_entry = NULL;
+static name_entry* lru_entry = NULL;
+static size_t entries_count = 0;
+static size_t generation = 0;
+
+static size_t Hash(dev_t dev, ino_t dirino, const char* name)
+{
+	size_t hash = (size_t) dev * 31 + (size_t) dirino;
+	for ( size_t i = 0; name[i]; i++ )
+		hash = hash * 33 + (unsigned char) name[i];
+	return hash;
+}
+
+static name_entry* Find(dev_t dev, ino_t dirino, const char* name, size_t hash)
+{
+	for ( name_entry* entry = buckets[hash % HASH_BUCKETS];
+	      entry;
+	      entry = entry->hash_next )
+		if ( entry->hash == hash && entry->dev == dev &&
+		     entry->dirino == dirino && !strcmp(entry->name, name) )
+			return entry;
+	return NULL;
+}
+
+static void Link(name_entry* entry)
+{
+	name_entry** bucket = &buckets[entry->hash % HASH_BUCKETS];
+	entry->hash_prev = NULL;
+	entry->hash_next = *bucket;
+	if ( *bucket )
+		(*bucket)->hash_prev = entry;
+	*bucket = entry;
+	entry->lru_prev = NULL;
+	entry->lru_next = mru_entry;
+	(mru_entry ? mru_entry->lru_prev : lru_entry) = entry;
+	mru_entry = entry;
+	entries_count++;
+}
+
+static void Unlink(name_entry* entry)
+{
+	name_entry** bucket = &buckets[entry->hash % HASH_BUCKETS];
+	(entry->hash_prev ? entry->hash_prev->hash_next : *bucket) =
+		entry->hash_next;
+	if ( entry->hash_next )
+		entry->hash_next->hash_prev = entry->hash_prev;
+	(entry->lru_prev ? entry->lru_prev->lru_next : mru_entry) =
+		entry->lru_next;
+	(entry->lru_next ? entry->lru_next->lru_prev : lru_entry) =
+		entry->lru_prev;
+	entries_count--;
+}
+
+// The entries are deleted without the lock held, as releasing the last
+// reference to an inode may need to talk to its filesystem.
+static void Delete(name_entry* entries)
+{
+	while ( name_entry* entry = entries )
+	{
+		entries = entry->lru_next;
+		delete[] entry->name;
+		delete entry;
+	}
+}
+
+bool Lookup(Ref<Inode> dir, const char* name, Ref<Inode>* result)
+{
+	size_t hash = Hash(dir->dev, dir->ino, name);
+	ScopedLock lock(&cache_lock);
+	name_entry* entry = Find(dir->dev, dir->ino, name, hash);
+	if ( !entry )
+		return false;
+	Unlink(entry);
+	Link(entry);
+	*result = entry->child;
+	return true;
+}
+
+size_t Generation()
+{
+	ScopedLock lock(&cache_lock);
+	return generation;
+}
+
+// The entry isn't added if the cache was invalidated since the lookup began, as
+// the lookup may have seen the directory from before the change.
+void Insert(Ref<Inode> dir, const char* name, Ref<Inode> child,
+            size_t lookup_generation)
+{
+	int errno_saved = errno;
+	name_entry* entry = new name_entry;
+	if ( !entry )
+		return (void) (errno = errno_saved);
+	if ( !(entry->name = String::Clone(name)) )
+		return delete entry, (void) (errno = errno_saved);
+	entry->child = child;
+	entry->dev = dir->dev;
+	entry->dirino = dir->ino;
+	entry->hash = Hash(dir->dev, dir->ino, name);
+	name_entry* evicted = NULL;
+	kthread_mutex_lock(&cache_lock);
+	if ( lookup_generation != generation ||
+	     Find(entry->dev, entry->dirino, name, entry->hash) )
+	{
+		kthread_mutex_unlock(&cache_lock);
+		entry->lru_next = NULL;
+		Delete(entry);
+		errno = errno_saved;
+		return;
+	}
+	Link(entry);
+	if ( MAX_ENTRIES < entries_count )
+	{
+		evicted = lru_entry;
+		Unlink(evicted);
+		evicted->lru_next = NULL;
+	}
+	kthread_mutex_unlock(&cache_lock);
+	Delete(evicted);
+	errno = errno_saved;
+}
+
+void Invalidate(Ref<Inode> dir, const char* name)
+{
+	size_t hash = Hash(dir->dev, dir->ino, name);
+	kthread_mutex_lock(&cache_lock);
+	generation++;
+	name_entry* entry = Find(dir->dev, dir->ino, name, hash);
+	if ( entry )
+	{
+		Unlink(entry);
+		entry->lru_next = NULL;
+	}
+	kthread_mutex_unlock(&cache_lock);
+	Delete(entry);
+}
+
+void InvalidateDevice(dev_t dev)
+{
+	name_entry* invalidated = NULL;
+	kthread_mutex_lock(&cache_lock);
+	generation++;
+	name_entry* entry = mru_entry;
+	while ( entry )
+	{
+		name_entry* next = entry->lru_next;
+		if ( entry->dev == dev )
+		{
+			Unlink(entry);
+			entry->lru_next = invalidated;
+			invalidated = entry;
+		}
+		entry = next;
+	}
+	kthread_mutex_unlock(&cache_lock);
+	Delete(invalidated);
+}
+
+} // namespace NameCache
+} // namespace Sortix
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -20,6 +20,7 @@
 #include <brand.h>
 #include <string.h>
 
+#include <sortix/kernel/cpu.h>
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/log.h>
@@ -50,6 +51,9 @@ void PanicInit()
 	// and the data protected by them may be inconsistent.
 	Interrupt::Disable();
 
+	// The other processors must not keep running while we panic.
+	CPU::StopOthers();
+
 	// Detect if we are really early and we don't even have a log yet.
 	if ( !Log::device_callback )
 		HaltKernel();
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -76,8 +76,8 @@ private:
 	kthread_cond_t readcond;
 	kthread_cond_t writecond;
 	uint8_t* buffer;
-	uintptr_t sender_system_tid;
-	uintptr_t receiver_system_tid;
+	Thread* sender_thread;
+	Thread* receiver_thread;
 	size_t bufferoffset;
 	size_t bufferused;
 	size_t buffersize;
@@ -101,8 +101,8 @@ PipeChannel::PipeChannel(uint8_t* buffer, size_t buffersize)
 	bufferoffset = bufferused = 0;
 	anyreading = anywriting = true;
 	is_sigpipe_enabled = true;
-	sender_system_tid = 0;
-	receiver_system_tid = 0;
+	sender_thread = NULL;
+	receiver_thread = NULL;
 	pledged_read = 0;
 	pledged_write = 0;
 	closers = 0;
@@ -144,23 +144,21 @@ ssize_t PipeChannel::read(ioctx_t* ctx, uint8_t* buf, size_t count)
 	if ( SSIZE_MAX < count )
 		count = SSIZE_MAX;
 	Thread* this_thread = CurrentThread();
-	this_thread->yield_to_tid = sender_system_tid;
+	this_thread->yield_to = sender_thread;
 	ScopedLockSignal lock(&pipelock);
 	if ( !lock.IsAcquired() )
 		return errno = EINTR, -1;
 	size_t so_far = 0;
 	while ( count )
 	{
-		receiver_system_tid = this_thread->system_tid;
+		receiver_thread = this_thread;
 		while ( anywriting && !bufferused )
 		{
-			this_thread->yield_to_tid = sender_system_tid;
+			this_thread->yield_to = sender_thread;
 			if ( pledged_read )
 			{
 				pledged_write++;
-				kthread_mutex_unlock(&pipelock);
-				kthread_yield();
-				kthread_mutex_lock(&pipelock);
+				kthread_cond_wait(&readcond, &pipelock);
 				pledged_write--;
 				continue;
 			}
@@ -172,7 +170,11 @@ ssize_t PipeChannel::read(ioctx_t* ctx, uint8_t* buf, size_t count)
 			bool interrupted = !kthread_cond_wait_signal(&readcond, &pipelock);
 			pledged_write--;
 			if ( interrupted )
+			{
+				// Wake the other side if it is waiting for this pledge.
+				kthread_cond_broadcast(&writecond);
 				return errno = EINTR, -1;
+			}
 		}
 		if ( !bufferused && !anywriting )
 			return (ssize_t) so_far;
@@ -202,24 +204,22 @@ ssize_t PipeChannel::write(ioctx_t* ctx, const uint8_t* buf, size_t count)
 	if ( SSIZE_MAX < count )
 		count = SSIZE_MAX;
 	Thread* this_thread = CurrentThread();
-	this_thread->yield_to_tid = receiver_system_tid;
+	this_thread->yield_to = receiver_thread;
 	ScopedLockSignal lock(&pipelock);
 	if ( !lock.IsAcquired() )
 		return errno = EINTR, -1;
-	sender_system_tid = this_thread->system_tid;
+	sender_thread = this_thread;
 	size_t so_far = 0;
 	while ( count )
 	{
-		sender_system_tid = this_thread->system_tid;
+		sender_thread = this_thread;
 		while ( anyreading && bufferused == buffersize )
 		{
-			this_thread->yield_to_tid = receiver_system_tid;
+			this_thread->yield_to = receiver_thread;
 			if ( pledged_write )
 			{
 				pledged_read++;
-				kthread_mutex_unlock(&pipelock);
-				kthread_yield();
-				kthread_mutex_lock(&pipelock);
+				kthread_cond_wait(&writecond, &pipelock);
 				pledged_read--;
 				continue;
 			}
@@ -231,7 +231,11 @@ ssize_t PipeChannel::write(ioctx_t* ctx, const uint8_t* buf, size_t count)
 			bool interrupted = !kthread_cond_wait_signal(&writecond, &pipelock);
 			pledged_read--;
 			if ( interrupted )
+			{
+				// Wake the other side if it is waiting for this pledge.
+				kthread_cond_broadcast(&readcond);
 				return errno = EINTR, -1;
+			}
 		}
 		if ( !anyreading )
 		{
@@ -410,7 +414,7 @@ ssize_t PipeEndpoint::read(ioctx_t* ctx, uint8_t* buf, size_t count)
 	if ( !reading )
 		return errno = EBADF, -1;
 	ssize_t result = channel->read(ctx, buf, count);
-	CurrentThread()->yield_to_tid = 0;
+	CurrentThread()->yield_to = NULL;
 	Scheduler::ScheduleTrueThread();
 	return result;
 }
@@ -420,7 +424,7 @@ ssize_t PipeEndpoint::write(ioctx_t* ctx, const uint8_t* buf, size_t count)
 	if ( reading )
 		return errno = EBADF, -1;
 	ssize_t result = channel->write(ctx, buf, count);
-	CurrentThread()->yield_to_tid = 0;
+	CurrentThread()->yield_to = NULL;
 	Scheduler::ScheduleTrueThread();
 	return result;
 }
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * pressure.cpp
+ * Memory pressure and reclaiming memory from caches.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+
+#include <sortix/mempressure.h>
+
+#include <sortix/kernel/kernel.h>
+#include <sortix/kernel/kthread.h>
+#include <sortix/kernel/memorymanagement.h>
+#include <sortix/kernel/pressure.h>
+#include <sortix/kernel/worker.h>
+
+namespace Sortix {
+namespace Pressure {
+
+static kthread_mutex_t shrinkers_lock = KTHREAD_MUTEX_INITIALIZER;
+static struct shrinker* first_shrinker = NULL;
+static struct shrinker* last_shrinker = NULL;
+static kthread_mutex_t reclaim_lock = KTHREAD_MUTEX_INITIALIZER;
+static kthread_mutex_t event_lock = KTHREAD_MUTEX_INITIALIZER;
+static kthread_cond_t event_cond = KTHREAD_COND_INITIALIZER;
+static struct mempressure last_event;
+static size_t event_generation = 0;
+static bool reclaim_scheduled = false;
+static bool initialized = false;
+
+// Memory is reclaimed when less than the low watermark is free, until at least
+// the high watermark is free.
+static size_t LowWatermark(size_t total)
+{
+	return total / 32;
+}
+
+static size_t HighWatermark(size_t total)
+{
+	return total / 16;
+}
+
+// Asks the shrinkers to write back the modified pages they can free afterwards.
+// The synchronous reclaim gives up rather than waiting for this to finish.
+static void WriteBack(size_t pages)
+{
+	ScopedLock lock1(&reclaim_lock);
+	ScopedLock lock2(&shrinkers_lock);
+	size_t written = 0;
+	for ( struct shrinker* shrinker = first_shrinker;
+	      shrinker && written < pages;
+	      shrinker = shrinker->next )
+		if ( shrinker->writeback )
+			written += shrinker->writeback(shrinker->context, pages - written);
+}
+
+static void ReclaimJob(void* /*user*/)
+{
+	size_t used;
+	size_t total;
+	Memory::Statistics(&used, &total);
+	size_t free = total - used;
+	size_t target = HighWatermark(total);
+
+	// Let user-space trim its caches meanwhile.
+	kthread_mutex_lock(&event_lock);
+	last_event.free = free;
+	last_event.target = target;
+	event_generation++;
+	kthread_cond_broadcast(&event_cond);
+	kthread_mutex_unlock(&event_lock);
+
+	if ( free < target )
+	{
+		size_t pages = (target - free) / Page::Size();
+		size_t freed = Reclaim(pages);
+		if ( freed < pages )
+		{
+			WriteBack(pages - freed);
+			Reclaim(pages - freed);
+		}
+	}
+
+	kthread_mutex_lock(&event_lock);
+	reclaim_scheduled = false;
+	kthread_mutex_unlock(&event_lock);
+}
+
+void Init()
+{
+	initialized = true;
+}
+
+void RegisterShrinker(struct shrinker* shrinker)
+{
+	ScopedLock lock(&shrinkers_lock);
+	shrinker->prev = last_shrinker;
+	shrinker->next = NULL;
+	(last_shrinker ? last_shrinker->next : first_shrinker) = shrinker;
+	last_shrinker = shrinker;
+}
+
+void UnregisterShrinker(struct shrinker* shrinker)
+{
+	ScopedLock lock(&shrinkers_lock);
+	(shrinker->prev ? shrinker->prev->next : first_shrinker) = shrinker->next;
+	(shrinker->next ? shrinker->next->prev : last_shrinker) = shrinker->prev;
+	shrinker->prev = NULL;
+	shrinker->next = NULL;
+}
+
+// Called after memory is allocated to start reclaiming memory in the background
+// if the free memory is below the low watermark.
+void Check()
+{
+	if ( !initialized )
+		return;
+	size_t used;
+	size_t total;
+	Memory::Statistics(&used, &total);
+	if ( LowWatermark(total) <= total - used )
+		return;
+	ScopedLock lock(&event_lock);
+	if ( reclaim_scheduled )
+		return;
+	reclaim_scheduled = Worker::TrySchedule(ReclaimJob, NULL);
+}
+
+// Asks the shrinkers to free the pages, which fails if memory is already being
+// reclaimed, including when a shrinker itself runs out of memory.
+size_t Reclaim(size_t pages)
+{
+	if ( !kthread_mutex_trylock(&reclaim_lock) )
+		return 0;
+	size_t freed = 0;
+	kthread_mutex_lock(&shrinkers_lock);
+	for ( struct shrinker* shrinker = first_shrinker;
+	      shrinker && freed < pages;
+	      shrinker = shrinker->next )
+		freed += shrinker->shrink(shrinker->context, pages - freed);
+	// Start with the next shrinker next time, so the caches shrink evenly.
+	if ( first_shrinker && first_shrinker != last_shrinker )
+	{
+		struct shrinker* shrinker = first_shrinker;
+		(first_shrinker = shrinker->next)->prev = NULL;
+		shrinker->prev = last_shrinker;
+		shrinker->next = NULL;
+		last_shrinker->next = shrinker;
+		last_shrinker = shrinker;
+	}
+	kthread_mutex_unlock(&shrinkers_lock);
+	kthread_mutex_unlock(&reclaim_lock);
+	return freed;
+}
+
+// Waits for the next time the system runs low on memory.
+bool Wait(struct mempressure* event)
+{
+	ScopedLock lock(&event_lock);
+	size_t generation = event_generation;
+	while ( generation == event_generation )
+		if ( !kthread_cond_wait_signal(&event_cond, &event_lock) )
+			return errno = EINTR, false;
+	*event = last_event;
+	return true;
+}
+
+} // namespace Pressure
+} // namespace Sortix
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -78,6 +78,8 @@ Process::Process()
 	nicelock = KTHREAD_MUTEX_INITIALIZER;
 	nice = 0;
 
+	fpu_switches = 0;
+
 	idlock = KTHREAD_MUTEX_INITIALIZER;
 	uid = euid = 0;
 	gid = egid = 0;
@@ -136,11 +138,11 @@ Process::Process()
 	threadlock = KTHREAD_MUTEX_INITIALIZER;
 	threads_exiting = false;
 
-	segments = NULL;
-	segments_used = 0;
-	segments_length = 0;
+	segment_tree = NULL;
 	segment_write_lock = KTHREAD_MUTEX_INITIALIZER;
 	segment_lock = KTHREAD_MUTEX_INITIALIZER;
+	resident_pages = 0;
+	page_table_pages = 0;
 
 	user_timers_lock = KTHREAD_MUTEX_INITIALIZER;
 	memset(&user_timers, 0, sizeof(user_timers));
@@ -161,7 +163,7 @@ Process::~Process()
 	assert(!zombiechild);
 	assert(!firstchild);
 	assert(!addrspace);
-	assert(!segments);
+	assert(!segment_tree);
 	assert(!dtable);
 	assert(!mtable);
 	assert(!cwd);
@@ -365,14 +367,19 @@ void Process::ResetAddressSpace()
 
 	assert(Memory::GetAddressSpace() == addrspace);
 
-	for ( size_t i = 0; i < segments_used; i++ )
-		Memory::UnmapRange(segments[i].addr, segments[i].size, PAGE_USAGE_USER_SPACE);
-
-	Memory::Flush();
+	struct tlb_gather gather;
+	Memory::TLBGatherInit(&gather);
+	for ( struct segment* segment = FirstSegment(this);
+	      segment;
+	      segment = NextSegment(segment) )
+	{
+		Memory::UnmapRange(segment->addr, segment->size, PAGE_USAGE_USER_SPACE);
+		Memory::TLBGatherRange(&gather, segment->addr, segment->size);
+	}
+	Memory::TLBGatherFinish(&gather);
 
-	segments_used = segments_length = 0;
-	free(segments);
-	segments = NULL;
+	DeleteSegmentTree(segment_tree);
+	segment_tree = NULL;
 }
 
 void Process::NotifyMemberExit(Process* child)
@@ -624,34 +631,29 @@ Process* Process::Fork()
 		return NULL;
 	}
 
-	struct segment* clone_segments = NULL;
+	struct segment_node* clone_segments = NULL;
 
-	// Fork the segment list.
-	if ( segments )
+	// Fork the segment tree.
+	if ( segment_tree && !(clone_segments = CloneSegmentTree(segment_tree)) )
 	{
-		size_t segments_size = sizeof(struct segment) * segments_used;
-		if ( !(clone_segments = (struct segment*) malloc(segments_size)) )
-		{
-			delete clone;
-			return NULL;
-		}
-		memcpy(clone_segments, segments, segments_size);
+		delete clone;
+		return NULL;
 	}
 
 	// Fork address-space here and copy memory.
 	clone->addrspace = Memory::Fork();
 	if ( !clone->addrspace )
 	{
-		free(clone_segments);
+		DeleteSegmentTree(clone_segments);
 		delete clone;
 		return NULL;
 	}
 
 	// Now it's too late to clean up here, if anything goes wrong, we simply
 	// ask the process to commit suicide before it goes live.
-	clone->segments = clone_segments;
-	clone->segments_used = segments_used;
-	clone->segments_length = segments_used;
+	clone->segment_tree = clone_segments;
+	clone->resident_pages = resident_pages;
+	clone->page_table_pages = page_table_pages;
 
 	// Remember the relation to the child process.
 	AddChildProcess(clone);
@@ -761,12 +763,11 @@ bool Process::MapSegment(struct segment* result, void* hint, size_t size,
 		// segment just created is not removed.
 		return false;
 	}
-	Memory::Flush();
 	return true;
 }
 
-int Process::Execute(const char* programname, const uint8_t* program,
-                     size_t programsize, int argc, const char* const* argv,
+int Process::Execute(const char* programname, Ref<Descriptor> program,
+                     int argc, const char* const* argv,
                      int envc, const char* const* envp,
                      struct thread_registers* regs)
 {
@@ -780,7 +781,7 @@ int Process::Execute(const char* programname, const uint8_t* program,
 
 	ELF::Auxiliary aux;
 
-	addr_t entry = ELF::Load(program, programsize, &aux);
+	addr_t entry = ELF::Load(program, &aux);
 	if ( !entry ) { delete[] programname_clone; return -1; }
 
 	delete[] program_image_path;
@@ -849,6 +850,31 @@ int Process::Execute(const char* programname, const uint8_t* program,
 	for ( int i = 0; i < envc; i++ )
 		arg_size += strlen(envp[i]) + 1;
 
+	// Read the thread-local storage master copy now, as reading the file may
+	// copy to user-space which requires the segment lock to be free.
+	uint8_t* file_raw_tls = new uint8_t[aux.tls_file_size];
+	if ( !file_raw_tls )
+	{
+		ResetForExecute();
+		return -1;
+	}
+	ioctx_t ctx; SetupKernelIOCtx(&ctx);
+	for ( size_t sofar = 0; sofar < aux.tls_file_size; )
+	{
+		off_t offset = (off_t) (aux.tls_file_offset + sofar);
+		ssize_t amount = program->pread(&ctx, file_raw_tls + sofar,
+		                                aux.tls_file_size - sofar, offset);
+		if ( amount <= 0 )
+		{
+			if ( amount == 0 )
+				errno = EEOF;
+			delete[] file_raw_tls;
+			ResetForExecute();
+			return -1;
+		}
+		sofar += amount;
+	}
+
 	struct segment arg_segment;
 	struct segment stack_segment;
 	struct segment raw_tls_segment;
@@ -866,6 +892,7 @@ int Process::Execute(const char* programname, const uint8_t* program,
 	{
 		kthread_mutex_unlock(&segment_lock);
 		kthread_mutex_unlock(&segment_write_lock);
+		delete[] file_raw_tls;
 		ResetForExecute();
 		return errno = ENOMEM, -1;
 	}
@@ -897,8 +924,6 @@ int Process::Execute(const char* programname, const uint8_t* program,
 	}
 	target_envp[envc] = (char*) NULL;
 
-	const uint8_t* file_raw_tls = program + aux.tls_file_offset;
-
 	uint8_t* target_raw_tls = (uint8_t*) raw_tls_segment.addr;
 	memcpy(target_raw_tls, file_raw_tls, aux.tls_file_size);
 	memset(target_raw_tls + aux.tls_file_size, 0, aux.tls_mem_size - aux.tls_file_size);
@@ -909,6 +934,8 @@ int Process::Execute(const char* programname, const uint8_t* program,
 	memcpy(target_tls, file_raw_tls, aux.tls_file_size);
 	memset(target_tls + aux.tls_file_size, 0, aux.tls_mem_size - aux.tls_file_size);
 
+	delete[] file_raw_tls;
+
 	struct uthread* uthread = (struct uthread*) (tls_segment.addr + tls_offset_uthread);
 	assert((((uintptr_t) uthread) & (aux.uthread_align-1)) == 0);
 	memset(uthread, 0, sizeof(*uthread));
@@ -1082,23 +1109,6 @@ static size_t shebang_count_arguments(char* line)
 //         * utils/which.c
 // NOTE: See comments in execvpe() for algorithmic commentary.
 
-static bool sys_execve_alloc(addralloc_t* alloc, size_t size)
-{
-	if ( !AllocateKernelAddress(alloc, size) )
-		return false;
-	if ( !Memory::MapRange(alloc->from, alloc->size, PROT_KREAD | PROT_KWRITE, PAGE_USAGE_EXECUTE) )
-		return FreeKernelAddress(alloc), false;
-	Memory::Flush();
-	return true;
-}
-
-static void sys_execve_free(addralloc_t* alloc)
-{
-	Memory::UnmapRange(alloc->from, alloc->size, PAGE_USAGE_EXECUTE);
-	Memory::Flush();
-	FreeKernelAddress(alloc);
-}
-
 static
 int sys_execve_kernel(const char* filename,
                       int argc,
@@ -1127,43 +1137,47 @@ int sys_execve_kernel(const char* filename,
 	if ( (uintmax_t) SIZE_MAX < (uintmax_t) st.st_size )
 		return errno = EFBIG, -1;
 
-	size_t filesize = (size_t) st.st_size;
+	int result = process->Execute(filename, desc, argc, argv, envc, envp, regs);
 
-	addralloc_t buffer_alloc;
-	if ( !sys_execve_alloc(&buffer_alloc, filesize) )
-		return -1;
+	if ( result == 0 || errno != ENOEXEC )
+		return result;
 
-	uint8_t* buffer = (uint8_t*) buffer_alloc.from;
-	for ( size_t sofar = 0; sofar < filesize; )
+	// The interpreter line must fit in the first page of the file.
+	size_t buffer_size = Page::Size();
+	if ( (uintmax_t) st.st_size < (uintmax_t) buffer_size )
+		buffer_size = (size_t) st.st_size;
+	uint8_t* buffer = new uint8_t[buffer_size];
+	if ( !buffer )
+		return -1;
+	size_t filesize = 0;
+	while ( filesize < buffer_size )
 	{
-		ssize_t amount = desc->read(&ctx, buffer + sofar, filesize - sofar);
+		ssize_t amount = desc->pread(&ctx, buffer + filesize,
+		                             buffer_size - filesize, filesize);
 		if ( amount < 0 )
-			return sys_execve_free(&buffer_alloc), -1;
+			return delete[] buffer, -1;
 		if ( amount == 0 )
-			return sys_execve_free(&buffer_alloc), errno = EEOF, -1;
-		sofar += amount;
+			break;
+		filesize += amount;
 	}
 
 	desc.Reset();
 
-	int result = process->Execute(filename, buffer, filesize, argc, argv, envc, envp, regs);
-
-	if ( result == 0 || errno != ENOEXEC ||
-	     filesize < 2 || buffer[0] != '#' || buffer[1] != '!' )
-		return sys_execve_free(&buffer_alloc), result;
+	if ( filesize < 2 || buffer[0] != '#' || buffer[1] != '!' )
+		return delete[] buffer, errno = ENOEXEC, -1;
 
 	size_t line_length = 0;
 	while ( 2 + line_length < filesize && buffer[2 + line_length] != '\n' )
 		line_length++;
-	if ( line_length == filesize )
-		return sys_execve_free(&buffer_alloc), errno = ENOEXEC, -1;
+	if ( 2 + line_length == filesize && (uintmax_t) filesize < (uintmax_t) st.st_size )
+		return delete[] buffer, errno = ENOEXEC, -1;
 
 	char* line = new char[line_length+1];
 	if ( !line )
-		return sys_execve_free(&buffer_alloc), -1;
+		return delete[] buffer, -1;
 	memcpy(line, buffer + 2, line_length);
 	line[line_length] = '\0';
-	sys_execve_free(&buffer_alloc);
+	delete[] buffer;
 
 	char* line_clone = String::Clone(line);
 	if ( !line_clone )
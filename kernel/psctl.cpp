@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -28,9 +28,11 @@
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/copy.h>
 #include <sortix/kernel/kthread.h>
+#include <sortix/kernel/memorymanagement.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/ptable.h>
 #include <sortix/kernel/refcount.h>
+#include <sortix/kernel/segment.h>
 #include <sortix/kernel/syscall.h>
 
 namespace Sortix {
@@ -121,6 +123,10 @@ int sys_psctl(pid_t pid, int request, void* ptr)
 		kthread_mutex_lock(&process->nicelock);
 		psst.nice = process->nice;
 		kthread_mutex_unlock(&process->nicelock);
+		kthread_mutex_lock(&process->segment_lock);
+		if ( process->segment_tree )
+			psst.vsz = process->segment_tree->subtree_size;
+		kthread_mutex_unlock(&process->segment_lock);
 		// Note: It is safe to access the clocks in this manner as each of them
 		//       are locked by disabling interrupts. This is perhaps not
 		//       SMP-ready, but it will do for now.
@@ -129,6 +135,9 @@ int sys_psctl(pid_t pid, int request, void* ptr)
 		psst.tmns.tmns_stime = process->system_clock.current_time;
 		psst.tmns.tmns_cutime = process->child_execute_clock.current_time;
 		psst.tmns.tmns_cstime = process->child_system_clock.current_time;
+		psst.fpu_switches = process->fpu_switches;
+		psst.rss = process->resident_pages * Page::Size();
+		psst.page_tables = process->page_table_pages * Page::Size();
 		Interrupt::Enable();
 		return CopyToUser(ptr, &psst, sizeof(psst)) ? 0 : -1;
 	}
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -32,6 +32,16 @@
 
 namespace Sortix {
 
+// Nice values outside the supported range are silently clamped.
+static int ClampPriority(int prio)
+{
+	if ( prio < -20 )
+		return -20;
+	if ( 19 < prio )
+		return 19;
+	return prio;
+}
+
 static int GetProcessPriority(pid_t who)
 {
 	if ( who < 0 )
@@ -133,6 +143,7 @@ int sys_getpriority(int which, id_t who)
 
 int sys_setpriority(int which, id_t who, int prio)
 {
+	prio = ClampPriority(prio);
 	switch ( which )
 	{
 	case PRIO_PROCESS: return SetProcessPriority(who, prio);
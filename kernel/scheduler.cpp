@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -23,16 +23,14 @@
 #include <string.h>
 #include <timespec.h>
 
-#if defined(__x86_64__)
-#include <msr.h>
-#endif
-
 #include <sortix/clock.h>
 #include <sortix/timespec.h>
 
+#include <sortix/kernel/cpu.h>
 #include <sortix/kernel/decl.h>
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/kernel.h>
+#include <sortix/kernel/kthread.h>
 #include <sortix/kernel/memorymanagement.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/registers.h>
@@ -50,10 +48,65 @@
 namespace Sortix {
 namespace Scheduler {
 
-static Thread* current_thread;
+// Runnable threads are kept on a list per priority level, where a bitmap of
+// the non-empty levels lets the highest priority thread be found in constant
+// time. Threads at the same level run in round-robin order.
+static const int PRIORITY_LEVELS = 40;
 
-void SaveInterruptedContext(const struct interrupt_context* intctx,
-                            struct thread_registers* registers)
+struct priority_array
+{
+	uint64_t bitmap;
+	size_t count;
+	Thread* lists[PRIORITY_LEVELS];
+};
+
+// Each processor has its own queue of runnable threads and runs its own idle
+// thread when it has nothing to do. Threads run from the active array until
+// their time slice is used up, after which they wait in the expired array until
+// every thread in the active array has had its turn, and the arrays are then
+// swapped. The time slice is proportional to the weight of the thread, which
+// gives each thread its share of the processor regardless of its priority.
+struct run_queue
+{
+	Thread* current_thread;
+	Thread* idle_thread;
+	Thread* true_current_thread;
+	Thread* previous_thread;
+	Thread* preferred_thread;
+	struct priority_array arrays[2];
+	size_t active_index;
+	size_t runnable_count;
+	bool need_resched;
+};
+
+// Threads that sleep before using up their time slice are considered
+// interactive and gradually gain priority, while threads that use their time
+// slices fully gradually lose priority, within this many levels of the priority
+// given by their nice value.
+static const int MAX_PRIORITY_BONUS = 5;
+
+// The length of the time slice in timer ticks for each nice value. From nice
+// -12 to 0 each level gives roughly 25% more processor time than the one below.
+// Slices are capped at 64 ticks for the lower nice values and can't be shorter
+// than a tick for the higher ones, so those nice values only differ by their
+// priority.
+static const unsigned int timeslices[40] =
+{
+	64, 64, 64, 64, 64, 64, 64, 64, 60, 48, // -20 to -11
+	38, 31, 24, 20, 16, 13, 10,  8,  6,  5, // -10 to  -1
+	 4,  3,  3,  2,  2,  1,  1,  1,  1,  1, //   0 to   9
+	 1,  1,  1,  1,  1,  1,  1,  1,  1,  1, //  10 to  19
+};
+
+static struct run_queue run_queues[CPU::MAX_CPUS];
+static Process* init_process;
+
+// Woken when a dead thread is no longer on any processor. Protected by the
+// kernel lock and disabling interrupts.
+static kthread_cond_t off_cpu_cond = KTHREAD_COND_INITIALIZER;
+
+static void SaveContextRegisters(const struct interrupt_context* intctx,
+                                 struct thread_registers* registers)
 {
 #if defined(__i386__)
 	registers->signal_pending = intctx->signal_pending;
@@ -70,12 +123,11 @@ void SaveInterruptedContext(const struct interrupt_context* intctx,
 	registers->eflags = intctx->eflags;
 	registers->fsbase = (unsigned long) GDT::GetFSBase();
 	registers->gsbase = (unsigned long) GDT::GetGSBase();
-	asm ( "mov %%cr3, %0" : "=r"(registers->cr3) );
+	registers->cr3 = Memory::GetAddressSpace();
 	registers->kernel_stack = GDT::GetKernelStack();
 	registers->cs = intctx->cs;
 	registers->ds = intctx->ds;
 	registers->ss = intctx->ss;
-	asm volatile ("fxsave (%0)" : : "r"(registers->fpuenv));
 #elif defined(__x86_64__)
 	registers->signal_pending = intctx->signal_pending;
 	registers->kerrno = intctx->kerrno;
@@ -98,21 +150,20 @@ void SaveInterruptedContext(const struct interrupt_context* intctx,
 	registers->r15 = intctx->r15;
 	registers->rip = intctx->rip;
 	registers->rflags = intctx->rflags;
-	registers->fsbase = (unsigned long) rdmsr(MSRID_FSBASE);
-	registers->gsbase = (unsigned long) rdmsr(MSRID_GSBASE);
-	asm ( "mov %%cr3, %0" : "=r"(registers->cr3) );
+	registers->fsbase = (unsigned long) GDT::GetFSBase();
+	registers->gsbase = (unsigned long) GDT::GetGSBase();
+	registers->cr3 = Memory::GetAddressSpace();
 	registers->kernel_stack = GDT::GetKernelStack();
 	registers->cs = intctx->cs;
 	registers->ds = intctx->ds;
 	registers->ss = intctx->ss;
-	asm volatile ("fxsave (%0)" : : "r"(registers->fpuenv));
 #else
 #warning "You need to implement register saving"
 #endif
 }
 
-void LoadInterruptedContext(struct interrupt_context* intctx,
-                            const struct thread_registers* registers)
+static void LoadContextRegisters(struct interrupt_context* intctx,
+                                 const struct thread_registers* registers)
 {
 #if defined(__i386__)
 	intctx->signal_pending = registers->signal_pending;
@@ -129,12 +180,11 @@ void LoadInterruptedContext(struct interrupt_context* intctx,
 	intctx->eflags = registers->eflags;
 	GDT::SetFSBase(registers->fsbase);
 	GDT::SetGSBase(registers->gsbase);
-	asm volatile ( "mov %0, %%cr3" : : "r"(registers->cr3) );
+	Memory::SwitchAddressSpace(registers->cr3);
 	GDT::SetKernelStack(registers->kernel_stack);
 	intctx->cs = registers->cs;
 	intctx->ds = registers->ds;
 	intctx->ss = registers->ss;
-	asm volatile ("fxrstor (%0)" : : "r"(registers->fpuenv));
 #elif defined(__x86_64__)
 	intctx->signal_pending = registers->signal_pending;
 	intctx->kerrno = registers->kerrno;
@@ -157,19 +207,36 @@ void LoadInterruptedContext(struct interrupt_context* intctx,
 	intctx->r15 = registers->r15;
 	intctx->rip = registers->rip;
 	intctx->rflags = registers->rflags;
-	wrmsr(MSRID_FSBASE, registers->fsbase);
-	wrmsr(MSRID_GSBASE, registers->gsbase);
-	asm volatile ( "mov %0, %%cr3" : : "r"(registers->cr3) );
+	GDT::SetFSBase(registers->fsbase);
+	GDT::SetGSBase(registers->gsbase);
+	Memory::SwitchAddressSpace(registers->cr3);
 	GDT::SetKernelStack(registers->kernel_stack);
 	intctx->cs = registers->cs;
 	intctx->ds = registers->ds;
 	intctx->ss = registers->ss;
-	asm volatile ("fxrstor (%0)" : : "r"(registers->fpuenv));
 #else
 #warning "You need to implement register loading"
 #endif
 }
 
+void SaveInterruptedContext(const struct interrupt_context* intctx,
+                            struct thread_registers* registers)
+{
+	SaveContextRegisters(intctx, registers);
+#if defined(__i386__) || defined(__x86_64__)
+	Float::Save(CurrentThread(), registers->fpuenv);
+#endif
+}
+
+void LoadInterruptedContext(struct interrupt_context* intctx,
+                            const struct thread_registers* registers)
+{
+	LoadContextRegisters(intctx, registers);
+#if defined(__i386__) || defined(__x86_64__)
+	Float::Load(CurrentThread(), registers->fpuenv);
+#endif
+}
+
 extern "C" void fake_interrupt(void);
 
 // Pretend a particular interrupt arrived on another thread's stack. This
@@ -181,6 +248,7 @@ extern "C" void fake_interrupt(void);
 static void FakeInterruptedContext(struct interrupt_context* intctx, int int_no)
 {
 #if defined(__i386__)
+	Thread* current_thread = CurrentThread();
 	uintptr_t stack = current_thread->kernelstackpos +
 	                  current_thread->kernelstacksize;
 	stack -= sizeof(struct interrupt_context);
@@ -210,6 +278,7 @@ static void FakeInterruptedContext(struct interrupt_context* intctx, int int_no)
 	intctx->esp = stack;
 	intctx->ss = KDS | KRPL;
 #elif defined(__x86_64__)
+	Thread* current_thread = CurrentThread();
 	uintptr_t stack = current_thread->kernelstackpos +
 	                  current_thread->kernelstacksize;
 	stack -= sizeof(struct interrupt_context);
@@ -250,71 +319,330 @@ static void FakeInterruptedContext(struct interrupt_context* intctx, int int_no)
 #endif
 }
 
-static
-void SwitchThread(struct interrupt_context* intctx, Thread* prev, Thread* next)
+static void SwitchThread(struct interrupt_context* intctx,
+                         struct run_queue* rq,
+                         Thread* prev,
+                         Thread* next)
 {
 	if ( prev == next )
 		return;
 
-	SaveInterruptedContext(intctx, &prev->registers);
+	SaveContextRegisters(intctx, &prev->registers);
 	if ( !prev->registers.cr3 )
 		Log::PrintF("Thread %p had cr3=0x%zx\n", prev, prev->registers.cr3);
 	if ( !next->registers.cr3 )
 		Log::PrintF("Thread %p has cr3=0x%zx\n", next, next->registers.cr3);
-	LoadInterruptedContext(intctx, &next->registers);
+	LoadContextRegisters(intctx, &next->registers);
+#if defined(__i386__) || defined(__x86_64__)
+	Float::Switch(prev, next);
+#endif
 
-	current_thread = next;
+	// This processor keeps using the stack of the previous thread until it
+	// returns from the interrupt, so no other processor may run it until then.
+	rq->current_thread = next;
+	rq->previous_thread = prev;
+	next->cpu = rq - run_queues;
+	next->on_cpu = true;
 }
 
-static Thread* idle_thread;
-static Thread* first_runnable_thread;
-static Thread* true_current_thread;
-static Process* init_process;
+static int GetNice(Thread* thread)
+{
+	int nice = thread->process ? thread->process->nice : 0;
+	if ( nice < -20 )
+		return -20;
+	if ( 19 < nice )
+		return 19;
+	return nice;
+}
+
+static int GetPriority(Thread* thread)
+{
+	int priority = GetNice(thread) + 20 + thread->scheduler_bonus;
+	if ( priority < 0 )
+		return 0;
+	if ( PRIORITY_LEVELS <= priority )
+		return PRIORITY_LEVELS - 1;
+	return priority;
+}
+
+static unsigned int GetTimeslice(Thread* thread)
+{
+	return timeslices[GetNice(thread) + 20];
+}
+
+static struct priority_array* ActiveArray(struct run_queue* rq)
+{
+	return &rq->arrays[rq->active_index];
+}
+
+static struct priority_array* ExpiredArray(struct run_queue* rq)
+{
+	return &rq->arrays[rq->active_index ^ 1];
+}
+
+static bool IsExpired(struct run_queue* rq, Thread* thread)
+{
+	return thread->scheduler_array != rq->active_index;
+}
 
-static Thread* FindRunnableThreadWithSystemTid(uintptr_t system_tid)
+static void ArrayInsert(struct priority_array* array, Thread* thread)
 {
-	Thread* begun_thread = current_thread;
-	Thread* iter = begun_thread;
-	do
+	int priority = thread->scheduler_priority;
+	Thread* first = array->lists[priority];
+	if ( !first )
 	{
-		if ( iter->system_tid == system_tid )
-			return iter;
-		iter = iter->scheduler_list_next;
-	} while ( iter != begun_thread );
-	return NULL;
+		array->lists[priority] = thread;
+		array->bitmap |= 1ULL << priority;
+		thread->scheduler_list_prev = thread;
+		thread->scheduler_list_next = thread;
+	}
+	else
+	{
+		thread->scheduler_list_prev = first->scheduler_list_prev;
+		thread->scheduler_list_next = first;
+		first->scheduler_list_prev = thread;
+		thread->scheduler_list_prev->scheduler_list_next = thread;
+	}
+	array->count++;
 }
 
-static Thread* PopNextThread(bool yielded)
+static void ArrayRemove(struct priority_array* array, Thread* thread)
+{
+	int priority = thread->scheduler_priority;
+	assert(thread->scheduler_list_prev);
+	assert(thread->scheduler_list_next);
+	if ( thread->scheduler_list_next == thread )
+	{
+		array->lists[priority] = NULL;
+		array->bitmap &= ~(1ULL << priority);
+	}
+	else
+	{
+		if ( array->lists[priority] == thread )
+			array->lists[priority] = thread->scheduler_list_next;
+		thread->scheduler_list_prev->scheduler_list_next = thread->scheduler_list_next;
+		thread->scheduler_list_next->scheduler_list_prev = thread->scheduler_list_prev;
+	}
+	thread->scheduler_list_prev = NULL;
+	thread->scheduler_list_next = NULL;
+	array->count--;
+}
+
+static void RemoveFromRunQueue(struct run_queue* rq, Thread* thread)
+{
+	ArrayRemove(&rq->arrays[thread->scheduler_array], thread);
+	rq->runnable_count--;
+}
+
+static void InsertIntoRunQueue(struct run_queue* rq, Thread* thread,
+                               bool expired = false)
+{
+	if ( !thread->scheduler_timeslice )
+		thread->scheduler_timeslice = GetTimeslice(thread);
+	thread->scheduler_priority = GetPriority(thread);
+	thread->scheduler_array = rq->active_index ^ (expired ? 1 : 0);
+	ArrayInsert(&rq->arrays[thread->scheduler_array], thread);
+	thread->cpu = rq - run_queues;
+	rq->runnable_count++;
+}
+
+// Moves a thread that has used up its time slice to the expired array.
+static void ExpireThread(struct run_queue* rq, Thread* thread)
+{
+	RemoveFromRunQueue(rq, thread);
+	if ( thread->scheduler_bonus < MAX_PRIORITY_BONUS )
+		thread->scheduler_bonus++;
+	thread->scheduler_timeslice = GetTimeslice(thread);
+	InsertIntoRunQueue(rq, thread, true);
+}
+
+static bool IsIdle(struct run_queue* rq)
+{
+	return rq->current_thread == rq->idle_thread && !rq->runnable_count;
+}
+
+// Whether a thread has higher priority than the thread running on a processor.
+static bool ShouldPreempt(struct run_queue* rq, Thread* thread)
+{
+	Thread* current = rq->current_thread;
+	if ( current == rq->idle_thread )
+		return true;
+	return current->state != ThreadState::RUNNABLE ||
+	       thread->scheduler_priority < current->scheduler_priority;
+}
+
+// Whether the thread can be moved to the run queue of another processor.
+static bool CanMigrate(struct run_queue* rq, Thread* thread)
+{
+	return thread != rq->current_thread &&
+	       thread != rq->true_current_thread &&
+	       !thread->on_cpu;
+}
+
+// Decides which processor should run a thread that just became runnable,
+// preferring the processor it last ran on, as its caches may still be warm,
+// unless another processor is idle or much less busy.
+static size_t SelectCPU(Thread* thread)
+{
+	size_t cpu_count = CPU::GetCount();
+	size_t preferred = thread->cpu < cpu_count ? thread->cpu : CPU::GetIndex();
+	struct run_queue* preferred_rq = &run_queues[preferred];
+	if ( !CanMigrate(preferred_rq, thread) || IsIdle(preferred_rq) )
+		return preferred;
+	size_t best = preferred;
+	for ( size_t i = 0; i < cpu_count; i++ )
+	{
+		if ( IsIdle(&run_queues[i]) )
+			return i;
+		if ( run_queues[i].runnable_count + 1 < run_queues[best].runnable_count )
+			best = i;
+	}
+	return best;
+}
+
+// Takes a runnable thread from the busiest processor if it is sufficiently
+// busier than this processor.
+static void StealThread(struct run_queue* rq, size_t imbalance)
+{
+	size_t cpu_count = CPU::GetCount();
+	struct run_queue* busiest = NULL;
+	for ( size_t i = 0; i < cpu_count; i++ )
+	{
+		struct run_queue* other = &run_queues[i];
+		if ( other == rq ||
+		     other->runnable_count < rq->runnable_count + imbalance )
+			continue;
+		if ( !busiest || busiest->runnable_count < other->runnable_count )
+			busiest = other;
+	}
+	if ( !busiest )
+		return;
+	// Prefer taking threads that have already used their time slice, as they
+	// are the ones that would have to wait the longest.
+	for ( size_t i = 0; i < 2; i++ )
+	{
+		struct priority_array* array = i == 0 ? ExpiredArray(busiest) :
+		                                        ActiveArray(busiest);
+		for ( int priority = 0; priority < PRIORITY_LEVELS; priority++ )
+		{
+			Thread* first = array->lists[priority];
+			if ( !first )
+				continue;
+			Thread* iter = first;
+			do
+			{
+				if ( CanMigrate(busiest, iter) )
+				{
+					bool expired = IsExpired(busiest, iter);
+					RemoveFromRunQueue(busiest, iter);
+					InsertIntoRunQueue(rq, iter, expired);
+					return;
+				}
+				iter = iter->scheduler_list_next;
+			} while ( iter != first );
+		}
+	}
+}
+
+// Hands the processor directly to the thread a yielding thread is waiting on,
+// such as the other end of a pipe, if that thread is runnable. The thread is
+// pulled over from another processor if possible, rather than waiting for
+// its own processor to get around to it.
+static Thread* TakeYieldTarget(struct run_queue* rq, Thread* target)
+{
+	if ( !IsThreadAlive(target) || target->state != ThreadState::RUNNABLE )
+		return NULL;
+	size_t cpu = (size_t) (rq - run_queues);
+	if ( target->cpu != cpu )
+	{
+		struct run_queue* other = &run_queues[target->cpu];
+		if ( !CanMigrate(other, target) )
+			return NULL;
+		bool expired = IsExpired(other, target);
+		RemoveFromRunQueue(other, target);
+		InsertIntoRunQueue(rq, target, expired);
+	}
+	return target;
+}
+
+static Thread* PopNextThread(struct run_queue* rq, bool yielded)
 {
 	Thread* result;
 
-	uintptr_t yield_to_tid = current_thread->yield_to_tid;
-	if ( yielded && yield_to_tid != 0 )
+	// The thread runs on the time slice of the yielding thread, which remains
+	// the true current thread.
+	Thread* yield_to = rq->current_thread->yield_to;
+	if ( yielded && yield_to && (result = TakeYieldTarget(rq, yield_to)) )
+		return result;
+
+	Thread* preferred = rq->preferred_thread;
+	rq->preferred_thread = NULL;
+	if ( preferred && preferred->state == ThreadState::RUNNABLE &&
+	     preferred->cpu == (size_t) (rq - run_queues) )
+		return rq->true_current_thread = preferred;
+
+	if ( !rq->runnable_count )
+		StealThread(rq, 1);
+
+	struct priority_array* active = ActiveArray(rq);
+	if ( !active->count && ExpiredArray(rq)->count )
 	{
-		if ( (result = FindRunnableThreadWithSystemTid(yield_to_tid)) )
-			return result;
+		rq->active_index ^= 1;
+		active = ActiveArray(rq);
 	}
 
-	if ( first_runnable_thread )
+	// Keep running the current thread until its time slice is used up, unless
+	// it yielded or a thread with a higher priority became runnable.
+	Thread* current = rq->current_thread;
+	if ( !yielded &&
+	     current != rq->idle_thread &&
+	     current->state == ThreadState::RUNNABLE &&
+	     current->cpu == (size_t) (rq - run_queues) &&
+	     !IsExpired(rq, current) &&
+	     !(active->bitmap & ((1ULL << current->scheduler_priority) - 1)) )
+		result = current;
+	else if ( active->count )
 	{
-		result = first_runnable_thread;
-		first_runnable_thread = first_runnable_thread->scheduler_list_next;
+		int priority = __builtin_ctzll(active->bitmap);
+		result = active->lists[priority];
+		active->lists[priority] = result->scheduler_list_next;
 	}
 	else
 	{
-		result = idle_thread;
+		result = rq->idle_thread;
 	}
 
-	true_current_thread = result;
+	rq->true_current_thread = result;
 
 	return result;
 }
 
+// The processor is no longer on the stack of the previous thread, so other
+// processors may now run it, or free it if it has exited.
+static void ReleasePreviousThread(struct run_queue* rq)
+{
+	Thread* prev = rq->previous_thread;
+	rq->previous_thread = NULL;
+	if ( !prev || prev == rq->current_thread )
+		return;
+	prev->on_cpu = false;
+	if ( prev->state == ThreadState::DEAD )
+		kthread_cond_broadcast(&off_cpu_cond);
+}
+
 static void RealSwitch(struct interrupt_context* intctx, bool yielded)
 {
-	Thread* old_thread = CurrentThread();
-	Thread* new_thread = PopNextThread(yielded);
-	SwitchThread(intctx, old_thread, new_thread);
+	struct run_queue* rq = &run_queues[CPU::GetIndex()];
+	ReleasePreviousThread(rq);
+	rq->need_resched = false;
+	Thread* old_thread = rq->current_thread;
+	Thread* new_thread = PopNextThread(rq, yielded);
+	// Only tick periodically when there are threads that may need preempting.
+	if ( new_thread == rq->idle_thread )
+		CPU::EnterIdle();
+	else if ( old_thread == rq->idle_thread )
+		CPU::LeaveIdle();
+	SwitchThread(intctx, rq, old_thread, new_thread);
 	if ( intctx->signal_pending && InUserspace(intctx) )
 	{
 		// Become the thread for real and run the signal handler.
@@ -336,9 +664,42 @@ static void RealSwitch(struct interrupt_context* intctx, bool yielded)
 
 void Switch(struct interrupt_context* intctx)
 {
+	// Even out the load between the processors as time passes.
+	StealThread(&run_queues[CPU::GetIndex()], 2);
 	RealSwitch(intctx, false);
 }
 
+void Tick(struct interrupt_context* intctx)
+{
+	struct run_queue* rq = &run_queues[CPU::GetIndex()];
+	// Charge a thread running on a donated time slice to the thread that
+	// donated it, unless the donor has since gone to sleep, so handing off the
+	// processor doesn't give either thread more than its share.
+	Thread* current = rq->current_thread;
+	Thread* donor = rq->true_current_thread;
+	if ( donor != current &&
+	     donor->state == ThreadState::RUNNABLE &&
+	     donor->cpu == (size_t) (rq - run_queues) )
+		current = donor;
+	if ( current != rq->idle_thread &&
+	     current->state == ThreadState::RUNNABLE &&
+	     current->cpu == (size_t) (rq - run_queues) &&
+	     !IsExpired(rq, current) &&
+	     current->scheduler_timeslice &&
+	     !--current->scheduler_timeslice )
+		ExpireThread(rq, current);
+	Switch(intctx);
+}
+
+// Switches thread when returning from an interrupt that made a thread runnable
+// on this processor, which should run instead of the current thread, rather
+// than waiting for the next tick that may not come while idle.
+void PreemptIfNeeded(struct interrupt_context* intctx)
+{
+	if ( run_queues[CPU::GetIndex()].need_resched )
+		Switch(intctx);
+}
+
 void InterruptYieldCPU(struct interrupt_context* intctx, void* /*user*/)
 {
 	RealSwitch(intctx, true);
@@ -346,19 +707,46 @@ void InterruptYieldCPU(struct interrupt_context* intctx, void* /*user*/)
 
 void ThreadExitCPU(struct interrupt_context* intctx, void* /*user*/)
 {
-	SetThreadState(current_thread, ThreadState::DEAD);
+	SetThreadState(CurrentThread(), ThreadState::DEAD);
 	RealSwitch(intctx, false);
 }
 
 // The idle thread serves no purpose except being an infinite loop that does
-// nothing, which is only run when the system has nothing to do.
+// nothing, which is only run when the processor has nothing to do.
 void SetIdleThread(Thread* thread)
 {
-	assert(!idle_thread);
-	idle_thread = thread;
+	size_t cpu = CPU::GetIndex();
+	struct run_queue* rq = &run_queues[cpu];
+	assert(!rq->idle_thread);
+	rq->idle_thread = thread;
 	SetThreadState(thread, ThreadState::NONE);
-	current_thread = thread;
-	true_current_thread = thread;
+	rq->current_thread = thread;
+	rq->true_current_thread = thread;
+	thread->cpu = cpu;
+	thread->on_cpu = true;
+}
+
+// The idle thread may run for a long time without switching again on a tickless
+// processor, so the idle loop releases the previous thread right away. The
+// previous thread is only set by the processor itself, so it can be checked
+// without the kernel lock, which must be held when releasing it.
+bool HasPreviousThread(size_t cpu)
+{
+	return run_queues[cpu].previous_thread;
+}
+
+void ReleasePreviousThread(size_t cpu)
+{
+	ReleasePreviousThread(&run_queues[cpu]);
+}
+
+// Waits until the thread has exited and no processor is using its stack.
+void WaitForExit(Thread* thread)
+{
+	bool was_enabled = Interrupt::SetEnabled(false);
+	while ( thread->state != ThreadState::DEAD || thread->on_cpu )
+		kthread_cond_wait(&off_cpu_cond, NULL);
+	Interrupt::SetEnabled(was_enabled);
 }
 
 void SetInitProcess(Process* init)
@@ -373,41 +761,50 @@ Process* GetInitProcess()
 
 Process* GetKernelProcess()
 {
-	if ( !idle_thread )
+	if ( !run_queues[0].idle_thread )
 		return NULL;
-	return idle_thread->process;
+	return run_queues[0].idle_thread->process;
+}
+
+// Returns the processor currently running the thread, or SIZE_MAX if none.
+size_t GetRunningCPU(Thread* thread)
+{
+	size_t cpu = thread->cpu;
+	if ( cpu < CPU::GetCount() && run_queues[cpu].current_thread == thread )
+		return cpu;
+	return SIZE_MAX;
 }
 
 void SetThreadState(Thread* thread, ThreadState state)
 {
 	bool wasenabled = Interrupt::SetEnabled(false);
 
-	// Remove the thread from the list of runnable threads.
+	// Remove the thread from the list of runnable threads, rewarding it with
+	// higher priority if it goes to sleep before using its time slice.
 	if ( thread->state == ThreadState::RUNNABLE &&
 	     state != ThreadState::RUNNABLE )
 	{
-		if ( thread == first_runnable_thread )
-			first_runnable_thread = thread->scheduler_list_next;
-		if ( thread == first_runnable_thread )
-			first_runnable_thread = NULL;
-		assert(thread->scheduler_list_prev);
-		assert(thread->scheduler_list_next);
-		thread->scheduler_list_prev->scheduler_list_next = thread->scheduler_list_next;
-		thread->scheduler_list_next->scheduler_list_prev = thread->scheduler_list_prev;
-		thread->scheduler_list_prev = NULL;
-		thread->scheduler_list_next = NULL;
+		RemoveFromRunQueue(&run_queues[thread->cpu], thread);
+		if ( state == ThreadState::BLOCKING &&
+		     thread->scheduler_timeslice &&
+		     -MAX_PRIORITY_BONUS < thread->scheduler_bonus )
+			thread->scheduler_bonus--;
 	}
 
-	// Insert the thread into the scheduler's carousel linked list.
+	// Insert the thread into the run queue of a processor and wake that
+	// processor if it is idle or runs a thread with lower priority.
 	if ( thread->state != ThreadState::RUNNABLE &&
 	     state == ThreadState::RUNNABLE )
 	{
-		if ( first_runnable_thread == NULL )
-			first_runnable_thread = thread;
-		thread->scheduler_list_prev = first_runnable_thread->scheduler_list_prev;
-		thread->scheduler_list_next = first_runnable_thread;
-		first_runnable_thread->scheduler_list_prev = thread;
-		thread->scheduler_list_prev->scheduler_list_next = thread;
+		size_t cpu = SelectCPU(thread);
+		InsertIntoRunQueue(&run_queues[cpu], thread);
+		if ( ShouldPreempt(&run_queues[cpu], thread) )
+		{
+			if ( cpu == CPU::GetIndex() )
+				run_queues[cpu].need_resched = true;
+			else
+				CPU::Reschedule(cpu);
+		}
 	}
 
 	thread->state = state;
@@ -441,10 +838,16 @@ namespace Scheduler {
 void ScheduleTrueThread()
 {
 	bool wasenabled = Interrupt::SetEnabled(false);
-	if ( true_current_thread != current_thread )
+	struct run_queue* rq = &run_queues[CPU::GetIndex()];
+	Thread* true_thread = rq->true_current_thread;
+	// The true thread may have gone to sleep or moved to another processor
+	// after donating its time slice.
+	if ( true_thread != rq->current_thread &&
+	     true_thread->state == ThreadState::RUNNABLE &&
+	     true_thread->cpu == (size_t) (rq - run_queues) )
 	{
-		current_thread->yield_to_tid = 0;
-		first_runnable_thread = true_current_thread;
+		rq->current_thread->yield_to = NULL;
+		rq->preferred_thread = true_thread;
 		kthread_yield();
 	}
 	Interrupt::SetEnabled(wasenabled);
@@ -457,7 +860,7 @@ namespace Sortix {
 
 Thread* CurrentThread()
 {
-	return Scheduler::current_thread;
+	return Scheduler::run_queues[CPU::GetIndex()].current_thread;
 }
 
 Process* CurrentProcess()
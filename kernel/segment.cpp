@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -23,6 +23,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sortix/mman.h>
 
@@ -31,10 +32,23 @@
 #include <sortix/kernel/memorymanagement.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/segment.h>
-#include <sortix/kernel/yielder.h>
 
 namespace Sortix {
 
+// Splits the segment such that right is the part of left starting at the
+// address, which left no longer contains.
+void SplitSegment(struct segment* left, struct segment* right, uintptr_t at)
+{
+	assert(left->addr < at && at - left->addr < left->size);
+	right->addr = at;
+	right->size = left->addr + left->size - at;
+	right->prot = left->prot;
+	right->flags = left->flags;
+	right->desc = left->desc;
+	right->offset = left->offset + (off_t) (at - left->addr);
+	left->size = at - left->addr;
+}
+
 bool AreSegmentsOverlapping(const struct segment* a, const struct segment* b)
 {
 	return a->addr < b->addr + b->size && b->addr < a->addr + a->size;
@@ -53,18 +67,134 @@ bool IsUserspaceSegment(const struct segment* segment)
 	return true;
 }
 
+static size_t NodeHeight(const struct segment_node* node)
+{
+	return node ? node->height : 0;
+}
+
+// Recomputes the height of the node and the summary of its subtree from the
+// segment itself and its children.
+static void UpdateNode(struct segment_node* node)
+{
+	struct segment_node* left = node->left;
+	struct segment_node* right = node->right;
+	size_t left_height = NodeHeight(left);
+	size_t right_height = NodeHeight(right);
+	node->height = 1 + (left_height < right_height ? right_height : left_height);
+	node->subtree_addr = left ? left->subtree_addr : node->addr;
+	node->subtree_end = right ? right->subtree_end : node->addr + node->size;
+	node->subtree_size = node->size;
+	size_t gap = 0;
+	if ( left )
+	{
+		node->subtree_size += left->subtree_size;
+		if ( gap < left->subtree_gap )
+			gap = left->subtree_gap;
+		if ( gap < node->addr - left->subtree_end )
+			gap = node->addr - left->subtree_end;
+	}
+	if ( right )
+	{
+		node->subtree_size += right->subtree_size;
+		if ( gap < right->subtree_gap )
+			gap = right->subtree_gap;
+		if ( gap < right->subtree_addr - (node->addr + node->size) )
+			gap = right->subtree_addr - (node->addr + node->size);
+	}
+	node->subtree_gap = gap;
+}
+
+static void ReplaceChild(Process* process, struct segment_node* parent,
+                         struct segment_node* old_child,
+                         struct segment_node* new_child)
+{
+	if ( new_child )
+		new_child->parent = parent;
+	if ( !parent )
+		process->segment_tree = new_child;
+	else if ( parent->left == old_child )
+		parent->left = new_child;
+	else
+		parent->right = new_child;
+}
+
+static struct segment_node* RotateLeft(Process* process,
+                                       struct segment_node* node)
+{
+	struct segment_node* pivot = node->right;
+	ReplaceChild(process, node->parent, node, pivot);
+	if ( (node->right = pivot->left) )
+		node->right->parent = node;
+	pivot->left = node;
+	node->parent = pivot;
+	UpdateNode(node);
+	UpdateNode(pivot);
+	return pivot;
+}
+
+static struct segment_node* RotateRight(Process* process,
+                                        struct segment_node* node)
+{
+	struct segment_node* pivot = node->left;
+	ReplaceChild(process, node->parent, node, pivot);
+	if ( (node->left = pivot->right) )
+		node->left->parent = node;
+	pivot->right = node;
+	node->parent = pivot;
+	UpdateNode(node);
+	UpdateNode(pivot);
+	return pivot;
+}
+
+// Restores the balance of the tree and the subtree summaries from the node and
+// up to the root.
+static void Rebalance(Process* process, struct segment_node* node)
+{
+	while ( node )
+	{
+		UpdateNode(node);
+		size_t left_height = NodeHeight(node->left);
+		size_t right_height = NodeHeight(node->right);
+		if ( right_height + 1 < left_height )
+		{
+			struct segment_node* left = node->left;
+			if ( NodeHeight(left->left) < NodeHeight(left->right) )
+				RotateLeft(process, left);
+			node = RotateRight(process, node);
+		}
+		else if ( left_height + 1 < right_height )
+		{
+			struct segment_node* right = node->right;
+			if ( NodeHeight(right->right) < NodeHeight(right->left) )
+				RotateRight(process, right);
+			node = RotateLeft(process, node);
+		}
+		node = node->parent;
+	}
+}
+
 struct segment* FindOverlappingSegment(Process* process, const struct segment* new_segment)
 {
 	// process->segment_lock is held at this point.
 
-	// TODO: Speed up using binary search.
-	for ( size_t i = 0; i < process->segments_used; i++ )
+	// Find the first segment that ends after the region begins, which is the
+	// segment overlapping with it if any, as the segments don't overlap.
+	struct segment_node* result = NULL;
+	struct segment_node* node = process->segment_tree;
+	while ( node )
 	{
-		struct segment* segment = &process->segments[i];
-		if ( AreSegmentsOverlapping(segment, new_segment) )
-			return segment;
+		if ( new_segment->addr < node->addr + node->size )
+		{
+			result = node;
+			node = node->left;
+		}
+		else
+			node = node->right;
 	}
 
+	if ( result && AreSegmentsOverlapping(result, new_segment) )
+		return result;
+
 	return NULL;
 }
 
@@ -81,124 +211,186 @@ bool AddSegment(Process* process, const struct segment* new_segment)
 
 	// assert(!IsSegmentOverlapping(new_segment));
 
-	// Check if we need to expand the segment list.
-	if ( process->segments_used == process->segments_length )
+	struct segment_node* node = new struct segment_node;
+	if ( !node )
+		return false;
+	*(struct segment*) node = *new_segment;
+
+	// Insert the new segment in the tree ordered by address.
+	struct segment_node* parent = NULL;
+	struct segment_node** link = &process->segment_tree;
+	while ( *link )
 	{
-		size_t new_length = process->segments_length ?
-		                    process->segments_length * 2 : 8;
-		size_t new_size = new_length * sizeof(struct segment);
-		struct segment* new_segments =
-			(struct segment*) realloc(process->segments, new_size);
-		if ( !new_segments )
-			return false;
-		process->segments = new_segments;
-		process->segments_length = new_length;
+		parent = *link;
+		if ( segmentcmp(new_segment, parent) < 0 )
+			link = &parent->left;
+		else
+			link = &parent->right;
 	}
+	node->parent = parent;
+	*link = node;
 
-	// Add the new segment to the segment list.
-	process->segments[process->segments_used++] = *new_segment;
-
-	// Sort the segment list after address.
-	qsort(process->segments, process->segments_used, sizeof(struct segment),
-	      segmentcmp);
+	Rebalance(process, node);
 
 	return true;
 }
 
-class segment_gaps
+void RemoveSegment(Process* process, struct segment* segment)
 {
-	typedef yielder_iterator<segment_gaps, struct segment> my_iterator;
-
-public:
-	segment_gaps(finished_yielder) : process(0) { }
+	// process->segment_lock is held at this point.
 
-	segment_gaps(Process* process) :
-		process(process),
-		current_segment_index(0),
-		checked_leading(false),
-		checked_trailing(false)
+	struct segment_node* node = (struct segment_node*) segment;
+	struct segment_node* rebalance_from;
+	if ( node->left && node->right )
 	{
-		Memory::GetUserVirtualArea(&userspace_addr, &userspace_size);
+		// Take the place of the node with the next segment.
+		struct segment_node* next = node->right;
+		while ( next->left )
+			next = next->left;
+		if ( next->parent == node )
+			rebalance_from = next;
+		else
+		{
+			rebalance_from = next->parent;
+			ReplaceChild(process, next->parent, next, next->right);
+			next->right = node->right;
+			next->right->parent = next;
+		}
+		ReplaceChild(process, node->parent, node, next);
+		next->left = node->left;
+		next->left->parent = next;
 	}
-
-	bool yield(struct segment* result)
+	else
 	{
-		// process->segment_lock is held at this point.
+		rebalance_from = node->parent;
+		ReplaceChild(process, node->parent, node,
+		             node->left ? node->left : node->right);
+	}
 
-		// Check if we have finished iterating all the segments.
-		if ( !process )
-			return false;
+	Rebalance(process, rebalance_from);
 
-		// If the process has no segments at all, our job is really easy.
-		if ( !process->segments_used )
-		{
-			result->addr = userspace_addr;
-			result->size = userspace_size;
-			result->prot = 0;
-			process = NULL;
-			return true;
-		}
+	delete node;
+}
 
-		// Find out whether there is a gap before the first segment.
-		if ( !checked_leading && (checked_leading = true) &&
-		     process->segments[0].addr != userspace_addr )
-		{
-			result->addr = userspace_addr;
-			result->size = process->segments[0].addr - userspace_addr;
-			result->prot = 0;
-			return true;
-		}
+// The tree must be updated whenever a segment in it is resized or moved, which
+// must not change the order of the segments.
+void UpdateSegment(struct segment* segment)
+{
+	for ( struct segment_node* node = (struct segment_node*) segment;
+	      node;
+	      node = node->parent )
+		UpdateNode(node);
+}
 
-		// Search through the segments until a gap follows one.
-		while ( current_segment_index + 1 < process->segments_used )
-		{
-			result->addr = process->segments[current_segment_index].addr +
-			               process->segments[current_segment_index].size;
-			result->size = process->segments[current_segment_index+1].addr -
-			               result->addr;
-			result->prot = 0;
-			current_segment_index++;
-			if ( result->size )
-				return true;
-		}
+struct segment* FirstSegment(Process* process)
+{
+	struct segment_node* node = process->segment_tree;
+	if ( !node )
+		return NULL;
+	while ( node->left )
+		node = node->left;
+	return node;
+}
 
-		// Find out if there is a gap after the last segment.
-		if ( !checked_trailing && (checked_trailing = true) &&
-		     process->segments[process->segments_used-1].addr +
-		     process->segments[process->segments_used-1].size !=
-		     userspace_addr + userspace_size )
-		{
-			result->addr = process->segments[process->segments_used-1].addr +
-			               process->segments[process->segments_used-1].size;
-			result->size = userspace_addr + userspace_size - result->addr;
-			result->prot = 0;
-			return true;
-		}
+struct segment* NextSegment(struct segment* segment)
+{
+	struct segment_node* node = (struct segment_node*) segment;
+	if ( node->right )
+	{
+		node = node->right;
+		while ( node->left )
+			node = node->left;
+		return node;
+	}
+	while ( node->parent && node->parent->right == node )
+		node = node->parent;
+	return node->parent;
+}
 
-		process = NULL;
+static struct segment_node* CloneSegmentNode(const struct segment_node* node,
+                                             struct segment_node* parent)
+{
+	struct segment_node* clone = new struct segment_node;
+	if ( !clone )
+		return NULL;
+	*clone = *node;
+	clone->parent = parent;
+	clone->left = NULL;
+	clone->right = NULL;
+	if ( (node->left && !(clone->left = CloneSegmentNode(node->left, clone))) ||
+	     (node->right && !(clone->right = CloneSegmentNode(node->right, clone))) )
+	{
+		DeleteSegmentTree(clone);
+		return NULL;
+	}
+	return clone;
+}
+
+struct segment_node* CloneSegmentTree(const struct segment_node* tree)
+{
+	if ( !tree )
+		return NULL;
+	return CloneSegmentNode(tree, NULL);
+}
+
+void DeleteSegmentTree(struct segment_node* tree)
+{
+	if ( !tree )
+		return;
+	DeleteSegmentTree(tree->left);
+	DeleteSegmentTree(tree->right);
+	delete tree;
+}
 
+// Finds the lowest gap between the segments in the subtree that begins at or
+// after the address and is at least size bytes.
+static bool FindGapAbove(const struct segment_node* node, uintptr_t addr,
+                         size_t size, uintptr_t* result)
+{
+	if ( !node || node->subtree_gap < size ||
+	     node->subtree_end < addr || node->subtree_end - addr < size )
 		return false;
+	if ( FindGapAbove(node->left, addr, size, result) )
+		return true;
+	if ( node->left )
+	{
+		uintptr_t gap_addr = node->left->subtree_end;
+		if ( addr <= gap_addr && size <= node->addr - gap_addr )
+			return *result = gap_addr, true;
 	}
-
-	my_iterator begin() const
+	if ( node->right )
 	{
-		return my_iterator(segment_gaps(*this));
+		uintptr_t gap_addr = node->addr + node->size;
+		if ( addr <= gap_addr && size <= node->right->subtree_addr - gap_addr )
+			return *result = gap_addr, true;
 	}
+	return FindGapAbove(node->right, addr, size, result);
+}
 
-	my_iterator end() const
+// Finds the highest gap between the segments in the subtree that ends at or
+// before the address and is at least size bytes.
+static bool FindGapBelow(const struct segment_node* node, uintptr_t end,
+                         size_t size, uintptr_t* result)
+{
+	if ( !node || node->subtree_gap < size ||
+	     end < node->subtree_addr || end - node->subtree_addr < size )
+		return false;
+	if ( FindGapBelow(node->right, end, size, result) )
+		return true;
+	if ( node->right )
 	{
-		return my_iterator(segment_gaps{finished_yielder{}});
+		uintptr_t gap_end = node->right->subtree_addr;
+		if ( gap_end <= end && size <= gap_end - (node->addr + node->size) )
+			return *result = gap_end, true;
 	}
-
-private:
-	Process* process;
-	uintptr_t userspace_addr;
-	size_t userspace_size;
-	size_t current_segment_index;
-	bool checked_leading;
-	bool checked_trailing;
-
-};
+	if ( node->left )
+	{
+		uintptr_t gap_end = node->addr;
+		if ( gap_end <= end && size <= gap_end - node->left->subtree_end )
+			return *result = gap_end, true;
+	}
+	return FindGapBelow(node->left, end, size, result);
+}
 
 bool PlaceSegment(struct segment* solution, Process* process, void* addr_ptr,
                   size_t size, int flags)
@@ -208,40 +400,66 @@ bool PlaceSegment(struct segment* solution, Process* process, void* addr_ptr,
 	assert(size);
 	assert(!(flags & MAP_FIXED));
 
-	uintptr_t addr = (uintptr_t) addr_ptr;
-	size = Page::AlignUp(size);
-	bool found_any = false;
-	size_t best_distance = 0;
-	struct segment best;
+	uintptr_t userspace_addr;
+	size_t userspace_size;
+	Memory::GetUserVirtualArea(&userspace_addr, &userspace_size);
+	uintptr_t userspace_end = userspace_addr + userspace_size;
 
-	for ( struct segment gap : segment_gaps(process) )
-	{
-		if ( gap.size < size )
-			continue;
-		if ( gap.addr <= addr && addr + size - gap.addr <= gap.size )
-		{
-			solution->addr = addr;
-			solution->size = size;
-			solution->prot = 0;
-			return true;
-		}
-		struct segment attempt;
-		size_t distance;
-		attempt.addr = gap.addr;
-		attempt.size = size;
-		attempt.prot = 0;
-		distance = addr < attempt.addr ? attempt.addr - addr : addr - attempt.addr;
-		if ( !found_any|| distance < best_distance )
-			found_any = true, best_distance = distance, best = attempt;
-		attempt.addr = gap.addr + gap.size - size;
-		attempt.size = size;
-		attempt.prot = 0;
-		distance = addr < attempt.addr ? attempt.addr - addr : addr - attempt.addr;
-		if ( !found_any|| distance < best_distance )
-			found_any = true, best_distance = distance, best = attempt;
-	}
+	uintptr_t addr = Page::AlignDown((uintptr_t) addr_ptr);
+	size = Page::AlignUp(size);
+	if ( userspace_size < size )
+		return false;
+	if ( addr < userspace_addr )
+		addr = userspace_addr;
+	if ( userspace_end - size < addr )
+		addr = userspace_end - size;
+
+	solution->addr = addr;
+	solution->size = size;
+	solution->prot = 0;
+
+	// Use the hinted location if it's available.
+	if ( !IsSegmentOverlapping(process, solution) )
+		return true;
+
+	// Otherwise find the nearest gaps large enough above and below the hinted
+	// location, including the gaps before the first segment and after the last.
+	const struct segment_node* tree = process->segment_tree;
+	uintptr_t first = tree->subtree_addr;
+	uintptr_t last = tree->subtree_end;
+	uintptr_t above = 0;
+	uintptr_t below = 0;
+	bool found_above = true;
+	bool found_below = true;
+	if ( userspace_addr < first && addr <= userspace_addr &&
+	     size <= first - userspace_addr )
+		above = userspace_addr;
+	else if ( FindGapAbove(tree, addr, size, &above) )
+		;
+	else if ( last < userspace_end && addr <= last &&
+	          size <= userspace_end - last )
+		above = last;
+	else
+		found_above = false;
+	if ( last < userspace_end && userspace_end <= addr + size &&
+	     size <= userspace_end - last )
+		below = userspace_end;
+	else if ( FindGapBelow(tree, addr + size, size, &below) )
+		;
+	else if ( userspace_addr < first && first <= addr + size &&
+	          size <= first - userspace_addr )
+		below = first;
+	else
+		found_below = false;
+
+	if ( !found_above && !found_below )
+		return false;
+	if ( found_below && (!found_above || addr - (below - size) <= above - addr) )
+		solution->addr = below - size;
+	else
+		solution->addr = above;
 
-	return *solution = best, found_any;
+	return true;
 }
 
 } // namespace Sortix
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -32,10 +32,12 @@
 #include <sortix/ucontext.h>
 
 #include <sortix/kernel/copy.h>
+#include <sortix/kernel/cpu.h>
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/ptable.h>
+#include <sortix/kernel/scheduler.h>
 #include <sortix/kernel/signal.h>
 #include <sortix/kernel/syscall.h>
 #include <sortix/kernel/thread.h>
@@ -95,11 +97,19 @@ void UpdatePendingSignals(Thread* thread) // thread->process->signal_lock held
 	if ( thread->force_no_signals )
 		is_pending = 0;
 
-	// Store whether a signal is pending in the virtual register.
+	// Store whether a signal is pending in the virtual register, which lives in
+	// another processor if the thread is running there.
+	size_t cpu;
 	if ( thread == CurrentThread() )
 		asm_signal_is_pending = is_pending;
+	else if ( (cpu = Scheduler::GetRunningCPU(thread)) != SIZE_MAX )
+		CPU::SetSignalPending(cpu, is_pending);
 	else
 		thread->registers.signal_pending = is_pending;
+
+	// Wake the thread if it is sleeping such that it can be interrupted.
+	if ( is_pending && thread->state == ThreadState::BLOCKING )
+		Scheduler::SetThreadState(thread, ThreadState::RUNNABLE);
 }
 
 void Thread::DoUpdatePendingSignal()
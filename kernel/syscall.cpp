@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -193,6 +193,9 @@ void* syscall_list[SYSCALL_MAX_NUM + 1] =
 	[SYSCALL_TCSENDBREAK] = (void*) sys_tcsendbreak,
 	[SYSCALL_TCSETATTR] = (void*) sys_tcsetattr,
 	[SYSCALL_SCRAM] = (void*) sys_scram,
+	[SYSCALL_FUTEX] = (void*) sys_futex,
+	[SYSCALL_MSYNC] = (void*) sys_msync,
+	[SYSCALL_MEMUSAGE] = (void*) sys_memusage,
 	[SYSCALL_MAX_NUM] = (void*) sys_bad_syscall,
 };
 } /* extern "C" */
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -21,11 +21,13 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <sortix/exit.h>
+#include <sortix/futex.h>
 #include <sortix/mman.h>
 #include <sortix/signal.h>
 
@@ -40,6 +42,10 @@
 #include <sortix/kernel/thread.h>
 #include <sortix/kernel/time.h>
 
+#if defined(__i386__) || defined(__x86_64__)
+#include "x86-family/float.h"
+#endif
+
 void* operator new (size_t /*size*/, void* address) throw()
 {
 	return address;
@@ -47,6 +53,47 @@ void* operator new (size_t /*size*/, void* address) throw()
 
 namespace Sortix {
 
+// Threads are hashed by their address, such that a thread remembered by another
+// thread or an object can be checked for still existing in constant time.
+static const size_t THREAD_HASH_SIZE = 1024;
+static Thread* thread_hash[THREAD_HASH_SIZE];
+
+static size_t HashThread(Thread* thread)
+{
+	uintptr_t value = (uintptr_t) thread;
+	return ((value >> 4) ^ (value >> 14)) % THREAD_HASH_SIZE;
+}
+
+static void RegisterThread(Thread* thread)
+{
+	bool wasenabled = Interrupt::SetEnabled(false);
+	size_t index = HashThread(thread);
+	thread->hash_next = thread_hash[index];
+	thread_hash[index] = thread;
+	Interrupt::SetEnabled(wasenabled);
+}
+
+static void UnregisterThread(Thread* thread)
+{
+	bool wasenabled = Interrupt::SetEnabled(false);
+	Thread** link = &thread_hash[HashThread(thread)];
+	while ( *link != thread )
+		link = &(*link)->hash_next;
+	*link = thread->hash_next;
+	Interrupt::SetEnabled(wasenabled);
+}
+
+// The thread is only compared by its address and may well have been destroyed.
+bool IsThreadAlive(Thread* thread)
+{
+	for ( Thread* iter = thread_hash[HashThread(thread)];
+	      iter;
+	      iter = iter->hash_next )
+		if ( iter == thread )
+			return true;
+	return false;
+}
+
 Thread* AllocateThread()
 {
 	uint8_t* allocation = (uint8_t*) malloc(sizeof(class Thread) + 16);
@@ -73,15 +120,21 @@ void FreeThread(Thread* thread)
 Thread::Thread()
 {
 	assert(!((uintptr_t) registers.fpuenv & 0xFUL));
-	system_tid = (uintptr_t) this;
-	yield_to_tid = 0;
+	yield_to = NULL;
+	hash_next = NULL;
 	id = 0; // TODO: Make a thread id.
 	process = NULL;
 	prevsibling = NULL;
 	nextsibling = NULL;
 	scheduler_list_prev = NULL;
 	scheduler_list_next = NULL;
+	scheduler_array = 0;
+	scheduler_priority = 0;
+	scheduler_bonus = 0;
+	scheduler_timeslice = 0;
 	state = NONE;
+	cpu = 0;
+	on_cpu = false;
 	memset(&registers, 0, sizeof(registers));
 	kernelstackpos = 0;
 	kernelstacksize = 0;
@@ -95,13 +148,18 @@ Thread::Thread()
 	// execute_clock initialized in member constructor.
 	// system_clock initialized in member constructor.
 	Time::InitializeThreadClocks(this);
+	RegisterThread(this);
 }
 
 Thread::~Thread()
 {
+	UnregisterThread(this);
 	if ( process )
 		process->OnThreadDestruction(this);
 	assert(CurrentThread() != this);
+#if defined(__i386__) || defined(__x86_64__)
+	Float::ForgetThread(this);
+#endif
 	if ( kernelstackmalloced )
 		delete[] (uint8_t*) kernelstackpos;
 }
@@ -353,7 +411,6 @@ int sys_exit_thread(int requested_exit_code,
 		extended.unmap_size = Page::AlignDown(extended.unmap_size);
 		Memory::UnmapMemory(process, (uintptr_t) extended.unmap_from,
 		                                         extended.unmap_size);
-		Memory::Flush();
 		// TODO: The segment is not actually removed!
 	}
 
@@ -365,12 +422,14 @@ int sys_exit_thread(int requested_exit_code,
 		extended.tls_unmap_size = Page::AlignDown(extended.tls_unmap_size);
 		Memory::UnmapMemory(process, (uintptr_t) extended.tls_unmap_from,
 		                                         extended.tls_unmap_size);
-		Memory::Flush();
 	}
 
 	if ( flags & EXIT_THREAD_ZERO )
 		ZeroUser(extended.zero_from, extended.zero_size);
 
+	if ( flags & EXIT_THREAD_FUTEX_WAKE )
+		sys_futex((int*) extended.zero_from, FUTEX_WAKE, INT_MAX, NULL);
+
 	if ( !is_others )
 	{
 		// Validate the requested exit code such that the process can't exit
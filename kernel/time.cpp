@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -77,6 +77,12 @@ void OnTick(struct timespec tick_period, bool system_mode)
 {
 	realtime_clock->Advance(tick_period);
 	uptime_clock->Advance(tick_period);
+	AccountTick(tick_period, system_mode);
+}
+
+// Charges the time since the last tick on this processor to its thread.
+void AccountTick(struct timespec tick_period, bool system_mode)
+{
 	Thread* thread = CurrentThread();
 	Process* process = thread->process;
 	thread->execute_clock.Advance(tick_period);
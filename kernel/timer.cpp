@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -124,6 +124,9 @@ void Timer::Set(struct itimerspec* value, struct itimerspec* ovalue, int flags,
 	}
 
 	clock->UnlockClock();
+
+	if ( (this->flags & TIMER_ACTIVE) && clock->timers_changed )
+		clock->timers_changed();
 }
 
 } // namespace Sortix
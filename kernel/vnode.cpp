@@ -24,6 +24,8 @@
 #include <sortix/mount.h>
 #include <sortix/stat.h>
 
+#include <fsmarshall-msg.h>
+
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/refcount.h>
 #include <sortix/kernel/ioctx.h>
@@ -31,6 +33,7 @@
 #include <sortix/kernel/inode.h>
 #include <sortix/kernel/vnode.h>
 #include <sortix/kernel/mtable.h>
+#include <sortix/kernel/namecache.h>
 #include <sortix/kernel/process.h>
 
 #include "fs/user.h"
@@ -77,6 +80,40 @@ Vnode::~Vnode()
 {
 }
 
+// Lookups that can't change the directory are remembered in the name cache,
+// while anything else goes to the inode and forgets what the cache knew.
+Ref<Inode> Vnode::OpenCached(ioctx_t* ctx, const char* filename, int flags,
+                             mode_t mode)
+{
+	const int changing_flags = O_CREATE | O_EXCL | O_TRUNC | O_WRITE;
+	if ( !inode->names_cacheable() ||
+	     !strcmp(filename, ".") || !strcmp(filename, "..") )
+		return inode->open(ctx, filename, flags, mode);
+	if ( flags & changing_flags )
+	{
+		Ref<Inode> result = inode->open(ctx, filename, flags, mode);
+		if ( flags & O_CREATE )
+			NameCache::Invalidate(inode, filename);
+		return result;
+	}
+	Ref<Inode> result;
+	if ( NameCache::Lookup(inode, filename, &result) )
+	{
+		if ( !result )
+			return errno = ENOENT, Ref<Inode>(NULL);
+		if ( (flags & O_DIRECTORY) &&
+		     !S_ISDIR(result->type) && !S_ISLNK(result->type) )
+			return errno = ENOTDIR, Ref<Inode>(NULL);
+		return result;
+	}
+	size_t generation = NameCache::Generation();
+	if ( (result = inode->open(ctx, filename, flags, mode)) )
+		NameCache::Insert(inode, filename, result, generation);
+	else if ( errno == ENOENT )
+		NameCache::Insert(inode, filename, Ref<Inode>(NULL), generation);
+	return result;
+}
+
 Ref<Vnode> Vnode::open(ioctx_t* ctx, const char* filename, int flags, mode_t mode)
 {
 	bool dotdot = strcmp(filename, "..") == 0;
@@ -95,7 +132,7 @@ Ref<Vnode> Vnode::open(ioctx_t* ctx, const char* filename, int flags, mode_t mod
 		return mountedat;
 
 	// Move within the current filesystem.
-	Ref<Inode> retinode = inode->open(ctx, filename, flags, mode);
+	Ref<Inode> retinode = OpenCached(ctx, filename, flags, mode);
 	if ( !retinode )
 		return Ref<Vnode>(NULL);
 	Ref<Vnode> retmountedat = mountedat;
@@ -131,8 +168,8 @@ Ref<Vnode> Vnode::fsm_mount(ioctx_t* ctx,
                             const struct stat* rootst_ptr,
                             int flags)
 {
-	if ( flags & ~(0) )
-		return Ref<Vnode>(NULL);
+	if ( flags & ~(FSM_MOUNT_TAGGED) )
+		return errno = EINVAL, Ref<Vnode>(NULL);
 
 	if ( !strcmp(filename, ".") || !strcmp(filename, "..") )
 		return errno = EINVAL, Ref<Vnode>(NULL);
@@ -147,7 +184,7 @@ Ref<Vnode> Vnode::fsm_mount(ioctx_t* ctx,
 
 	Ref<Inode> root_inode;
 	Ref<Inode> server_inode;
-	if ( !UserFS::Bootstrap(&root_inode, &server_inode, &rootst) )
+	if ( !UserFS::Bootstrap(&root_inode, &server_inode, &rootst, flags) )
 		return Ref<Vnode>(NULL);
 
 	Ref<Vnode> server_vnode(new Vnode(server_inode, Ref<Vnode>(NULL), 0, 0));
@@ -204,6 +241,7 @@ int Vnode::unmount(ioctx_t* ctx, const char* filename, int flags)
 		// TODO: Implement the UNMOUNT_FORCE case.
 		mp_inode->unmounted(ctx);
 	}
+	NameCache::InvalidateDevice(mp_inode->dev);
 	mp_inode.Reset();
 
 	return 0;
@@ -275,35 +313,50 @@ int Vnode::isatty(ioctx_t* ctx)
 }
 
 ssize_t Vnode::readdirents(ioctx_t* ctx, struct dirent* dirent,
-                           size_t size, off_t start)
+                           size_t size, off_t* cookie)
 {
-	return inode->readdirents(ctx, dirent, size, start);
+	return inode->readdirents(ctx, dirent, size, cookie);
 }
 
 int Vnode::mkdir(ioctx_t* ctx, const char* filename, mode_t mode)
 {
-	return inode->mkdir(ctx, filename, mode);
+	int ret = inode->mkdir(ctx, filename, mode);
+	if ( inode->names_cacheable() )
+		NameCache::Invalidate(inode, filename);
+	return ret;
 }
 
 int Vnode::unlink(ioctx_t* ctx, const char* filename)
 {
-	return inode->unlink(ctx, filename);
+	int ret = inode->unlink(ctx, filename);
+	if ( inode->names_cacheable() )
+		NameCache::Invalidate(inode, filename);
+	return ret;
 }
 
 int Vnode::rmdir(ioctx_t* ctx, const char* filename)
 {
-	return inode->rmdir(ctx, filename);
+	int ret = inode->rmdir(ctx, filename);
+	if ( inode->names_cacheable() )
+		NameCache::Invalidate(inode, filename);
+	return ret;
 }
 
 int Vnode::link(ioctx_t* ctx, const char* filename, Ref<Vnode> node)
 {
 	if ( node->inode->dev != inode->dev ) { errno = EXDEV; return -1; }
-	return inode->link(ctx, filename, node->inode);
+	int ret = inode->link(ctx, filename, node->inode);
+	if ( inode->names_cacheable() )
+		NameCache::Invalidate(inode, filename);
+	return ret;
 }
 
 int Vnode::symlink(ioctx_t* ctx, const char* oldname, const char* filename)
 {
-	return inode->symlink(ctx, oldname, filename);
+	int ret = inode->symlink(ctx, oldname, filename);
+	if ( inode->names_cacheable() )
+		NameCache::Invalidate(inode, filename);
+	return ret;
 }
 
 int Vnode::rename_here(ioctx_t* ctx, Ref<Vnode> from, const char* oldname,
@@ -312,7 +365,12 @@ int Vnode::rename_here(ioctx_t* ctx, Ref<Vnode> from, const char* oldname,
 	if ( from->dev != dev )
 		return errno = EXDEV, -1;
 	// TODO: Force the same mount point here, like Linux does.
-	return inode->rename_here(ctx, from->inode, oldname, newname);
+	int ret = inode->rename_here(ctx, from->inode, oldname, newname);
+	if ( from->inode->names_cacheable() )
+		NameCache::Invalidate(from->inode, oldname);
+	if ( inode->names_cacheable() )
+		NameCache::Invalidate(inode, newname);
+	return ret;
 }
 
 ssize_t Vnode::readlink(ioctx_t* ctx, char* buf, size_t bufsiz)
@@ -452,4 +510,14 @@ int Vnode::tcsetattr(ioctx_t* ctx, int actions, const struct termios* tio)
 	return inode->tcsetattr(ctx, actions, tio);
 }
 
+addr_t Vnode::mmap(ioctx_t* ctx, off_t off)
+{
+	return inode->mmap(ctx, off);
+}
+
+int Vnode::msync(ioctx_t* ctx, off_t off, size_t size)
+{
+	return inode->msync(ctx, off, size);
+}
+
 } // namespace Sortix
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2012 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2012, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -14,9 +14,11 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  *
  * worker.cpp
- * Kernel worker thread.
+ * Kernel worker threads.
  */
 
+#include <assert.h>
+
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/kthread.h>
 #include <sortix/kernel/worker.h>
@@ -30,51 +32,81 @@ struct Job
 	void* user;
 };
 
+struct JobQueue
+{
+	kthread_cond_t jobsfree;
+	size_t jobsused;
+	size_t jobsoff;
+	Job* jobs;
+};
+
+static const size_t NUM_JOBS = 128UL;
+
 static kthread_mutex_t jobslock;
 static kthread_cond_t jobsready;
-static kthread_cond_t jobsfree;
-static size_t jobsused;
-static size_t jobsoff;
-static size_t jobslen;
-static Job* jobs;
+static JobQueue queues[NUM_PRIORITIES];
+static size_t idle_workers;
 
 void Init()
 {
 	jobslock = KTHREAD_MUTEX_INITIALIZER;
 	jobsready = KTHREAD_COND_INITIALIZER;
-	jobsfree = KTHREAD_COND_INITIALIZER;
-	const size_t NUM_JOBS = 128UL;
-	jobslen = NUM_JOBS;
-	jobs = new Job[jobslen];
-	if ( !jobs )
-		Panic("Unable to allocate worker thread job queue");
-	jobsused = 0;
-	jobsoff = 0;
+	for ( int i = 0; i < NUM_PRIORITIES; i++ )
+	{
+		queues[i].jobsfree = KTHREAD_COND_INITIALIZER;
+		queues[i].jobsused = 0;
+		queues[i].jobsoff = 0;
+		queues[i].jobs = new Job[NUM_JOBS];
+		if ( !queues[i].jobs )
+			Panic("Unable to allocate worker thread job queue");
+	}
+	idle_workers = 0;
 }
 
-static bool _Schedule(void (*func)(void*), void* user, bool retry)
+static bool _Schedule(void (*func)(void*), void* user, int priority, bool retry)
 {
+	assert(0 <= priority && priority < NUM_PRIORITIES);
+	JobQueue* queue = &queues[priority];
 	ScopedLock lock(&jobslock);
-	if ( jobsused == jobslen && !retry )
+	if ( queue->jobsused == NUM_JOBS && !retry )
 		return false;
-	while ( jobsused == jobslen )
-		kthread_cond_wait(&jobsfree, &jobslock);
-	if ( !jobsused )
-		kthread_cond_signal(&jobsready);
-	size_t index = (jobsoff + jobsused++) % jobslen;
-	jobs[index].func = func;
-	jobs[index].user = user;
+	while ( queue->jobsused == NUM_JOBS )
+		kthread_cond_wait(&queue->jobsfree, &jobslock);
+	size_t index = (queue->jobsoff + queue->jobsused++) % NUM_JOBS;
+	queue->jobs[index].func = func;
+	queue->jobs[index].user = user;
+	kthread_cond_signal(&jobsready);
 	return true;
 }
 
-void Schedule(void (*func)(void*), void* user)
+void Schedule(void (*func)(void*), void* user, int priority)
 {
-	_Schedule(func, user, true);
+	_Schedule(func, user, priority, true);
 }
 
-bool TrySchedule(void (*func)(void*), void* user)
+bool TrySchedule(void (*func)(void*), void* user, int priority)
 {
-	return _Schedule(func, user, false);
+	return _Schedule(func, user, priority, false);
+}
+
+// Takes the most important job, though only high priority jobs are taken by the
+// last idle worker, such that slow jobs can't delay the high priority jobs.
+static bool TakeJob(Job* job)
+{
+	for ( int priority = 0; priority < NUM_PRIORITIES; priority++ )
+	{
+		JobQueue* queue = &queues[priority];
+		if ( !queue->jobsused )
+			continue;
+		if ( priority != PRIORITY_HIGH && idle_workers < 2 )
+			return false;
+		*job = queue->jobs[queue->jobsoff];
+		queue->jobsoff = (queue->jobsoff + 1) % NUM_JOBS;
+		if ( queue->jobsused-- == NUM_JOBS )
+			kthread_cond_signal(&queue->jobsfree);
+		return true;
+	}
+	return false;
 }
 
 static void PerformJob(Job* job)
@@ -84,17 +116,25 @@ static void PerformJob(Job* job)
 
 void Thread(void* /*user*/)
 {
+	kthread_mutex_lock(&jobslock);
+	idle_workers++;
 	while ( true )
 	{
-		kthread_mutex_lock(&jobslock);
-		while ( !jobsused )
+		Job job;
+		while ( !TakeJob(&job) )
 			kthread_cond_wait(&jobsready, &jobslock);
-		Job job = jobs[jobsoff];
-		jobsoff = (jobsoff+1) % jobslen;
-		if ( jobsused-- == jobslen )
-			kthread_cond_signal(&jobsfree);
+		idle_workers--;
+		// Pass on the wakeup if there is more work for the other workers.
+		for ( int i = 0; i < NUM_PRIORITIES; i++ )
+			if ( queues[i].jobsused )
+			{
+				kthread_cond_signal(&jobsready);
+				break;
+			}
 		kthread_mutex_unlock(&jobslock);
 		PerformJob(&job);
+		kthread_mutex_lock(&jobslock);
+		idle_workers++;
 	}
 }
 
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -48,6 +48,13 @@ void RecursiveFreeUserspacePages(size_t level, size_t offset)
 			continue;
 		if ( !(entry & PML_FORK) )
 			continue;
+		if ( level == LARGE_PAGE_LEVEL && (entry & PML_LARGE) )
+		{
+			addr_t large = entry & PML_ADDRESS & ~(LARGE_PAGE_SIZE - 1);
+			for ( size_t n = 0; n < LARGE_PAGE_SIZE; n += 4096UL )
+				Page::PutUnlocked(large + n, PAGE_USAGE_USER_SPACE);
+			continue;
+		}
 		if ( 1 < level )
 			RecursiveFreeUserspacePages(level-1, offset * ENTRIES + i);
 		addr_t addr = pml->entry[i] & PML_ADDRESS;
@@ -78,6 +85,7 @@ void DestroyAddressSpace(addr_t fallback)
 	RecursiveFreeUserspacePages(TOPPMLLEVEL, 0);
 
 	SwitchAddressSpace(fallback);
+	ForgetAddressSpace(dir);
 
 	// Ok, now we got marked everything left behind as unused, we can
 	// now safely let another thread use the pages.
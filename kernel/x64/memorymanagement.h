@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -38,15 +38,18 @@ PML* const PMLS[TOPPMLLEVEL + 1] =
 
 PML* const FORKPML = (PML* const) 0xFFFFFF0000000000UL;
 
+// The page directories can map 2 MiB pages directly.
+const size_t LARGE_PAGE_LEVEL = 2;
+const size_t LARGE_PAGE_SIZE = 2UL * 1024UL * 1024UL;
+
 } // namespace Memory
 } // namespace Sortix
 
 namespace Sortix {
 namespace Page {
 
-addr_t* const STACK = (addr_t* const) 0xFFFFFE8000000000UL;
-const size_t MAXSTACKSIZE = (512UL*1024UL*1024UL*1024UL);
-const size_t MAXSTACKLENGTH = MAXSTACKSIZE / sizeof(addr_t);
+const addr_t FRAME_TABLE = 0xFFFFFE8000000000UL;
+const size_t FRAME_TABLE_MAX_SIZE = 512UL * 1024UL * 1024UL * 1024UL;
 
 } // namespace Page
 } // namespace Sortix
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * x86-family/acpi.cpp
+ * Advanced Configuration and Power Interface tables.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sortix/mman.h>
+
+#include <sortix/kernel/addralloc.h>
+#include <sortix/kernel/kernel.h>
+#include <sortix/kernel/memorymanagement.h>
+
+#include "acpi.h"
+
+namespace Sortix {
+namespace ACPI {
+
+struct rsdp
+{
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt_address;
+	uint32_t length;
+	uint64_t xsdt_address;
+	uint8_t extended_checksum;
+	uint8_t reserved[3];
+} __attribute__((packed));
+
+static uint64_t rsdt_address;
+static bool rsdt_is_xsdt;
+
+static uint8_t Checksum(const void* data_ptr, size_t size)
+{
+	const uint8_t* data = (const uint8_t*) data_ptr;
+	uint8_t sum = 0;
+	for ( size_t i = 0; i < size; i++ )
+		sum += data[i];
+	return sum;
+}
+
+bool ReadPhysical(void* dest_ptr, uint64_t physical, size_t size)
+{
+	if ( !size )
+		return true;
+	if ( (uint64_t) UINTPTR_MAX < physical ||
+	     (uint64_t) UINTPTR_MAX - physical < size - 1 )
+		return false;
+	addralloc_t alloc;
+	if ( !AllocateKernelAddress(&alloc, Page::Size()) )
+		return false;
+	uint8_t* dest = (uint8_t*) dest_ptr;
+	while ( size )
+	{
+		addr_t page = Page::AlignDown((addr_t) physical);
+		size_t offset = (addr_t) physical - page;
+		size_t amount = Page::Size() - offset;
+		if ( size < amount )
+			amount = size;
+		if ( !Memory::Map(page, alloc.from, PROT_KREAD) )
+		{
+			FreeKernelAddress(&alloc);
+			return false;
+		}
+		Memory::InvalidatePage(alloc.from);
+		memcpy(dest, (const uint8_t*) alloc.from + offset, amount);
+		Memory::Unmap(alloc.from);
+		Memory::InvalidatePage(alloc.from);
+		dest += amount;
+		physical += amount;
+		size -= amount;
+	}
+	FreeKernelAddress(&alloc);
+	return true;
+}
+
+static bool SearchRSDP(uint64_t from, size_t size, struct rsdp* result)
+{
+	uint8_t* area = (uint8_t*) malloc(size);
+	if ( !area )
+		return false;
+	if ( !ReadPhysical(area, from, size) )
+		return free(area), false;
+	bool found = false;
+	for ( size_t i = 0; !found && i + 20 <= size; i += 16 )
+	{
+		if ( memcmp(area + i, "RSD PTR ", 8) != 0 )
+			continue;
+		if ( Checksum(area + i, 20) != 0 )
+			continue;
+		memset(result, 0, sizeof(*result));
+		size_t amount = size - i < sizeof(*result) ? size - i : sizeof(*result);
+		memcpy(result, area + i, amount);
+		found = true;
+	}
+	free(area);
+	return found;
+}
+
+bool Init()
+{
+	// The root system description pointer is either in the first kilobyte of
+	// the extended BIOS data area or in the BIOS read-only memory.
+	struct rsdp rsdp;
+	uint16_t ebda_segment;
+	bool found = false;
+	if ( ReadPhysical(&ebda_segment, 0x40E, sizeof(ebda_segment)) &&
+	     ebda_segment )
+		found = SearchRSDP((uint64_t) ebda_segment << 4, 1024, &rsdp);
+	if ( !found )
+		found = SearchRSDP(0xE0000, 0x20000, &rsdp);
+	if ( !found )
+		return false;
+
+	// Prefer the extended table if the firmware provides it and we can use it.
+	rsdt_address = rsdp.rsdt_address;
+	rsdt_is_xsdt = false;
+	if ( 2 <= rsdp.revision && rsdp.xsdt_address &&
+	     Checksum(&rsdp, sizeof(rsdp)) == 0 &&
+	     rsdp.xsdt_address <= (uint64_t) UINTPTR_MAX )
+	{
+		rsdt_address = rsdp.xsdt_address;
+		rsdt_is_xsdt = true;
+	}
+
+	return rsdt_address != 0;
+}
+
+static void* ReadTableAt(uint64_t physical)
+{
+	struct sdt_header header;
+	if ( !ReadPhysical(&header, physical, sizeof(header)) )
+		return NULL;
+	if ( header.length < sizeof(header) )
+		return NULL;
+	void* table = malloc(header.length);
+	if ( !table )
+		return NULL;
+	if ( !ReadPhysical(table, physical, header.length) ||
+	     Checksum(table, header.length) != 0 )
+		return free(table), (void*) NULL;
+	return table;
+}
+
+// Returns a copy of the first table with the given signature, which the caller
+// must free, or NULL if there is no such table.
+void* ReadTable(const char* signature)
+{
+	if ( !rsdt_address )
+		return NULL;
+	struct sdt_header* rsdt = (struct sdt_header*) ReadTableAt(rsdt_address);
+	if ( !rsdt )
+		return NULL;
+	size_t entry_size = rsdt_is_xsdt ? 8 : 4;
+	size_t entries_count = (rsdt->length - sizeof(*rsdt)) / entry_size;
+	const uint8_t* entries = (const uint8_t*) (rsdt + 1);
+	void* result = NULL;
+	for ( size_t i = 0; !result && i < entries_count; i++ )
+	{
+		uint64_t address = 0;
+		memcpy(&address, entries + i * entry_size, entry_size);
+		struct sdt_header header;
+		if ( !ReadPhysical(&header, address, sizeof(header)) )
+			continue;
+		if ( memcmp(header.signature, signature, 4) != 0 )
+			continue;
+		result = ReadTableAt(address);
+	}
+	free(rsdt);
+	return result;
+}
+
+} // namespace ACPI
+} // namespace Sortix
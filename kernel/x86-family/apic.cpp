@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * x86-family/apic.cpp
+ * Local Advanced Programmable Interrupt Controller.
+ */
+
+#include <msr.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <timespec.h>
+
+#include <sortix/clock.h>
+#include <sortix/mman.h>
+
+#include <sortix/kernel/addralloc.h>
+#include <sortix/kernel/cpu.h>
+#include <sortix/kernel/cpuid.h>
+#include <sortix/kernel/kernel.h>
+#include <sortix/kernel/kthread.h>
+#include <sortix/kernel/memorymanagement.h>
+#include <sortix/kernel/time.h>
+
+#include "acpi.h"
+#include "apic.h"
+#include "memorymanagement.h"
+
+namespace Sortix {
+namespace APIC {
+
+const size_t REG_ID = 0x020;
+const size_t REG_TPR = 0x080;
+const size_t REG_EOI = 0x0B0;
+const size_t REG_SVR = 0x0F0;
+const size_t REG_ICR_LOW = 0x300;
+const size_t REG_ICR_HIGH = 0x310;
+const size_t REG_LVT_TIMER = 0x320;
+const size_t REG_TIMER_INITIAL = 0x380;
+const size_t REG_TIMER_CURRENT = 0x390;
+const size_t REG_TIMER_DIVIDE = 0x3E0;
+
+const uint32_t MSR_TSC_DEADLINE = 0x6E0;
+
+const uint32_t SVR_ENABLE = 1 << 8;
+const uint32_t ICR_DELIVERY_PENDING = 1 << 12;
+const uint32_t ICR_FIXED = 0x4000;
+const uint32_t ICR_INIT = 0x4500;
+const uint32_t ICR_STARTUP = 0x4600;
+const uint32_t LVT_MASKED = 1 << 16;
+const uint32_t LVT_TIMER_PERIODIC = 1 << 17;
+const uint32_t LVT_TIMER_TSC_DEADLINE = 2 << 17;
+const uint32_t TIMER_DIVIDE_BY_16 = 0x3;
+
+struct madt
+{
+	struct ACPI::sdt_header header;
+	uint32_t local_apic_address;
+	uint32_t flags;
+} __attribute__((packed));
+
+const uint8_t MADT_LOCAL_APIC = 0;
+const uint8_t MADT_LOCAL_APIC_ADDRESS_OVERRIDE = 5;
+
+struct madt_local_apic
+{
+	uint8_t type;
+	uint8_t length;
+	uint8_t acpi_processor_id;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__((packed));
+
+struct madt_local_apic_address_override
+{
+	uint8_t type;
+	uint8_t length;
+	uint16_t reserved;
+	uint64_t local_apic_address;
+} __attribute__((packed));
+
+static addralloc_t lapic_alloc;
+static volatile uint8_t* lapic;
+static uint32_t processor_ids[CPU::MAX_CPUS];
+static size_t processor_count;
+static uint32_t timer_counts_per_second;
+
+static uint32_t Read(size_t reg)
+{
+	return *(volatile uint32_t*) (lapic + reg);
+}
+
+static void Write(size_t reg, uint32_t value)
+{
+	*(volatile uint32_t*) (lapic + reg) = value;
+}
+
+static bool IsSupported()
+{
+	if ( !IsCPUIdSupported() )
+		return false;
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, eax, ebx, ecx, edx);
+	return edx & (1 << 9);
+}
+
+bool Init()
+{
+	if ( !IsSupported() )
+		return false;
+	struct madt* madt = (struct madt*) ACPI::ReadTable("APIC");
+	if ( !madt )
+		return false;
+	if ( madt->header.length < sizeof(*madt) )
+		return free(madt), false;
+
+	uint64_t address = madt->local_apic_address;
+	uint32_t bsp_id = 0;
+	bool has_bsp_id = false;
+	processor_count = 0;
+	const uint8_t* entries = (const uint8_t*) (madt + 1);
+	size_t entries_size = madt->header.length - sizeof(*madt);
+	for ( size_t offset = 0; offset + 2 <= entries_size; )
+	{
+		uint8_t type = entries[offset + 0];
+		uint8_t length = entries[offset + 1];
+		if ( length < 2 || entries_size - offset < length )
+			break;
+		if ( type == MADT_LOCAL_APIC &&
+		     sizeof(struct madt_local_apic) <= length )
+		{
+			struct madt_local_apic entry;
+			memcpy(&entry, entries + offset, sizeof(entry));
+			if ( (entry.flags & 1) && processor_count < CPU::MAX_CPUS )
+				processor_ids[processor_count++] = entry.apic_id;
+		}
+		else if ( type == MADT_LOCAL_APIC_ADDRESS_OVERRIDE &&
+		          sizeof(struct madt_local_apic_address_override) <= length )
+		{
+			struct madt_local_apic_address_override entry;
+			memcpy(&entry, entries + offset, sizeof(entry));
+			address = entry.local_apic_address;
+		}
+		offset += length;
+	}
+	free(madt);
+
+	if ( !address || (uint64_t) UINTPTR_MAX < address )
+		return false;
+	if ( !AllocateKernelAddress(&lapic_alloc, Page::Size()) )
+		return false;
+	addr_t physical = Page::AlignDown((addr_t) address);
+	int prot = PROT_KREAD | PROT_KWRITE;
+	if ( !Memory::MapPAT(physical, lapic_alloc.from, prot, Memory::PAT_UC) )
+	{
+		FreeKernelAddress(&lapic_alloc);
+		return false;
+	}
+	Memory::Flush();
+	lapic = (volatile uint8_t*) (lapic_alloc.from + ((addr_t) address - physical));
+
+	InitCPU();
+
+	// Make sure the bootstrap processor is listed first, so the processor
+	// indexes match the order the processors are brought online.
+	bsp_id = GetID();
+	for ( size_t i = 0; !has_bsp_id && i < processor_count; i++ )
+	{
+		if ( processor_ids[i] != bsp_id )
+			continue;
+		processor_ids[i] = processor_ids[0];
+		processor_ids[0] = bsp_id;
+		has_bsp_id = true;
+	}
+	if ( !has_bsp_id )
+	{
+		if ( processor_count == CPU::MAX_CPUS )
+			processor_count--;
+		processor_ids[processor_count++] = processor_ids[0];
+		processor_ids[0] = bsp_id;
+	}
+
+	return true;
+}
+
+void InitCPU()
+{
+	Write(REG_TPR, 0);
+	Write(REG_SVR, SVR_ENABLE | VECTOR_SPURIOUS);
+}
+
+size_t GetProcessorCount()
+{
+	return processor_count;
+}
+
+uint32_t GetProcessorID(size_t index)
+{
+	return processor_ids[index];
+}
+
+uint32_t GetID()
+{
+	return Read(REG_ID) >> 24;
+}
+
+void EOI()
+{
+	Write(REG_EOI, 0);
+}
+
+static void SendCommand(uint32_t apic_id, uint32_t command)
+{
+	while ( Read(REG_ICR_LOW) & ICR_DELIVERY_PENDING )
+		asm volatile ("pause");
+	Write(REG_ICR_HIGH, apic_id << 24);
+	Write(REG_ICR_LOW, command);
+	while ( Read(REG_ICR_LOW) & ICR_DELIVERY_PENDING )
+		asm volatile ("pause");
+}
+
+void SendIPI(uint32_t apic_id, unsigned int vector)
+{
+	SendCommand(apic_id, ICR_FIXED | vector);
+}
+
+void SendInit(uint32_t apic_id)
+{
+	SendCommand(apic_id, ICR_INIT);
+}
+
+void SendStartup(uint32_t apic_id, uint32_t physical)
+{
+	SendCommand(apic_id, ICR_STARTUP | (physical >> 12 & 0xFF));
+}
+
+// Measures the speed of the timer against the uptime clock, which must be
+// running already.
+void CalibrateTimer()
+{
+	Write(REG_TIMER_DIVIDE, TIMER_DIVIDE_BY_16);
+	Write(REG_LVT_TIMER, LVT_MASKED | VECTOR_TIMER);
+
+	// Start measuring at the edge of a clock tick for best precision.
+	struct timespec before = Time::Get(CLOCK_BOOT);
+	struct timespec start;
+	while ( timespec_eq(start = Time::Get(CLOCK_BOOT), before) )
+		kthread_yield();
+	Write(REG_TIMER_INITIAL, UINT32_MAX);
+	struct timespec duration = timespec_make(0, 100 * 1000 * 1000);
+	struct timespec end = timespec_add(start, duration);
+	struct timespec now;
+	while ( timespec_lt(now = Time::Get(CLOCK_BOOT), end) )
+		kthread_yield();
+	uint32_t elapsed = UINT32_MAX - Read(REG_TIMER_CURRENT);
+	Write(REG_TIMER_INITIAL, 0);
+
+	struct timespec measured = timespec_sub(now, start);
+	uint64_t measured_ns = (uint64_t) measured.tv_sec * 1000000000ULL +
+	                       (uint64_t) measured.tv_nsec;
+	timer_counts_per_second = (uint64_t) elapsed * 1000000000ULL / measured_ns;
+}
+
+// Busy waits using the timer, which must be calibrated and not otherwise in
+// use on this processor.
+void Delay(unsigned long microseconds)
+{
+	uint64_t counts = (uint64_t) timer_counts_per_second * microseconds / 1000000;
+	if ( !counts )
+		counts = 1;
+	if ( UINT32_MAX < counts )
+		counts = UINT32_MAX;
+	Write(REG_TIMER_DIVIDE, TIMER_DIVIDE_BY_16);
+	Write(REG_LVT_TIMER, LVT_MASKED | VECTOR_TIMER);
+	Write(REG_TIMER_INITIAL, (uint32_t) counts);
+	while ( Read(REG_TIMER_CURRENT) )
+		asm volatile ("pause");
+}
+
+void StartTimer(long frequency)
+{
+	uint32_t counts = timer_counts_per_second / frequency;
+	Write(REG_TIMER_DIVIDE, TIMER_DIVIDE_BY_16);
+	Write(REG_LVT_TIMER, LVT_TIMER_PERIODIC | VECTOR_TIMER);
+	Write(REG_TIMER_INITIAL, counts ? counts : 1);
+}
+
+void StopTimer()
+{
+	Write(REG_LVT_TIMER, LVT_MASKED | VECTOR_TIMER);
+	Write(REG_TIMER_INITIAL, 0);
+}
+
+bool IsTSCDeadlineSupported()
+{
+	if ( !lapic )
+		return false;
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, eax, ebx, ecx, edx);
+	return ecx & (1 << 24);
+}
+
+// Interrupts this processor once the time stamp counter reaches the deadline.
+void SetTSCDeadline(uint64_t deadline)
+{
+	Write(REG_LVT_TIMER, LVT_TIMER_TSC_DEADLINE | VECTOR_TIMER);
+	// The mode change must be visible before the deadline is armed.
+	asm volatile ("mfence" : : : "memory");
+	wrmsr(MSR_TSC_DEADLINE, deadline);
+}
+
+} // namespace APIC
+} // namespace Sortix
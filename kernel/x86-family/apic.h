@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * x86-family/apic.h
+ * Local Advanced Programmable Interrupt Controller.
+ */
+
+#ifndef SORTIX_X86_FAMILY_APIC_H
+#define SORTIX_X86_FAMILY_APIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Sortix {
+namespace APIC {
+
+const unsigned int VECTOR_TIMER = 0xF0;
+const unsigned int VECTOR_RESCHEDULE = 0xF1;
+const unsigned int VECTOR_TLB_FLUSH = 0xF2;
+const unsigned int VECTOR_HALT = 0xF3;
+const unsigned int VECTOR_SPURIOUS = 0xFF;
+
+bool Init();
+void InitCPU();
+size_t GetProcessorCount();
+uint32_t GetProcessorID(size_t index);
+uint32_t GetID();
+void EOI();
+void SendIPI(uint32_t apic_id, unsigned int vector);
+void SendInit(uint32_t apic_id);
+void SendStartup(uint32_t apic_id, uint32_t physical);
+void CalibrateTimer();
+void Delay(unsigned long microseconds);
+void StartTimer(long frequency);
+void StopTimer();
+bool IsTSCDeadlineSupported();
+void SetTSCDeadline(uint64_t deadline);
+
+} // namespace APIC
+} // namespace Sortix
+
+#endif
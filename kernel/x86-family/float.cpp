@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -18,9 +18,12 @@
  */
 
 #include <assert.h>
+#include <string.h>
 
+#include <sortix/kernel/cpu.h>
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/kernel.h>
+#include <sortix/kernel/process.h>
 #include <sortix/kernel/thread.h>
 
 #include "float.h"
@@ -30,5 +33,98 @@ namespace Float {
 
 extern "C" { __attribute__((aligned(16))) uint8_t fpu_initialized_regs[512]; }
 
+// The floating point registers are switched lazily, as most threads never use
+// them. The task switched bit in cr0 is set when switching to a thread whose
+// state is not loaded on the processor, such that the thread traps the first
+// time it uses the floating point registers, which then loads its state. The
+// state of a thread that used the registers is saved when it is switched away
+// from, so its saved state is always current while it isn't running, and the
+// processor remembers whose state it still has loaded, so a thread switched
+// back to on the same processor need not load it again.
+
+static const unsigned long CR0_TS = 1 << 3;
+
+static Thread* owners[CPU::MAX_CPUS];
+
+static inline unsigned long ReadCR0()
+{
+	unsigned long cr0;
+	asm volatile ("mov %%cr0, %0" : "=r"(cr0));
+	return cr0;
+}
+
+static inline void SetTaskSwitched()
+{
+	asm volatile ("mov %0, %%cr0" : : "r"(ReadCR0() | CR0_TS));
+}
+
+static inline void ClearTaskSwitched()
+{
+	asm volatile ("clts");
+}
+
+// Whether the thread is running on this processor with its state loaded, such
+// that the registers may be newer than its saved state.
+static bool IsLive(Thread* thread)
+{
+	return owners[CPU::GetIndex()] == thread && !(ReadCR0() & CR0_TS);
+}
+
+static void Disown(Thread* thread)
+{
+	for ( size_t i = 0; i < CPU::MAX_CPUS; i++ )
+		if ( owners[i] == thread )
+			owners[i] = NULL;
+}
+
+void Switch(Thread* prev, Thread* next)
+{
+	size_t cpu = CPU::GetIndex();
+	if ( IsLive(prev) )
+		asm volatile ("fxsave (%0)" : : "r"(prev->registers.fpuenv));
+	if ( owners[cpu] == next )
+		ClearTaskSwitched();
+	else
+		SetTaskSwitched();
+}
+
+// Copies the current floating point state of the current thread.
+void Save(Thread* thread, uint8_t* fpuenv)
+{
+	if ( IsLive(thread) )
+		asm volatile ("fxsave (%0)" : : "r"(thread->registers.fpuenv));
+	if ( fpuenv != thread->registers.fpuenv )
+		memcpy(fpuenv, thread->registers.fpuenv, 512);
+}
+
+// Replaces the floating point state of the current thread, which is loaded
+// again when the thread next uses it.
+void Load(Thread* thread, const uint8_t* fpuenv)
+{
+	if ( fpuenv != thread->registers.fpuenv )
+		memcpy(thread->registers.fpuenv, fpuenv, 512);
+	Disown(thread);
+	SetTaskSwitched();
+}
+
+void ForgetThread(Thread* thread)
+{
+	Disown(thread);
+}
+
+void OnNotAvailable(struct interrupt_context* /*intctx*/, void* /*user*/)
+{
+	Thread* thread = CurrentThread();
+	size_t cpu = CPU::GetIndex();
+	ClearTaskSwitched();
+	if ( owners[cpu] == thread )
+		return;
+	Disown(thread);
+	asm volatile ("fxrstor (%0)" : : "r"(thread->registers.fpuenv));
+	owners[cpu] = thread;
+	if ( thread->process )
+		thread->process->fpu_switches++;
+}
+
 } // namespace Float
 } // namespace Sortix
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -22,11 +22,22 @@
 
 #include <stdint.h>
 
+namespace Sortix {
+class Thread;
+struct interrupt_context;
+} // namespace Sortix
+
 namespace Sortix {
 namespace Float {
 
 extern "C" uint8_t fpu_initialized_regs[512];
 
+void Switch(Thread* prev, Thread* next);
+void Save(Thread* thread, uint8_t* fpuenv);
+void Load(Thread* thread, const uint8_t* fpuenv);
+void ForgetThread(Thread* thread);
+void OnNotAvailable(struct interrupt_context* intctx, void* user);
+
 } // namespace Float
 } // namespace Sortix
 
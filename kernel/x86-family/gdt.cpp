@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -18,10 +18,12 @@
  */
 
 #include <assert.h>
+#include <msr.h>
 #include <stdint.h>
 #include <string.h>
 
 #include <sortix/kernel/cpu.h>
+#include <sortix/kernel/cpuid.h>
 #include <sortix/kernel/registers.h>
 
 #include "gdt.h"
@@ -104,7 +106,8 @@ extern "C" {
 const size_t STACK_SIZE = 64*1024;
 extern size_t stack[STACK_SIZE / sizeof(size_t)];
 
-struct tss_entry tss =
+struct tss_entry tss[CPU::MAX_CPUS] =
+{
 {
 #if defined(__i386__)
 	.prev_tss = 0,                                                     /* c++ */
@@ -145,6 +148,7 @@ struct tss_entry tss =
 	.reserved3 = 0,
 	.iomap_base = 0,
 #endif
+},
 };
 
 } /* extern "C" */
@@ -177,9 +181,21 @@ struct tss_entry tss =
 	  0,                                               /* reserved0 */ }
 #endif
 
+// Each processor has its own copy of the global descriptor table, as each has
+// its own task switch segment and (on i386) thread local segments. The copies
+// are the same power of two size, such that the index of the current processor
+// can be determined from the address of its table.
+#if defined(__i386__)
+#define GDT_NUM_ENTRIES 8
+#elif defined(__x86_64__)
+#define GDT_NUM_ENTRIES 8 /* The last entry is padding. */
+#endif
+#define GDT_TSS_ENTRY 5
+
 extern "C" {
 
-struct gdt_entry gdt[] =
+struct gdt_entry gdt[CPU::MAX_CPUS][GDT_NUM_ENTRIES] =
+{
 {
 	/* 0x00: Null segment */
 	GDT_ENTRY(0, 0, 0, 0),
@@ -198,7 +214,7 @@ struct gdt_entry gdt[] =
 	GDT_ENTRY(0, 0xFFFFFFFF, 0xF2, GRAN_32_BIT_MODE | GRAN_4KIB_BLOCKS),
 
 	/* 0x28: Task Switch Segment. */
-	GDT_ENTRY(0 /*((uintptr_t) &tss)*/, sizeof(tss) - 1, 0xE9, 0x00),
+	GDT_ENTRY(0 /*((uintptr_t) &tss)*/, sizeof(tss[0]) - 1, 0xE9, 0x00),
 
 	/* 0x30: F Segment. */
 	GDT_ENTRY(0, 0xFFFFFFFF, 0xF2, GRAN_32_BIT_MODE | GRAN_4KIB_BLOCKS),
@@ -219,37 +235,126 @@ struct gdt_entry gdt[] =
 	GDT_ENTRY(0, 0xFFFFFFFF, 0xF2, GRAN_64_BIT_MODE | GRAN_4KIB_BLOCKS),
 
 	/* 0x28: Task Switch Segment. */
-	GDT_ENTRY64((uint64_t) 0 /*((uintptr_t) &tss)*/, sizeof(tss) - 1, 0xE9, 0x00),
+	GDT_ENTRY64((uint64_t) 0 /*((uintptr_t) &tss)*/, sizeof(tss[0]) - 1, 0xE9, 0x00),
+
+	/* 0x38: Padding. */
+	GDT_ENTRY(0, 0, 0, 0),
 #endif
+},
 };
 
-uint16_t gdt_size_minus_one = sizeof(gdt) - 1;
+uint16_t gdt_size_minus_one = sizeof(gdt[0]) - 1;
 
 } /* extern "C" */
 
+static_assert(sizeof(gdt[0]) == 1 << 6, "gdt[0] must be 64 bytes");
+
+size_t GetCurrentIndex()
+{
+#if defined(__i386__)
+	struct { uint16_t limit; uint32_t base; } __attribute__((packed)) gdtr;
+#elif defined(__x86_64__)
+	struct { uint16_t limit; uint64_t base; } __attribute__((packed)) gdtr;
+#endif
+	asm volatile ("sgdt %0" : "=m"(gdtr));
+	return (gdtr.base - (uintptr_t) gdt) >> 6;
+}
+
+void PrepareCPU(size_t cpu)
+{
+	assert(cpu < CPU::MAX_CPUS);
+	memcpy(&tss[cpu], &tss[0], sizeof(tss[cpu]));
+#if defined(__i386__)
+	tss[cpu].esp0 = 0;
+#elif defined(__x86_64__)
+	tss[cpu].stack0 = 0;
+#endif
+	memcpy(&gdt[cpu], &gdt[0], sizeof(gdt[cpu]));
+	struct gdt_entry* entry = &gdt[cpu][GDT_TSS_ENTRY];
+	uintptr_t base = (uintptr_t) &tss[cpu];
+	entry->base_low = base >> 0 & 0xFFFF;
+	entry->base_middle = base >> 16 & 0xFF;
+	entry->base_high = base >> 24 & 0xFF;
+	entry->access = 0xE9; // Not busy, the boot processor's copy is.
+#if defined(__x86_64__)
+	uint32_t* base_highest = (uint32_t*) &entry[1];
+	base_highest[0] = (uint64_t) base >> 32;
+	base_highest[1] = 0;
+#endif
+}
+
+void LoadCPU(size_t cpu)
+{
+	assert(cpu < CPU::MAX_CPUS);
+	uintptr_t base = (uintptr_t) &gdt[cpu];
+#if defined(__i386__)
+	asm volatile ("subl $6, %%esp\n\t"
+	              "movw %w0, 0(%%esp)\n\t"
+	              "movl %1, 2(%%esp)\n\t"
+	              "lgdt (%%esp)\n\t"
+	              "addl $6, %%esp\n\t"
+	              "ljmp $0x08, $1f\n\t"
+	              "1:\n\t"
+	              "movw $0x10, %%ax\n\t"
+	              "movw %%ax, %%ds\n\t"
+	              "movw %%ax, %%es\n\t"
+	              "movw %%ax, %%ss\n\t"
+	              "movw $(0x28 | 0x3), %%ax\n\t"
+	              "ltr %%ax\n\t"
+	              "movw $(0x30 | 0x3), %%ax\n\t"
+	              "movw %%ax, %%fs\n\t"
+	              "movw $(0x38 | 0x3), %%ax\n\t"
+	              "movw %%ax, %%gs"
+	              : : "r"(gdt_size_minus_one), "r"(base) : "eax", "memory");
+#elif defined(__x86_64__)
+	asm volatile ("subq $10, %%rsp\n\t"
+	              "movw %w0, 0(%%rsp)\n\t"
+	              "movq %1, 2(%%rsp)\n\t"
+	              "lgdt (%%rsp)\n\t"
+	              "addq $10, %%rsp\n\t"
+	              "pushq $0x08\n\t"
+	              "leaq 1f(%%rip), %%rax\n\t"
+	              "pushq %%rax\n\t"
+	              "lretq\n\t"
+	              "1:\n\t"
+	              "movw $0x10, %%ax\n\t"
+	              "movw %%ax, %%ds\n\t"
+	              "movw %%ax, %%es\n\t"
+	              "movw %%ax, %%ss\n\t"
+	              "movw $(0x28 | 0x3), %%ax\n\t"
+	              "ltr %%ax\n\t"
+	              "movw $(0x20 | 0x3), %%ax\n\t"
+	              "movw %%ax, %%fs\n\t"
+	              "movw %%ax, %%gs"
+	              : : "r"(gdt_size_minus_one), "r"(base) : "rax", "memory");
+#endif
+}
+
 uintptr_t GetKernelStack()
 {
+	size_t cpu = CPU::GetIndex();
 #if defined(__i386__)
-	return tss.esp0;
+	return tss[cpu].esp0;
 #elif defined(__x86_64__)
-	return tss.stack0;
+	return tss[cpu].stack0;
 #endif
 }
 
 void SetKernelStack(uintptr_t stack_pointer)
 {
 	assert((stack_pointer & 0xF) == 0);
+	size_t cpu = CPU::GetIndex();
 #if defined(__i386__)
-	tss.esp0 = (uint32_t) stack_pointer;
+	tss[cpu].esp0 = (uint32_t) stack_pointer;
 #elif defined(__x86_64__)
-	tss.stack0 = (uint64_t) stack_pointer;
+	tss[cpu].stack0 = (uint64_t) stack_pointer;
 #endif
 }
 
 #if defined(__i386__)
 uint32_t GetFSBase()
 {
-	struct gdt_entry* entry = gdt + GDT_FS_ENTRY;
+	struct gdt_entry* entry = gdt[CPU::GetIndex()] + GDT_FS_ENTRY;
 	return (uint32_t) entry->base_low << 0 |
 	       (uint32_t) entry->base_middle << 16 |
 	       (uint32_t) entry->base_high << 24;
@@ -257,7 +362,7 @@ uint32_t GetFSBase()
 
 uint32_t GetGSBase()
 {
-	struct gdt_entry* entry = gdt + GDT_GS_ENTRY;
+	struct gdt_entry* entry = gdt[CPU::GetIndex()] + GDT_GS_ENTRY;
 	return (uint32_t) entry->base_low << 0 |
 	       (uint32_t) entry->base_middle << 16 |
 	       (uint32_t) entry->base_high << 24;
@@ -265,7 +370,7 @@ uint32_t GetGSBase()
 
 void SetFSBase(uint32_t fsbase)
 {
-	struct gdt_entry* entry = gdt + GDT_FS_ENTRY;
+	struct gdt_entry* entry = gdt[CPU::GetIndex()] + GDT_FS_ENTRY;
 	entry->base_low = fsbase >> 0 & 0xFFFF;
 	entry->base_middle = fsbase >> 16 & 0xFF;
 	entry->base_high = fsbase >> 24 & 0xFF;
@@ -274,12 +379,73 @@ void SetFSBase(uint32_t fsbase)
 
 void SetGSBase(uint32_t gsbase)
 {
-	struct gdt_entry* entry = gdt + GDT_GS_ENTRY;
+	struct gdt_entry* entry = gdt[CPU::GetIndex()] + GDT_GS_ENTRY;
 	entry->base_low = gsbase >> 0 & 0xFFFF;
 	entry->base_middle = gsbase >> 16 & 0xFF;
 	entry->base_high = gsbase >> 24 & 0xFF;
 	asm volatile ("mov %0, %%gs" : : "r"(GDT_GS_ENTRY << 3 | URPL));
 }
+#elif defined(__x86_64__)
+// The segment bases are accessed with the FSGSBASE instructions if supported,
+// which are much faster than the model specific registers.
+static bool fsgsbase_enabled;
+
+bool IsFSGSBaseSupported()
+{
+	if ( !IsCPUIdSupported() )
+		return false;
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(0, eax, ebx, ecx, edx);
+	if ( eax < 7 )
+		return false;
+	asm volatile ("xchgl %%ebx, %1; cpuid; xchgl %%ebx, %1"
+	              : "=a"(eax), "=r"(ebx), "=c"(ecx), "=d"(edx)
+	              : "0"(7), "2"(0));
+	return ebx & (1 << 0);
+}
+
+void InitializeFSGSBase()
+{
+	unsigned long cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= 1UL << 16;
+	asm volatile ("mov %0, %%cr4" : : "r"(cr4));
+	fsgsbase_enabled = true;
+}
+
+uint64_t GetFSBase()
+{
+	if ( !fsgsbase_enabled )
+		return rdmsr(MSRID_FSBASE);
+	uint64_t fsbase;
+	asm volatile ("rdfsbase %0" : "=r"(fsbase));
+	return fsbase;
+}
+
+uint64_t GetGSBase()
+{
+	if ( !fsgsbase_enabled )
+		return rdmsr(MSRID_GSBASE);
+	uint64_t gsbase;
+	asm volatile ("rdgsbase %0" : "=r"(gsbase));
+	return gsbase;
+}
+
+void SetFSBase(uint64_t fsbase)
+{
+	if ( !fsgsbase_enabled )
+		wrmsr(MSRID_FSBASE, fsbase);
+	else
+		asm volatile ("wrfsbase %0" : : "r"(fsbase));
+}
+
+void SetGSBase(uint64_t gsbase)
+{
+	if ( !fsgsbase_enabled )
+		wrmsr(MSRID_GSBASE, gsbase);
+	else
+		asm volatile ("wrgsbase %0" : : "r"(gsbase));
+}
 #endif
 
 } // namespace GDT
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -20,12 +20,16 @@
 #ifndef SORTIX_X86_FAMILY_GDT_H
 #define SORTIX_X86_FAMILY_GDT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 namespace Sortix {
 namespace GDT {
 
 void Init();
+size_t GetCurrentIndex();
+void PrepareCPU(size_t cpu);
+void LoadCPU(size_t cpu);
 uintptr_t GetKernelStack();
 void SetKernelStack(uintptr_t stack_pointer);
 #if defined(__i386__)
@@ -33,6 +37,13 @@ uint32_t GetFSBase();
 uint32_t GetGSBase();
 void SetFSBase(uint32_t fsbase);
 void SetGSBase(uint32_t gsbase);
+#elif defined(__x86_64__)
+bool IsFSGSBaseSupported();
+void InitializeFSGSBase();
+uint64_t GetFSBase();
+uint64_t GetGSBase();
+void SetFSBase(uint64_t fsbase);
+void SetGSBase(uint64_t gsbase);
 #endif
 
 } // namespace GDT
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -26,12 +26,15 @@
 #include <sortix/kernel/cpu.h>
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/kernel.h>
+#include <sortix/kernel/memorymanagement.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/scheduler.h>
 #include <sortix/kernel/signal.h>
 #include <sortix/kernel/syscall.h>
 #include <sortix/kernel/thread.h>
 
+#include "apic.h"
+#include "float.h"
 #include "gdt.h"
 #include "idt.h"
 #include "pic.h"
@@ -87,6 +90,10 @@ extern "C" void irq12();
 extern "C" void irq13();
 extern "C" void irq14();
 extern "C" void irq15();
+extern "C" void isr240();
+extern "C" void isr241();
+extern "C" void isr242();
+extern "C" void isr243();
 extern "C" void interrupt_handler_null();
 extern "C" void syscall_handler();
 extern "C" void yield_cpu_handler();
@@ -131,6 +138,7 @@ static struct interrupt_handler Scheduler__InterruptYieldCPU_handler;
 static struct interrupt_handler Signal__DispatchHandler_handler;
 static struct interrupt_handler Signal__ReturnHandler_handler;
 static struct interrupt_handler Scheduler__ThreadExitCPU_handler;
+static struct interrupt_handler Float__NotAvailable_handler;
 
 void RegisterHandler(unsigned int index, struct interrupt_handler* handler)
 {
@@ -236,7 +244,13 @@ void Init()
 	RegisterRawHandler(130, isr130, true, true);
 	RegisterRawHandler(131, isr131, true, true);
 	RegisterRawHandler(132, thread_exit_handler, true, false);
+	RegisterRawHandler(APIC::VECTOR_TIMER, isr240, false, false);
+	RegisterRawHandler(APIC::VECTOR_RESCHEDULE, isr241, false, false);
+	RegisterRawHandler(APIC::VECTOR_TLB_FLUSH, isr242, false, false);
+	RegisterRawHandler(APIC::VECTOR_HALT, isr243, false, false);
 
+	Float__NotAvailable_handler.handler = Float::OnNotAvailable;
+	RegisterHandler(7, &Float__NotAvailable_handler);
 	Scheduler__InterruptYieldCPU_handler.handler = Scheduler::InterruptYieldCPU;
 	RegisterHandler(129, &Scheduler__InterruptYieldCPU_handler);
 	Signal__DispatchHandler_handler.handler = Signal::DispatchHandler;
@@ -251,6 +265,12 @@ void Init()
 	Interrupt::Enable();
 }
 
+// Loads the interrupt table on an application processor.
+void InitCPU()
+{
+	IDT::Set(interrupt_table, NUM_INTERRUPTS);
+}
+
 const char* ExceptionName(const struct interrupt_context* intctx)
 {
 	if ( intctx->int_no < NUM_KNOWN_EXCEPTIONS )
@@ -330,6 +350,13 @@ extern "C" void interrupt_handler(struct interrupt_context* intctx)
 	bool is_in_user = !is_in_kernel;
 	bool is_crash = int_no < 32 && int_no != 7;
 
+	// Page faults that merely need the memory manager to do its part, such as
+	// copying a copy-on-write page, are not crashes.
+	if ( int_no == 14 /* Page fault */ &&
+	     Memory::HandlePageFault(intctx->cr2, intctx->err_code & 0x2,
+	                             intctx->err_code & 0x4) )
+		return;
+
 	// Invoke the appropriate interrupt handler.
 	if ( is_crash && is_in_kernel )
 		KernelCrashHandler(intctx);
@@ -346,6 +373,14 @@ extern "C" void interrupt_handler(struct interrupt_context* intctx)
 	// Send an end of interrupt signal to the PICs if we got an IRQ.
 	if ( IRQ0 <= int_no && int_no <= IRQ15 )
 		PIC::SendEOI(int_no - IRQ0);
+
+	// Send an end of interrupt signal to the local APIC if it interrupted us.
+	if ( APIC::VECTOR_TIMER <= int_no && int_no <= APIC::VECTOR_HALT )
+		APIC::EOI();
+
+	// Run a thread that the interrupt woke up if it should run right away.
+	if ( !is_crash )
+		Scheduler::PreemptIfNeeded(intctx);
 }
 
 } // namespace Interrupt
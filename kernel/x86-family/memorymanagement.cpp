@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -23,11 +23,15 @@
 
 #include <sortix/mman.h>
 
+#include <sortix/kernel/cpu.h>
+#include <sortix/kernel/cpuid.h>
 #include <sortix/kernel/kernel.h>
 #include <sortix/kernel/kthread.h>
 #include <sortix/kernel/memorymanagement.h>
 #include <sortix/kernel/panic.h>
 #include <sortix/kernel/pat.h>
+#include <sortix/kernel/pressure.h>
+#include <sortix/kernel/process.h>
 #include <sortix/kernel/syscall.h>
 
 #include "multiboot.h"
@@ -43,15 +47,58 @@ extern size_t end;
 namespace Sortix {
 namespace Page {
 
-void InitPushRegion(addr_t position, size_t length);
-size_t pagesnotonstack = 0;
-size_t stackused = 0;
-size_t stackreserved = 0;
-size_t stacklength = 4096 / sizeof(addr_t);
+// The physical memory is managed by a buddy allocator, where free blocks of
+// 2^order contiguous frames aligned to their size are kept on a list per order
+// in each zone, and a freed block is merged with its buddy if it is also free.
+// Information about every frame is kept in a table mapped in the kernel, where
+// the links of the free lists refer to other frames by their number, with zero
+// being the end of the list as the first frame is never available.
+
+const size_t PAGE_ORDERS = 11; // Up to 4 MiB blocks.
+const uint8_t FRAME_FREE = 1 << 0; // The frame is the head of a free block.
+
+struct page_frame
+{
+	uint32_t next;
+	uint32_t prev;
+	uint32_t shares;
+	uint8_t flags;
+	uint8_t order;
+	uint8_t usage;
+	uint8_t unused;
+};
+
+enum page_zone
+{
+	PAGE_ZONE_DMA, // Below 16 MiB.
+	PAGE_ZONE_32BIT, // Below 4 GiB.
+	PAGE_ZONE_NORMAL,
+	PAGE_ZONE_NUM,
+};
+
+struct page_zone_lists
+{
+	uint32_t free_lists[PAGE_ORDERS];
+	size_t free_pages;
+};
+
+struct page_frame* const frames = (struct page_frame*) FRAME_TABLE;
+size_t frame_count = 0;
+struct page_zone_lists zones[PAGE_ZONE_NUM];
+size_t free_pages = 0;
+size_t reserved_pages = 0;
 size_t totalmem = 0;
 size_t page_usage_counts[PAGE_USAGE_NUM_KINDS];
 kthread_mutex_t pagelock = KTHREAD_MUTEX_INITIALIZER;
 
+// The frame table itself is allocated from this range during early boot.
+addr_t early_start = 0;
+addr_t early_next = 0;
+addr_t early_end = 0;
+
+void InitFrameTable(size_t count);
+void InitPushRegion(addr_t position, size_t length);
+
 } // namespace Page
 } // namespace Sortix
 
@@ -120,6 +167,77 @@ static bool CheckUsedRanges(multiboot_info_t* bootinfo,
 	                      dist_ptr) )
 		return true;
 
+	size_t early_size = Page::early_next - Page::early_start;
+	if ( early_size &&
+	     CheckUsedRange(test, Page::early_start, early_size, dist_ptr) )
+		return true;
+
+	return false;
+}
+
+typedef const multiboot_memory_map_t* mmap_t;
+
+// Returns the page aligned part of a memory region that is usable RAM.
+static bool UsableRegion(mmap_t mmap, addr_t* base_ptr, size_t* length_ptr)
+{
+	// Check that we can use this kind of RAM.
+	if ( mmap->type != 1 )
+		return false;
+
+	// Truncate the memory area if needed.
+	uint64_t mmap_addr = mmap->addr;
+	uint64_t mmap_len = mmap->len;
+#if defined(__i386__)
+	if ( 0xFFFFFFFFULL < mmap_addr )
+		return false;
+	if ( 0xFFFFFFFFULL < mmap_addr + mmap_len )
+		mmap_len = 0x100000000ULL - mmap_addr;
+#endif
+
+	// Properly page align the entry if needed.
+	// TODO: Is the bootloader required to page align this? This could be
+	//       raw BIOS data that might not be page aligned? But that would
+	//       be a silly computer.
+	addr_t base_unaligned = (addr_t) mmap_addr;
+	addr_t base = Page::AlignUp(base_unaligned);
+	if ( mmap_len < base - base_unaligned )
+		return false;
+	size_t length_unaligned = mmap_len - (base - base_unaligned);
+	size_t length = Page::AlignDown(length_unaligned);
+	if ( !length )
+		return false;
+
+	*base_ptr = base;
+	*length_ptr = length;
+	return true;
+}
+
+// Finds a contiguous range of unused RAM for the frame table.
+static bool FindEarlyRange(multiboot_info_t* bootinfo, size_t needed)
+{
+	for ( mmap_t mmap = (mmap_t) (addr_t) bootinfo->mmap_addr;
+	      (addr_t) mmap < bootinfo->mmap_addr + bootinfo->mmap_length;
+	      mmap = (mmap_t) ((addr_t) mmap + mmap->size + sizeof(mmap->size)) )
+	{
+		addr_t base;
+		size_t length;
+		if ( !UsableRegion(mmap, &base, &length) )
+			continue;
+		addr_t processed = base;
+		while ( processed < base + length )
+		{
+			size_t distance = base + length - processed;
+			if ( !CheckUsedRanges(bootinfo, processed, &distance) &&
+			     needed <= distance )
+			{
+				Page::early_start = processed;
+				Page::early_next = processed;
+				Page::early_end = processed + distance;
+				return true;
+			}
+			processed += distance;
+		}
+	}
 	return false;
 }
 
@@ -150,45 +268,55 @@ void Init(multiboot_info_t* bootinfo)
 		PAT2PMLFlags[PAT_UCM] = PML_NOCACHE;
 	}
 
-	typedef const multiboot_memory_map_t* mmap_t;
+	// If supported, keep the translations of the kernel when switching address
+	// space, as the kernel is mapped the same way in every address space.
+	if ( IsGlobalPagesSupported() )
+		InitializeGlobalPages();
+
+	// If supported, tag the translations with the address space they belong
+	// to, so they needn't be flushed when switching address space.
+	if ( IsPCIDSupported() )
+		InitializePCID();
 
-	// Loop over every detected memory region.
+	// Count the amount of usable RAM.
+	size_t frame_count = 0;
 	for ( mmap_t mmap = (mmap_t) (addr_t) bootinfo->mmap_addr;
 	      (addr_t) mmap < bootinfo->mmap_addr + bootinfo->mmap_length;
 	      mmap = (mmap_t) ((addr_t) mmap + mmap->size + sizeof(mmap->size)) )
 	{
-		// Check that we can use this kind of RAM.
-		if ( mmap->type != 1 )
-			continue;
-
-		// Truncate the memory area if needed.
-		uint64_t mmap_addr = mmap->addr;
-		uint64_t mmap_len = mmap->len;
-#if defined(__i386__)
-		if ( 0xFFFFFFFFULL < mmap_addr )
-			continue;
-		if ( 0xFFFFFFFFULL < mmap_addr + mmap_len )
-			mmap_len = 0x100000000ULL - mmap_addr;
-#endif
-
-		// Properly page align the entry if needed.
-		// TODO: Is the bootloader required to page align this? This could be
-		//       raw BIOS data that might not be page aligned? But that would
-		//       be a silly computer.
-		addr_t base_unaligned = (addr_t) mmap_addr;
-		addr_t base = Page::AlignUp(base_unaligned);
-		if ( mmap_len < base - base_unaligned )
-			continue;
-		size_t length_unaligned = mmap_len - (base - base_unaligned);
-		size_t length = Page::AlignDown(length_unaligned);
-		if ( !length )
+		addr_t base;
+		size_t length;
+		if ( !UsableRegion(mmap, &base, &length) )
 			continue;
-
-		// Count the amount of usable RAM.
 		Page::totalmem += length;
+		if ( frame_count < (base >> 12) + (length >> 12) )
+			frame_count = (base >> 12) + (length >> 12);
+	}
 
-		// Give all the physical memory to the physical memory allocator
-		// but make sure not to give it things we already use.
+	// Allocate the frame table (and the page tables mapping it) from the first
+	// range of unused RAM that is large enough.
+	size_t max_frames = Page::FRAME_TABLE_MAX_SIZE / sizeof(struct Page::page_frame);
+	if ( UINT32_MAX < max_frames )
+		max_frames = UINT32_MAX;
+	if ( max_frames < frame_count )
+		frame_count = max_frames;
+	size_t table_size = frame_count * sizeof(struct Page::page_frame);
+	size_t table_pages = Page::AlignUp(table_size) >> 12;
+	size_t overhead_pages = 2 * (table_pages / ENTRIES + TOPPMLLEVEL);
+	if ( !FindEarlyRange(bootinfo, (table_pages + overhead_pages) << 12) )
+		Panic("Unable to find room for the physical frame table.");
+	Page::InitFrameTable(frame_count);
+
+	// Give all the physical memory to the physical memory allocator
+	// but make sure not to give it things we already use.
+	for ( mmap_t mmap = (mmap_t) (addr_t) bootinfo->mmap_addr;
+	      (addr_t) mmap < bootinfo->mmap_addr + bootinfo->mmap_length;
+	      mmap = (mmap_t) ((addr_t) mmap + mmap->size + sizeof(mmap->size)) )
+	{
+		addr_t base;
+		size_t length;
+		if ( !UsableRegion(mmap, &base, &length) )
+			continue;
 		addr_t processed = base;
 		while ( processed < base + length )
 		{
@@ -222,7 +350,7 @@ void Init(multiboot_info_t* bootinfo)
 
 void Statistics(size_t* amountused, size_t* totalmem)
 {
-	size_t memfree = (Page::stackused - Page::stackreserved) << 12UL;
+	size_t memfree = (Page::free_pages - Page::reserved_pages) << 12UL;
 	size_t memused = Page::totalmem - memfree;
 	if ( amountused )
 		*amountused = memused;
@@ -230,84 +358,225 @@ void Statistics(size_t* amountused, size_t* totalmem)
 		*totalmem = Page::totalmem;
 }
 
+// Reports how many bytes of memory are used for each kind of usage.
+void UsageStatistics(size_t usage[PAGE_USAGE_NUM_KINDS])
+{
+	ScopedLock lock(&Page::pagelock);
+	for ( size_t i = 0; i < PAGE_USAGE_NUM_KINDS; i++ )
+		usage[i] = Page::page_usage_counts[i] << 12UL;
+}
+
 } // namespace Memory
 } // namespace Sortix
 
 namespace Sortix {
 namespace Page {
 
-void PageUsageRegisterUse(addr_t where, enum page_usage usage)
+static enum page_zone ZoneOf(size_t frame)
+{
+	if ( frame < (0x1000000UL >> 12) )
+		return PAGE_ZONE_DMA;
+#if defined(__x86_64__)
+	if ( frame < (0x100000000UL >> 12) )
+		return PAGE_ZONE_32BIT;
+	return PAGE_ZONE_NORMAL;
+#else
+	return PAGE_ZONE_32BIT;
+#endif
+}
+
+static void PageUsageRegisterUse(size_t frame, enum page_usage usage)
 {
+	frames[frame].usage = usage;
 	if ( PAGE_USAGE_NUM_KINDS <= usage )
 		return;
-	(void) where;
 	page_usage_counts[usage]++;
 }
 
-void PageUsageRegisterFree(addr_t where, enum page_usage usage)
+static void PageUsageRegisterFree(size_t frame, enum page_usage usage)
 {
+	// Frames that were never allocated by us, such as the initrd, are only
+	// accounted for once given to us.
+	if ( usage == PAGE_USAGE_WASNT_ALLOCATED )
+		return;
+	// The frame is accounted for as whatever it was allocated as, even if a
+	// file cache frame is released by a memory mapping.
+	usage = (enum page_usage) frames[frame].usage;
 	if ( PAGE_USAGE_NUM_KINDS <= usage )
 		return;
-	(void) where;
 	assert(page_usage_counts[usage] != 0);
 	page_usage_counts[usage]--;
 }
 
-void ExtendStack()
+static void FreeListAdd(size_t frame, size_t order)
 {
-	// This call will always succeed, if it didn't, then the stack
-	// wouldn't be full, and thus this function won't be called.
-	addr_t page = GetUnlocked(PAGE_USAGE_PHYSICAL);
+	struct page_zone_lists* zone = &zones[ZoneOf(frame)];
+	frames[frame].flags = FRAME_FREE;
+	frames[frame].order = order;
+	frames[frame].prev = 0;
+	frames[frame].next = zone->free_lists[order];
+	if ( zone->free_lists[order] )
+		frames[zone->free_lists[order]].prev = frame;
+	zone->free_lists[order] = frame;
+}
 
-	// This call will also succeed, since there are plenty of physical
-	// pages available and it might need some.
-	addr_t virt = (addr_t) (STACK + stacklength);
-	if ( !Memory::Map(page, virt, PROT_KREAD | PROT_KWRITE) )
-		Panic("Unable to extend page stack, which should have worked");
+static void FreeListRemove(size_t frame, size_t order)
+{
+	struct page_zone_lists* zone = &zones[ZoneOf(frame)];
+	assert(frames[frame].flags & FRAME_FREE);
+	assert(frames[frame].order == order);
+	if ( frames[frame].prev )
+		frames[frames[frame].prev].next = frames[frame].next;
+	else
+		zone->free_lists[order] = frames[frame].next;
+	if ( frames[frame].next )
+		frames[frames[frame].next].prev = frames[frame].prev;
+	frames[frame].flags = 0;
+	frames[frame].next = 0;
+	frames[frame].prev = 0;
+}
 
-	// TODO: This may not be needed during the boot process!
-	//Memory::InvalidatePage((addr_t) (STACK + stacklength));
+// Frees the block and merges it with its buddy for as long as it is free. The
+// zone boundaries are aligned to the largest blocks, so buddies are always in
+// the same zone.
+static void FreeBlock(size_t frame, size_t order)
+{
+	size_t count = 1UL << order;
+	zones[ZoneOf(frame)].free_pages += count;
+	free_pages += count;
+	while ( order + 1 < PAGE_ORDERS )
+	{
+		size_t buddy = frame ^ (1UL << order);
+		if ( frame_count <= buddy ||
+		     !(frames[buddy].flags & FRAME_FREE) ||
+		     frames[buddy].order != order )
+			break;
+		FreeListRemove(buddy, order);
+		frame &= ~(1UL << order);
+		order++;
+	}
+	FreeListAdd(frame, order);
+}
 
-	stacklength += 4096UL / sizeof(addr_t);
+// Frees a range of frames in the largest aligned blocks possible.
+static void FreeRange(size_t frame, size_t count)
+{
+	while ( count )
+	{
+		size_t order = 0;
+		while ( order + 1 < PAGE_ORDERS &&
+		        !(frame & ((2UL << order) - 1)) &&
+		        (2UL << order) <= count )
+			order++;
+		FreeBlock(frame, order);
+		frame += 1UL << order;
+		count -= 1UL << order;
+	}
 }
 
-void InitPushRegion(addr_t position, size_t length)
+// Allocates a block of the order from the zone, splitting a larger block if
+// needed, and returns its first frame or zero if none was available.
+static size_t AllocateBlock(enum page_zone zone_id, size_t order)
 {
-	// Align our entries on page boundaries.
-	addr_t newposition = Page::AlignUp(position);
-	length = Page::AlignDown((position + length) - newposition);
-	position = newposition;
+	struct page_zone_lists* zone = &zones[zone_id];
+	size_t found = order;
+	while ( found < PAGE_ORDERS && !zone->free_lists[found] )
+		found++;
+	if ( PAGE_ORDERS <= found )
+		return 0;
+	size_t frame = zone->free_lists[found];
+	FreeListRemove(frame, found);
+	while ( order < found )
+	{
+		found--;
+		FreeListAdd(frame + (1UL << found), found);
+	}
+	size_t count = 1UL << order;
+	zone->free_pages -= count;
+	free_pages -= count;
+	return frame;
+}
 
-	while ( length )
+// Allocates contiguous frames from the zones at and below the highest zone,
+// preferring the higher zones such that the lower memory is kept for the
+// hardware that needs it.
+static addr_t AllocateFrames(size_t count, enum page_zone highest,
+                             enum page_usage usage)
+{
+	size_t order = 0;
+	while ( (1UL << order) < count )
+		order++;
+	if ( PAGE_ORDERS <= order )
+		return errno = ENOMEM, 0;
+	for ( size_t i = highest + 1; 0 < i; i-- )
 	{
-		if ( unlikely(stackused == stacklength) )
+		size_t frame = AllocateBlock((enum page_zone) (i - 1), order);
+		if ( !frame )
+			continue;
+		if ( count < 1UL << order )
+			FreeRange(frame + count, (1UL << order) - count);
+		for ( size_t n = 0; n < count; n++ )
 		{
-			if ( stackused == MAXSTACKLENGTH )
-			{
-				pagesnotonstack += length / 4096UL;
-				return;
-			}
+			frames[frame + n].shares = 0;
+			PageUsageRegisterUse(frame + n, usage);
+		}
+		return (addr_t) frame << 12;
+	}
+	return errno = ENOMEM, 0;
+}
 
-			ExtendStack();
+// Maps the frame table during early boot, where the pages are allocated from
+// the early range. The frames aren't known until the table exists.
+void InitFrameTable(size_t count)
+{
+	size_t table_size = Page::AlignUp(count * sizeof(struct page_frame));
+	for ( size_t offset = 0; offset < table_size; offset += 4096UL )
+	{
+		addr_t virt = FRAME_TABLE + offset;
+		addr_t phys;
+		if ( !Memory::LookUp(virt, &phys, NULL) )
+		{
+			if ( !(phys = GetUnlocked(PAGE_USAGE_PHYSICAL)) ||
+			     !Memory::Map(phys, virt, PROT_KREAD | PROT_KWRITE) )
+				Panic("Unable to map the physical frame table");
+			Memory::InvalidatePage(virt);
 		}
+		memset((void*) virt, 0, 4096UL);
+	}
+	frame_count = count;
+	// The frames of the table weren't accounted for before it existed.
+	for ( addr_t page = early_start; page < early_next; page += 4096UL )
+		if ( page >> 12 < frame_count )
+			PageUsageRegisterUse(page >> 12, PAGE_USAGE_PHYSICAL);
+	early_end = early_next;
+}
 
-		addr_t* stackentry = &(STACK[stackused++]);
-		*stackentry = position;
+void InitPushRegion(addr_t position, size_t length)
+{
+	// Align our entries on page boundaries.
+	addr_t newposition = Page::AlignUp(position);
+	length = Page::AlignDown((position + length) - newposition);
+	position = newposition;
 
-		length -= 4096UL;
-		position += 4096UL;
-	}
+	// Memory beyond the frame table can't be used.
+	size_t frame = position >> 12;
+	size_t count = length >> 12;
+	if ( frame_count <= frame )
+		return;
+	if ( frame_count - frame < count )
+		count = frame_count - frame;
+	FreeRange(frame, count);
 }
 
 bool ReserveUnlocked(size_t* counter, size_t least, size_t ideal)
 {
 	assert(least < ideal);
-	size_t available = stackused - stackreserved;
-	if ( least < available )
+	size_t available = free_pages - reserved_pages;
+	if ( available < least )
 		return errno = ENOMEM, false;
 	if ( available < ideal )
 		ideal = available;
-	stackreserved += ideal;
+	reserved_pages += ideal;
 	*counter += ideal;
 	return true;
 }
@@ -333,12 +602,11 @@ addr_t GetReservedUnlocked(size_t* counter, enum page_usage usage)
 {
 	if ( !*counter )
 		return 0;
-	assert(stackused); // After all, we did _reserve_ the memory.
-	addr_t result = STACK[--stackused];
-	assert(result == AlignDown(result));
-	stackreserved--;
+	assert(reserved_pages); // After all, we did _reserve_ the memory.
+	addr_t result = AllocateFrames(1, PAGE_ZONE_NORMAL, usage);
+	assert(result);
+	reserved_pages--;
 	(*counter)--;
-	PageUsageRegisterUse(result, usage);
 	return result;
 }
 
@@ -350,69 +618,96 @@ addr_t GetReserved(size_t* counter, enum page_usage usage)
 
 addr_t GetUnlocked(enum page_usage usage)
 {
-	assert(stackreserved <= stackused);
-	if ( unlikely(stackreserved == stackused) )
+	// The frame table is allocated before there is any free memory.
+	if ( unlikely(early_next < early_end) )
+	{
+		addr_t result = early_next;
+		early_next += 4096UL;
+		return result;
+	}
+	assert(reserved_pages <= free_pages);
+	if ( unlikely(reserved_pages == free_pages) )
 		return errno = ENOMEM, 0;
-	addr_t result = STACK[--stackused];
-	assert(result == AlignDown(result));
-	PageUsageRegisterUse(result, usage);
-	return result;
+	return AllocateFrames(1, PAGE_ZONE_NORMAL, usage);
 }
 
+// Failed allocations are retried after reclaiming memory from the caches, which
+// start giving back memory in the background once running low on memory.
+static const size_t RECLAIM_BATCH = 64;
+
 addr_t Get(enum page_usage usage)
 {
-	ScopedLock lock(&pagelock);
-	return GetUnlocked(usage);
+	kthread_mutex_lock(&pagelock);
+	addr_t result = GetUnlocked(usage);
+	kthread_mutex_unlock(&pagelock);
+	if ( !result && Pressure::Reclaim(RECLAIM_BATCH) )
+	{
+		kthread_mutex_lock(&pagelock);
+		result = GetUnlocked(usage);
+		kthread_mutex_unlock(&pagelock);
+	}
+	Pressure::Check();
+	return result ? result : (errno = ENOMEM, 0);
 }
 
-// TODO: This competes with the normal allocation for precious 32-bit pages, we
-//       should use different pools for this, and preferably preallocate some
-//       32-bit pages exclusively for driver usage. Also, get proper hardware
-//       without these issues.
 addr_t Get32BitUnlocked(enum page_usage usage)
 {
-	assert(stackreserved <= stackused);
-	if ( unlikely(stackreserved == stackused) )
+	assert(reserved_pages <= free_pages);
+	if ( unlikely(reserved_pages == free_pages) )
 		return errno = ENOMEM, 0;
-	for ( size_t ii = stackused; 0 < ii; ii-- )
+	return AllocateFrames(1, PAGE_ZONE_32BIT, usage);
+}
+
+addr_t Get32Bit(enum page_usage usage)
+{
+	kthread_mutex_lock(&pagelock);
+	addr_t result = Get32BitUnlocked(usage);
+	kthread_mutex_unlock(&pagelock);
+	if ( !result && Pressure::Reclaim(RECLAIM_BATCH) )
 	{
-		size_t i = ii - 1;
-		addr_t result = STACK[i];
-		assert(result == AlignDown(result));
-		if ( 4 < sizeof(void*) && UINT32_MAX < result )
-			continue;
-		if ( i + 1 != stackused )
-		{
-			STACK[i] = STACK[stackused - 1];
-			STACK[stackused - 1] = result;
-		}
-		stackused--;
-		PageUsageRegisterUse(result, usage);
-		return result;
+		kthread_mutex_lock(&pagelock);
+		result = Get32BitUnlocked(usage);
+		kthread_mutex_unlock(&pagelock);
 	}
-	return errno = ENOMEM, 0;
+	Pressure::Check();
+	return result ? result : (errno = ENOMEM, 0);
 }
 
-addr_t Get32Bit(enum page_usage usage)
+addr_t GetContiguous(size_t count, enum page_usage usage)
 {
-	ScopedLock lock(&pagelock);
-	return Get32BitUnlocked(usage);
+	kthread_mutex_lock(&pagelock);
+	addr_t result = 0;
+	if ( count <= free_pages - reserved_pages )
+		result = AllocateFrames(count, PAGE_ZONE_NORMAL, usage);
+	kthread_mutex_unlock(&pagelock);
+	Pressure::Check();
+	return result ? result : (errno = ENOMEM, 0);
+}
+
+addr_t GetContiguous32Bit(size_t count, enum page_usage usage)
+{
+	kthread_mutex_lock(&pagelock);
+	addr_t result = 0;
+	if ( count <= free_pages - reserved_pages )
+		result = AllocateFrames(count, PAGE_ZONE_32BIT, usage);
+	kthread_mutex_unlock(&pagelock);
+	Pressure::Check();
+	return result ? result : (errno = ENOMEM, 0);
 }
 
 void PutUnlocked(addr_t page, enum page_usage usage)
 {
 	assert(page == AlignDown(page));
-	if ( unlikely(stackused == stacklength) )
+	size_t frame = page >> 12;
+	assert(frame < frame_count);
+	assert(!(frames[frame].flags & FRAME_FREE));
+	if ( unlikely(frames[frame].shares) )
 	{
-		if ( stackused == MAXSTACKLENGTH )
-		{
-			pagesnotonstack++;
-			return;
-		}
-		ExtendStack();
+		frames[frame].shares--;
+		return;
 	}
-	STACK[stackused++] = page;
-	PageUsageRegisterFree(page, usage);
+	PageUsageRegisterFree(frame, usage);
+	FreeBlock(frame, 0);
 }
 
 void Put(addr_t page, enum page_usage usage)
@@ -421,6 +716,24 @@ void Put(addr_t page, enum page_usage usage)
 	PutUnlocked(page, usage);
 }
 
+void PutContiguous(addr_t page, size_t count, enum page_usage usage)
+{
+	ScopedLock lock(&pagelock);
+	for ( size_t i = 0; i < count; i++ )
+		PutUnlocked(page + i * 4096UL, usage);
+}
+
+void ShareUnlocked(addr_t page)
+{
+	assert(page >> 12 < frame_count);
+	frames[page >> 12].shares++;
+}
+
+bool IsShared(addr_t page)
+{
+	return page >> 12 < frame_count && frames[page >> 12].shares;
+}
+
 void Lock()
 {
 	kthread_mutex_lock(&pagelock);
@@ -462,6 +775,9 @@ addr_t ProtectionToPMLFlags(int prot)
 
 int PMLFlagsToProtection(addr_t flags)
 {
+	// Copy-on-write pages are writable, they're just not written to yet.
+	if ( flags & PML_COW )
+		flags |= PML_WRITABLE;
 	int prot = PROT_KREAD;
 	if ( (flags & PML_USERSPACE) && !(flags & PML_NX) )
 		prot |= PROT_EXEC;
@@ -507,6 +823,17 @@ bool LookUp(addr_t mapto, addr_t* physical, int* protection)
 		int entryprot = PMLFlagsToProtection(entryflags);
 		prot &= entryprot;
 
+		// The entry may map a large page rather than a table.
+		if ( i == LARGE_PAGE_LEVEL && (entry & PML_LARGE) )
+		{
+			addr_t large = entry & PML_ADDRESS & ~(LARGE_PAGE_SIZE - 1);
+			if ( physical )
+				*physical = large + (Page::AlignDown(mapto) & (LARGE_PAGE_SIZE - 1));
+			if ( protection )
+				*protection = prot;
+			return true;
+		}
+
 		// Find the index of the next PML in the fractal mapped memory.
 		offset = offset * ENTRIES + childid;
 	}
@@ -528,18 +855,141 @@ bool LookUp(addr_t mapto, addr_t* physical, int* protection)
 	return true;
 }
 
-void InvalidatePage(addr_t /*addr*/)
+const int WALK_CREATE = 1 << 0; // Create the missing tables.
+const int WALK_SPLIT = 1 << 1; // Split large pages into tables.
+
+static addr_t* WalkEntry(addr_t mapto, size_t level, int walk_flags);
+
+// Returns the page table entry mapping the virtual page, or NULL if the page
+// tables for it don't exist or it's part of a large page.
+static addr_t* LookUpEntry(addr_t mapto)
 {
-	// TODO: Actually just call the instruction.
-	Flush();
+	return WalkEntry(mapto, 1, 0);
+}
+
+// Returns the directory entry mapping the large page containing the virtual
+// page, or NULL if it isn't part of a large page.
+static addr_t* LookUpLargeEntry(addr_t mapto)
+{
+	if ( !LARGE_PAGE_SIZE )
+		return NULL;
+	addr_t* entry = WalkEntry(mapto, LARGE_PAGE_LEVEL, 0);
+	if ( !entry || !(*entry & PML_PRESENT) || !(*entry & PML_LARGE) )
+		return NULL;
+	return entry;
+}
+
+
+// Address spaces are tagged with process-context identifiers if supported,
+// such that switching address space doesn't flush the translations of other
+// address spaces. Each processor assigns its few identifiers to the address
+// spaces it most recently ran, and an identifier is flushed when reassigned.
+// Flushing the current address space makes the translations cached under the
+// other identifiers stale as well, since kernel memory is mapped in all of
+// them, so each identifier remembers the flush generation it was last flushed
+// in and is flushed again on its next use if that is outdated.
+
+static const size_t PCID_SLOTS = 8;
+static const addr_t CR3_PCID = 0xFFF;
+#if defined(__x86_64__)
+static const addr_t CR3_NOFLUSH = 1UL << 63;
+#endif
+
+struct pcid_slot
+{
+	addr_t addrspace;
+	unsigned long generation;
+};
+
+static bool global_pages;
+static bool pcid_enabled;
+static unsigned long pcid_generation;
+static struct pcid_slot pcid_slots[CPU::MAX_CPUS][PCID_SLOTS];
+static size_t pcid_victim[CPU::MAX_CPUS];
+
+// Identifiers are only used if the kernel pages are global, as invalidating a
+// page otherwise only invalidates it for the current identifier.
+bool IsPCIDSupported()
+{
+#if defined(__x86_64__)
+	if ( !IsCPUIdSupported() )
+		return false;
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, eax, ebx, ecx, edx);
+	return (ecx & (1 << 17)) && global_pages;
+#else
+	return false;
+#endif
 }
 
+bool IsGlobalPagesSupported()
+{
+	if ( !IsCPUIdSupported() )
+		return false;
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, eax, ebx, ecx, edx);
+	return edx & (1 << 13);
+}
+
+void InitializeGlobalPages()
+{
+	unsigned long cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= 1UL << 7;
+	asm volatile ("mov %0, %%cr4" : : "r"(cr4));
+	global_pages = true;
+}
+
+// The current address space must not have an identifier when this is called.
+void InitializePCID()
+{
+	unsigned long cr4;
+	asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= 1UL << 17;
+	asm volatile ("mov %0, %%cr4" : : "r"(cr4));
+	pcid_enabled = true;
+}
+
+void ForgetAddressSpace(addr_t addrspace)
+{
+	for ( size_t cpu = 0; cpu < CPU::MAX_CPUS; cpu++ )
+		for ( size_t i = 0; i < PCID_SLOTS; i++ )
+			if ( pcid_slots[cpu][i].addrspace == addrspace )
+				pcid_slots[cpu][i].addrspace = 0;
+}
+
+static void LoadAddressSpace(addr_t addrspace)
+{
+#if defined(__x86_64__)
+	if ( pcid_enabled )
+	{
+		struct pcid_slot* slots = pcid_slots[CPU::GetIndex()];
+		size_t index = 0;
+		while ( index < PCID_SLOTS && slots[index].addrspace != addrspace )
+			index++;
+		bool fresh = index < PCID_SLOTS &&
+		             slots[index].generation == pcid_generation;
+		if ( index == PCID_SLOTS )
+		{
+			index = pcid_victim[CPU::GetIndex()]++ % PCID_SLOTS;
+			slots[index].addrspace = addrspace;
+		}
+		slots[index].generation = pcid_generation;
+		addr_t value = addrspace | (index + 1);
+		if ( fresh )
+			value |= CR3_NOFLUSH;
+		asm volatile ( "mov %0, %%cr3" : : "r"(value) : "memory" );
+		return;
+	}
+#endif
+	asm volatile ( "mov %0, %%cr3" : : "r"(addrspace) : "memory" );
+}
 
 addr_t GetAddressSpace()
 {
 	addr_t result;
 	asm ( "mov %%cr3, %0" : "=r"(result) );
-	return result;
+	return result & ~CR3_PCID;
 }
 
 addr_t SwitchAddressSpace(addr_t addrspace)
@@ -547,27 +997,207 @@ addr_t SwitchAddressSpace(addr_t addrspace)
 	assert(Page::IsAligned(addrspace));
 
 	addr_t previous = GetAddressSpace();
-	asm volatile ( "mov %0, %%cr3" : : "r"(addrspace) );
+	if ( previous != addrspace )
+		LoadAddressSpace(addrspace);
 	return previous;
 }
 
+void InvalidateLocalPage(addr_t addr)
+{
+	asm volatile ( "invlpg (%0)" : : "r"(addr) : "memory" );
+}
+
+// Reloading the address space flushes everything but the global pages, which
+// are flushed by turning global pages off and on again.
+void FlushLocal(bool global)
+{
+	if ( global && global_pages )
+	{
+		unsigned long cr4;
+		asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+		asm volatile ("mov %0, %%cr4" : : "r"(cr4 & ~(1UL << 7)) : "memory");
+		asm volatile ("mov %0, %%cr4" : : "r"(cr4) : "memory");
+		return;
+	}
+	addr_t current;
+	asm ( "mov %%cr3, %0" : "=r"(current) );
+	asm volatile ( "mov %0, %%cr3" : : "r"(current) : "memory" );
+}
+
+// Every identifier is flushed on its next use, except the one of the current
+// address space which is flushed now.
+static void FlushIdentifiers()
+{
+	addr_t current;
+	asm ( "mov %%cr3, %0" : "=r"(current) );
+	pcid_generation++;
+	if ( pcid_enabled && (current & CR3_PCID) )
+		pcid_slots[CPU::GetIndex()][(current & CR3_PCID) - 1].generation =
+			pcid_generation;
+}
+
+static void FlushEverywhere(bool global)
+{
+	FlushIdentifiers();
+	FlushLocal(global);
+	CPU::FlushRemoteTLBs(global);
+}
+
 void Flush()
 {
-	addr_t previous;
-	asm ( "mov %%cr3, %0" : "=r"(previous) );
-	asm volatile ( "mov %0, %%cr3" : : "r"(previous) );
+	FlushEverywhere(true);
+}
+
+static size_t TopIndex(addr_t addr)
+{
+	return addr >> (12 + (TOPPMLLEVEL-1) * TRANSBITS) & (ENTRIES-1);
+}
+
+// The kernel half of the address space is the same in every address space, and
+// is mapped with global pages, except for the recursive mapping of the tables
+// and the scratch area used for forking and splitting large pages, which are
+// different in each address space.
+static addr_t GlobalFlag(addr_t mapto)
+{
+	size_t index = TopIndex(mapto);
+	if ( global_pages && ENTRIES / 2 <= index && index != ENTRIES-1 &&
+	     index != TopIndex((addr_t) FORKPML) )
+		return PML_GLOBAL;
+	return 0;
+}
+
+// Invalidating a page only reaches the translations cached for the current
+// identifier on each processor, so the other processors flush the identifier
+// of the current address space on its next use. The recursive mapping of the
+// tables isn't global and may be cached under every identifier, while the
+// scratch area is specific to the address space like user-space.
+static void InvalidateIdentifiers(const addr_t* pages, size_t count)
+{
+	if ( !pcid_enabled )
+		return;
+	bool user = false;
+	for ( size_t i = 0; i < count; i++ )
+	{
+		size_t index = TopIndex(pages[i]);
+		if ( index == ENTRIES-1 )
+		{
+			FlushIdentifiers();
+			return;
+		}
+		if ( index < ENTRIES / 2 || index == TopIndex((addr_t) FORKPML) )
+			user = true;
+	}
+	if ( !user )
+		return;
+	addr_t addrspace = GetAddressSpace();
+	size_t self = CPU::GetIndex();
+	for ( size_t cpu = 0; cpu < CPU::MAX_CPUS; cpu++ )
+	{
+		if ( cpu == self )
+			continue;
+		for ( size_t i = 0; i < PCID_SLOTS; i++ )
+			if ( pcid_slots[cpu][i].addrspace == addrspace )
+				pcid_slots[cpu][i].generation = pcid_generation - 1;
+	}
+}
+
+static void InvalidatePages(const addr_t* pages, size_t count)
+{
+	for ( size_t i = 0; i < count; i++ )
+		InvalidateLocalPage(pages[i]);
+	InvalidateIdentifiers(pages, count);
+	CPU::InvalidateRemotePages(pages, count);
+}
+
+void InvalidatePage(addr_t addr)
+{
+	InvalidatePages(&addr, 1);
 }
 
+void TLBGatherInit(struct tlb_gather* gather)
+{
+	gather->count = 0;
+	gather->flush = false;
+	gather->global = false;
+}
+
+void TLBGatherPage(struct tlb_gather* gather, addr_t addr)
+{
+	if ( GlobalFlag(addr) )
+		gather->global = true;
+	if ( gather->flush )
+		return;
+	if ( gather->count == TLB_GATHER_PAGES )
+	{
+		gather->flush = true;
+		return;
+	}
+	gather->pages[gather->count++] = Page::AlignDown(addr);
+}
+
+void TLBGatherRange(struct tlb_gather* gather, addr_t addr, size_t size)
+{
+	addr_t from = Page::AlignDown(addr);
+	addr_t to = Page::AlignUp(addr + size);
+	if ( TLB_GATHER_PAGES - gather->count < (to - from) / 4096UL )
+	{
+		if ( GlobalFlag(from) || GlobalFlag(to - 1) )
+			gather->global = true;
+		gather->flush = true;
+		return;
+	}
+	for ( addr_t page = from; page < to; page += 4096UL )
+		TLBGatherPage(gather, page);
+}
+
+// Small batches are invalidated page by page, while larger batches flush
+// everything, keeping the global kernel pages unless they were changed.
+void TLBGatherFinish(struct tlb_gather* gather)
+{
+	if ( gather->flush )
+		FlushEverywhere(gather->global);
+	else if ( gather->count )
+		InvalidatePages(gather->pages, gather->count);
+	TLBGatherInit(gather);
+}
+
+static bool MapEntry(addr_t mapto, addr_t entry);
+
+static bool MapLarge(addr_t physical, addr_t mapto, int prot);
+static addr_t UnmapLarge(addr_t mapto);
+
 bool MapRange(addr_t where, size_t bytes, int protection, enum page_usage usage)
 {
 	for ( addr_t page = where; page < where + bytes; page += 4096UL )
 	{
+		// Map the aligned parts of the range with large pages if the physical
+		// memory is available contiguously.
+		if ( LARGE_PAGE_SIZE && !(page & (LARGE_PAGE_SIZE - 1)) &&
+		     LARGE_PAGE_SIZE <= where + bytes - page )
+		{
+			size_t count = LARGE_PAGE_SIZE / 4096UL;
+			addr_t large = Page::GetContiguous(count, usage);
+			if ( large && MapLarge(large, page, protection) )
+			{
+				page += LARGE_PAGE_SIZE - 4096UL;
+				continue;
+			}
+			if ( large )
+				Page::PutContiguous(large, count, usage);
+		}
+
 		addr_t physicalpage = Page::Get(usage);
 		if ( physicalpage == 0 )
 		{
 			while ( where < page )
 			{
 				page -= 4096UL;
+				if ( addr_t large = UnmapLarge(page) )
+				{
+					Page::PutContiguous(large, LARGE_PAGE_SIZE / 4096UL, usage);
+					page &= ~(LARGE_PAGE_SIZE - 1);
+					continue;
+				}
 				physicalpage = Unmap(page);
 				Page::Put(physicalpage, usage);
 			}
@@ -577,34 +1207,145 @@ bool MapRange(addr_t where, size_t bytes, int protection, enum page_usage usage)
 		Map(physicalpage, page, protection);
 	}
 
+	if ( usage == PAGE_USAGE_USER_SPACE )
+		CurrentProcess()->resident_pages += bytes / 4096UL;
+
 	return true;
 }
 
+// User-space ranges may have pages that were never used and don't exist.
 bool UnmapRange(addr_t where, size_t bytes, enum page_usage usage)
 {
+	if ( !SplitLargePages(where, bytes) )
+		return false;
 	for ( addr_t page = where; page < where + bytes; page += 4096UL )
 	{
+		// Unmap large pages entirely in the range at once, while the large
+		// pages partially in the range are split by unmapping their pages.
+		addr_t large;
+		if ( LARGE_PAGE_SIZE && !(page & (LARGE_PAGE_SIZE - 1)) &&
+		     LARGE_PAGE_SIZE <= where + bytes - page &&
+		     (large = UnmapLarge(page)) )
+		{
+			size_t count = LARGE_PAGE_SIZE / 4096UL;
+			Page::PutContiguous(large, count, usage);
+			if ( usage == PAGE_USAGE_USER_SPACE )
+				CurrentProcess()->resident_pages -= count;
+			page += LARGE_PAGE_SIZE - 4096UL;
+			continue;
+		}
+
 		addr_t physicalpage = Unmap(page);
+		if ( !physicalpage )
+			continue;
 		Page::Put(physicalpage, usage);
+		if ( usage == PAGE_USAGE_USER_SPACE )
+			CurrentProcess()->resident_pages--;
 	}
 	return true;
 }
 
-static bool MapInternal(addr_t physical, addr_t mapto, int prot, addr_t extraflags = 0)
+// Maps the range such that each page is allocated and zeroed when first used,
+// or read from the file backing it, which is recorded in the otherwise unused
+// bits of the non-present entries.
+bool MapLazyRange(addr_t where, size_t bytes, int protection, bool file)
 {
-	addr_t flags = ProtectionToPMLFlags(prot) | PML_PRESENT;
+	addr_t entry = ProtectionToPMLFlags(protection) | PML_LAZY;
+	if ( file )
+		entry |= PML_FILE;
+	for ( addr_t page = where; page < where + bytes; page += 4096UL )
+	{
+		if ( !MapEntry(page, entry) )
+		{
+			while ( where < page )
+			{
+				page -= 4096UL;
+				Unmap(page);
+			}
+			return false;
+		}
+	}
+	return true;
+}
 
-	// Translate the virtual address into PML indexes.
-	const size_t MASK = (1<<TRANSBITS)-1;
-	size_t pmlchildid[TOPPMLLEVEL + 1];
-	for ( size_t i = 1; i <= TOPPMLLEVEL; i++ )
-		pmlchildid[i] = mapto >> (12 + (i-1) * TRANSBITS) & MASK;
+// The page tables mapping user-space are accounted to the current process, as
+// the address spaces only share the page tables mapping the kernel.
+static void AccountPageTables(addr_t mapto, ssize_t count)
+{
+	uintptr_t userspace_addr;
+	size_t userspace_size;
+	GetUserVirtualArea(&userspace_addr, &userspace_size);
+	if ( mapto < userspace_addr || userspace_size <= mapto - userspace_addr )
+		return;
+	CurrentProcess()->page_table_pages += count;
+}
 
-	// For each PML level, make sure it exists.
+// Replaces the large page with a page table mapping the same pages, which is
+// filled in the scratch page before it's used, as other threads may be using
+// the large page meanwhile.
+static bool SplitLargePage(addr_t* entry_ptr, PML* table, addr_t mapto)
+{
+	addr_t entry = *entry_ptr;
+	addr_t pt = Page::Get(PAGE_USAGE_PAGING_OVERHEAD);
+	if ( !pt )
+		return false;
+	addr_t scratch = (addr_t) FORKPML;
+	if ( !Map(pt, scratch, PROT_KREAD | PROT_KWRITE) )
+	{
+		Page::Put(pt, PAGE_USAGE_PAGING_OVERHEAD);
+		return false;
+	}
+	InvalidatePage(scratch);
+	// The above may have slept, so check the large page wasn't dealt with.
+	if ( *entry_ptr != entry )
+	{
+		Page::Put(pt, PAGE_USAGE_PAGING_OVERHEAD);
+		return true;
+	}
+	addr_t large = entry & PML_ADDRESS & ~(LARGE_PAGE_SIZE - 1);
+	addr_t flags = entry & PML_FLAGS & ~PML_LARGE;
+	if ( entry & PML_LARGE_PAT )
+		flags |= PML_PAT;
+	PML* new_table = (PML*) scratch;
+	for ( size_t i = 0; i < ENTRIES; i++ )
+		new_table->entry[i] = (large + i * 4096UL) | flags;
+	*entry_ptr = pt | PML_PRESENT | PML_WRITABLE | PML_USERSPACE | PML_FORK;
+	AccountPageTables(mapto, 1);
+	InvalidatePage((addr_t) table);
+	InvalidatePage(Page::AlignDown(mapto));
+	return true;
+}
+
+// Splits the large page containing the virtual page unless the page is at the
+// start of it.
+static bool SplitLargePageAt(addr_t mapto)
+{
+	if ( !LARGE_PAGE_SIZE || !(mapto & (LARGE_PAGE_SIZE - 1)) ||
+	     !LookUpLargeEntry(mapto) )
+		return true;
+	if ( !WalkEntry(mapto, 1, WALK_SPLIT) )
+		return errno = ENOMEM, false;
+	return true;
+}
+
+// Splits the large pages partially in the range, such that the pages in the
+// range can be changed without changing the pages outside it. This is done
+// before the range is changed, so failing doesn't leave it half changed.
+bool SplitLargePages(addr_t where, size_t bytes)
+{
+	return SplitLargePageAt(where) && SplitLargePageAt(where + bytes);
+}
+
+// Returns the entry at the level in the page tables for the virtual address,
+// or NULL if the tables for it don't exist, or if it's part of a large page at
+// a higher level, unless asked to create the tables and split large pages.
+static addr_t* WalkEntry(addr_t mapto, size_t level, int walk_flags)
+{
+	const size_t MASK = (1<<TRANSBITS)-1;
 	size_t offset = 0;
-	for ( size_t i = TOPPMLLEVEL; i > 1; i-- )
+	for ( size_t i = TOPPMLLEVEL; i > level; i-- )
 	{
-		size_t childid = pmlchildid[i];
+		size_t childid = mapto >> (12 + (i-1) * TRANSBITS) & MASK;
 		PML* pml = PMLS[i] + offset;
 
 		addr_t& entry = pml->entry[childid];
@@ -612,16 +1353,32 @@ static bool MapInternal(addr_t physical, addr_t mapto, int prot, addr_t extrafla
 		// Find the index of the next PML in the fractal mapped memory.
 		size_t childoffset = offset * ENTRIES + childid;
 
+		if ( i == LARGE_PAGE_LEVEL && (entry & PML_PRESENT) &&
+		     (entry & PML_LARGE) )
+		{
+			if ( !(walk_flags & WALK_SPLIT) ||
+			     !SplitLargePage(&entry, PMLS[i-1] + childoffset, mapto) )
+				return NULL;
+		}
+
 		if ( !(entry & PML_PRESENT) )
 		{
+			if ( !(walk_flags & WALK_CREATE) )
+				return NULL;
+
 			// TODO: Possible memory leak when page allocation fails.
 			addr_t page = Page::Get(PAGE_USAGE_PAGING_OVERHEAD);
 
 			if ( !page )
-				return false;
+				return NULL;
 			addr_t pmlflags = PML_PRESENT | PML_WRITABLE | PML_USERSPACE
 			                | PML_FORK;
+			// The kernel half of the top level is shared by every address
+			// space and is never forked.
+			if ( i == TOPPMLLEVEL && ENTRIES / 2 <= childid )
+				pmlflags = PML_PRESENT | PML_WRITABLE;
 			entry = page | pmlflags;
+			AccountPageTables(mapto, 1);
 
 			// Invalidate the new PML and reset it to zeroes.
 			addr_t pmladdr = (addr_t) (PMLS[i-1] + childoffset);
@@ -632,76 +1389,182 @@ static bool MapInternal(addr_t physical, addr_t mapto, int prot, addr_t extrafla
 		offset = childoffset;
 	}
 
-	// Actually map the physical page to the virtual page.
-	const addr_t entry = physical | flags | extraflags;
-	(PMLS[1] + offset)->entry[pmlchildid[1]] = entry;
+	size_t childid = mapto >> (12 + (level-1) * TRANSBITS) & MASK;
+	return &(PMLS[level] + offset)->entry[childid];
+}
+
+static bool MapEntry(addr_t mapto, addr_t entry)
+{
+	addr_t* entry_ptr = WalkEntry(mapto, 1, WALK_CREATE | WALK_SPLIT);
+	if ( !entry_ptr )
+		return false;
+	if ( entry & PML_PRESENT )
+		entry |= GlobalFlag(mapto);
+	*entry_ptr = entry;
+	return true;
+}
+
+// Flags for mapping the physical page with the protection, where writable
+// pages shared with another address space must be copied before writing,
+// unless they're shared memory mappings.
+static addr_t EntryFlags(addr_t physical, int prot, addr_t extraflags)
+{
+	addr_t flags = ProtectionToPMLFlags(prot) | PML_PRESENT;
+	if ( (flags & PML_WRITABLE) && !(extraflags & PML_SHARED) &&
+	     Page::IsShared(physical) )
+		flags = (flags & ~PML_WRITABLE) | PML_COW;
+	return flags | extraflags;
+}
+
+// Maps a large page if there's no large page there already and the page table
+// at that location, if any, is empty.
+static bool MapLarge(addr_t physical, addr_t mapto, int prot)
+{
+	assert(LARGE_PAGE_SIZE);
+	assert(!(physical & (LARGE_PAGE_SIZE - 1)));
+	assert(!(mapto & (LARGE_PAGE_SIZE - 1)));
+	addr_t* entry = WalkEntry(mapto, LARGE_PAGE_LEVEL, WALK_CREATE);
+	if ( !entry )
+		return false;
+	addr_t old_table = 0;
+	if ( *entry & PML_PRESENT )
+	{
+		if ( *entry & PML_LARGE )
+			return false;
+		PML* table = (PML*) WalkEntry(mapto, 1, 0);
+		for ( size_t i = 0; i < ENTRIES; i++ )
+			if ( table->entry[i] )
+				return false;
+		old_table = *entry & PML_ADDRESS;
+	}
+	*entry = physical | EntryFlags(physical, prot, PML_LARGE | GlobalFlag(mapto));
+	InvalidatePage(mapto);
+	if ( old_table )
+	{
+		InvalidatePage((addr_t) WalkEntry(mapto, 1, 0));
+		Page::Put(old_table, PAGE_USAGE_PAGING_OVERHEAD);
+		AccountPageTables(mapto, -1);
+	}
 	return true;
 }
 
+// Unmaps the large page containing the virtual page and returns its first
+// physical page, or returns zero if it isn't part of a large page.
+static addr_t UnmapLarge(addr_t mapto)
+{
+	addr_t* entry = LookUpLargeEntry(mapto);
+	if ( !entry )
+		return 0;
+	addr_t large = *entry & PML_ADDRESS & ~(LARGE_PAGE_SIZE - 1);
+	*entry = 0;
+	InvalidatePage(mapto);
+	return large;
+}
+
+static bool MapInternal(addr_t physical, addr_t mapto, int prot, addr_t extraflags = 0)
+{
+	return MapEntry(mapto, physical | EntryFlags(physical, prot, extraflags));
+}
+
 bool Map(addr_t physical, addr_t mapto, int prot)
 {
 	return MapInternal(physical, mapto, prot);
 }
 
-void PageProtect(addr_t mapto, int protection)
+// Returns the entry of a page that is allocated on first use, if it is so.
+static addr_t* LookUpLazy(addr_t mapto)
 {
-	addr_t phys;
-	if ( !LookUp(mapto, &phys, NULL) )
-		return;
-	Map(phys, mapto, protection);
+	addr_t* entry = LookUpEntry(mapto);
+	if ( !entry || (*entry & PML_PRESENT) || !(*entry & PML_LAZY) )
+		return NULL;
+	return entry;
 }
 
-void PageProtectAdd(addr_t mapto, int protection)
+// Changes the protection of the page, whether it's lazy or present, while
+// keeping what the page is backed by.
+static bool Reprotect(addr_t mapto, int protection)
 {
-	addr_t phys;
-	int prot;
-	if ( !LookUp(mapto, &phys, &prot) )
-		return;
-	prot |= protection;
-	Map(phys, mapto, prot);
+	if ( !SplitLargePages(mapto, 4096UL) )
+		return false;
+	addr_t* entry = LookUpEntry(mapto);
+	if ( !entry )
+		return true;
+	if ( !(*entry & PML_PRESENT) && (*entry & PML_LAZY) )
+		*entry = ProtectionToPMLFlags(protection) | (*entry & (PML_LAZY | PML_FILE));
+	else if ( *entry & PML_PRESENT )
+		MapInternal(*entry & PML_ADDRESS, mapto, protection, *entry & PML_SHARED);
+	return true;
 }
 
-void PageProtectSub(addr_t mapto, int protection)
+static int LookUpProtection(addr_t mapto)
 {
-	addr_t phys;
+	addr_t* entry = LookUpEntry(mapto);
 	int prot;
-	if ( !LookUp(mapto, &phys, &prot) )
-		return;
-	prot &= ~protection;
-	Map(phys, mapto, prot);
+	if ( entry && !(*entry & PML_PRESENT) && (*entry & PML_LAZY) )
+		return PMLFlagsToProtection(*entry & ~(PML_LAZY | PML_FILE));
+	if ( LookUp(mapto, NULL, &prot) )
+		return prot;
+	return 0;
 }
 
-addr_t Unmap(addr_t mapto)
+bool PageProtect(addr_t mapto, int protection)
 {
-	// Translate the virtual address into PML indexes.
-	const size_t MASK = (1<<TRANSBITS)-1;
-	size_t pmlchildid[TOPPMLLEVEL + 1];
-	for ( size_t i = 1; i <= TOPPMLLEVEL; i++ )
-	{
-		pmlchildid[i] = mapto >> (12 + (i-1) * TRANSBITS) & MASK;
-	}
+	return Reprotect(mapto, protection);
+}
 
-	// For each PML level, make sure it exists.
-	size_t offset = 0;
-	for ( size_t i = TOPPMLLEVEL; i > 1; i-- )
-	{
-		size_t childid = pmlchildid[i];
-		PML* pml = PMLS[i] + offset;
+bool PageProtectAdd(addr_t mapto, int protection)
+{
+	return Reprotect(mapto, LookUpProtection(mapto) | protection);
+}
 
-		addr_t& entry = pml->entry[childid];
+bool PageProtectSub(addr_t mapto, int protection)
+{
+	return Reprotect(mapto, LookUpProtection(mapto) & ~protection);
+}
 
-		if ( !(entry & PML_PRESENT) )
-			PanicF("Attempted to unmap virtual page 0x%jX, but the virtual"
-			       " page was wasn't mapped. This is a bug in the code "
-			       "code calling this function", (uintmax_t) mapto);
+// Large pages entirely in the range keep being large pages, while the large
+// pages partially in the range are split.
+bool PageProtectRange(addr_t where, size_t bytes, int protection)
+{
+	if ( !SplitLargePages(where, bytes) )
+		return false;
+	for ( addr_t page = where; page < where + bytes; page += 4096UL )
+	{
+		addr_t* entry;
+		if ( LARGE_PAGE_SIZE && !(page & (LARGE_PAGE_SIZE - 1)) &&
+		     LARGE_PAGE_SIZE <= where + bytes - page &&
+		     (entry = LookUpLargeEntry(page)) )
+		{
+			addr_t large = *entry & PML_ADDRESS & ~(LARGE_PAGE_SIZE - 1);
+			addr_t pat = *entry & (PML_LARGE_PAT | PML_WRTHROUGH | PML_NOCACHE);
+			addr_t flags = PML_LARGE | pat | GlobalFlag(page);
+			*entry = large | EntryFlags(large, protection, flags);
+			InvalidatePage(page);
+			page += LARGE_PAGE_SIZE - 4096UL;
+			continue;
+		}
+		Reprotect(page, protection);
+	}
+	return true;
+}
 
-		// Find the index of the next PML in the fractal mapped memory.
-		offset = offset * ENTRIES + childid;
+// Large pages must have been split with SplitLargePages before unmapping part
+// of them, which is where running out of memory is handled.
+addr_t Unmap(addr_t mapto)
+{
+	addr_t* entry = LookUpEntry(mapto);
+	if ( !entry )
+	{
+		if ( LookUpLargeEntry(mapto) )
+			PanicF("Attempted to unmap virtual page 0x%jX that is part of a "
+			       "large page that wasn't split first", (uintmax_t) mapto);
+		PanicF("Attempted to unmap virtual page 0x%jX, but the virtual"
+		       " page was wasn't mapped. This is a bug in the code "
+		       "code calling this function", (uintmax_t) mapto);
 	}
 
-	addr_t& entry = (PMLS[1] + offset)->entry[pmlchildid[1]];
-	addr_t result = entry & PML_ADDRESS;
-	entry = 0;
+	addr_t result = *entry & PML_ADDRESS;
+	*entry = 0;
 
 	// TODO: If all the entries in PML[N] are not-present, then who
 	// unmaps its entry from PML[N-1]?
@@ -715,23 +1578,29 @@ bool MapPAT(addr_t physical, addr_t mapto, int prot, addr_t mtype)
 	return MapInternal(physical, mapto, prot, extraflags);
 }
 
+// Undoes the first i entries of a partially forked PML.
 void ForkCleanup(size_t i, size_t level)
 {
 	PML* destpml = FORKPML + level;
-	if ( !i )
-		return;
-	for ( size_t n = 0; n < i-1; n++ )
+	for ( size_t n = 0; n < i; n++ )
 	{
-		addr_t entry = destpml->entry[i];
-		if ( !(entry & PML_FORK ) )
+		addr_t entry = destpml->entry[n];
+		if ( !(entry & PML_PRESENT) || !(entry & PML_FORK) )
 			continue;
 		addr_t phys = entry & PML_ADDRESS;
+		if ( level == LARGE_PAGE_LEVEL && (entry & PML_LARGE) )
+		{
+			phys &= ~(LARGE_PAGE_SIZE - 1);
+			Page::PutContiguous(phys, LARGE_PAGE_SIZE / 4096UL,
+			                    PAGE_USAGE_USER_SPACE);
+			continue;
+		}
 		if ( 1 < level )
 		{
 			addr_t destaddr = (addr_t) (FORKPML + level-1);
 			Map(phys, destaddr, PROT_KREAD | PROT_KWRITE);
 			InvalidatePage(destaddr);
-			ForkCleanup(ENTRIES+1UL, level-1);
+			ForkCleanup(ENTRIES, level-1);
 		}
 		enum page_usage usage = 1 < level ? PAGE_USAGE_PAGING_OVERHEAD
 		                                  : PAGE_USAGE_USER_SPACE;
@@ -739,14 +1608,15 @@ void ForkCleanup(size_t i, size_t level)
 	}
 }
 
-// TODO: Copying every frame is endlessly useless in many uses. It'd be
-// nice to upgrade this to a copy-on-write algorithm.
+// The page tables are copied, while the pages themselves are shared by the
+// address spaces until either writes to them, at which point the writer gets
+// its own copy of the page.
 bool Fork(size_t level, size_t pmloffset)
 {
 	PML* destpml = FORKPML + level;
 	for ( size_t i = 0; i < ENTRIES; i++ )
 	{
-		addr_t entry = (PMLS[level] + pmloffset)->entry[i];
+		addr_t& entry = (PMLS[level] + pmloffset)->entry[i];
 
 		// Link the entry if it isn't supposed to be forked.
 		if ( !(entry & PML_PRESENT) || !(entry & PML_FORK ) )
@@ -755,9 +1625,35 @@ bool Fork(size_t level, size_t pmloffset)
 			continue;
 		}
 
-		enum page_usage usage = 1 < level ? PAGE_USAGE_PAGING_OVERHEAD
-		                                  : PAGE_USAGE_USER_SPACE;
-		addr_t phys = Page::Get(usage);
+		// Share the page and write protect it in both address spaces, unless
+		// it's a shared memory mapping.
+		if ( level == 1 )
+		{
+			Page::Lock();
+			Page::ShareUnlocked(entry & PML_ADDRESS);
+			Page::Unlock();
+			if ( (entry & PML_WRITABLE) && !(entry & PML_SHARED) )
+				entry = (entry & ~PML_WRITABLE) | PML_COW;
+			destpml->entry[i] = entry;
+			continue;
+		}
+
+		// Share every page of large pages likewise, which are only split if
+		// written to.
+		if ( level == LARGE_PAGE_LEVEL && (entry & PML_LARGE) )
+		{
+			addr_t large = entry & PML_ADDRESS & ~(LARGE_PAGE_SIZE - 1);
+			Page::Lock();
+			for ( size_t n = 0; n < LARGE_PAGE_SIZE; n += 4096UL )
+				Page::ShareUnlocked(large + n);
+			Page::Unlock();
+			if ( entry & PML_WRITABLE )
+				entry = (entry & ~PML_WRITABLE) | PML_COW;
+			destpml->entry[i] = entry;
+			continue;
+		}
+
+		addr_t phys = Page::Get(PAGE_USAGE_PAGING_OVERHEAD);
 		if ( unlikely(!phys) )
 		{
 			ForkCleanup(i, level);
@@ -774,24 +1670,12 @@ bool Fork(size_t level, size_t pmloffset)
 
 		size_t offset = pmloffset * ENTRIES + i;
 
-		if ( 1 < level )
+		if ( !Fork(level-1, offset) )
 		{
-			if ( !Fork(level-1, offset) )
-			{
-				Page::Put(phys, usage);
-				ForkCleanup(i, level);
-				return false;
-			}
-			continue;
+			Page::Put(phys, PAGE_USAGE_PAGING_OVERHEAD);
+			ForkCleanup(i, level);
+			return false;
 		}
-
-		// Determine the source page's address.
-		const void* src = (const void*) (offset * 4096UL);
-
-		// Determine the destination page's address.
-		void* dest = (void*) (FORKPML + level - 1);
-
-		memcpy(dest, src, 4096UL);
 	}
 
 	return true;
@@ -814,7 +1698,10 @@ addr_t Fork()
 	addr_t dir = Page::Get(PAGE_USAGE_PAGING_OVERHEAD);
 	if ( dir == 0 )
 		return 0;
-	if ( !Fork(dir, TOPPMLLEVEL, 0) )
+	bool success = Fork(dir, TOPPMLLEVEL, 0);
+	// The pages shared with the new address space are now write protected.
+	Flush();
+	if ( !success )
 	{
 		Page::Put(dir, PAGE_USAGE_PAGING_OVERHEAD);
 		return 0;
@@ -839,5 +1726,194 @@ addr_t Fork()
 	return dir;
 }
 
+// Gives the current address space its own copy of a copy-on-write page that is
+// written to, or simply makes the page writable if it's no longer shared.
+static bool CopyOnWrite(addr_t page)
+{
+	addr_t* entry = LookUpEntry(page);
+	if ( !entry || !(*entry & PML_PRESENT) || !(*entry & PML_COW) )
+		return false;
+	addr_t phys = *entry & PML_ADDRESS;
+	if ( !Page::IsShared(phys) )
+	{
+		*entry = (*entry & ~PML_COW) | PML_WRITABLE;
+		InvalidatePage(page);
+		return true;
+	}
+	// The lowest page of the fork area is unused as fork only copies the page
+	// tables, so the copy is made there.
+	addr_t copy = Page::Get(PAGE_USAGE_USER_SPACE);
+	if ( !copy )
+		return false;
+	addr_t scratch = (addr_t) FORKPML;
+	if ( !Map(copy, scratch, PROT_KREAD | PROT_KWRITE) )
+	{
+		Page::Put(copy, PAGE_USAGE_USER_SPACE);
+		return false;
+	}
+	InvalidatePage(scratch);
+	// The above may have slept, so check the page is still the same, in case
+	// another thread dealt with it in the meanwhile.
+	entry = LookUpEntry(page);
+	if ( !entry || (*entry & PML_ADDRESS) != phys ||
+	     !(*entry & PML_PRESENT) || !(*entry & PML_COW) )
+	{
+		Page::Put(copy, PAGE_USAGE_USER_SPACE);
+		return true;
+	}
+	memcpy((void*) scratch, (const void*) page, 4096UL);
+	*entry = copy | (*entry & PML_FLAGS & ~PML_COW) | PML_WRITABLE;
+	InvalidatePage(page);
+	Page::Put(phys, PAGE_USAGE_USER_SPACE);
+	return true;
+}
+
+// Makes a copy-on-write large page writable if it's no longer shared, or
+// otherwise splits it such that only the written page is copied.
+static bool CopyOnWriteLarge(addr_t page)
+{
+	addr_t* entry = LookUpLargeEntry(page);
+	if ( !entry || !(*entry & PML_COW) )
+		return false;
+	addr_t large = *entry & PML_ADDRESS & ~(LARGE_PAGE_SIZE - 1);
+	bool shared = false;
+	for ( size_t n = 0; !shared && n < LARGE_PAGE_SIZE; n += 4096UL )
+		shared = Page::IsShared(large + n);
+	if ( !shared )
+	{
+		*entry = (*entry & ~PML_COW) | PML_WRITABLE;
+		InvalidatePage(page);
+		return true;
+	}
+	return WalkEntry(page, 1, WALK_SPLIT);
+}
+
+// Allocates a large page filled with zeroes on the first use of any of its
+// pages, if all of them are to be allocated on first use alike. The table of
+// the lazy entries is freed afterwards.
+static bool DemandZeroLarge(addr_t page)
+{
+	if ( !LARGE_PAGE_SIZE )
+		return false;
+	addr_t mapto = page & ~(LARGE_PAGE_SIZE - 1);
+	addr_t* table = LookUpEntry(mapto);
+	if ( !table || !(table[0] & PML_LAZY) || (table[0] & PML_FILE) )
+		return false;
+	for ( size_t i = 1; i < ENTRIES; i++ )
+		if ( table[i] != table[0] )
+			return false;
+	size_t count = LARGE_PAGE_SIZE / 4096UL;
+	addr_t large = Page::GetContiguous(count, PAGE_USAGE_USER_SPACE);
+	if ( !large )
+		return false;
+	// The pages are zeroed in the scratch page, as other threads must not see
+	// their old contents.
+	addr_t scratch = (addr_t) FORKPML;
+	for ( size_t n = 0; n < LARGE_PAGE_SIZE; n += 4096UL )
+	{
+		if ( !Map(large + n, scratch, PROT_KREAD | PROT_KWRITE) )
+		{
+			Page::PutContiguous(large, count, PAGE_USAGE_USER_SPACE);
+			return false;
+		}
+		InvalidatePage(scratch);
+		memset((void*) scratch, 0, 4096UL);
+	}
+	// The above may have slept, so check the pages weren't dealt with.
+	addr_t* entry = WalkEntry(mapto, LARGE_PAGE_LEVEL, 0);
+	table = LookUpEntry(mapto);
+	bool unchanged = entry && table && (table[0] & PML_LAZY) &&
+	                 !(table[0] & PML_FILE);
+	for ( size_t i = 1; unchanged && i < ENTRIES; i++ )
+		unchanged = table[i] == table[0];
+	if ( !unchanged )
+	{
+		Page::PutContiguous(large, count, PAGE_USAGE_USER_SPACE);
+		return true;
+	}
+	addr_t old_table = *entry & PML_ADDRESS;
+	*entry = large | (table[0] & ~PML_LAZY) | PML_PRESENT | PML_LARGE;
+	InvalidatePage(mapto);
+	InvalidatePage((addr_t) table);
+	Page::Put(old_table, PAGE_USAGE_PAGING_OVERHEAD);
+	AccountPageTables(mapto, -1);
+	CurrentProcess()->resident_pages += count;
+	return true;
+}
+
+// Allocates the page on its first use, filled with zeroes.
+static bool DemandZero(addr_t page)
+{
+	addr_t* lazy = LookUpLazy(page);
+	if ( !lazy || (*lazy & PML_FILE) )
+		return false;
+	if ( DemandZeroLarge(page) )
+		return true;
+	addr_t phys = Page::Get(PAGE_USAGE_USER_SPACE);
+	if ( !phys )
+		return false;
+	// The page is zeroed in the scratch page, as other threads must not see
+	// its old contents.
+	addr_t scratch = (addr_t) FORKPML;
+	if ( !Map(phys, scratch, PROT_KREAD | PROT_KWRITE) )
+	{
+		Page::Put(phys, PAGE_USAGE_USER_SPACE);
+		return false;
+	}
+	InvalidatePage(scratch);
+	// The above may have slept, so check the page wasn't dealt with meanwhile.
+	addr_t* entry = LookUpLazy(page);
+	if ( !entry || (*entry & PML_FILE) )
+	{
+		Page::Put(phys, PAGE_USAGE_USER_SPACE);
+		return true;
+	}
+	memset((void*) scratch, 0, 4096UL);
+	*entry = phys | (*entry & ~PML_LAZY) | PML_PRESENT;
+	InvalidatePage(page);
+	CurrentProcess()->resident_pages++;
+	return true;
+}
+
+// Maps the page of the file into the page that was to be read from the file on
+// first use, unless it has been dealt with meanwhile. The page is past the end
+// of the file if physical is zero, and is then allocated on first use instead.
+bool MapFilePage(addr_t mapto, addr_t physical, bool shared)
+{
+	addr_t* entry = LookUpLazy(mapto);
+	if ( !entry || !(*entry & PML_FILE) )
+		return false;
+	addr_t flags = *entry & ~(PML_LAZY | PML_FILE);
+	if ( !physical )
+	{
+		*entry = flags | PML_LAZY;
+		return true;
+	}
+	// Private mappings get their own copy of the page once written to.
+	if ( shared )
+		flags |= PML_SHARED;
+	else if ( flags & PML_WRITABLE )
+		flags = (flags & ~PML_WRITABLE) | PML_COW;
+	*entry = physical | flags | PML_PRESENT;
+	InvalidatePage(mapto);
+	CurrentProcess()->resident_pages++;
+	return true;
+}
+
+bool HandlePageFault(addr_t address, bool write, bool user)
+{
+	addr_t page = Page::AlignDown(address);
+	if ( DemandZero(page) )
+		return true;
+	addr_t* lazy = LookUpLazy(page);
+	if ( lazy && (*lazy & PML_FILE) )
+		return HandleFilePageFault(page, !user);
+	if ( write && CopyOnWriteLarge(page) )
+		return true;
+	if ( write && CopyOnWrite(page) )
+		return true;
+	return false;
+}
+
 } // namespace Memory
 } // namespace Sortix
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -38,10 +38,17 @@ const addr_t PML_USERSPACE  = 1 << 2;
 const addr_t PML_WRTHROUGH  = 1 << 3;
 const addr_t PML_NOCACHE    = 1 << 4;
 const addr_t PML_PAT        = 1 << 7;
+const addr_t PML_LARGE      = 1 << 7; // If a directory entry: Large page.
+const addr_t PML_GLOBAL     = 1 << 8; // Not flushed when switching address space.
 const addr_t PML_AVAILABLE1 = 1 << 9;
 const addr_t PML_AVAILABLE2 = 1 << 10;
 const addr_t PML_AVAILABLE3 = 1 << 11;
 const addr_t PML_FORK       = PML_AVAILABLE1;
+const addr_t PML_COW        = PML_AVAILABLE2; // Writable once copied.
+const addr_t PML_LAZY       = PML_AVAILABLE3; // Allocated on first use.
+const addr_t PML_FILE       = PML_AVAILABLE2; // If lazy: Read from a file.
+const addr_t PML_SHARED     = PML_AVAILABLE3; // If present: Never copied.
+const addr_t PML_LARGE_PAT  = 1 << 12; // The PAT bit of large pages.
 #ifdef __x86_64__
 const addr_t PML_NX         = 1UL << 63;
 #else
@@ -96,6 +103,13 @@ static inline addr_t EncodePATAsPMLFlag(addr_t pat)
 bool MapPAT(addr_t physical, addr_t mapto, int prot, addr_t mtype);
 addr_t ProtectionToPMLFlags(int prot);
 int PMLFlagsToProtection(addr_t flags);
+bool IsGlobalPagesSupported();
+void InitializeGlobalPages();
+bool IsPCIDSupported();
+void InitializePCID();
+void ForgetAddressSpace(addr_t addrspace);
+void InvalidateLocalPage(addr_t addr);
+void FlushLocal(bool global);
 
 } // namespace Memory
 } // namespace Sortix
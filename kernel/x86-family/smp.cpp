@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * x86-family/smp.cpp
+ * Symmetric multiprocessing.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <timespec.h>
+
+#include <sortix/clock.h>
+
+#include <sortix/kernel/cpu.h>
+#include <sortix/kernel/interrupt.h>
+#include <sortix/kernel/kernel.h>
+#include <sortix/kernel/kthread.h>
+#include <sortix/kernel/pat.h>
+#include <sortix/kernel/process.h>
+#include <sortix/kernel/registers.h>
+#include <sortix/kernel/scheduler.h>
+#include <sortix/kernel/signal.h>
+#include <sortix/kernel/thread.h>
+#include <sortix/kernel/time.h>
+
+#include "acpi.h"
+#include "apic.h"
+#include "gdt.h"
+#include "memorymanagement.h"
+
+extern "C" int global_errno;
+
+extern "C" uint8_t smp_trampoline[];
+extern "C" uint8_t smp_trampoline_parameters[];
+extern "C" uint8_t smp_trampoline_end[];
+extern "C" uint8_t idle_loop[];
+extern "C" uint8_t idle_loop_end[];
+
+namespace Sortix {
+namespace CPU {
+
+// The kernel is not yet safe to run on multiple processors at once, so all
+// kernel code runs with this big kernel lock held, while user-space runs in
+// parallel. The lock is taken when entering the kernel through an interrupt or
+// system call, and released when returning to user-space or when a processor
+// goes idle. The bootstrap processor holds the lock (ticket 0) when booting.
+
+struct cpu
+{
+	uint32_t apic_id;
+	unsigned long signal_pending;
+	int kerrno;
+	volatile unsigned long tlb_generation;
+	Thread* idle_thread;
+	volatile int startup;
+	bool tickless;
+};
+
+// A starting processor claims its idle thread by moving from waiting to
+// running, unless the bootstrap processor has given up on it first.
+static const int STARTUP_WAITING = 0;
+static const int STARTUP_RUNNING = 1;
+static const int STARTUP_ABANDONED = 2;
+
+// The trampoline is copied to this physical address, see x64/smp.S.
+static const uintptr_t TRAMPOLINE = 0x8000;
+static const size_t AP_STACK_SIZE = 32 * 1024;
+static const long AP_TICK_FREQUENCY = 100 /*Hz*/;
+
+static struct cpu cpus[MAX_CPUS];
+static volatile size_t cpu_count = 1;
+static volatile unsigned long lock_next_ticket = 1;
+static volatile unsigned long lock_now_serving = 0;
+static volatile size_t lock_owner = 0;
+static volatile unsigned long tlb_generation = 0;
+static const addr_t* volatile tlb_pages = NULL;
+static volatile size_t tlb_pages_count = 0;
+static volatile bool tlb_global = false;
+
+static struct interrupt_handler timer_handler;
+static struct interrupt_handler reschedule_handler;
+static struct interrupt_handler tlb_flush_handler;
+static struct interrupt_handler halt_handler;
+
+static void AcknowledgeTLBFlush(size_t cpu)
+{
+	unsigned long generation = __atomic_load_n(&tlb_generation, __ATOMIC_ACQUIRE);
+	if ( cpus[cpu].tlb_generation == generation )
+		return;
+	if ( tlb_pages_count )
+		for ( size_t i = 0; i < tlb_pages_count; i++ )
+			Memory::InvalidateLocalPage(tlb_pages[i]);
+	else
+		Memory::FlushLocal(tlb_global);
+	__atomic_store_n(&cpus[cpu].tlb_generation, generation, __ATOMIC_RELEASE);
+}
+
+// The kernel lock must only be taken and released with interrupts disabled, as
+// an interrupt would otherwise try to take it again.
+static void Lock(size_t cpu)
+{
+	unsigned long ticket =
+		__atomic_fetch_add(&lock_next_ticket, 1, __ATOMIC_RELAXED);
+	while ( __atomic_load_n(&lock_now_serving, __ATOMIC_ACQUIRE) != ticket )
+	{
+		// Another processor may be waiting for us while holding the lock.
+		AcknowledgeTLBFlush(cpu);
+		asm volatile ("pause");
+	}
+	lock_owner = cpu;
+	asm_signal_is_pending = cpus[cpu].signal_pending;
+	global_errno = cpus[cpu].kerrno;
+}
+
+static void Unlock(size_t cpu)
+{
+	cpus[cpu].signal_pending = asm_signal_is_pending;
+	cpus[cpu].kerrno = global_errno;
+	lock_owner = SIZE_MAX;
+	__atomic_store_n(&lock_now_serving, lock_now_serving + 1, __ATOMIC_RELEASE);
+}
+
+static bool IsLockContended()
+{
+	return 1 < lock_next_ticket - lock_now_serving;
+}
+
+extern "C" void smp_kernel_enter()
+{
+	size_t cpu = GDT::GetCurrentIndex();
+	if ( lock_owner != cpu )
+		Lock(cpu);
+}
+
+extern "C" void smp_kernel_leave(uintptr_t ip, uintptr_t cs, uintptr_t flags)
+{
+	size_t cpu = lock_owner;
+	bool to_user = cs & 0x3;
+	bool to_idle = (uintptr_t) idle_loop <= ip && ip < (uintptr_t) idle_loop_end;
+	if ( to_user || to_idle )
+		Unlock(cpu);
+	// Let other processors in if returning to preemptible kernel code.
+	else if ( (flags & FLAGS_INTERRUPT) && IsLockContended() )
+	{
+		Unlock(cpu);
+		Lock(cpu);
+	}
+}
+
+size_t GetCount()
+{
+	return cpu_count;
+}
+
+size_t GetIndex()
+{
+	return lock_owner;
+}
+
+// The idle loop calls this with interrupts disabled whenever the processor
+// wakes up, which is also when it has just switched to the idle thread.
+extern "C" void smp_idle_wakeup()
+{
+	size_t cpu = GDT::GetCurrentIndex();
+	if ( !Scheduler::HasPreviousThread(cpu) )
+		return;
+	Lock(cpu);
+	Scheduler::ReleasePreviousThread(cpu);
+	Unlock(cpu);
+}
+
+__attribute__((noreturn))
+void Idle()
+{
+	Interrupt::Disable();
+	Unlock(GetIndex());
+	asm volatile ("jmp idle_loop");
+	__builtin_unreachable();
+}
+
+// The bootstrap processor keeps the clocks and its timer must interrupt when
+// the next timer is due, while the application processors only need their
+// timer for preemption and are woken by an interprocessor interrupt when a
+// thread is scheduled on them.
+void EnterIdle()
+{
+	size_t cpu = GetIndex();
+	if ( cpu == 0 )
+		return Time::EnterIdle();
+	if ( !cpus[cpu].tickless )
+	{
+		APIC::StopTimer();
+		cpus[cpu].tickless = true;
+	}
+}
+
+void LeaveIdle()
+{
+	size_t cpu = GetIndex();
+	if ( cpu == 0 )
+		return Time::LeaveIdle();
+	if ( cpus[cpu].tickless )
+	{
+		APIC::StartTimer(AP_TICK_FREQUENCY);
+		cpus[cpu].tickless = false;
+	}
+}
+
+void Reschedule(size_t cpu)
+{
+	if ( cpu != GetIndex() )
+		APIC::SendIPI(cpus[cpu].apic_id, APIC::VECTOR_RESCHEDULE);
+}
+
+void SetSignalPending(size_t cpu, unsigned long pending)
+{
+	cpus[cpu].signal_pending = pending;
+	if ( pending )
+		Reschedule(cpu);
+}
+
+// The kernel lock is held while waiting for the other processors, so only one
+// request is outstanding at a time and the requested pages stay valid.
+static void ShootDownTLBs(const addr_t* pages, size_t pages_count, bool global)
+{
+	size_t count = cpu_count;
+	if ( count <= 1 )
+		return;
+	size_t self = GetIndex();
+	tlb_pages = pages;
+	tlb_pages_count = pages_count;
+	tlb_global = global;
+	unsigned long generation =
+		__atomic_add_fetch(&tlb_generation, 1, __ATOMIC_ACQ_REL);
+	cpus[self].tlb_generation = generation;
+	for ( size_t i = 0; i < count; i++ )
+		if ( i != self )
+			APIC::SendIPI(cpus[i].apic_id, APIC::VECTOR_TLB_FLUSH);
+	for ( size_t i = 0; i < count; i++ )
+	{
+		if ( i == self )
+			continue;
+		while ( (long) (generation - cpus[i].tlb_generation) > 0 )
+			asm volatile ("pause");
+	}
+}
+
+void FlushRemoteTLBs(bool global)
+{
+	ShootDownTLBs(NULL, 0, global);
+}
+
+void InvalidateRemotePages(const addr_t* pages, size_t count)
+{
+	ShootDownTLBs(pages, count, false);
+}
+
+void StopOthers()
+{
+	size_t count = cpu_count;
+	if ( count <= 1 )
+		return;
+	for ( size_t i = 0; i < count; i++ )
+		if ( i != GetIndex() )
+			APIC::SendIPI(cpus[i].apic_id, APIC::VECTOR_HALT);
+}
+
+static void OnTimer(struct interrupt_context* intctx, void* /*user*/)
+{
+	// The bootstrap processor uses its timer for the clocks, see time.cpp.
+	if ( GetIndex() == 0 )
+		return Time::OnLocalTimer(intctx);
+	struct timespec period = timespec_make(0, 1000000000L / AP_TICK_FREQUENCY);
+	Time::AccountTick(period, !InUserspace(intctx));
+	Scheduler::Tick(intctx);
+}
+
+static void OnReschedule(struct interrupt_context* intctx, void* /*user*/)
+{
+	// Another processor may have armed a timer due before the next timer
+	// interrupt of the bootstrap processor.
+	if ( GetIndex() == 0 )
+		Time::OnTimersChanged();
+	Scheduler::Switch(intctx);
+}
+
+static void OnTLBFlush(struct interrupt_context* /*intctx*/, void* /*user*/)
+{
+	AcknowledgeTLBFlush(GetIndex());
+}
+
+static void OnHalt(struct interrupt_context* /*intctx*/, void* /*user*/)
+{
+	while ( true )
+		asm volatile ("cli; hlt");
+}
+
+extern "C" __attribute__((noreturn)) void KernelInitAP(size_t cpu)
+{
+	int expected = STARTUP_WAITING;
+	if ( !__atomic_compare_exchange_n(&cpus[cpu].startup, &expected,
+	                                  STARTUP_RUNNING, false, __ATOMIC_ACQ_REL,
+	                                  __ATOMIC_ACQUIRE) )
+	{
+		while ( true )
+			asm volatile ("cli; hlt");
+	}
+
+	// Load the per-processor tables and configuration that the bootstrap
+	// processor already has.
+	GDT::LoadCPU(cpu);
+	Interrupt::InitCPU();
+	if ( IsPATSupported() )
+		InitializePAT();
+	if ( Memory::IsGlobalPagesSupported() )
+		Memory::InitializeGlobalPages();
+	if ( Memory::IsPCIDSupported() )
+		Memory::InitializePCID();
+#if defined(__x86_64__)
+	if ( GDT::IsFSGSBaseSupported() )
+		GDT::InitializeFSGSBase();
+#endif
+	APIC::InitCPU();
+
+	// Interrupts are still disabled since the trampoline.
+	Lock(cpu);
+	Thread* idle_thread = cpus[cpu].idle_thread;
+	GDT::SetKernelStack(idle_thread->kernelstackpos +
+	                    idle_thread->kernelstacksize);
+	Scheduler::SetIdleThread(idle_thread);
+	APIC::StartTimer(AP_TICK_FREQUENCY);
+
+	// Processors are brought online in order, so the online processors are
+	// always those with an index less than the processor count.
+	cpu_count = cpu + 1;
+
+	Idle();
+}
+
+static bool StartCPU(size_t cpu, uint32_t apic_id)
+{
+	Process* kernel_process = Scheduler::GetKernelProcess();
+#if defined(__x86_64__)
+	// The trampoline loads the page directory while in 32-bit mode.
+	if ( UINT32_MAX < kernel_process->addrspace )
+		return false;
+#endif
+
+	uint8_t* stack = new uint8_t[AP_STACK_SIZE];
+	if ( !stack )
+		return false;
+	uintptr_t stack_top = ((uintptr_t) stack + AP_STACK_SIZE) & ~0xFUL;
+	struct thread_registers regs;
+	memset(&regs, 0, sizeof(regs));
+	regs.cr3 = kernel_process->addrspace;
+	regs.kernel_stack = stack_top;
+	Thread* idle_thread = CreateKernelThread(kernel_process, &regs);
+	if ( !idle_thread )
+		return delete[] stack, false;
+	idle_thread->kernelstackpos = (addr_t) stack;
+	idle_thread->kernelstacksize = AP_STACK_SIZE;
+	idle_thread->kernelstackmalloced = true;
+
+	cpus[cpu].apic_id = apic_id;
+	cpus[cpu].idle_thread = idle_thread;
+	cpus[cpu].startup = STARTUP_WAITING;
+	cpus[cpu].tlb_generation = tlb_generation;
+	GDT::PrepareCPU(cpu);
+
+	uint64_t parameters[3];
+	parameters[0] = kernel_process->addrspace;
+	parameters[1] = stack_top;
+	parameters[2] = cpu;
+	size_t offset = smp_trampoline_parameters - smp_trampoline;
+	memcpy((void*) (TRAMPOLINE + offset), parameters, sizeof(parameters));
+
+	// The universal startup algorithm: Reset the processor and send it two
+	// startup interprocessor interrupts.
+	APIC::SendInit(apic_id);
+	APIC::Delay(10000);
+	APIC::SendStartup(apic_id, TRAMPOLINE);
+	APIC::Delay(200);
+	APIC::SendStartup(apic_id, TRAMPOLINE);
+
+	struct timespec timeout = timespec_make(1, 0);
+	struct timespec deadline = timespec_add(Time::Get(CLOCK_BOOT), timeout);
+	while ( cpu_count <= cpu &&
+	        timespec_lt(Time::Get(CLOCK_BOOT), deadline) )
+		kthread_yield();
+	if ( cpu < cpu_count )
+		return true;
+
+	// Give up on the processor, unless it claimed its idle thread just now and
+	// will be online shortly.
+	int expected = STARTUP_WAITING;
+	if ( !__atomic_compare_exchange_n(&cpus[cpu].startup, &expected,
+	                                  STARTUP_ABANDONED, false,
+	                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) )
+	{
+		while ( cpu_count <= cpu )
+			kthread_yield();
+		return true;
+	}
+
+	// Put the processor back to sleep so it doesn't run the trampoline later
+	// when it has been reused for another processor. It no longer runs on the
+	// idle thread's stack once the reset has been delivered.
+	APIC::SendInit(apic_id);
+	cpus[cpu].idle_thread = NULL;
+	FreeThread(idle_thread);
+	return false;
+}
+
+void InitSMP()
+{
+	if ( !ACPI::Init() || !APIC::Init() )
+		return;
+	cpus[0].apic_id = APIC::GetProcessorID(0);
+	APIC::CalibrateTimer();
+	Time::InitLocalTimer();
+
+	timer_handler.handler = OnTimer;
+	Interrupt::RegisterHandler(APIC::VECTOR_TIMER, &timer_handler);
+	reschedule_handler.handler = OnReschedule;
+	Interrupt::RegisterHandler(APIC::VECTOR_RESCHEDULE, &reschedule_handler);
+	tlb_flush_handler.handler = OnTLBFlush;
+	Interrupt::RegisterHandler(APIC::VECTOR_TLB_FLUSH, &tlb_flush_handler);
+	halt_handler.handler = OnHalt;
+	Interrupt::RegisterHandler(APIC::VECTOR_HALT, &halt_handler);
+
+	size_t processor_count = APIC::GetProcessorCount();
+	if ( processor_count <= 1 )
+		return;
+
+	// The trampoline borrows low memory that may still contain data from the
+	// boot loader, so restore it afterwards.
+	size_t trampoline_size = smp_trampoline_end - smp_trampoline;
+	uint8_t* saved = new uint8_t[trampoline_size];
+	if ( !saved )
+		return;
+	memcpy(saved, (void*) TRAMPOLINE, trampoline_size);
+	memcpy((void*) TRAMPOLINE, smp_trampoline, trampoline_size);
+
+	for ( size_t i = 1; i < processor_count; i++ )
+	{
+		uint32_t apic_id = APIC::GetProcessorID(i);
+		if ( !StartCPU(i, apic_id) )
+		{
+			Log::PrintF("Failed to start processor with APIC id %u\n",
+			            (unsigned int) apic_id);
+			break;
+		}
+	}
+
+	memcpy((void*) TRAMPOLINE, saved, trampoline_size);
+	delete[] saved;
+}
+
+} // namespace CPU
+} // namespace Sortix
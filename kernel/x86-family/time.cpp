@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -19,20 +19,26 @@
 
 #include <sys/types.h>
 
+#include <stdint.h>
 #include <timespec.h>
 
+#include <sortix/clock.h>
 #include <sortix/timespec.h>
 
 #include <sortix/kernel/clock.h>
 #include <sortix/kernel/cpu.h>
+#include <sortix/kernel/cpuid.h>
 #include <sortix/kernel/interrupt.h>
 #include <sortix/kernel/ioport.h>
 #include <sortix/kernel/kernel.h>
+#include <sortix/kernel/kthread.h>
 #include <sortix/kernel/process.h>
 #include <sortix/kernel/scheduler.h>
 #include <sortix/kernel/thread.h>
 #include <sortix/kernel/time.h>
 
+#include "apic.h"
+
 namespace Sortix {
 namespace Time {
 
@@ -60,13 +66,52 @@ static struct timespec PeriodOfFrequency(long frequency)
 	return timespec_make(0, period_ns);
 }
 
+static struct timespec DurationOfCount(uint32_t count)
+{
+	uint64_t ns = (uint64_t) count * 1000000000ULL / 1193180;
+	return timespec_make(ns / 1000000000ULL, ns % 1000000000ULL);
+}
+
+static uint32_t CountOfDuration(struct timespec duration)
+{
+	if ( duration.tv_sec < 0 )
+		return 0;
+	if ( 1 <= duration.tv_sec )
+		return UINT32_MAX;
+	return (uint64_t) duration.tv_nsec * 1193180 / 1000000000ULL;
+}
+
+// The periodic interrupt uses the rate generator mode, whose counter counts
+// down the divisor exactly once per period and can be read back to tell how
+// far into the period the timer is.
 static void RequestIRQ0(uint16_t divisor)
 {
-	outport8(0x43, 0x36);
+	outport8(0x43, 0x34);
 	outport8(0x40, divisor >> 0 & 0xFF);
 	outport8(0x40, divisor >> 8 & 0xFF);
 }
 
+// The one-shot interrupt uses the interrupt on terminal count mode, which
+// interrupts once when the counter reaches zero.
+static void RequestOneShotIRQ0(uint16_t count)
+{
+	outport8(0x43, 0x30);
+	outport8(0x40, count >> 0 & 0xFF);
+	outport8(0x40, count >> 8 & 0xFF);
+}
+
+// Reads the current counter of the timer and whether its output is high, which
+// in one-shot mode means the counter has reached zero.
+static uint16_t ReadIRQ0Count(bool* output)
+{
+	outport8(0x43, 0xC2);
+	uint8_t status = inport8(0x40);
+	uint8_t low = inport8(0x40);
+	uint8_t high = inport8(0x40);
+	*output = status & 0x80;
+	return low | high << 8;
+}
+
 extern Clock* realtime_clock;
 extern Clock* uptime_clock;
 
@@ -76,10 +121,155 @@ static struct timespec tick_period;
 static long tick_frequency;
 static uint16_t tick_divisor;
 
+// The timer is only programmed in one-shot mode when the bootstrap processor
+// is idle, as nothing then needs to be preempted, and the clocks are advanced
+// by the time that actually passed when the processor wakes up.
+static const uint32_t ONESHOT_MIN_COUNT = 120; // ~100 us
+static bool tickless_allowed;
+static bool tickless;
+static bool oneshot_pending;
+static uint32_t oneshot_count;
+static bool oneshot_stale_irq0;
+
+// The time stamp counter is used as the clock source if it runs at a constant
+// rate, such that the clocks can be read between timer interrupts with a fine
+// resolution. The timer is then always programmed in one-shot mode for the
+// next timer deadline or the next scheduler tick, whichever is sooner, using
+// the TSC-deadline mode of the local APIC if available, or otherwise the PIT.
+static const long EVENT_MIN_NS = 10000;
+static bool tsc_clocksource;
+static uint64_t tsc_frequency;
+static uint64_t tsc_last_tick;
+static uint64_t tsc_last_schedule;
+static uint64_t tsc_tick_period;
+static uint64_t tsc_next_event;
+static bool tsc_idle;
+static bool tsc_deadline;
+
+static uint64_t ReadTSC()
+{
+	uint32_t low;
+	uint32_t high;
+	asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+	return (uint64_t) low << 0 | (uint64_t) high << 32;
+}
+
+static bool IsInvariantTSCSupported()
+{
+	if ( !IsCPUIdSupported() )
+		return false;
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(0x80000000, eax, ebx, ecx, edx);
+	if ( eax < 0x80000007 )
+		return false;
+	cpuid(0x80000007, eax, ebx, ecx, edx);
+	return edx & (1 << 8);
+}
+
+static struct timespec DurationOfTSC(uint64_t cycles)
+{
+	uint64_t secs = cycles / tsc_frequency;
+	uint64_t nsecs = (cycles % tsc_frequency) * 1000000000ULL / tsc_frequency;
+	return timespec_make(secs, nsecs);
+}
+
+static uint64_t TSCOfDuration(struct timespec duration)
+{
+	if ( duration.tv_sec < 0 )
+		return 0;
+	if ( UINT64_MAX / 2 / tsc_frequency <= (uint64_t) duration.tv_sec )
+		return UINT64_MAX / 2;
+	return (uint64_t) duration.tv_sec * tsc_frequency +
+	       (uint64_t) duration.tv_nsec * tsc_frequency / 1000000000ULL;
+}
+
+// Called with the clock locked to tell how long ago it was last advanced.
+static struct timespec InterpolateTSC()
+{
+	uint64_t now = ReadTSC();
+	if ( now < tsc_last_tick )
+		return timespec_nul();
+	return DurationOfTSC(now - tsc_last_tick);
+}
+
+static void ProgramNextEvent(bool only_if_earlier)
+{
+	uint64_t now = ReadTSC();
+	uint64_t deadline = tsc_idle ? now + tsc_frequency :
+	                               tsc_last_schedule + tsc_tick_period;
+	struct timespec delay;
+	if ( realtime_clock->GetNextTimerDelay(&delay) &&
+	     tsc_last_tick + TSCOfDuration(delay) < deadline )
+		deadline = tsc_last_tick + TSCOfDuration(delay);
+	if ( uptime_clock->GetNextTimerDelay(&delay) &&
+	     tsc_last_tick + TSCOfDuration(delay) < deadline )
+		deadline = tsc_last_tick + TSCOfDuration(delay);
+	if ( only_if_earlier && now < tsc_next_event && tsc_next_event <= deadline )
+		return;
+	uint64_t min_deadline = now + TSCOfDuration(timespec_make(0, EVENT_MIN_NS));
+	if ( deadline < min_deadline )
+		deadline = min_deadline;
+	tsc_next_event = deadline;
+	if ( tsc_deadline )
+		APIC::SetTSCDeadline(deadline);
+	else
+	{
+		uint32_t count = CountOfDuration(DurationOfTSC(deadline - now));
+		if ( UINT16_MAX < count )
+			count = UINT16_MAX;
+		if ( count < 1 )
+			count = 1;
+		RequestOneShotIRQ0(count);
+	}
+}
+
+static void OnTSCEvent(struct interrupt_context* intctx)
+{
+	uint64_t now = ReadTSC();
+	struct timespec elapsed = DurationOfTSC(now - tsc_last_tick);
+	// Carry the fraction of a nanosecond over to the next advancement.
+	tsc_last_tick += TSCOfDuration(elapsed);
+	OnTick(elapsed, !InUserspace(intctx));
+	if ( !tsc_idle && tsc_tick_period <= now - tsc_last_schedule )
+	{
+		tsc_last_schedule = now;
+		Scheduler::Tick(intctx);
+	}
+	ProgramNextEvent(false);
+}
+
 static void OnIRQ0(struct interrupt_context* intctx, void* /*user*/)
 {
+	if ( tsc_clocksource )
+		return OnTSCEvent(intctx);
+
+	if ( tickless )
+	{
+		bool expired;
+		ReadIRQ0Count(&expired);
+		// A periodic interrupt may have been pending when the timer was put in
+		// one-shot mode, whose period has not been accounted for yet.
+		if ( !oneshot_pending || !expired )
+		{
+			OnTick(tick_period, !InUserspace(intctx));
+			return;
+		}
+		oneshot_pending = false;
+		OnTick(DurationOfCount(oneshot_count), !InUserspace(intctx));
+		Scheduler::Tick(intctx);
+		return;
+	}
+
+	// The one-shot interrupt may have been pending when the periodic interrupt
+	// was restored, but its duration has already been accounted for.
+	if ( oneshot_stale_irq0 )
+	{
+		oneshot_stale_irq0 = false;
+		return;
+	}
+
 	OnTick(tick_period, !InUserspace(intctx));
-	Scheduler::Switch(intctx);
+	Scheduler::Tick(intctx);
 
 	// TODO: There is a horrible bug that causes Sortix to only receive
 	//       one IRQ0 on my laptop, but it works in virtual machines. But
@@ -92,6 +282,84 @@ static void OnIRQ0(struct interrupt_context* intctx, void* /*user*/)
 		did_ugly_irq0_hack = true;
 }
 
+// Programs the timer to interrupt at the earliest pending timer deadline, or as
+// late as the timer allows, rather than every tick. Called with interrupts
+// disabled when the bootstrap processor switches to its idle thread.
+void EnterIdle()
+{
+	if ( tsc_clocksource )
+	{
+		if ( !tsc_idle )
+		{
+			tsc_idle = true;
+			ProgramNextEvent(false);
+		}
+		return;
+	}
+
+	if ( !tickless_allowed || oneshot_pending )
+		return;
+
+	// Account for the time passed since the last periodic interrupt.
+	if ( !tickless )
+	{
+		bool output;
+		uint16_t count = ReadIRQ0Count(&output);
+		if ( count && count <= tick_divisor )
+			OnTick(DurationOfCount(tick_divisor - count), true);
+	}
+
+	uint32_t count = UINT16_MAX;
+	struct timespec delay;
+	if ( realtime_clock->GetNextTimerDelay(&delay) &&
+	     CountOfDuration(delay) < count )
+		count = CountOfDuration(delay);
+	if ( uptime_clock->GetNextTimerDelay(&delay) &&
+	     CountOfDuration(delay) < count )
+		count = CountOfDuration(delay);
+	if ( count < ONESHOT_MIN_COUNT )
+		count = ONESHOT_MIN_COUNT;
+
+	tickless = true;
+	oneshot_pending = true;
+	oneshot_count = count;
+	RequestOneShotIRQ0(count);
+}
+
+// Accounts for the time spent idle and restores the periodic interrupt. Called
+// with interrupts disabled when the bootstrap processor leaves its idle thread.
+void LeaveIdle()
+{
+	if ( tsc_clocksource )
+	{
+		if ( tsc_idle )
+		{
+			tsc_idle = false;
+			tsc_last_schedule = ReadTSC();
+			ProgramNextEvent(true);
+		}
+		return;
+	}
+
+	if ( !tickless )
+		return;
+
+	if ( oneshot_pending )
+	{
+		bool expired;
+		uint16_t count = ReadIRQ0Count(&expired);
+		uint32_t elapsed = oneshot_count;
+		if ( !expired && count <= oneshot_count )
+			elapsed = oneshot_count - count;
+		oneshot_stale_irq0 = expired;
+		oneshot_pending = false;
+		OnTick(DurationOfCount(elapsed), true);
+	}
+
+	tickless = false;
+	RequestIRQ0(tick_divisor);
+}
+
 void CPUInit()
 {
 	// Estimate the rate that interrupts will be coming at.
@@ -139,6 +407,98 @@ void Start()
 
 	// Request a timer interrupt now that we can handle them safely.
 	RequestIRQ0(tick_divisor);
+	tickless_allowed = true;
+}
+
+// Measures the frequency of the time stamp counter against the PIT and switches
+// the clocks over to it. This must run on the bootstrap processor while the
+// timer is periodic, before the other processors are online.
+void InitClockSource()
+{
+	if ( !IsInvariantTSCSupported() )
+		return;
+
+	// Start and stop measuring at the edge of a clock tick for best precision.
+	struct timespec before = Get(CLOCK_BOOT);
+	struct timespec start;
+	while ( timespec_eq(start = Get(CLOCK_BOOT), before) )
+		kthread_yield();
+	uint64_t tsc_start = ReadTSC();
+	struct timespec duration = timespec_make(0, 100 * 1000 * 1000);
+	struct timespec end = timespec_add(start, duration);
+	struct timespec now;
+	while ( timespec_lt(now = Get(CLOCK_BOOT), end) )
+		kthread_yield();
+	uint64_t tsc_end = ReadTSC();
+
+	// The clocks advance by the nominal tick period, while the actual period
+	// is a whole number of PIT cycles.
+	struct timespec measured = timespec_sub(now, start);
+	uint64_t measured_ns = (uint64_t) measured.tv_sec * 1000000000ULL +
+	                       (uint64_t) measured.tv_nsec;
+	uint64_t ticks = measured_ns / tick_period.tv_nsec;
+	uint64_t pit_cycles = ticks * tick_divisor;
+	if ( !pit_cycles || tsc_end <= tsc_start )
+		return;
+	tsc_frequency = (tsc_end - tsc_start) * 1193180 / pit_cycles;
+	if ( !tsc_frequency )
+		return;
+
+	bool was_enabled = Interrupt::SetEnabled(false);
+	bool output;
+	uint16_t count = ReadIRQ0Count(&output);
+	uint64_t tsc_now = ReadTSC();
+	tsc_last_tick = tsc_now;
+	if ( count && count <= tick_divisor )
+		tsc_last_tick -= TSCOfDuration(DurationOfCount(tick_divisor - count));
+	tsc_last_schedule = tsc_now;
+	tsc_tick_period = TSCOfDuration(tick_period);
+	struct timespec resolution = timespec_make(0, 1);
+	realtime_clock->Set(NULL, &resolution);
+	uptime_clock->Set(NULL, &resolution);
+	realtime_clock->interpolate = InterpolateTSC;
+	uptime_clock->interpolate = InterpolateTSC;
+	realtime_clock->timers_changed = OnTimersChanged;
+	uptime_clock->timers_changed = OnTimersChanged;
+	tsc_clocksource = true;
+	ProgramNextEvent(false);
+	Interrupt::SetEnabled(was_enabled);
+}
+
+// Switches the timer interrupt from the PIT to the local APIC in TSC-deadline
+// mode, once the local APIC has been initialized.
+void InitLocalTimer()
+{
+	if ( !tsc_clocksource || !APIC::IsTSCDeadlineSupported() )
+		return;
+	bool was_enabled = Interrupt::SetEnabled(false);
+	tsc_deadline = true;
+	ProgramNextEvent(false);
+	Interrupt::SetEnabled(was_enabled);
+}
+
+// The local APIC timer of the bootstrap processor interrupts in TSC-deadline
+// mode.
+void OnLocalTimer(struct interrupt_context* intctx)
+{
+	if ( tsc_clocksource )
+		OnTSCEvent(intctx);
+}
+
+// Reprograms the timer if a timer was armed that expires before the next timer
+// interrupt. Only the bootstrap processor can program its local APIC.
+void OnTimersChanged()
+{
+	if ( !tsc_clocksource )
+		return;
+	if ( tsc_deadline && CPU::GetIndex() != 0 )
+	{
+		CPU::Reschedule(0);
+		return;
+	}
+	bool was_enabled = Interrupt::SetEnabled(false);
+	ProgramNextEvent(true);
+	Interrupt::SetEnabled(was_enabled);
 }
 
 } // namespace Time
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -27,16 +27,6 @@
 
 #include "multiboot.h"
 
-namespace Sortix {
-namespace Page {
-
-extern size_t stackused;
-extern size_t stacklength;
-void ExtendStack();
-
-} // namespace Page
-} // namespace Sortix
-
 namespace Sortix {
 namespace Memory {
 
@@ -59,6 +49,13 @@ void RecursiveFreeUserspacePages(size_t level, size_t offset)
 			continue;
 		if ( !(entry & PML_FORK) )
 			continue;
+		if ( level == LARGE_PAGE_LEVEL && (entry & PML_LARGE) )
+		{
+			addr_t large = entry & PML_ADDRESS & ~(LARGE_PAGE_SIZE - 1);
+			for ( size_t n = 0; n < LARGE_PAGE_SIZE; n += 4096UL )
+				Page::PutUnlocked(large + n, PAGE_USAGE_USER_SPACE);
+			continue;
+		}
 		if ( 1 < level )
 			RecursiveFreeUserspacePages(level-1, offset * ENTRIES + i);
 		addr_t addr = pml->entry[i] & PML_ADDRESS;
@@ -85,6 +82,7 @@ void DestroyAddressSpace(addr_t fallback)
 	RecursiveFreeUserspacePages(TOPPMLLEVEL, 0);
 
 	SwitchAddressSpace(fallback);
+	ForgetAddressSpace(dir);
 
 	// Ok, now we got marked everything left behind as unused, we can
 	// now safely let another thread use the pages.
@@ -100,7 +98,7 @@ const addr_t KERNEL_STACK_END = 0x80001000UL;
 const addr_t KERNEL_STACK_START = KERNEL_STACK_END + KERNEL_STACK_SIZE;
 
 const addr_t VIRTUAL_AREA_LOWER = KERNEL_STACK_START;
-const addr_t VIRTUAL_AREA_UPPER = 0xFF400000UL;
+const addr_t VIRTUAL_AREA_UPPER = 0xFE400000UL;
 
 void GetKernelVirtualArea(addr_t* from, size_t* size)
 {
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -36,15 +36,18 @@ PML* const PMLS[TOPPMLLEVEL + 1] =
 
 PML* const FORKPML = (PML* const) 0xFF800000UL;
 
+// TODO: The page directory can map 4 MiB pages if the processor supports PSE.
+const size_t LARGE_PAGE_LEVEL = 2;
+const size_t LARGE_PAGE_SIZE = 0;
+
 } // namespace Memory
 } // namespace Sortix
 
 namespace Sortix {
 namespace Page {
 
-addr_t* const STACK = (addr_t* const) 0xFF400000UL;
-const size_t MAXSTACKSIZE = (4UL*1024UL*1024UL);
-const size_t MAXSTACKLENGTH = MAXSTACKSIZE / sizeof(addr_t);
+const addr_t FRAME_TABLE = 0xFE400000UL;
+const size_t FRAME_TABLE_MAX_SIZE = 16UL * 1024UL * 1024UL;
 
 } // namespace Page
 } // namespace Sortix
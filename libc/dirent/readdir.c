@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -20,31 +20,51 @@
 #include <sys/readdirents.h>
 
 #include <dirent.h>
+#include <DIR.h>
 #include <errno.h>
 #include <stdlib.h>
 
+#define READDIR_BUFFER_SIZE 32768
+
+// The entries are read in batches into a buffer, which grows if an entry
+// doesn't fit, and are handed out one at a time.
 struct dirent* readdir(DIR* dir)
 {
+	if ( dir->buffer_offset < dir->buffer_used )
+	{
+		struct dirent* entry =
+			(struct dirent*) (dir->buffer + dir->buffer_offset);
+		dir->buffer_offset += entry->d_reclen;
+		return entry;
+	}
 	int old_errno = errno;
-	struct dirent fallback;
-	struct dirent* entry = dir->entry ? dir->entry : &fallback;
-	size_t size = dir->entry ? dir->size : sizeof(fallback);
+	if ( !dir->buffer )
+	{
+		if ( !(dir->buffer = (unsigned char*) malloc(READDIR_BUFFER_SIZE)) )
+			return NULL;
+		dir->buffer_size = READDIR_BUFFER_SIZE;
+	}
+	dir->buffer_used = 0;
+	dir->buffer_offset = 0;
 	ssize_t amount;
-	while ( (amount = readdirents(dir->fd, entry, size)) < 0 )
+	while ( (amount = readdirents(dir->fd, (struct dirent*) dir->buffer,
+	                              dir->buffer_size)) < 0 )
 	{
 		if ( errno != ERANGE )
 			return NULL;
 		errno = old_errno;
-		size_t needed = entry->d_reclen;
-		free(dir->entry);
-		dir->entry = NULL;
-		struct dirent* new_dirent = (struct dirent*) malloc(needed);
-		if ( !new_dirent )
+		size_t needed = ((struct dirent*) dir->buffer)->d_reclen;
+		unsigned char* new_buffer = (unsigned char*) malloc(needed);
+		if ( !new_buffer )
 			return NULL;
-		entry = dir->entry = new_dirent;
-		size = dir->size = needed;
+		free(dir->buffer);
+		dir->buffer = new_buffer;
+		dir->buffer_size = needed;
 	}
 	if ( amount == 0 )
 		return NULL;
-	return dir->entry;
+	dir->buffer_used = (size_t) amount;
+	struct dirent* entry = (struct dirent*) dir->buffer;
+	dir->buffer_offset = entry->d_reclen;
+	return entry;
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -18,9 +18,12 @@
  */
 
 #include <dirent.h>
+#include <DIR.h>
 #include <unistd.h>
 
 void rewinddir(DIR* dir)
 {
+	dir->buffer_used = 0;
+	dir->buffer_offset = 0;
 	lseek(dir->fd, 0, SEEK_SET);
 }
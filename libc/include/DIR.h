@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -49,8 +49,10 @@ typedef struct __DIR DIR;
 
 struct __DIR
 {
-	struct dirent* entry;
-	size_t size;
+	unsigned char* buffer;
+	size_t buffer_size;
+	size_t buffer_used;
+	size_t buffer_offset;
 	int fd;
 };
 
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -79,7 +79,7 @@ typedef __SIZE_TYPE__ __pthread_key_t;
 #if defined(__is_sortix_libc)
 typedef struct
 {
-	unsigned long lock;
+	int lock;
 	unsigned long type;
 	unsigned long owner;
 	unsigned long recursion;
@@ -87,7 +87,7 @@ typedef struct
 #else
 typedef struct
 {
-	unsigned long __pthread_lock;
+	int __pthread_lock;
 	unsigned long __pthread_type;
 	unsigned long __pthread_owner;
 	unsigned long __pthread_recursion;
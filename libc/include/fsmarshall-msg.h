@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -38,6 +38,7 @@ extern "C" {
 #define FSM_MOUNT_CLOFORK (1 << 1)
 #define FSM_MOUNT_NOFOLLOW (1 << 2)
 #define FSM_MOUNT_NONBLOCK (1 << 3)
+#define FSM_MOUNT_TAGGED (1 << 4)
 
 struct fsm_msg_header
 {
@@ -47,6 +48,19 @@ struct fsm_msg_header
 	gid_t gid;
 };
 
+/* Servers mounted with FSM_MOUNT_TAGGED don't accept a connection for each
+   request, but read the requests from the server file descriptor and write the
+   responses back to it. Each request and response is a frame with this header
+   followed by size bytes of the message, which starts with a fsm_msg_header.
+   The response has the tag of its request. Several requests can be read
+   before responding to them, and they can be answered in any order. A frame
+   written in a single write is never interleaved with other frames. */
+struct fsm_tagged_header
+{
+	size_t tag;
+	size_t size;
+};
+
 #define FSM_RESP_ERROR 0
 struct fsm_resp_error
 {
@@ -184,16 +198,17 @@ struct fsm_req_isatty
 struct fsm_req_readdirents
 {
 	ino_t ino;
-	off_t rec_num;
+	off_t cookie; /* Zero or the cookie from the previous response. */
+	size_t size; /* The most bytes of entries to respond with. */
 };
 
 #define FSM_RESP_READDIRENTS 21
 struct fsm_resp_readdirents
 {
-	ino_t ino;
-	unsigned char type;
-	size_t namelen;
-	/*char name[namelen];*/
+	off_t cookie; /* Where to continue listing the directory. */
+	size_t size; /* Zero at the end of the directory. */
+	size_t needed; /* If size is zero, how large the next entry is, if any. */
+	/*struct dirent entries[]; with size bytes of DIRENT_RECLEN packed entries */
 };
 
 #define FSM_REQ_OPEN 22
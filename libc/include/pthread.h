@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -149,8 +149,9 @@ struct pthread
 #if defined(__is_sortix_libc)
 struct pthread_cond_elem
 {
+	struct pthread_cond_elem* prev;
 	struct pthread_cond_elem* next;
-	volatile unsigned long woken;
+	int woken;
 };
 #endif
 
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * sys/futex.h
+ * Fast userspace mutual exclusion.
+ */
+
+#ifndef _SYS_FUTEX_H
+#define _SYS_FUTEX_H 1
+
+#include <sys/cdefs.h>
+
+#include <sortix/futex.h>
+#include <sortix/timespec.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int futex(int*, int, int, const struct timespec*);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011, 2012, 2013, 2014, 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2012, 2013, 2014, 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -470,7 +470,7 @@ int getopt(int, char* const*, const char*);
 /* TODO: char* crypt(const char*, const char*); */
 /* TODO: void encrypt(char [64], int); */
 /* gethostid will not be implemented */
-/* TODO: int nice(int); */
+int nice(int);
 /* setpgrp will not be implemented. */
 /* TODO: void swab(const void* __restrict, void* __restrict, ssize_t); */
 /* TODO: void sync(void); */
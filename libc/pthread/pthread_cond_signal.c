@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,7 +17,10 @@
  * Signals a condition.
  */
 
+#include <sys/futex.h>
+
 #include <pthread.h>
+#include <stddef.h>
 
 int pthread_cond_signal(pthread_cond_t* cond)
 {
@@ -26,7 +29,13 @@ int pthread_cond_signal(pthread_cond_t* cond)
 		return 0;
 	if ( !(cond->first = elem->next) )
 		cond->last = NULL;
+	else
+		cond->first->prev = NULL;
+	elem->prev = NULL;
 	elem->next = NULL;
-	elem->woken = 1;
+	// The waiter may return and the element cease to exist as soon as it has
+	// been marked as woken, though waking the address afterwards is harmless.
+	__atomic_store_n(&elem->woken, 1, __ATOMIC_RELEASE);
+	futex(&elem->woken, FUTEX_WAKE, 1, NULL);
 	return 0;
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,18 +17,20 @@
  * Waits on a condition or until a timeout happens.
  */
 
+#include <sys/futex.h>
+
 #include <errno.h>
 #include <pthread.h>
-#include <sched.h>
+#include <stddef.h>
 #include <time.h>
-#include <timespec.h>
-#include <unistd.h>
 
 int pthread_cond_timedwait(pthread_cond_t* restrict cond,
                            pthread_mutex_t* restrict mutex,
                            const struct timespec* restrict abstime)
 {
+	int errno_saved = errno;
 	struct pthread_cond_elem elem;
+	elem.prev = cond->last;
 	elem.next = NULL;
 	elem.woken = 0;
 	if ( cond->last )
@@ -36,16 +38,31 @@ int pthread_cond_timedwait(pthread_cond_t* restrict cond,
 	if ( !cond->last )
 		cond->first = &elem;
 	cond->last = &elem;
-	while ( !elem.woken )
+	pthread_mutex_unlock(mutex);
+	int op = FUTEX_WAIT | FUTEX_ABSOLUTE | FUTEX_CLOCK(cond->clock);
+	int ret = 0;
+	while ( !__atomic_load_n(&elem.woken, __ATOMIC_ACQUIRE) )
 	{
-		struct timespec now;
-		if ( clock_gettime(cond->clock, &now) < 0 )
-			return errno;
-		if ( timespec_le(*abstime, now) )
-			return errno = ETIMEDOUT;
-		pthread_mutex_unlock(mutex);
-		sched_yield();
-		pthread_mutex_lock(mutex);
+		if ( futex(&elem.woken, op, 0, abstime) < 0 &&
+		     errno != EAGAIN && errno != EINTR )
+		{
+			ret = errno;
+			break;
+		}
 	}
-	return 0;
+	pthread_mutex_lock(mutex);
+	errno = errno_saved;
+	// The condition may have been signaled after the timeout, otherwise the
+	// waiter must be removed from the condition while the mutex is held.
+	if ( __atomic_load_n(&elem.woken, __ATOMIC_ACQUIRE) )
+		return 0;
+	if ( elem.prev )
+		elem.prev->next = elem.next;
+	else
+		cond->first = elem.next;
+	if ( elem.next )
+		elem.next->prev = elem.prev;
+	else
+		cond->last = elem.prev;
+	return errno = ret;
 }
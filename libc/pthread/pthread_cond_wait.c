@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,16 +17,18 @@
  * Waits on a condition.
  */
 
+#include <sys/futex.h>
+
+#include <errno.h>
 #include <pthread.h>
-#include <sched.h>
-#include <time.h>
-#include <timespec.h>
-#include <unistd.h>
+#include <stddef.h>
 
 int pthread_cond_wait(pthread_cond_t* restrict cond,
                       pthread_mutex_t* restrict mutex)
 {
+	int errno_saved = errno;
 	struct pthread_cond_elem elem;
+	elem.prev = cond->last;
 	elem.next = NULL;
 	elem.woken = 0;
 	if ( cond->last )
@@ -34,11 +36,10 @@ int pthread_cond_wait(pthread_cond_t* restrict cond,
 	if ( !cond->last )
 		cond->first = &elem;
 	cond->last = &elem;
-	while ( !elem.woken )
-	{
-		pthread_mutex_unlock(mutex);
-		sched_yield();
-		pthread_mutex_lock(mutex);
-	}
+	pthread_mutex_unlock(mutex);
+	while ( !__atomic_load_n(&elem.woken, __ATOMIC_ACQUIRE) )
+		futex(&elem.woken, FUTEX_WAIT, 0, NULL);
+	pthread_mutex_lock(mutex);
+	errno = errno_saved;
 	return 0;
 }
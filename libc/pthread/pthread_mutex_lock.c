@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,22 +17,37 @@
  * Locks a mutex.
  */
 
+#include <sys/futex.h>
+
+#include <errno.h>
 #include <pthread.h>
-#include <sched.h>
-#include <time.h>
-#include <timespec.h>
+#include <stdbool.h>
 
-static const unsigned long UNLOCKED_VALUE = 0;
-static const unsigned long LOCKED_VALUE = 1;
+static const int UNLOCKED_VALUE = 0;
+static const int LOCKED_VALUE = 1;
+static const int CONTENDED_VALUE = 2;
 
 int pthread_mutex_lock(pthread_mutex_t* mutex)
 {
-	while ( !__sync_bool_compare_and_swap(&mutex->lock, UNLOCKED_VALUE, LOCKED_VALUE) )
+	int state = UNLOCKED_VALUE;
+	if ( !__atomic_compare_exchange_n(&mutex->lock, &state, LOCKED_VALUE, false,
+	                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
 	{
 		if ( mutex->type == PTHREAD_MUTEX_RECURSIVE &&
 		     (pthread_t) mutex->owner == pthread_self() )
-				return mutex->recursion++, 0;
-		sched_yield();
+			return mutex->recursion++, 0;
+		int errno_saved = errno;
+		// Mark the mutex as contended so the owner wakes us when unlocking.
+		if ( state != CONTENDED_VALUE )
+			state = __atomic_exchange_n(&mutex->lock, CONTENDED_VALUE,
+			                            __ATOMIC_ACQUIRE);
+		while ( state != UNLOCKED_VALUE )
+		{
+			futex(&mutex->lock, FUTEX_WAIT, CONTENDED_VALUE, NULL);
+			state = __atomic_exchange_n(&mutex->lock, CONTENDED_VALUE,
+			                            __ATOMIC_ACQUIRE);
+		}
+		errno = errno_saved;
 	}
 	mutex->owner = (unsigned long) pthread_self();
 	mutex->recursion = 0;
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -19,13 +19,16 @@
 
 #include <errno.h>
 #include <pthread.h>
+#include <stdbool.h>
 
-static const unsigned long UNLOCKED_VALUE = 0;
-static const unsigned long LOCKED_VALUE = 1;
+static const int UNLOCKED_VALUE = 0;
+static const int LOCKED_VALUE = 1;
 
 int pthread_mutex_trylock(pthread_mutex_t* mutex)
 {
-	if ( !__sync_bool_compare_and_swap(&mutex->lock, UNLOCKED_VALUE, LOCKED_VALUE) )
+	int state = UNLOCKED_VALUE;
+	if ( !__atomic_compare_exchange_n(&mutex->lock, &state, LOCKED_VALUE, false,
+	                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) )
 	{
 		if ( mutex->type == PTHREAD_MUTEX_RECURSIVE &&
 		     (pthread_t) mutex->owner == pthread_self() )
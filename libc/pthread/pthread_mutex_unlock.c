@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2013, 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2013, 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,16 +17,20 @@
  * Unlocks a mutex.
  */
 
+#include <sys/futex.h>
+
 #include <pthread.h>
 
-static const unsigned long UNLOCKED_VALUE = 0;
-static const unsigned long LOCKED_VALUE = 1;
+static const int UNLOCKED_VALUE = 0;
+static const int CONTENDED_VALUE = 2;
 
 int pthread_mutex_unlock(pthread_mutex_t* mutex)
 {
 	if ( mutex->type == PTHREAD_MUTEX_RECURSIVE && mutex->recursion )
 		return mutex->recursion--, 0;
 	mutex->owner = 0;
-	mutex->lock = UNLOCKED_VALUE;
+	if ( __atomic_exchange_n(&mutex->lock, UNLOCKED_VALUE,
+	                         __ATOMIC_RELEASE) == CONTENDED_VALUE )
+		futex(&mutex->lock, FUTEX_WAKE, 1, NULL);
 	return 0;
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,10 +17,13 @@
  * Unlock a semaphore.
  */
 
+#include <sys/futex.h>
+
 #include <errno.h>
 #include <limits.h>
 #include <semaphore.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 int sem_post(sem_t* sem)
 {
@@ -36,6 +39,9 @@ int sem_post(sem_t* sem)
 		                                  __ATOMIC_SEQ_CST, __ATOMIC_RELAXED) )
 			continue;
 
+		if ( __atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) )
+			futex(&sem->value, FUTEX_WAKE, 1, NULL);
+
 		return 0;
 	}
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -17,13 +17,12 @@
  * Lock a semaphore.
  */
 
+#include <sys/futex.h>
+
 #include <errno.h>
-#include <sched.h>
 #include <semaphore.h>
-#include <signal.h>
 #include <stddef.h>
 #include <time.h>
-#include <timespec.h>
 
 int sem_timedwait(sem_t* restrict sem, const struct timespec* restrict abstime)
 {
@@ -32,39 +31,22 @@ int sem_timedwait(sem_t* restrict sem, const struct timespec* restrict abstime)
 	if ( errno != EAGAIN )
 		return -1;
 
-	sigset_t old_set_mask;
-	sigset_t old_set_allowed;
-	sigset_t all_signals;
-	sigfillset(&all_signals);
-	sigprocmask(SIG_SETMASK, &all_signals, &old_set_mask);
-	signotset(&old_set_allowed, &old_set_mask);
-
+	// TODO: Using CLOCK_REALTIME for this is bad as it is not monotonic. We
+	//       need to enchance the semaphore API so a better clock can be
+	//       used instead.
+	int op = FUTEX_WAIT | FUTEX_ABSOLUTE | FUTEX_CLOCK(CLOCK_REALTIME);
+	__atomic_add_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+	int ret = 0;
 	while ( sem_trywait(sem) != 0 )
 	{
-		// TODO: Using CLOCK_REALTIME for this is bad as it is not monotonic. We
-		//       need to enchance the semaphore API so a better clock can be
-		//       used instead.
-		if ( errno == EAGAIN )
+		// Sleep only while the semaphore is zero, as sem_post wakes a waiter
+		// only after incrementing it.
+		if ( futex(&sem->value, op, 0, abstime) < 0 && errno != EAGAIN )
 		{
-			struct timespec now;
-			clock_gettime(CLOCK_REALTIME, &now);
-			if ( timespec_le(*abstime, now) )
-				errno = ETIMEDOUT;
+			ret = -1;
+			break;
 		}
-
-		if ( errno == EAGAIN && sigpending(&old_set_allowed) )
-			errno = EINTR;
-
-		if ( errno != EAGAIN )
-		{
-			sigprocmask(SIG_SETMASK, &old_set_mask, NULL);
-			return -1;
-		}
-
-		sched_yield();
 	}
-
-	sigprocmask(SIG_SETMASK, &old_set_mask, NULL);
-
-	return 0;
+	__atomic_sub_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+	return ret;
 }
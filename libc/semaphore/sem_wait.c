@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2014 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2014, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -18,40 +18,10 @@
  */
 
 #include <errno.h>
-#include <sched.h>
 #include <semaphore.h>
-#include <signal.h>
 #include <stddef.h>
 
 int sem_wait(sem_t* sem)
 {
-	if ( sem_trywait(sem) == 0 )
-		return 0;
-	if ( errno != EAGAIN )
-		return -1;
-
-	sigset_t old_set_mask;
-	sigset_t old_set_allowed;
-	sigset_t all_signals;
-	sigfillset(&all_signals);
-	sigprocmask(SIG_SETMASK, &all_signals, &old_set_mask);
-	signotset(&old_set_allowed, &old_set_mask);
-
-	while ( sem_trywait(sem) != 0 )
-	{
-		if ( errno == EAGAIN && sigpending(&old_set_allowed) )
-			errno = EINTR;
-
-		if ( errno != EAGAIN )
-		{
-			sigprocmask(SIG_SETMASK, &old_set_mask, NULL);
-			return -1;
-		}
-
-		sched_yield();
-	}
-
-	sigprocmask(SIG_SETMASK, &old_set_mask, NULL);
-
-	return 0;
+	return sem_timedwait(sem, NULL);
 }
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * unistd/nice.c
+ * Change the scheduling priority of the current process.
+ */
+
+#include <sys/resource.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+int nice(int increment)
+{
+	int errno_saved = errno;
+	errno = 0;
+	int prio = getpriority(PRIO_PROCESS, 0);
+	if ( prio == -1 && errno )
+		return -1;
+	errno = errno_saved;
+	if ( increment < -40 )
+		increment = -40;
+	if ( 40 < increment )
+		increment = 40;
+	if ( setpriority(PRIO_PROCESS, 0, prio + increment) < 0 )
+		return -1;
+	return getpriority(PRIO_PROCESS, 0);
+}
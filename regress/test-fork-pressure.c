@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * test-fork-pressure.c
+ * Tests whether processes forking while memory is reclaimed keep their memory.
+ */
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "test.h"
+
+#define FORKERS 4
+#define ROUNDS 64
+#define PAGES 64
+#define HOG_CHUNKS 1024
+#define HOG_CHUNK_SIZE (1024 * 1024)
+
+// Keeps memory so low that it's reclaimed by the allocations while forking.
+static void hog(void)
+{
+	void* chunks[HOG_CHUNKS];
+	while ( true )
+	{
+		size_t count = 0;
+		size_t used, total;
+		while ( count < HOG_CHUNKS )
+		{
+			if ( memstat(&used, &total) < 0 )
+				test_error(errno, "memstat");
+			if ( total - used < total / 64 + HOG_CHUNK_SIZE )
+				break;
+			void* chunk = mmap(NULL, HOG_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if ( chunk == MAP_FAILED )
+				break;
+			memset(chunk, 0xFF, HOG_CHUNK_SIZE);
+			chunks[count++] = chunk;
+		}
+		while ( count )
+			munmap(chunks[--count], HOG_CHUNK_SIZE);
+	}
+}
+
+static bool verify(const uintptr_t* memory, size_t count, uintptr_t pattern)
+{
+	for ( size_t i = 0; i < count; i++ )
+		if ( memory[i] != pattern + i )
+			return false;
+	return true;
+}
+
+static void forker(uintptr_t pattern)
+{
+	size_t size = PAGES * (size_t) sysconf(_SC_PAGESIZE);
+	size_t count = size / sizeof(uintptr_t);
+	uintptr_t* memory = (uintptr_t*) mmap(NULL, size, PROT_READ | PROT_WRITE,
+	                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( memory == MAP_FAILED )
+		test_error(errno, "mmap");
+	for ( size_t i = 0; i < count; i++ )
+		memory[i] = pattern + i;
+	for ( int round = 0; round < ROUNDS; round++ )
+	{
+		pid_t child = fork();
+		if ( child < 0 && (errno == ENOMEM || errno == EAGAIN) )
+			continue;
+		if ( child < 0 )
+			test_error(errno, "fork");
+		if ( child == 0 )
+			_exit(verify(memory, count, pattern) ? 0 : 1);
+		int status;
+		if ( waitpid(child, &status, 0) < 0 )
+			test_error(errno, "waitpid");
+		test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		test_assert(verify(memory, count, pattern));
+	}
+}
+
+int main(void)
+{
+	pid_t hog_pid = fork();
+	if ( hog_pid < 0 )
+		test_error(errno, "fork");
+	if ( hog_pid == 0 )
+		hog();
+
+	pid_t forkers[FORKERS];
+	for ( int i = 0; i < FORKERS; i++ )
+	{
+		if ( (forkers[i] = fork()) < 0 )
+			test_error(errno, "fork");
+		if ( forkers[i] == 0 )
+		{
+			forker((uintptr_t) (i + 1) << (sizeof(uintptr_t) * 8 - 8));
+			_exit(0);
+		}
+	}
+
+	bool success = true;
+	for ( int i = 0; i < FORKERS; i++ )
+	{
+		int status;
+		if ( waitpid(forkers[i], &status, 0) < 0 )
+			test_error(errno, "waitpid");
+		if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+			success = false;
+	}
+
+	kill(hog_pid, SIGKILL);
+	if ( waitpid(hog_pid, NULL, 0) < 0 )
+		test_error(errno, "waitpid");
+
+	test_assert(success);
+
+	return 0;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * test-mmap-many.c
+ * Tests whether many memory mappings can be made, changed and removed.
+ */
+
+#include <sys/mman.h>
+
+#include <unistd.h>
+
+#include "test.h"
+
+#define MAPPINGS 1024
+
+int main(void)
+{
+	size_t page_size = getpagesize();
+	size_t size = MAPPINGS * page_size;
+
+	// Reserve a region and split it into many mappings by changing the
+	// protection of every other page.
+	unsigned char* region = (unsigned char*) mmap(NULL, size,
+	                                              PROT_READ | PROT_WRITE,
+	                                              MAP_PRIVATE | MAP_ANONYMOUS,
+	                                              -1, 0);
+	if ( region == MAP_FAILED )
+		test_error(errno, "mmap");
+	for ( size_t i = 0; i < MAPPINGS; i++ )
+		region[i * page_size] = (unsigned char) i;
+	for ( size_t i = 0; i < MAPPINGS; i += 2 )
+		if ( mprotect(region + i * page_size, page_size, PROT_READ) < 0 )
+			test_error(errno, "mprotect");
+	for ( size_t i = 0; i < MAPPINGS; i++ )
+		test_assert(region[i * page_size] == (unsigned char) i);
+
+	// Punch holes in the region and check a hinted mapping fills the hole.
+	for ( size_t i = 1; i < MAPPINGS; i += 4 )
+		if ( munmap(region + i * page_size, page_size) < 0 )
+			test_error(errno, "munmap");
+	void* hint = region + 5 * page_size;
+	void* hole = mmap(hint, page_size, PROT_READ | PROT_WRITE,
+	                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( hole == MAP_FAILED )
+		test_error(errno, "mmap");
+	test_assert(hole == hint);
+	test_assert(((unsigned char*) hole)[0] == 0);
+
+	// A mapping too large for the holes must not be placed over the region.
+	size_t large_size = 2 * page_size;
+	unsigned char* large = (unsigned char*) mmap(hint, large_size,
+	                                             PROT_READ | PROT_WRITE,
+	                                             MAP_PRIVATE | MAP_ANONYMOUS,
+	                                             -1, 0);
+	if ( large == MAP_FAILED )
+		test_error(errno, "mmap");
+	test_assert(large + large_size <= region || region + size <= large);
+	for ( size_t i = 0; i < MAPPINGS; i++ )
+		if ( i % 4 != 1 )
+			test_assert(region[i * page_size] == (unsigned char) i);
+
+	// Remove the whole region at once.
+	if ( munmap(large, large_size) < 0 )
+		test_error(errno, "munmap");
+	if ( munmap(region, size) < 0 )
+		test_error(errno, "munmap");
+	void* again = mmap(region, size, PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if ( again == MAP_FAILED )
+		test_error(errno, "mmap");
+	test_assert(again == region);
+	test_assert(region[size - 1] == 0);
+	munmap(again, size);
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * test-mmap-self.c
+ * Tests whether a file can be read into and written from a mapping of itself.
+ */
+
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+int main(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t size = 2 * (size_t) page_size;
+
+	FILE* fp = tmpfile();
+	if ( !fp )
+		test_error(errno, "tmpfile");
+	int fd = fileno(fp);
+	for ( size_t i = 0; i < size; i++ )
+	{
+		unsigned char c = i % 251;
+		if ( pwrite(fd, &c, 1, i) != 1 )
+			test_error(errno, "pwrite");
+	}
+
+	unsigned char* map = (unsigned char*) mmap(NULL, size,
+	                                           PROT_READ | PROT_WRITE,
+	                                           MAP_PRIVATE, fd, 0);
+	if ( map == MAP_FAILED )
+		test_error(errno, "mmap");
+
+	// The destination pages haven't been touched yet, so reading faults in
+	// pages of the very file being read.
+	if ( pread(fd, map, page_size, page_size) != page_size )
+		test_error(errno, "pread");
+	for ( size_t i = 0; i < (size_t) page_size; i++ )
+		test_assert(map[i] == (page_size + i) % 251);
+
+	// Likewise the source pages of a write are faulted in from the file.
+	if ( pwrite(fd, map + page_size, page_size, 0) != page_size )
+		test_error(errno, "pwrite");
+	unsigned char c;
+	test_assert(pread(fd, &c, 1, 0) == 1);
+	test_assert(c == page_size % 251);
+
+	munmap(map, size);
+	fclose(fp);
+
+	return 0;
+}
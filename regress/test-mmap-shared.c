@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * test-mmap-shared.c
+ * Tests whether shared file mappings are coherent with the file.
+ */
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test.h"
+
+int main(void)
+{
+	const char* string = "dHqtnS4G3UmUezg";
+	size_t string_length = strlen(string);
+
+	FILE* fp = tmpfile();
+	if ( !fp )
+		test_error(errno, "tmpfile");
+	int fd = fileno(fp);
+	if ( pwrite(fd, string, string_length, 0) != (ssize_t) string_length )
+		test_error(errno, "pwrite");
+
+	char* map = (char*) mmap(NULL, string_length, PROT_READ | PROT_WRITE,
+	                         MAP_SHARED, fd, 0);
+	// Files on file systems that don't provide their pages can't be shared.
+	if ( map == MAP_FAILED && errno == ENODEV )
+		return 0;
+	if ( map == MAP_FAILED )
+		test_error(errno, "mmap");
+
+	test_assert(!memcmp(map, string, string_length));
+
+	map[0] = 'X';
+	char c;
+	test_assert(pread(fd, &c, 1, 0) == 1);
+	test_assert(c == 'X');
+
+	c = 'Y';
+	test_assert(pwrite(fd, &c, 1, 1) == 1);
+	test_assert(map[1] == 'Y');
+
+	pid_t child = fork();
+	if ( child < 0 )
+		test_error(errno, "fork");
+	if ( child == 0 )
+	{
+		map[2] = 'Z';
+		_exit(0);
+	}
+	int status;
+	if ( waitpid(child, &status, 0) < 0 )
+		test_error(errno, "waitpid");
+	test_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	test_assert(map[2] == 'Z');
+
+	if ( msync(map, string_length, MS_SYNC) < 0 )
+		test_error(errno, "msync");
+	test_assert(pread(fd, &c, 1, 2) == 1);
+	test_assert(c == 'Z');
+
+	char* private_map = (char*) mmap(NULL, string_length, PROT_READ | PROT_WRITE,
+	                                 MAP_PRIVATE, fd, 0);
+	if ( private_map == MAP_FAILED )
+		test_error(errno, "mmap");
+	test_assert(private_map[0] == 'X');
+	private_map[0] = 'W';
+	test_assert(map[0] == 'X');
+
+	munmap(private_map, string_length);
+	munmap(map, string_length);
+	fclose(fp);
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * test-pthread-cond.c
+ * Tests whether condition variables wake waiters and time out.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <time.h>
+#include <timespec.h>
+
+#include "test.h"
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static bool ready = false;
+
+void* thread_routine(void* cookie)
+{
+	(void) cookie;
+	pthread_mutex_lock(&mutex);
+	ready = true;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+int main(void)
+{
+	int errnum;
+
+	pthread_mutex_lock(&mutex);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct timespec timeout = timespec_add(now, timespec_make(0, 10000000));
+	errnum = pthread_cond_timedwait(&cond, &mutex, &timeout);
+	test_assert(errnum == ETIMEDOUT);
+	clock_gettime(CLOCK_REALTIME, &now);
+	test_assert(timespec_le(timeout, now));
+
+	pthread_t thread;
+	if ( (errnum = pthread_create(&thread, NULL, &thread_routine, NULL)) )
+		test_error(errnum, "pthread_create");
+
+	while ( !ready )
+		if ( (errnum = pthread_cond_wait(&cond, &mutex)) )
+			test_error(errnum, "pthread_cond_wait");
+
+	pthread_mutex_unlock(&mutex);
+
+	if ( (errnum = pthread_join(thread, NULL)) )
+		test_error(errnum, "pthread_join");
+
+	return 0;
+}
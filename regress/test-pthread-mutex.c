@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * test-pthread-mutex.c
+ * Tests whether contended mutexes provide mutual exclusion.
+ */
+
+#include <pthread.h>
+
+#include "test.h"
+
+#define NUM_THREADS 4
+#define NUM_ITERATIONS 100000
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile unsigned long counter = 0;
+
+void* thread_routine(void* cookie)
+{
+	(void) cookie;
+	for ( int i = 0; i < NUM_ITERATIONS; i++ )
+	{
+		pthread_mutex_lock(&mutex);
+		counter = counter + 1;
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	int errnum;
+
+	pthread_t threads[NUM_THREADS];
+	for ( int i = 0; i < NUM_THREADS; i++ )
+		if ( (errnum = pthread_create(&threads[i], NULL, &thread_routine, NULL)) )
+			test_error(errnum, "pthread_create");
+
+	for ( int i = 0; i < NUM_THREADS; i++ )
+		if ( (errnum = pthread_join(threads[i], NULL)) )
+			test_error(errnum, "pthread_join");
+
+	test_assert(counter == NUM_THREADS * NUM_ITERATIONS);
+
+	test_assert(pthread_mutex_trylock(&mutex) == 0);
+	test_assert(pthread_mutex_trylock(&mutex) == EBUSY);
+	test_assert(pthread_mutex_unlock(&mutex) == 0);
+
+	return 0;
+}
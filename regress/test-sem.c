@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016 Jonas 'Sortie' Termansen.
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * test-sem.c
+ * Tests whether semaphores wake waiters and time out.
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <timespec.h>
+
+#include "test.h"
+
+#define NUM_POSTS 1000
+
+static sem_t sem;
+
+void* thread_routine(void* cookie)
+{
+	(void) cookie;
+	for ( int i = 0; i < NUM_POSTS; i++ )
+		sem_post(&sem);
+	return NULL;
+}
+
+int main(void)
+{
+	int errnum;
+
+	if ( sem_init(&sem, 0, 0) < 0 )
+		test_error(errno, "sem_init");
+
+	test_assert(sem_trywait(&sem) < 0 && errno == EAGAIN);
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	struct timespec timeout = timespec_add(now, timespec_make(0, 10000000));
+	test_assert(sem_timedwait(&sem, &timeout) < 0 && errno == ETIMEDOUT);
+
+	pthread_t thread;
+	if ( (errnum = pthread_create(&thread, NULL, &thread_routine, NULL)) )
+		test_error(errnum, "pthread_create");
+
+	for ( int i = 0; i < NUM_POSTS; i++ )
+		if ( sem_wait(&sem) < 0 )
+			test_error(errno, "sem_wait");
+
+	if ( (errnum = pthread_join(thread, NULL)) )
+		test_error(errnum, "pthread_join");
+
+	int value;
+	sem_getvalue(&sem, &value);
+	test_assert(value == 0);
+
+	return 0;
+}
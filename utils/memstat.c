@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2011 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2011, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -18,6 +18,7 @@
  */
 
 #include <err.h>
+#include <memusage.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -74,5 +75,27 @@ int main(void)
 	unsigned percent = ((unsigned long long) memused * 100ULL ) / memtotal;
 	printf(" total (%u%s)\n", percent, "%");
 
+	struct memusage mu;
+	if ( memusage(&mu) < 0 )
+		err(1, "memusage");
+
+	static const char* const usage_names[MEMUSAGE_NUM] =
+	{
+		[MEMUSAGE_OTHER] = "other",
+		[MEMUSAGE_PHYSICAL] = "physical",
+		[MEMUSAGE_PAGING_OVERHEAD] = "paging overhead",
+		[MEMUSAGE_KERNEL_HEAP] = "kernel heap",
+		[MEMUSAGE_FILESYSTEM_CACHE] = "filesystem cache",
+		[MEMUSAGE_USER_SPACE] = "user-space",
+		[MEMUSAGE_EXECUTE] = "execute",
+		[MEMUSAGE_DRIVER] = "driver",
+	};
+	for ( size_t i = 0; i < MEMUSAGE_NUM; i++ )
+	{
+		printf("%-18s", usage_names[i]);
+		printbytes(mu.usage[i]);
+		printf("\n");
+	}
+
 	return 0;
 }
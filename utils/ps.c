@@ -1,5 +1,5 @@
 /*
- * Copyright (c) 2015 Jonas 'Sortie' Termansen.
+ * Copyright (c) 2015, 2016 Jonas 'Sortie' Termansen.
  *
  * Permission to use, copy, modify, and distribute this software for any
  * purpose with or without fee is hereby granted, provided that the above
@@ -141,6 +141,8 @@ int main(int argc, char* argv[])
 		printf("PPID\t");
 	if ( show_long )
 		printf("NI  ");
+	if ( show_long )
+		printf("RSS\tVSZ\tPT\t");
 	printf("TTY  ");
 	printf("TIME\t   ");
 	printf("CMD\n");
@@ -176,6 +178,9 @@ int main(int argc, char* argv[])
 			printf("%" PRIiPID "\t", psst.ppid);
 		if ( show_long )
 			printf("%-4i", psst.nice);
+		if ( show_long )
+			printf("%zu\t%zu\t%zu\t", psst.rss / 1024, psst.vsz / 1024,
+			       psst.page_tables / 1024);
 		printf("tty  ");
 		time_t time = psst.tmns.tmns_utime.tv_sec;
 		int hours = (time / (60 * 60)) % 24;